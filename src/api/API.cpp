@@ -18,40 +18,86 @@
 
 #include "logging/logging.h"
 
+#include <algorithm>
+
 namespace ceema {
 
+    namespace {
+        /**
+         * Buffered transfer of a single attempt of a request.
+         * Cancelled when a concurrent (hedged) attempt wins
+         */
+        class AttemptTransfer : public HttpBufferTransfer {
+            bool m_cancelled;
+        public:
+            explicit AttemptTransfer(byte_vector data) : HttpBufferTransfer(std::move(data)), m_cancelled(false) {
+            }
+
+            void cancel() {
+                m_cancelled = true;
+            }
+
+            bool cancelled() override {
+                return m_cancelled;
+            }
+        };
+    }
+
+    struct API::RetryRequest {
+        HttpMethod method;
+        std::string url;
+        byte_vector data;
+        std::string filename;
+        HttpRequestClass cls;
+        Idempotency idempotency;
+
+        promise<byte_vector> result;
+        // Attempts started, including hedged ones
+        unsigned attempts = 0;
+        unsigned retries = 0;
+        // Attempts still waiting for a result
+        unsigned pending = 0;
+        bool done = false;
+
+        std::vector<std::shared_ptr<AttemptTransfer>> inflight;
+    };
+
     API::API(HttpManager& manager) : m_manager(manager) {
         m_manager.set_cert(api_cert);
     }
 
-    future<byte_vector> API::get(std::string const &url) {
-        auto& client = m_manager.getFreeClient();
-        return client.get(url);
+    API::~API() {
+        for (HttpManager::TimerId id: m_timers) {
+            m_manager.cancelTimer(id);
+        }
+    }
+
+    future<byte_vector> API::get(std::string const &url, HttpRequestClass cls) {
+        return request(HttpMethod::GET, url, {}, {}, cls, Idempotency::IDEMPOTENT);
     }
 
-    future<void> API::get(std::string const &url, IHttpTransfer* transfer) {
-        auto& client = m_manager.getFreeClient();
+    future<void> API::get(std::string const &url, IHttpTransfer* transfer, HttpRequestClass cls) {
+        auto& client = m_manager.getFreeClient(cls);
         return client.get(url, transfer);
     }
 
-    future<byte_vector> API::post(std::string const &url, byte_vector const& data) {
-        auto& client = m_manager.getFreeClient();
-        return client.post(url, data);
+    future<byte_vector> API::post(std::string const &url, byte_vector const& data, HttpRequestClass cls,
+                                  Idempotency idempotency) {
+        return request(HttpMethod::POST, url, data, {}, cls, idempotency);
     }
 
-    void API::postFile(std::string url, IHttpTransfer* transfer, std::string const& filename) {
-        auto& client = m_manager.getFreeClient();
+    void API::postFile(std::string url, IHttpTransfer* transfer, std::string const& filename, HttpRequestClass cls) {
+        auto& client = m_manager.getFreeClient(cls);
         client.postFile(url, transfer, filename);
     }
 
-    future<byte_vector> API::postFile(std::string url, byte_vector const& data, std::string const& filename) {
-        auto& client = m_manager.getFreeClient();
-        return client.postFile(url, data, filename);
+    future<byte_vector> API::postFile(std::string url, byte_vector const& data, std::string const& filename,
+                                      HttpRequestClass cls, Idempotency idempotency) {
+        return request(HttpMethod::POST_FILE, url, data, filename, cls, idempotency);
     }
 
     future<json> API::jsonGet(std::string const& url) {
-        auto& client = m_manager.getFreeClient();
-        auto request_fut = client.get(url);
+        auto request_fut = get(url);
         auto json_fut = request_fut.next([](future<byte_vector> fut) {
             byte_vector data = fut.get();
             return checkJSONResult(json::parse(data.begin(), data.end()));
@@ -60,13 +106,12 @@ namespace ceema {
         return json_fut;
     }
 
-    future<json> API::jsonPost(std::string const& url, json request) {
-        auto& client = m_manager.getFreeClient();
+    future<json> API::jsonPost(std::string const& url, json request, Idempotency idempotency) {
         std::string jsonString = request.dump();
 
         LOG_DBG("Submitting API request: " << request);
 
-        auto request_fut = client.post(url, byte_vector(jsonString.begin(), jsonString.end()));
+        auto request_fut = post(url, byte_vector(jsonString.begin(), jsonString.end()), HttpRequestClass::API, idempotency);
         auto json_fut = request_fut.next([](future<byte_vector> fut) {
             byte_vector data = fut.get();
             return checkJSONResult(json::parse(data.begin(), data.end()));
@@ -75,6 +120,138 @@ namespace ceema {
         return json_fut;
     }
 
+    future<byte_vector> API::request(HttpMethod method, std::string const& url, byte_vector const& data,
+                                     std::string const& filename, HttpRequestClass cls, Idempotency idempotency) {
+        auto request = std::make_shared<RetryRequest>();
+        request->method = method;
+        request->url = url;
+        request->data = data;
+        request->filename = filename;
+        request->cls = cls;
+        request->idempotency = idempotency;
+
+        future<byte_vector> result = request->result.get_future();
+
+        m_retryBudgets[static_cast<std::size_t>(cls)].deposit(m_retryPolicy);
+        startAttempt(request);
+        if (method == HttpMethod::GET && m_retryPolicy.hedge && !request->done) {
+            scheduleHedge(request);
+        }
+
+        return result;
+    }
+
+    void API::startAttempt(std::shared_ptr<RetryRequest> const& request) {
+        auto transfer = std::make_shared<AttemptTransfer>(request->data);
+        future<byte_vector> result = transfer->get_future();
+        request->attempts++;
+
+        try {
+            auto& client = m_manager.getFreeClient(request->cls);
+            future<void> task;
+            switch (request->method) {
+                case HttpMethod::GET:
+                    task = client.get(request->url, transfer.get());
+                    break;
+                case HttpMethod::POST:
+                    task = client.post(request->url, transfer.get());
+                    break;
+                case HttpMethod::POST_FILE:
+                    task = client.postFile(request->url, transfer.get(), request->filename);
+                    break;
+            }
+
+            // The client refers to the transfer until the task is done
+            task.next([request, transfer](future<void>) {
+                auto& inflight = request->inflight;
+                inflight.erase(std::remove(inflight.begin(), inflight.end(), transfer), inflight.end());
+            });
+        } catch (std::exception&) {
+            onAttemptFailed(request, std::current_exception());
+            return;
+        }
+
+        request->inflight.push_back(transfer);
+        request->pending++;
+
+        result.next([this, request](future<byte_vector> fut) {
+            request->pending--;
+            if (request->done) {
+                // Another attempt already won
+                return;
+            }
+
+            try {
+                byte_vector data = fut.get();
+                request->done = true;
+                for (auto& attempt: request->inflight) {
+                    attempt->cancel();
+                }
+                request->result.set_value(std::move(data));
+            } catch (std::exception&) {
+                onAttemptFailed(request, std::current_exception());
+            }
+        });
+    }
+
+    void API::onAttemptFailed(std::shared_ptr<RetryRequest> const& request, std::exception_ptr exc) {
+        if (request->pending) {
+            // A hedged attempt is still running, let it decide the outcome
+            return;
+        }
+
+        auto& budget = m_retryBudgets[static_cast<std::size_t>(request->cls)];
+        if (request->attempts >= m_retryPolicy.maxAttempts ||
+                !RetryPolicy::retryable(exc, request->idempotency) ||
+                !budget.withdraw()) {
+            request->done = true;
+            request->result.set_exception(exc);
+            return;
+        }
+
+        request->retries++;
+        m_manager.telemetry().recordRetry(request->cls);
+
+        long delay = m_retryPolicy.backoff(request->retries);
+        LOG_DBG("Retrying request " << request->url << " in " << delay << "ms");
+        schedule(delay, [this, request]() {
+            if (!request->done) {
+                startAttempt(request);
+            }
+        });
+    }
+
+    void API::scheduleHedge(std::shared_ptr<RetryRequest> const& request) {
+        long threshold = m_manager.telemetry().latency_percentile(request->cls, m_retryPolicy.hedgePercentile);
+        if (threshold < 0) {
+            // Not enough data to know what is slow
+            return;
+        }
+
+        threshold = std::max(threshold, m_retryPolicy.hedgeMinDelay);
+        schedule(threshold, [this, request]() {
+            if (request->done || request->pending != 1 || request->attempts >= m_retryPolicy.maxAttempts) {
+                return;
+            }
+            if (!m_retryBudgets[static_cast<std::size_t>(request->cls)].withdraw()) {
+                return;
+            }
+
+            LOG_DBG("Hedging slow request " << request->url);
+            m_manager.telemetry().recordRetry(request->cls);
+            startAttempt(request);
+        });
+    }
+
+    void API::schedule(long delay_ms, std::function<void()> callback) {
+        auto id = std::make_shared<HttpManager::TimerId>(0);
+        *id = m_manager.scheduleTimer(delay_ms, [this, id, callback]() {
+            m_timers.erase(*id);
+            callback();
+        });
+        m_timers.insert(*id);
+    }
+
     json API::checkJSONResult(json data) {
         LOG_DBG("Got JSON data for API: " << data);
         if (data.count("success") && !data["success"].get<bool>()) {
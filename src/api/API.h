@@ -18,6 +18,11 @@
 
 #include "json.hpp"
 #include <api/HttpManager.h>
+#include <api/RetryPolicy.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_set>
 
 using json = nlohmann::json;
 
@@ -26,26 +31,92 @@ namespace ceema {
     class API {
         HttpManager& m_manager;
 
+        RetryPolicy m_retryPolicy;
+        std::array<RetryBudget, HTTP_REQUEST_CLASS_COUNT> m_retryBudgets;
+        // Retry and hedge timers that did not run yet
+        std::unordered_set<HttpManager::TimerId> m_timers;
+
         // Builtin certificate for the api server
         static const char* api_cert;
+    public:
+        RetryPolicy const& retry_policy() const {
+            return m_retryPolicy;
+        }
+
+        void set_retry_policy(RetryPolicy const& policy) {
+            m_retryPolicy = policy;
+        }
+
     protected:
         API(HttpManager& manager);
 
-        future<byte_vector> get(std::string const &url);
+        /**
+         * Cancels the pending retries and hedges
+         */
+        ~API();
+
+        /**
+         * GET url. Failed requests are retried according to the retry policy,
+         * and slow requests may be hedged
+         * @param url URL to retrieve
+         * @param cls Class of the request
+         * @return Future holding response data
+         */
+        future<byte_vector> get(std::string const &url, HttpRequestClass cls = HttpRequestClass::API);
 
-        future<void> get(std::string const &url, IHttpTransfer* transfer);
+        /**
+         * GET url into a transfer. Not retried, as the transfer cannot be replayed
+         */
+        future<void> get(std::string const &url, IHttpTransfer* transfer, HttpRequestClass cls = HttpRequestClass::API);
 
-        future<byte_vector> post(std::string const &url, byte_vector const& data);
+        /**
+         * POST data to url. Failed requests are retried according to the retry policy,
+         * non-idempotent requests only if the request never reached the server
+         * @param url URL to post to
+         * @param data Request body
+         * @param cls Class of the request
+         * @param idempotency Whether the request may safely be repeated
+         * @return Future holding response data
+         */
+        future<byte_vector> post(std::string const &url, byte_vector const& data, HttpRequestClass cls = HttpRequestClass::API,
+                                 Idempotency idempotency = Idempotency::NON_IDEMPOTENT);
 
-        future<byte_vector> postFile(std::string url, byte_vector const& data, std::string const& filename);
+        future<byte_vector> postFile(std::string url, byte_vector const& data, std::string const& filename,
+                                     HttpRequestClass cls = HttpRequestClass::API,
+                                     Idempotency idempotency = Idempotency::NON_IDEMPOTENT);
 
-        void postFile(std::string url, IHttpTransfer* transfer, std::string const& filename);
+        /**
+         * POST a file from a transfer. Not retried, as the transfer cannot be replayed
+         */
+        void postFile(std::string url, IHttpTransfer* transfer, std::string const& filename,
+                      HttpRequestClass cls = HttpRequestClass::API);
 
         future<json> jsonGet(std::string const &url);
 
-        future<json> jsonPost(std::string const &url, json request);
+        future<json> jsonPost(std::string const &url, json request, Idempotency idempotency = Idempotency::NON_IDEMPOTENT);
 
         static json checkJSONResult(json data);
+
+        HttpManager& manager() {
+            return m_manager;
+        }
+
+    private:
+        enum class HttpMethod {
+            GET,
+            POST,
+            POST_FILE,
+        };
+
+        struct RetryRequest;
+
+        future<byte_vector> request(HttpMethod method, std::string const& url, byte_vector const& data,
+                                    std::string const& filename, HttpRequestClass cls, Idempotency idempotency);
+
+        void startAttempt(std::shared_ptr<RetryRequest> const& request);
+        void onAttemptFailed(std::shared_ptr<RetryRequest> const& request, std::exception_ptr exc);
+        void scheduleHedge(std::shared_ptr<RetryRequest> const& request);
+        void schedule(long delay_ms, std::function<void()> callback);
     };
 
 }
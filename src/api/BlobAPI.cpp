@@ -28,7 +28,7 @@ namespace ceema {
     }
 
     void BlobAPI::upload(IHttpTransfer *transfer) {
-        return postFile(m_url, transfer, "blob");
+        return postFile(m_url, transfer, "blob", HttpRequestClass::BLOB_UPLOAD);
     }
 
     future<LegacyBlob> BlobAPI::uploadImage(std::string const& fileName, public_key const& pk, private_key const& sk) {
@@ -73,7 +73,7 @@ namespace ceema {
         std::string url = BlobAPI::getDownloadURL(id, m_useTLS);
         url += "/done";
 
-        return get(url).next([](future<byte_vector> fut) {
+        return get(url, HttpRequestClass::BLOB_DOWNLOAD).next([](future<byte_vector> fut) {
             fut.get();
             return;
         });
@@ -85,7 +85,7 @@ namespace ceema {
 
         encrypt(data, blob.n, pk, sk);
 
-        return postFile(m_url, data, "blob").next([blob{std::move(blob)}](future<byte_vector> fut) mutable {
+        return postFile(m_url, data, "blob", HttpRequestClass::BLOB_UPLOAD).next([blob{std::move(blob)}](future<byte_vector> fut) mutable {
             byte_vector blobString = fut.get();
 
             hex_decode(blobString, blob.id);
@@ -98,13 +98,13 @@ namespace ceema {
     future<void> BlobAPI::downloadData(IHttpTransfer* transfer, blob_id const& id) {
         std::string url = BlobAPI::getDownloadURL(id, m_useTLS);
 
-        return get(url, transfer);
+        return get(url, transfer, HttpRequestClass::BLOB_DOWNLOAD);
     }
 
     future<byte_vector> BlobAPI::downloadData(LegacyBlob const& blob, public_key const& pk, private_key const& sk) {
         std::string url = BlobAPI::getDownloadURL(blob.id, m_useTLS);
 
-        return get(url).next([blob, pk{pk}, sk{sk}](future<byte_vector> fut){
+        return get(url, HttpRequestClass::BLOB_DOWNLOAD).next([blob, pk{pk}, sk{sk}](future<byte_vector> fut){
             byte_vector data = fut.get();
             if (!decrypt(data, blob.n, pk, sk)) {
                 throw std::runtime_error("Unable to decrypt file");
@@ -58,7 +58,7 @@ namespace ceema {
         return m_bufferedTransfer.get_future();
     }
 
-    void HttpClient::post(std::string url, IHttpTransfer* transfer) {
+    future<void> HttpClient::post(std::string url, IHttpTransfer* transfer) {
         CURLcode res;
         if ((res = curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str())) != CURLE_OK) {
             throw std::runtime_error(curl_easy_strerror(res));
@@ -74,7 +74,7 @@ namespace ceema {
             throw std::runtime_error(curl_easy_strerror(res));
         }
 
-        startTask(transfer).next([headers](future<void> fut) {
+        return startTask(transfer).next([headers](future<void> fut) {
             curl_slist_free_all(headers);
             fut.get();
         });
@@ -87,7 +87,7 @@ namespace ceema {
         return m_bufferedTransfer.get_future();
     }
 
-    void HttpClient::postFile(std::string url, IHttpTransfer* transfer, std::string const& filename) {
+    future<void> HttpClient::postFile(std::string url, IHttpTransfer* transfer, std::string const& filename) {
         if (transfer->size() == -1) {
             throw std::runtime_error("Invalid file size to POST");
         }
@@ -117,7 +117,7 @@ namespace ceema {
             throw std::runtime_error(curl_easy_strerror(res));
         }
 
-        startTask(transfer).next([post](future<void> fut) {
+        return startTask(transfer).next([post](future<void> fut) {
             curl_formfree(post);
             fut.get();
         });
@@ -143,6 +143,16 @@ namespace ceema {
     }
 
     void HttpClient::completeTask(CURLcode resultCode) {
+        m_manager.telemetry().record(m_requestClass, HttpTransferTiming::fromCURL(m_curl), resultCode == CURLE_OK);
+
+        m_lastRes = resultCode;
+
+        long status = 0;
+        curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &status);
+        if (m_transfer) {
+            m_transfer->onResponse(status);
+        }
+
         if (resultCode == CURLE_OK) {
             if (m_transfer) {
                 m_transfer->onComplete();
@@ -152,7 +162,7 @@ namespace ceema {
             if (m_transfer) {
                 m_transfer->onFailed(resultCode, m_errbuf.data());
             }
-            m_currentTask.set_exception(std::make_exception_ptr(std::runtime_error(lastError())));
+            m_currentTask.set_exception(std::make_exception_ptr(http_exception(resultCode, status, lastError())));
         }
 
         m_transfer = nullptr;
@@ -282,6 +292,7 @@ namespace ceema {
         //LOG_DBG("progress_callback " << dltotal << " " << dlnow << " "  << ultotal << " "  << ulnow);
 
         if (client.m_transfer) {
+            client.m_transfer->onProgress(dltotal, dlnow, ultotal, ulnow);
             return client.m_transfer->cancelled() ? 1 : 0;
         } else {
             return 0;
@@ -26,14 +26,43 @@
 
 #include <config.h>
 #include <async/future.h>
+#include <api/HttpTelemetry.h>
 
 using json = nlohmann::json;
 
 namespace ceema {
     class HttpManager;
 
+    /**
+     * Error raised by a failed HTTP transfer
+     */
+    class http_exception : public std::runtime_error {
+        CURLcode m_code;
+        long m_status;
+    public:
+        http_exception(CURLcode code, long status, std::string const& what) :
+                std::runtime_error(what), m_code(code), m_status(status) {
+        }
+
+        /**
+         * @return CURL result of the transfer
+         */
+        CURLcode code() const {
+            return m_code;
+        }
+
+        /**
+         * @return HTTP status code of the response, 0 if none was received
+         */
+        long status() const {
+            return m_status;
+        }
+    };
+
     class IHttpTransfer {
     public:
+        virtual ~IHttpTransfer() = default;
+
         /**
          * Called when the transfer is initiated
          */
@@ -59,6 +88,13 @@ namespace ceema {
             return available;
         }
 
+        /**
+         * Called when the transfer has finished, before onComplete or onFailed
+         * @param status HTTP status code, 0 if no response was received
+         */
+        virtual void onResponse(long status) {
+        }
+
         /**
          * Call when the transfer has successfully completed
          */
@@ -71,6 +107,16 @@ namespace ceema {
         virtual void onFailed(CURLcode errCode, const char* errMsg) {
         }
 
+        /**
+         * Called periodically while the transfer is running
+         * @param dltotal Total bytes to download, 0 if not known
+         * @param dlnow Bytes downloaded so far
+         * @param ultotal Total bytes to upload, 0 if not known
+         * @param ulnow Bytes uploaded so far
+         */
+        virtual void onProgress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+        }
+
         /**
          * Checks if transfer is to be cancelled
          * @return True if transfer should be canceled (triggers onFailed if not completed)
@@ -92,12 +138,17 @@ namespace ceema {
     class FutureHttpTransfer: public IHttpTransfer {
     protected:
         promise<T> m_promise;
+        long m_status = 0;
 
     public:
         future<T> get_future() {
             return m_promise.get_future();
         }
 
+        void onResponse(long status) override {
+            m_status = status;
+        }
+
         void onComplete() override {
             m_promise.set_value(get_value());
         }
@@ -108,7 +159,7 @@ namespace ceema {
                 err += ": ";
                 err += errMsg;
             }
-            m_promise.set_exception(std::make_exception_ptr(std::runtime_error(err)));
+            m_promise.set_exception(std::make_exception_ptr(http_exception(errCode, m_status, err)));
         }
 
     protected:
@@ -119,12 +170,17 @@ namespace ceema {
     class FutureHttpTransfer<void>: public IHttpTransfer {
     protected:
         promise<void> m_promise;
+        long m_status = 0;
 
     public:
         future<void> get_future() {
             return m_promise.get_future();
         }
 
+        void onResponse(long status) override {
+            m_status = status;
+        }
+
         void onComplete() override {
             m_promise.set_value();
         }
@@ -135,7 +191,7 @@ namespace ceema {
                 err += ": ";
                 err += errMsg;
             }
-            m_promise.set_exception(std::make_exception_ptr(std::runtime_error(err)));
+            m_promise.set_exception(std::make_exception_ptr(http_exception(errCode, m_status, err)));
         }
     };
 
@@ -215,6 +271,8 @@ namespace ceema {
 
         bool m_busy;
 
+        HttpRequestClass m_requestClass;
+
         HttpManager& m_manager;
 
         // Allows to perform cleanup of CURL resources when done
@@ -222,7 +280,8 @@ namespace ceema {
     public:
         HttpClient(HttpManager& manager, std::string const& user_agent) : m_curl(NULL), m_errbuf{}, m_lastRes(CURLE_OK),
                                                                           m_userAgent(user_agent), m_transfer(nullptr),
-                                                                          m_busy(false), m_manager(manager) {
+                                                                          m_busy(false), m_requestClass(HttpRequestClass::OTHER),
+                                                                          m_manager(manager) {
             init();
         }
 
@@ -240,6 +299,18 @@ namespace ceema {
             m_cert = cert;
         }
 
+        HttpRequestClass request_class() const {
+            return m_requestClass;
+        }
+
+        /**
+         * Set the class under which the next request is accounted in the telemetry
+         * @param cls Class of the request
+         */
+        void set_request_class(HttpRequestClass cls) {
+            m_requestClass = cls;
+        }
+
         /**
          * GET url
          * @param url URL to retrieve
@@ -251,11 +322,11 @@ namespace ceema {
 
         future<byte_vector> post(std::string url, byte_vector data);
 
-        void post(std::string url, IHttpTransfer* transfer);
+        future<void> post(std::string url, IHttpTransfer* transfer);
 
         future<byte_vector> postFile(std::string url, byte_vector data, std::string const& filename);
 
-        void postFile(std::string url, IHttpTransfer* transfer, std::string const& filename);
+        future<void> postFile(std::string url, IHttpTransfer* transfer, std::string const& filename);
 
         /**
          * Close any open connections
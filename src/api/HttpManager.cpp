@@ -37,16 +37,19 @@ namespace ceema {
         curl_multi_cleanup(m_handle);
     }
 
-    HttpClient& HttpManager::getFreeClient() {
+    HttpClient& HttpManager::getFreeClient(HttpRequestClass cls) {
         //TODO: invalid const-correctness
         for(auto& client: m_clients) {
             if (!client.getBusy()) {
-                return const_cast<HttpClient&>(client);
+                auto& free_client = const_cast<HttpClient&>(client);
+                free_client.set_request_class(cls);
+                return free_client;
             }
         }
         auto emplace_res = m_clients.emplace(*this, std::string{"Threema/Ceema"});
         auto& client = const_cast<HttpClient&>(*emplace_res.first);
         client.set_cert(m_cert);
+        client.set_request_class(cls);
         return client;
     }
 }
\ No newline at end of file
@@ -18,6 +18,8 @@
 
 #include <curl/multi.h>
 #include <unordered_set>
+#include <functional>
+#include <cstdint>
 #include "HttpClient.h"
 
 namespace ceema {
@@ -32,7 +34,14 @@ namespace ceema {
 
         std::unordered_set<HttpClient> m_clients;
         int m_running_handles;
+
+        HttpTelemetry m_telemetry;
     public:
+        /**
+         * Identifies a timer of scheduleTimer(), never 0
+         */
+        using TimerId = std::uint64_t;
+
         HttpManager();
 
         virtual ~HttpManager();
@@ -43,11 +52,37 @@ namespace ceema {
 
         virtual void registerTimeout(long timeout_ms) = 0;
 
+        /**
+         * Run a callback once after a delay, from the same event loop as the transfers
+         * @param timeout_ms Delay in ms
+         * @param callback Function to call
+         * @return ID of the timer, for cancelTimer()
+         */
+        virtual TimerId scheduleTimer(long timeout_ms, std::function<void()> callback) = 0;
+
+        /**
+         * Cancel a timer that did not run yet. Unknown IDs are ignored.
+         */
+        virtual void cancelTimer(TimerId id) = 0;
+
         void set_cert(std::string cert) {
             m_cert = cert;
         }
 
-        HttpClient& getFreeClient();
+        /**
+         * Find an idle client, or create a new one
+         * @param cls Class the next request of the client is accounted under
+         * @return Client ready to start a new request
+         */
+        HttpClient& getFreeClient(HttpRequestClass cls = HttpRequestClass::OTHER);
+
+        HttpTelemetry& telemetry() {
+            return m_telemetry;
+        }
+
+        HttpTelemetry const& telemetry() const {
+            return m_telemetry;
+        }
 
         void queueClient(HttpClient& client) {
             if (!client.getBusy()) {
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HttpTelemetry.h"
+
+#include <algorithm>
+
+namespace ceema {
+
+    std::ostream& operator<<(std::ostream& os, HttpRequestClass cls) {
+        switch(cls) {
+            case HttpRequestClass::API:
+                return os << "api";
+            case HttpRequestClass::BLOB_UPLOAD:
+                return os << "blob-upload";
+            case HttpRequestClass::BLOB_DOWNLOAD:
+                return os << "blob-download";
+            case HttpRequestClass::OTHER:
+                return os << "other";
+        }
+        return os << "unknown";
+    }
+
+    constexpr std::size_t HttpTelemetry::LATENCY_WINDOW;
+
+    HttpTransferTiming HttpTransferTiming::fromCURL(CURL* curl) {
+        HttpTransferTiming timing;
+        curl_off_t connect = 0;
+        curl_off_t appconnect = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &timing.nameLookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &timing.firstByte);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &timing.total);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &timing.bytesUp);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &timing.bytesDown);
+
+        // CURL reports cumulative times; a reused connection reports 0 for both
+        if (connect > timing.nameLookup) {
+            timing.connect = connect - timing.nameLookup;
+        }
+        if (appconnect > connect) {
+            timing.tlsHandshake = appconnect - connect;
+        }
+
+        return timing;
+    }
+
+    void HttpTelemetry::record(HttpRequestClass cls, HttpTransferTiming const& timing, bool success) {
+        HttpTransferStats& stats = m_stats[index(cls)];
+
+        stats.requests++;
+        if (!success) {
+            stats.failures++;
+        }
+
+        stats.bytesUp += static_cast<std::uint64_t>(timing.bytesUp);
+        stats.bytesDown += static_cast<std::uint64_t>(timing.bytesDown);
+
+        stats.nameLookupTime += static_cast<std::uint64_t>(timing.nameLookup);
+        stats.connectTime += static_cast<std::uint64_t>(timing.connect);
+        stats.tlsTime += static_cast<std::uint64_t>(timing.tlsHandshake);
+        stats.firstByteTime += static_cast<std::uint64_t>(timing.firstByte);
+        stats.totalTime += static_cast<std::uint64_t>(timing.total);
+
+        if (success) {
+            LatencyWindow& window = m_latency[index(cls)];
+            window.samples[window.count % LATENCY_WINDOW] = static_cast<std::uint32_t>(timing.total / 1000);
+            window.count++;
+        }
+    }
+
+    long HttpTelemetry::latency_percentile(HttpRequestClass cls, double percentile) const {
+        LatencyWindow const& window = m_latency[index(cls)];
+        // Need a reasonable number of samples before the tail means anything
+        if (window.count < LATENCY_WINDOW / 4) {
+            return -1;
+        }
+
+        std::size_t count = std::min(window.count, LATENCY_WINDOW);
+        std::array<std::uint32_t, LATENCY_WINDOW> sorted = window.samples;
+        std::size_t rank = std::min(count - 1, static_cast<std::size_t>(percentile * count));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.begin() + count);
+        return sorted[rank];
+    }
+
+    std::ostream& operator<<(std::ostream& os, HttpTransferStats const& stats) {
+        os << stats.requests << " requests (" << stats.failures << " failed, "
+           << stats.retries << " retried), "
+           << stats.bytesUp << "B up, " << stats.bytesDown << "B down, "
+           << static_cast<std::uint64_t>(stats.bytes_per_second()) << "B/s, "
+           << "ttfb " << stats.avg_first_byte() << "us, "
+           << "connect " << stats.avg_connect() << "us, "
+           << "tls " << stats.avg_tls() << "us";
+        return os;
+    }
+
+}
@@ -0,0 +1,166 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <curl/curl.h>
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+namespace ceema {
+
+    /**
+     * Kind of request performed by an HttpClient, used to group telemetry
+     */
+    enum class HttpRequestClass {
+        API,
+        BLOB_UPLOAD,
+        BLOB_DOWNLOAD,
+        OTHER,
+    };
+
+    constexpr std::size_t HTTP_REQUEST_CLASS_COUNT = static_cast<std::size_t>(HttpRequestClass::OTHER) + 1;
+
+    std::ostream& operator<<(std::ostream& os, HttpRequestClass cls);
+
+    /**
+     * Timing of a single finished transfer, as reported by CURL.
+     * All durations are in microseconds, relative to the start of the transfer.
+     */
+    struct HttpTransferTiming {
+        curl_off_t nameLookup = 0;
+        curl_off_t connect = 0;
+        curl_off_t tlsHandshake = 0;
+        curl_off_t firstByte = 0;
+        curl_off_t total = 0;
+
+        curl_off_t bytesUp = 0;
+        curl_off_t bytesDown = 0;
+
+        /**
+         * Read timing information from a finished CURL easy handle
+         * @param curl CURL instance
+         * @return Timing of the last transfer of the handle
+         */
+        static HttpTransferTiming fromCURL(CURL* curl);
+    };
+
+    /**
+     * Aggregated statistics for one request class
+     */
+    struct HttpTransferStats {
+        std::uint64_t requests = 0;
+        std::uint64_t failures = 0;
+        std::uint64_t retries = 0;
+
+        std::uint64_t bytesUp = 0;
+        std::uint64_t bytesDown = 0;
+
+        // Sums over all finished requests, in microseconds
+        std::uint64_t nameLookupTime = 0;
+        std::uint64_t connectTime = 0;
+        std::uint64_t tlsTime = 0;
+        std::uint64_t firstByteTime = 0;
+        std::uint64_t totalTime = 0;
+
+        /**
+         * @return Average throughput (up and down combined) in bytes per second
+         */
+        double bytes_per_second() const {
+            return totalTime ? (bytesUp + bytesDown) * 1e6 / totalTime : 0.0;
+        }
+
+        /**
+         * @return Average time to first byte in microseconds
+         */
+        std::uint64_t avg_first_byte() const {
+            return requests ? firstByteTime / requests : 0;
+        }
+
+        /**
+         * @return Average TCP connect time in microseconds
+         */
+        std::uint64_t avg_connect() const {
+            return requests ? connectTime / requests : 0;
+        }
+
+        /**
+         * @return Average TLS handshake time in microseconds
+         */
+        std::uint64_t avg_tls() const {
+            return requests ? tlsTime / requests : 0;
+        }
+    };
+
+    std::ostream& operator<<(std::ostream& os, HttpTransferStats const& stats);
+
+    /**
+     * Collects per request class transfer statistics of an HttpManager
+     */
+    class HttpTelemetry {
+        // Number of recent request latencies kept per class
+        static constexpr std::size_t LATENCY_WINDOW = 64;
+
+        struct LatencyWindow {
+            std::array<std::uint32_t, LATENCY_WINDOW> samples{};
+            std::size_t count = 0;
+        };
+
+        std::array<HttpTransferStats, HTTP_REQUEST_CLASS_COUNT> m_stats;
+        std::array<LatencyWindow, HTTP_REQUEST_CLASS_COUNT> m_latency;
+
+    public:
+        /**
+         * Record a finished transfer
+         * @param cls Class of the request
+         * @param timing Timing of the transfer
+         * @param success True if the transfer completed successfully
+         */
+        void record(HttpRequestClass cls, HttpTransferTiming const& timing, bool success);
+
+        /**
+         * Record that a request of the given class is being retried
+         * @param cls Class of the request
+         */
+        void recordRetry(HttpRequestClass cls) {
+            m_stats[index(cls)].retries++;
+        }
+
+        HttpTransferStats const& stats(HttpRequestClass cls) const {
+            return m_stats[index(cls)];
+        }
+
+        /**
+         * Compute a percentile over the latency of recent successful requests
+         * @param cls Class of the requests
+         * @param percentile Percentile to compute, between 0 and 1
+         * @return Latency in ms, or -1 if too few requests were seen
+         */
+        long latency_percentile(HttpRequestClass cls, double percentile) const;
+
+        void reset() {
+            m_stats.fill(HttpTransferStats{});
+            m_latency.fill(LatencyWindow{});
+        }
+
+    private:
+        static std::size_t index(HttpRequestClass cls) {
+            return static_cast<std::size_t>(cls);
+        }
+    };
+
+}
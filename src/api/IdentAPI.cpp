@@ -21,31 +21,153 @@
 
 namespace ceema {
 
+    const std::size_t IdentAPI::MAX_BULK_LOOKUP = 100;
+
     future<Contact> IdentAPI::getClientInfo(std::string clientid) {
         std::string url = "https://api.threema.ch/identity/" + clientid;
 
         future<json> responseJson = jsonGet(url);
-        return responseJson.next([](future<json> res) -> Contact {
-            json data = res.get();
+        return responseJson.next([clientid](future<json> res) -> Contact {
+            json data;
+            try {
+                data = res.get();
+            } catch (http_exception& e) {
+                if (e.status() == 404) {
+                    throw unknown_identity_exception(client_id::fromString(clientid));
+                }
+                throw;
+            }
+
+            return parseContact(data);
+        });
+    }
+
+    future<std::vector<Contact>> IdentAPI::getClientInfo(std::vector<client_id> const& ids) {
+        std::string url = "https://api.threema.ch/identity/fetch_bulk";
 
-            json id = data["identity"];
-            json key = data["publicKey"];
+        json requestJson;
+        requestJson["identities"] = json::array();
+        for (client_id const& id: ids) {
+            requestJson["identities"].push_back(id.toString());
+        }
+
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([](future<json> fut) -> std::vector<Contact> {
+            json responseJson = fut.get();
 
-            if (id.is_null() || key.is_null()) {
-              throw std::runtime_error("Invalid data received");
+            std::vector<Contact> res;
+            for (auto const& data: responseJson["identities"]) {
+                res.push_back(parseContact(data));
             }
+            return res;
+        });
+    }
+
+    future<Contact> IdentAPI::fetchClientInfo(client_id const& id) {
+        auto& waiting = m_lookups[id];
+        waiting.emplace_back();
+        future<Contact> res = waiting.back().get_future();
+
+        if (waiting.size() > 1) {
+            // Already requested, share the result
+            return res;
+        }
+
+        m_lookupBatch.push_back(id);
+        if (m_lookupBatch.size() >= MAX_BULK_LOOKUP) {
+            flushLookups();
+        } else if (!m_lookupTimer) {
+            m_lookupTimer = manager().scheduleTimer(m_lookupWindow, [this]() {
+                m_lookupTimer = 0;
+                flushLookups();
+            });
+        }
+
+        return res;
+    }
+
+    void IdentAPI::flushLookups() {
+        if (m_lookupBatch.empty()) {
+            return;
+        }
 
-            client_id c_id = client_id::fromString(id);
+        std::vector<client_id> batch;
+        batch.swap(m_lookupBatch);
+
+        if (batch.size() == 1) {
+            client_id id = batch.front();
+            getClientInfo(id.toString()).next([this, id](future<Contact> fut) {
+                try {
+                    Contact contact = fut.get();
+                    resolveLookup(id, &contact, nullptr);
+                } catch (std::exception& e) {
+                    resolveLookup(id, nullptr, std::current_exception());
+                }
+            });
+            return;
+        }
 
-            public_key pkey;
-            if (base64_decode(key, pkey.data(), pkey.size()) != pkey.size()) {
-              throw std::runtime_error("Error decoding public key");
+        LOG_DEBUG(logging::loggerProtocol, "Bulk lookup of " << batch.size() << " identities");
+        getClientInfo(batch).next([this, batch](future<std::vector<Contact>> fut) {
+            std::vector<Contact> contacts;
+            try {
+                contacts = fut.get();
+            } catch (std::exception& e) {
+                std::exception_ptr exc = std::current_exception();
+                for (client_id const& id: batch) {
+                    resolveLookup(id, nullptr, exc);
+                }
+                return;
             }
 
-            return Contact(c_id, pkey);
+            for (Contact const& contact: contacts) {
+                resolveLookup(contact.id(), &contact, nullptr);
+            }
+            // Whatever was not returned is not known to the server
+            for (client_id const& id: batch) {
+                if (m_lookups.count(id)) {
+                    resolveLookup(id, nullptr, std::make_exception_ptr(unknown_identity_exception(id)));
+                }
+            }
         });
     }
 
+    void IdentAPI::resolveLookup(client_id const& id, Contact const* contact, std::exception_ptr exc) {
+        auto search = m_lookups.find(id);
+        if (search == m_lookups.end()) {
+            return;
+        }
+
+        // Detach first, so callbacks can start a new lookup for the same ID
+        std::vector<promise<Contact>> waiting = std::move(search->second);
+        m_lookups.erase(search);
+
+        for (auto& prom: waiting) {
+            if (contact) {
+                prom.set_value(*contact);
+            } else {
+                prom.set_exception(exc);
+            }
+        }
+    }
+
+    Contact IdentAPI::parseContact(json data) {
+        json id = data["identity"];
+        json key = data["publicKey"];
+
+        if (id.is_null() || key.is_null()) {
+          throw std::runtime_error("Invalid data received");
+        }
+
+        client_id c_id = client_id::fromString(id);
+
+        public_key pkey;
+        if (base64_decode(key, pkey.data(), pkey.size()) != pkey.size()) {
+          throw std::runtime_error("Error decoding public key");
+        }
+
+        return Contact(c_id, pkey);
+    }
+
     future<bool> IdentAPI::setFeatureLevel(Account const& client, int featureLevel) {
         std::string url = "https://api.threema.ch/identity/set_featurelevel";
 
@@ -54,7 +176,8 @@ namespace ceema {
         requestJson["identity"] = client.id().toString();
         requestJson["featureLevel"] = featureLevel;
 
-        return jsonPost(url, requestJson).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
+        // Requesting the challenge has no side effects
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
             json responseJson = fut.get();
 
             insertChallengeResponse(requestJson, responseJson, sk);
@@ -78,7 +201,7 @@ namespace ceema {
             requestJson["identities"].push_back(client.id().toString());
         }
 
-        return jsonPost(url, requestJson).next([](future<json> fut) mutable -> std::vector<unsigned> {
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([](future<json> fut) mutable -> std::vector<unsigned> {
             json responseJson = fut.get();
             LOG_DEBUG(logging::loggerProtocol, "Result " << responseJson);
 
@@ -132,7 +255,8 @@ namespace ceema {
         requestJson["identity"] = client.id().toString();
         requestJson["revocationKey"] = base64_encode(hash_slice);
 
-        return jsonPost(url, requestJson).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
+        // Requesting the challenge has no side effects
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
             json responseJson = fut.get();
 
             insertChallengeResponse(requestJson, responseJson, sk);
@@ -157,7 +281,8 @@ namespace ceema {
         requestJson["identity"] = client.id().toString();
         requestJson["email"] = email;
 
-        return jsonPost(url, requestJson).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
+        // Requesting the challenge has no side effects
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
             json responseJson = fut.get();
 
             insertChallengeResponse(requestJson, responseJson, sk);
@@ -184,7 +309,8 @@ namespace ceema {
             requestJson["urlScheme"] = true;
         }
 
-        return jsonPost(url, requestJson).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
+        // Requesting the challenge has no side effects
+        return jsonPost(url, requestJson, Idempotency::IDEMPOTENT).next([this, requestJson, sk=client.sk()](future<json> fut) mutable -> future<json> {
             json responseJson = fut.get();
 
             if (!responseJson.count("linked")) {
@@ -20,10 +20,26 @@
 
 #include <contact/Contact.h>
 #include <unordered_map>
+#include <vector>
 #include <contact/Account.h>
 
 namespace ceema {
 
+    /**
+     * Raised when the identity server does not know the requested ID
+     */
+    class unknown_identity_exception : public std::runtime_error {
+        client_id m_id;
+    public:
+        explicit unknown_identity_exception(client_id const& id) :
+                std::runtime_error("Unknown identity " + id.toString()), m_id(id) {
+        }
+
+        client_id const& id() const {
+            return m_id;
+        }
+    };
+
     class IdentAPI : public API {
         // E-Mail addresses are hashed with fixed key
         static byte_array<32> emailKey;
@@ -31,11 +47,50 @@ namespace ceema {
         static byte_array<32> phoneKey;
         static nonce createIdentNonce;
 
+        // Callers waiting for an ID, either in the batch or in flight
+        std::unordered_map<client_id, std::vector<promise<Contact>>> m_lookups;
+        // IDs to be requested by the next bulk lookup
+        std::vector<client_id> m_lookupBatch;
+        // Timer sending the batch, 0 if none is scheduled
+        HttpManager::TimerId m_lookupTimer;
+        long m_lookupWindow;
+
     public:
-        explicit IdentAPI(HttpManager& manager) : API(manager) {}
+        // Largest number of IDs requested in one bulk lookup
+        static const std::size_t MAX_BULK_LOOKUP;
+
+        explicit IdentAPI(HttpManager& manager) : API(manager), m_lookupTimer(0), m_lookupWindow(50) {}
+
+        ~IdentAPI() {
+            manager().cancelTimer(m_lookupTimer);
+        }
+
+        /**
+         * Set the time lookups are gathered before a bulk request is sent
+         * @param window_ms Delay in ms
+         */
+        void set_lookup_window(long window_ms) {
+            m_lookupWindow = window_ms;
+        }
 
         future<Contact> getClientInfo(std::string client_id);
 
+        /**
+         * Retrieve the public information of multiple clients in a single request
+         * @param ids IDs of the clients
+         * @return Future holding the contacts known to the server, unknown IDs are omitted
+         */
+        future<std::vector<Contact>> getClientInfo(std::vector<client_id> const& ids);
+
+        /**
+         * Retrieve the public information of a client. Concurrent requests for the same
+         * ID share a single lookup, and IDs requested within a short window are
+         * combined into a bulk lookup.
+         * @param id ID of the client
+         * @return Future holding the contact, or unknown_identity_exception
+         */
+        future<Contact> fetchClientInfo(client_id const& id);
+
         future<bool> setFeatureLevel(Account const& client, int featureLevel);
 
         future<std::vector<unsigned>> checkFeatureLevel(std::vector<Contact> const& clients);
@@ -63,6 +118,11 @@ namespace ceema {
         bool match(std::unordered_map<std::string, Contact>& phone, std::unordered_map<std::string, Contact>& mail);
         */
     private:
+        static Contact parseContact(json data);
+
+        void flushLookups();
+        void resolveLookup(client_id const& id, Contact const* contact, std::exception_ptr exc);
+
         bool insertChallengeResponse(json& request, json const& challenge, private_key const& sk, nonce const& n = crypto::generate_nonce());
 
         std::string hash_phone(std::string phone);
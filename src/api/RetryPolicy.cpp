@@ -0,0 +1,73 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RetryPolicy.h"
+
+#include <api/HttpClient.h>
+#include <encoding/crypto.h>
+
+namespace ceema {
+
+    long RetryPolicy::backoff(unsigned retry) const {
+        long cap = baseDelay;
+        for (unsigned i = 1; i < retry && cap < maxDelay; i++) {
+            cap *= 2;
+        }
+        cap = std::min(cap, maxDelay);
+        if (cap <= 0) {
+            return 0;
+        }
+
+        // Full jitter: spread retries of many clients over the whole window
+        return static_cast<long>(crypto::random::random() % (static_cast<std::uint32_t>(cap) + 1));
+    }
+
+    bool RetryPolicy::retryable(std::exception_ptr exc, Idempotency idempotency) {
+        try {
+            std::rethrow_exception(exc);
+        } catch (http_exception& e) {
+            if (e.status() == 0) {
+                switch (e.code()) {
+                    case CURLE_COULDNT_RESOLVE_HOST:
+                    case CURLE_COULDNT_CONNECT:
+                    case CURLE_SSL_CONNECT_ERROR:
+                        // Request never reached the server
+                        return true;
+                    case CURLE_OPERATION_TIMEDOUT:
+                    case CURLE_SEND_ERROR:
+                    case CURLE_RECV_ERROR:
+                    case CURLE_GOT_NOTHING:
+                    case CURLE_PARTIAL_FILE:
+                        // Server may or may not have processed the request
+                        return idempotency == Idempotency::IDEMPOTENT;
+                    default:
+                        return false;
+                }
+            }
+
+            if (e.status() == 429) {
+                // Rate limited, request was not processed
+                return true;
+            } else if (e.status() >= 500) {
+                return idempotency == Idempotency::IDEMPOTENT;
+            }
+            return false;
+        } catch (std::exception&) {
+            return false;
+        }
+    }
+
+}
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <exception>
+#include <algorithm>
+
+namespace ceema {
+
+    /**
+     * Whether repeating a request can cause side effects on the server
+     */
+    enum class Idempotency {
+        IDEMPOTENT,
+        NON_IDEMPOTENT,
+    };
+
+    /**
+     * Settings controlling how failed API requests are retried
+     */
+    struct RetryPolicy {
+        // Total number of attempts, including the first one
+        unsigned maxAttempts = 4;
+        // Backoff cap for the first retry, doubled for every subsequent one
+        long baseDelay = 250;
+        // Upper bound on the backoff, in ms
+        long maxDelay = 8000;
+
+        // Fraction of a retry earned per request, limits retries when the server is down
+        double budgetRatio = 0.2;
+        // Maximum number of retries that can be saved up
+        double budgetMax = 10.0;
+
+        // Send a second copy of idempotent GET requests that take unusually long
+        bool hedge = true;
+        // Latency percentile after which the hedged request is sent
+        double hedgePercentile = 0.95;
+        // Never hedge earlier than this, in ms
+        long hedgeMinDelay = 100;
+
+        /**
+         * Compute the delay before the given retry, using exponential
+         * backoff with full jitter
+         * @param retry Number of the retry, starting at 1
+         * @return Delay in ms
+         */
+        long backoff(unsigned retry) const;
+
+        /**
+         * Checks if a failed request may be attempted again
+         * @param exc Exception the request failed with
+         * @param idempotency Idempotency of the request
+         * @return True if the failure is transient and retrying is safe
+         */
+        static bool retryable(std::exception_ptr exc, Idempotency idempotency);
+    };
+
+    /**
+     * Token bucket limiting the number of retries relative to the number of requests
+     */
+    class RetryBudget {
+        double m_tokens;
+
+    public:
+        explicit RetryBudget(double tokens = RetryPolicy().budgetMax) : m_tokens(tokens) {}
+
+        /**
+         * Account a new request, adding a fraction of a retry to the budget
+         */
+        void deposit(RetryPolicy const& policy) {
+            m_tokens = std::min(m_tokens + policy.budgetRatio, policy.budgetMax);
+        }
+
+        /**
+         * Take a retry from the budget
+         * @return True if a retry was available
+         */
+        bool withdraw() {
+            if (m_tokens < 1.0) {
+                return false;
+            }
+            m_tokens -= 1.0;
+            return true;
+        }
+    };
+
+}
@@ -0,0 +1,455 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "EventLoop.h"
+
+#include <logging/logging.h>
+#include <socket/socket.h>
+
+#ifdef USE_IO_URING
+#include "UringTransport.h"
+#endif
+
+#include <algorithm>
+#include <type_traits>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace ceema {
+
+    // Timers of the wheel are handed out as HttpManager timers
+    static_assert(std::is_same<TimerWheel::TimerId, HttpManager::TimerId>::value, "Timer ID types differ");
+
+    namespace {
+        // Number of events fetched per epoll_wait call
+        const int MAX_EVENTS = 64;
+
+#ifdef USE_IO_URING
+        // Submission queue entries, and receive buffers shared by all sessions
+        const unsigned URING_ENTRIES = 1024;
+        const unsigned URING_BUFFERS = 1024;
+#endif
+
+        std::uint32_t to_epoll(std::uint32_t events, bool edge) {
+            std::uint32_t result = EPOLLRDHUP;
+            if (events & EventLoop::READABLE) {
+                result |= EPOLLIN;
+            }
+            if (events & EventLoop::WRITABLE) {
+                result |= EPOLLOUT;
+            }
+            if (edge) {
+                result |= EPOLLET;
+            }
+            return result;
+        }
+
+        std::uint32_t from_epoll(std::uint32_t events) {
+            std::uint32_t result = 0;
+            if (events & EPOLLIN) {
+                result |= EventLoop::READABLE;
+            }
+            if (events & EPOLLOUT) {
+                result |= EventLoop::WRITABLE;
+            }
+            if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                result |= EventLoop::CLOSED;
+            }
+            return result;
+        }
+    }
+
+    EventLoop::EventLoop() : m_curlTimer(0), m_running(false) {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll < 0) {
+            throw socket_exception();
+        }
+        m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_timerfd < 0) {
+            int err = last_error();
+            ::close(m_epoll);
+            throw socket_exception(err);
+        }
+        m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventfd < 0) {
+            int err = last_error();
+            ::close(m_timerfd);
+            ::close(m_epoll);
+            throw socket_exception(err);
+        }
+        watch(m_timerfd, READABLE, false, [this](std::uint32_t) {
+            onTimer();
+        });
+        watch(m_eventfd, READABLE, false, [this](std::uint32_t) {
+            onPosted();
+        });
+
+        // Replace the socket callback of HttpManager: epoll needs the exact
+        // set of events CURL waits for, not just the added ones
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETFUNCTION, &curl_socket_callback);
+
+#ifdef USE_IO_URING
+        try {
+            m_uring.reset(new UringTransport(*this, URING_ENTRIES, URING_BUFFERS));
+        } catch (std::exception& e) {
+            LOG_INFO(logging::loggerNetwork, "io_uring not available, using epoll: " << e.what());
+        }
+#endif
+    }
+
+    EventLoop::~EventLoop() {
+        // HttpManager removes its transfers after this object is gone
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETFUNCTION, nullptr);
+        curl_multi_setopt(m_handle, CURLMOPT_TIMERFUNCTION, nullptr);
+
+        while (!m_sessions.empty()) {
+            detach(*m_sessions.begin()->first);
+        }
+#ifdef USE_IO_URING
+        m_uring.reset();
+#endif
+        ::close(m_eventfd);
+        ::close(m_timerfd);
+        ::close(m_epoll);
+    }
+
+    void EventLoop::watch(int fd, std::uint32_t events, bool edge, Handler handler) {
+        auto iter = m_watches.find(fd);
+        if (iter != m_watches.end()) {
+            unwatch(fd);
+        }
+
+        std::unique_ptr<Watch> w(new Watch{fd, events, edge, std::move(handler)});
+        epoll_event ev{};
+        ev.events = to_epoll(events, edge);
+        ev.data.ptr = w.get();
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            throw socket_exception();
+        }
+        m_watches.emplace(fd, std::move(w));
+    }
+
+    void EventLoop::modify(int fd, std::uint32_t events) {
+        auto iter = m_watches.find(fd);
+        if (iter == m_watches.end()) {
+            throw std::logic_error("Modifying unwatched file descriptor");
+        }
+        Watch& w = *iter->second;
+        if (w.events == events) {
+            return;
+        }
+        w.events = events;
+        epoll_event ev{};
+        ev.events = to_epoll(events, w.edge);
+        ev.data.ptr = &w;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev) != 0) {
+            throw socket_exception();
+        }
+    }
+
+    void EventLoop::unwatch(int fd) {
+        auto iter = m_watches.find(fd);
+        if (iter == m_watches.end()) {
+            return;
+        }
+        // The fd may already be closed, in which case epoll dropped it already
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        // Events for it may still be pending in the current batch
+        iter->second->fd = -1;
+        m_removed.push_back(std::move(iter->second));
+        m_watches.erase(iter);
+    }
+
+    void EventLoop::attach(Session& session, int fd, SessionHandler handler) {
+        if (m_sessions.find(&session) != m_sessions.end()) {
+            throw std::logic_error("Session already attached");
+        }
+        m_sessions.emplace(&session, fd);
+#ifdef USE_IO_URING
+        if (m_uring) {
+            m_uring->attach(session, fd, std::move(handler));
+            return;
+        }
+#endif
+        watch(fd, READABLE | WRITABLE, true, [this, &session, handler](std::uint32_t events) {
+            std::exception_ptr error;
+            try {
+                if (events & WRITABLE) {
+                    session.onReadyWrite();
+                }
+                if ((events & (READABLE | CLOSED)) && !session.onReadyRead()) {
+                    error = std::make_exception_ptr(std::runtime_error("Connection closed by server"));
+                }
+            } catch (std::exception&) {
+                error = std::current_exception();
+            }
+
+            if (events & (READABLE | CLOSED)) {
+                // Packets read before the error are still delivered
+                handler(session, nullptr);
+            }
+            if (error) {
+                detach(session);
+                handler(session, error);
+            }
+        });
+    }
+
+    void EventLoop::detach(Session& session) {
+        auto iter = m_sessions.find(&session);
+        if (iter == m_sessions.end()) {
+            return;
+        }
+        int fd = iter->second;
+        m_sessions.erase(iter);
+
+        bool uring = false;
+#ifdef USE_IO_URING
+        uring = m_uring && m_uring->detach(session);
+#endif
+        if (!uring) {
+            unwatch(fd);
+        }
+        session.terminate();
+        ::close(fd);
+    }
+
+    void EventLoop::write_file(int fd, byte_vector data, std::uint64_t offset, WriteHandler handler) {
+#ifdef USE_IO_URING
+        if (m_uring) {
+            m_uring->write(fd, std::move(data), offset, std::move(handler));
+            return;
+        }
+#endif
+        std::exception_ptr error;
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t res = ::pwrite(fd, data.data() + written, data.size() - written,
+                                   static_cast<off_t>(offset + written));
+            if (res < 0 && last_error() == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                error = std::make_exception_ptr(socket_exception(res < 0 ? last_error() : EIO));
+                break;
+            }
+            written += static_cast<std::size_t>(res);
+        }
+        handler(error);
+    }
+
+    bool EventLoop::uses_uring() const {
+#ifdef USE_IO_URING
+        return static_cast<bool>(m_uring);
+#else
+        return false;
+#endif
+    }
+
+    int EventLoop::run_once(int timeout_ms) {
+#ifdef USE_IO_URING
+        if (m_uring) {
+            // Everything queued since the last round goes out in one system call
+            m_uring->submit();
+        }
+#endif
+        epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(m_epoll, events, MAX_EVENTS, timeout_ms);
+        if (count < 0) {
+            if (last_error() == EINTR) {
+                return 0;
+            }
+            throw socket_exception();
+        }
+
+        for (int i = 0; i < count; i++) {
+            Watch* w = static_cast<Watch*>(events[i].data.ptr);
+            if (w->fd < 0) {
+                // Removed by an earlier handler
+                continue;
+            }
+            try {
+                w->handler(from_epoll(events[i].events));
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Event handler failed: " << e.what());
+            }
+        }
+        m_removed.clear();
+
+        return count;
+    }
+
+    void EventLoop::run() {
+        m_running = true;
+        while (m_running) {
+            run_once(-1);
+        }
+    }
+
+    void EventLoop::post(std::function<void()> callback) {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(m_postMutex);
+            wake = m_posted.empty();
+            m_posted.push_back(std::move(callback));
+        }
+        if (wake) {
+            std::uint64_t one = 1;
+            ssize_t res = ::write(m_eventfd, &one, sizeof(one));
+            (void)res;
+        }
+    }
+
+    void* EventLoop::registerRead(int fd, void* ptr) {
+        auto iter = m_watches.find(fd);
+        std::uint32_t events = (iter != m_watches.end()) ? iter->second->events : 0;
+        updateSocket(fd, events | READABLE);
+        return ptr;
+    }
+
+    void* EventLoop::registerWrite(int fd, void* ptr) {
+        auto iter = m_watches.find(fd);
+        std::uint32_t events = (iter != m_watches.end()) ? iter->second->events : 0;
+        updateSocket(fd, events | WRITABLE);
+        return ptr;
+    }
+
+    void* EventLoop::unregister(int fd, void* ptr) {
+        unwatch(fd);
+        return nullptr;
+    }
+
+    void EventLoop::registerTimeout(long timeout_ms) {
+        // CURL keeps a single timeout, a new one replaces the previous
+        m_timers.cancel(m_curlTimer);
+        m_curlTimer = 0;
+        if (timeout_ms >= 0) {
+            m_curlTimer = m_timers.schedule(std::chrono::milliseconds(timeout_ms), [this]() {
+                m_curlTimer = 0;
+                int running_handles = 0;
+                curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+                checkMessages();
+            });
+        }
+        armTimer();
+    }
+
+    EventLoop::TimerId EventLoop::scheduleTimer(long timeout_ms, std::function<void()> callback) {
+        TimerId id = m_timers.schedule(std::chrono::milliseconds(timeout_ms), std::move(callback));
+        armTimer();
+        return id;
+    }
+
+    void EventLoop::cancelTimer(TimerId id) {
+        // The timerfd stays armed, an early wakeup is cheaper than re-arming
+        m_timers.cancel(id);
+    }
+
+    void EventLoop::updateSocket(int fd, std::uint32_t events) {
+        if (m_watches.find(fd) != m_watches.end()) {
+            modify(fd, events);
+            return;
+        }
+        // CURL does not always read everything it is notified for, so level-triggered
+        watch(fd, events, false, [this, fd](std::uint32_t events) {
+            int mask = (events & READABLE) ? CURL_CSELECT_IN : 0;
+            mask |= (events & WRITABLE) ? CURL_CSELECT_OUT : 0;
+            mask |= (events & CLOSED) ? CURL_CSELECT_ERR : 0;
+            int running_handles = 0;
+            curl_multi_socket_action(m_handle, fd, mask, &running_handles);
+            checkMessages();
+        });
+    }
+
+    void EventLoop::onTimer() {
+        std::uint64_t expirations;
+        while (::read(m_timerfd, &expirations, sizeof(expirations)) > 0) {
+        }
+        m_armed = clock::time_point();
+
+        // Timers scheduled by the callbacks run on a later round at the earliest
+        m_timers.advance();
+
+        armTimer();
+    }
+
+    void EventLoop::onPosted() {
+        std::uint64_t count;
+        while (::read(m_eventfd, &count, sizeof(count)) > 0) {
+        }
+
+        std::vector<std::function<void()>> posted;
+        {
+            std::lock_guard<std::mutex> lock(m_postMutex);
+            posted.swap(m_posted);
+        }
+        for (auto& callback: posted) {
+            try {
+                callback();
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Posted callback failed: " << e.what());
+            }
+        }
+    }
+
+    void EventLoop::armTimer() {
+        clock::time_point deadline = m_timers.next_deadline();
+        bool pending = deadline != clock::time_point::max();
+
+        itimerspec spec{};
+        if (pending) {
+            if (deadline == m_armed) {
+                return;
+            }
+            // A zero value disarms the timer, so fire in at least 1 ns
+            auto delay = std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - clock::now()),
+                                  std::chrono::nanoseconds(1));
+            spec.it_value.tv_sec = static_cast<time_t>(delay.count() / 1000000000);
+            spec.it_value.tv_nsec = static_cast<long>(delay.count() % 1000000000);
+            m_armed = deadline;
+        } else {
+            m_armed = clock::time_point();
+        }
+        timerfd_settime(m_timerfd, 0, &spec, nullptr);
+    }
+
+    int EventLoop::curl_socket_callback(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp) {
+        EventLoop* loop = static_cast<EventLoop*>(userp);
+        switch(action) {
+            case CURL_POLL_IN:
+                loop->updateSocket(s, READABLE);
+                break;
+            case CURL_POLL_OUT:
+                loop->updateSocket(s, WRITABLE);
+                break;
+            case CURL_POLL_INOUT:
+                loop->updateSocket(s, READABLE | WRITABLE);
+                break;
+            case CURL_POLL_REMOVE:
+                loop->unwatch(s);
+                break;
+            case CURL_POLL_NONE:
+            default:
+                break;
+        }
+        return CURLM_OK;
+    }
+
+}
@@ -0,0 +1,208 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "config.h"
+
+#include "TimerWheel.h"
+
+#include <api/HttpManager.h>
+#include <protocol/session.h>
+#include <types/bytes.h>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Event loop based on epoll and timerfd, for running the library without
+     * libpurple (or any other main loop).
+     *
+     * Serves as HttpManager for the HTTP APIs, and drives Sessions: the loop
+     * takes ownership of the socket of an attached session and watches it
+     * edge-triggered, which suits Session as it reads and writes until the
+     * socket would block. All callbacks run on the thread calling run();
+     * only post() may be called from other threads.
+     *
+     * If built with USE_IO_URING and the kernel supports it, sessions and
+     * file writes go through io_uring instead (see UringTransport).
+     */
+#ifdef USE_IO_URING
+    class UringTransport;
+#endif
+
+    class EventLoop : public HttpManager {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        enum Events : std::uint32_t {
+            READABLE = 1u << 0,
+            WRITABLE = 1u << 1,
+            // Error or hangup, always reported
+            CLOSED = 1u << 2,
+        };
+
+        /**
+         * Called with the Events that occurred on a file descriptor
+         */
+        using Handler = std::function<void(std::uint32_t events)>;
+
+        /**
+         * Called after an attached session received data, and once more with
+         * an error if the connection failed or was closed. The session is
+         * detached and terminated before the error is reported.
+         */
+        using SessionHandler = std::function<void(Session& session, std::exception_ptr error)>;
+
+        /**
+         * Called once a file write completed, with the error if it failed
+         */
+        using WriteHandler = std::function<void(std::exception_ptr error)>;
+
+    private:
+        struct Watch {
+            int fd;
+            std::uint32_t events;
+            bool edge;
+            Handler handler;
+        };
+
+        int m_epoll;
+        int m_timerfd;
+        int m_eventfd;
+        std::unordered_map<int, std::unique_ptr<Watch>> m_watches;
+        // Watches removed while dispatching events, freed after dispatching
+        std::vector<std::unique_ptr<Watch>> m_removed;
+
+        // All timers of the loop, including the CURL timeout, share the timerfd
+        TimerWheel m_timers;
+        TimerWheel::TimerId m_curlTimer;
+        clock::time_point m_armed;
+
+        std::unordered_map<Session*, int> m_sessions;
+        bool m_running;
+
+        std::mutex m_postMutex;
+        std::vector<std::function<void()>> m_posted;
+
+#ifdef USE_IO_URING
+        std::unique_ptr<UringTransport> m_uring;
+#endif
+
+    public:
+        EventLoop();
+        ~EventLoop();
+
+        EventLoop(EventLoop const&) = delete;
+        EventLoop& operator=(EventLoop const&) = delete;
+
+        /**
+         * Watch a file descriptor, replacing any previous watch of it
+         * @param fd File descriptor
+         * @param events Events to watch for
+         * @param edge True for edge-triggered notification
+         * @param handler Function to call on events
+         */
+        void watch(int fd, std::uint32_t events, bool edge, Handler handler);
+
+        /**
+         * Change the events watched for
+         */
+        void modify(int fd, std::uint32_t events);
+
+        /**
+         * Stop watching a file descriptor. Does not close it.
+         */
+        void unwatch(int fd);
+
+        /**
+         * Drive a connected session. The loop owns the socket from now on,
+         * and closes it when the session is detached.
+         * @param session Session, connect() must have been called with the socket
+         * @param fd Socket of the session
+         * @param handler Function to call when packets may be available
+         */
+        void attach(Session& session, int fd, SessionHandler handler);
+
+        /**
+         * Stop driving a session, terminate it and close its socket
+         */
+        void detach(Session& session);
+
+        /**
+         * Write data to a file. Queued with the session I/O when using
+         * io_uring, written right away otherwise. The handler may be called
+         * before this returns.
+         * @param fd File to write to, must stay open until the handler is called
+         * @param data Data to write
+         * @param offset Offset in the file
+         * @param handler Function to call once written
+         */
+        void write_file(int fd, byte_vector data, std::uint64_t offset, WriteHandler handler);
+
+        /**
+         * @return True if I/O goes through io_uring
+         */
+        bool uses_uring() const;
+
+        /**
+         * Wait for events once, and dispatch them
+         * @param timeout_ms Maximum time to wait in ms, -1 to wait indefinitely
+         * @return Number of file descriptor events handled
+         */
+        int run_once(int timeout_ms = -1);
+
+        /**
+         * Dispatch events until stop() is called
+         */
+        void run();
+
+        void stop() {
+            m_running = false;
+        }
+
+        /**
+         * Run a function on the loop thread, during its next iteration.
+         * Safe to call from any thread.
+         */
+        void post(std::function<void()> callback);
+
+        void* registerRead(int fd, void* ptr) override;
+        void* registerWrite(int fd, void* ptr) override;
+        void* unregister(int fd, void* ptr) override;
+        void registerTimeout(long timeout_ms) override;
+        TimerId scheduleTimer(long timeout_ms, std::function<void()> callback) override;
+        void cancelTimer(TimerId id) override;
+
+    private:
+        void updateSocket(int fd, std::uint32_t events);
+        void onTimer();
+        void onPosted();
+        void armTimer();
+
+        static int curl_socket_callback(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp);
+    };
+
+}
@@ -0,0 +1,248 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "IoUring.h"
+
+#include <socket/socket.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ceema {
+
+    namespace {
+        int sys_setup(unsigned entries, io_uring_params* params) {
+            return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+        }
+
+        int sys_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0));
+        }
+
+        int sys_register(int fd, unsigned opcode, void const* arg, unsigned count) {
+            return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+        }
+
+        // Ring indices are shared with the kernel
+        unsigned load_acquire(unsigned const* ptr) {
+            return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+        }
+
+        template<typename T>
+        void store_release(T* ptr, T value) {
+            __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+        }
+
+        template<typename T>
+        T* offset(void* base, std::uint32_t off) {
+            return reinterpret_cast<T*>(static_cast<std::uint8_t*>(base) + off);
+        }
+    }
+
+    IoUring::IoUring(unsigned entries) : m_fd(-1), m_eventfd(-1), m_ringPtr(MAP_FAILED), m_cqPtr(MAP_FAILED),
+                                         m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), m_sqeTail(0),
+                                         m_bufRing(nullptr), m_bufRingSize(0), m_bufGroup(0), m_bufCount(0),
+                                         m_bufSize(0), m_bufTail(0) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CLAMP;
+        m_fd = sys_setup(entries, &params);
+        if (m_fd < 0) {
+            throw socket_exception();
+        }
+        m_features = params.features;
+
+        m_ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (m_features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            m_ringSize = std::max(m_ringSize, m_cqSize);
+        }
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_ringPtr = ::mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                           IORING_OFF_SQ_RING);
+        if (m_ringPtr != MAP_FAILED) {
+            m_cqPtr = single ? m_ringPtr : ::mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        }
+        if (m_cqPtr != MAP_FAILED) {
+            m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                                       MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+        }
+        if (m_sqes == MAP_FAILED) {
+            int err = last_error();
+            unmap();
+            throw socket_exception(err);
+        }
+
+        m_sqHead = offset<unsigned>(m_ringPtr, params.sq_off.head);
+        m_sqTail = offset<unsigned>(m_ringPtr, params.sq_off.tail);
+        m_sqMask = *offset<unsigned>(m_ringPtr, params.sq_off.ring_mask);
+        m_sqEntries = params.sq_entries;
+        m_cqHead = offset<unsigned>(m_cqPtr, params.cq_off.head);
+        m_cqTail = offset<unsigned>(m_cqPtr, params.cq_off.tail);
+        m_cqMask = *offset<unsigned>(m_cqPtr, params.cq_off.ring_mask);
+        m_cqes = offset<io_uring_cqe>(m_cqPtr, params.cq_off.cqes);
+        m_sqeTail = *m_sqTail;
+
+        // Entries are used in ring order, so the index array is fixed
+        unsigned* array = offset<unsigned>(m_ringPtr, params.sq_off.array);
+        for (unsigned i = 0; i < m_sqEntries; i++) {
+            array[i] = i;
+        }
+
+        m_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventfd < 0 || sys_register(m_fd, IORING_REGISTER_EVENTFD, &m_eventfd, 1) != 0) {
+            int err = last_error();
+            unmap();
+            throw socket_exception(err);
+        }
+    }
+
+    IoUring::~IoUring() {
+        unmap();
+    }
+
+    io_uring_sqe* IoUring::sqe() {
+        if (m_sqeTail - load_acquire(m_sqHead) >= m_sqEntries) {
+            submit();
+            if (m_sqeTail - load_acquire(m_sqHead) >= m_sqEntries) {
+                throw socket_exception(EBUSY);
+            }
+        }
+        io_uring_sqe* entry = &m_sqes[m_sqeTail & m_sqMask];
+        std::memset(entry, 0, sizeof(*entry));
+        m_sqeTail++;
+        return entry;
+    }
+
+    unsigned IoUring::submit() {
+        store_release(m_sqTail, m_sqeTail);
+        unsigned count = m_sqeTail - load_acquire(m_sqHead);
+        if (!count) {
+            return 0;
+        }
+        int res;
+        do {
+            res = sys_enter(m_fd, count, 0, 0);
+        } while (res < 0 && last_error() == EINTR);
+        if (res < 0) {
+            int err = last_error();
+            if (err == EAGAIN || err == EBUSY) {
+                // Completion queue backed up; retried on the next submit
+                return 0;
+            }
+            throw socket_exception(err);
+        }
+        return static_cast<unsigned>(res);
+    }
+
+    void IoUring::reap(std::vector<Completion>& completions) {
+        completions.clear();
+        std::uint64_t count;
+        while (::read(m_eventfd, &count, sizeof(count)) > 0) {
+        }
+
+        unsigned head = *m_cqHead;
+        unsigned tail = load_acquire(m_cqTail);
+        for (; head != tail; head++) {
+            io_uring_cqe const& cqe = m_cqes[head & m_cqMask];
+            completions.push_back(Completion{cqe.user_data, cqe.res, cqe.flags});
+        }
+        store_release(m_cqHead, head);
+    }
+
+    void IoUring::provide_buffers(std::uint16_t group, unsigned count, unsigned size) {
+        if (m_bufRing || !count || (count & (count - 1)) || count > 32768) {
+            throw std::invalid_argument("Invalid buffer ring");
+        }
+        m_bufRingSize = count * sizeof(io_uring_buf);
+        void* ring = ::mmap(nullptr, m_bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            throw socket_exception();
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(ring);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (sys_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            int err = last_error();
+            ::munmap(ring, m_bufRingSize);
+            throw socket_exception(err);
+        }
+
+        m_bufRing = static_cast<io_uring_buf_ring*>(ring);
+        m_bufGroup = group;
+        m_bufCount = count;
+        m_bufSize = size;
+        m_buffers.resize(static_cast<std::size_t>(count) * size);
+        m_bufTail = 0;
+        for (unsigned i = 0; i < count; i++) {
+            add_buffer(i);
+        }
+        store_release(&m_bufRing->tail, m_bufTail);
+    }
+
+    void IoUring::recycle(unsigned id) {
+        add_buffer(id);
+        store_release(&m_bufRing->tail, m_bufTail);
+    }
+
+    void IoUring::add_buffer(unsigned id) {
+        // The ring tail overlays the reserved field of the first entry, leave it alone
+        io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(m_bufRing);
+        io_uring_buf& buf = bufs[m_bufTail & (m_bufCount - 1)];
+        buf.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+        buf.len = m_bufSize;
+        buf.bid = static_cast<std::uint16_t>(id);
+        m_bufTail++;
+    }
+
+    void IoUring::unmap() {
+        // Closing the ring first releases the kernel's hold on the mappings
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        if (m_eventfd >= 0) {
+            ::close(m_eventfd);
+            m_eventfd = -1;
+        }
+        if (m_bufRing) {
+            ::munmap(m_bufRing, m_bufRingSize);
+            m_bufRing = nullptr;
+        }
+        if (m_sqes != MAP_FAILED) {
+            ::munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqPtr != MAP_FAILED && m_cqPtr != m_ringPtr) {
+            ::munmap(m_cqPtr, m_cqSize);
+        }
+        if (m_ringPtr != MAP_FAILED) {
+            ::munmap(m_ringPtr, m_ringSize);
+        }
+        m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        m_cqPtr = MAP_FAILED;
+        m_ringPtr = MAP_FAILED;
+    }
+
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+namespace ceema {
+
+    /**
+     * Minimal io_uring instance, used directly through the kernel interface.
+     *
+     * Submission entries are collected with sqe() and handed to the kernel
+     * in one system call by submit(). Completions are signalled on an
+     * eventfd, so the ring can be driven from an epoll loop. Optionally
+     * holds a ring of provided buffers for receives (buffer selection).
+     *
+     * Constructing throws socket_exception if the kernel does not support
+     * io_uring (or it is disabled).
+     */
+    class IoUring {
+    public:
+        struct Completion {
+            std::uint64_t data;
+            std::int32_t res;
+            std::uint32_t flags;
+        };
+
+    private:
+        int m_fd;
+        int m_eventfd;
+        unsigned m_features;
+
+        // Shared ring mappings
+        void* m_ringPtr;
+        std::size_t m_ringSize;
+        void* m_cqPtr;
+        std::size_t m_cqSize;
+        io_uring_sqe* m_sqes;
+        std::size_t m_sqesSize;
+
+        unsigned* m_sqHead;
+        unsigned* m_sqTail;
+        unsigned m_sqMask;
+        unsigned m_sqEntries;
+        unsigned* m_cqHead;
+        unsigned* m_cqTail;
+        unsigned m_cqMask;
+        io_uring_cqe* m_cqes;
+        // Entries handed out by sqe(), published by submit()
+        unsigned m_sqeTail;
+
+        // Provided buffers
+        io_uring_buf_ring* m_bufRing;
+        std::size_t m_bufRingSize;
+        std::vector<std::uint8_t> m_buffers;
+        std::uint16_t m_bufGroup;
+        unsigned m_bufCount;
+        unsigned m_bufSize;
+        std::uint16_t m_bufTail;
+
+    public:
+        /**
+         * @param entries Size of the submission queue
+         */
+        explicit IoUring(unsigned entries);
+        ~IoUring();
+
+        IoUring(IoUring const&) = delete;
+        IoUring& operator=(IoUring const&) = delete;
+
+        /**
+         * @return eventfd signalled when completions are posted
+         */
+        int eventfd() const {
+            return m_eventfd;
+        }
+
+        /**
+         * Get a cleared submission entry. Submits queued entries if the
+         * queue is full, throws if no entry frees up.
+         */
+        io_uring_sqe* sqe();
+
+        /**
+         * Hand all queued entries to the kernel
+         * @return Number of entries submitted
+         */
+        unsigned submit();
+
+        /**
+         * Queue of entries not submitted yet
+         */
+        bool pending() const {
+            return m_sqeTail != *m_sqTail;
+        }
+
+        /**
+         * Take the posted completions. The buffer is cleared first.
+         */
+        void reap(std::vector<Completion>& completions);
+
+        /**
+         * Register a ring of provided buffers. Throws socket_exception if the
+         * kernel does not support buffer rings.
+         * @param group Buffer group ID, used in IOSQE_BUFFER_SELECT entries
+         * @param count Number of buffers, a power of two
+         * @param size Size of each buffer
+         */
+        void provide_buffers(std::uint16_t group, unsigned count, unsigned size);
+
+        std::uint16_t buffer_group() const {
+            return m_bufGroup;
+        }
+
+        /**
+         * @return Provided buffer selected by a completion
+         */
+        std::uint8_t const* buffer(unsigned id) const {
+            return m_buffers.data() + static_cast<std::size_t>(id) * m_bufSize;
+        }
+
+        /**
+         * Return a provided buffer to the kernel once its data is consumed
+         */
+        void recycle(unsigned id);
+
+    private:
+        void add_buffer(unsigned id);
+        void unmap();
+    };
+
+}
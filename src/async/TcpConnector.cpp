@@ -0,0 +1,301 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TcpConnector.h"
+
+#include <logging/logging.h>
+
+#include <unistd.h>
+
+namespace ceema {
+
+    TcpConnector::TcpConnector(EventLoop& loop) : TcpConnector(loop, Options()) {
+    }
+
+    TcpConnector::TcpConnector(EventLoop& loop, Options options) :
+            m_loop(loop), m_options(options), m_token(std::make_shared<Token>()), m_nextAttempt(0),
+            m_lookups(0), m_lastFamily(AF_UNSPEC), m_ready(false) {
+        m_token->self = this;
+    }
+
+    TcpConnector::~TcpConnector() {
+        cancel();
+        std::lock_guard<std::mutex> lock(m_token->mutex);
+        m_token->self = nullptr;
+    }
+
+    void TcpConnector::connect(std::vector<std::string> const& hosts, std::uint16_t port, Callback callback,
+                               byte_vector initial) {
+        cancel();
+        if (hosts.empty()) {
+            throw std::invalid_argument("No hosts to connect to");
+        }
+        m_callback = std::move(callback);
+        m_initial = std::move(initial);
+        m_lookups = hosts.size();
+
+        std::weak_ptr<Token> weak = m_token;
+        for (auto const& host: hosts) {
+            Resolver::shared().resolve(host, port, [weak](std::vector<SocketAddress> addresses, std::exception_ptr error) {
+                // On a resolver thread, hand the result to the loop unless cancelled meanwhile
+                auto token = weak.lock();
+                if (!token) {
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(token->mutex);
+                if (!token->self) {
+                    return;
+                }
+                token->self->m_loop.post([weak, addresses, error]() {
+                    auto token = weak.lock();
+                    if (token && token->self) {
+                        token->self->on_resolved(addresses, error);
+                    }
+                });
+            });
+        }
+    }
+
+    void TcpConnector::connect(std::vector<SocketAddress> const& addresses, Callback callback,
+                               byte_vector initial) {
+        cancel();
+        m_callback = std::move(callback);
+        m_initial = std::move(initial);
+        m_addresses.assign(addresses.begin(), addresses.end());
+        start_next();
+    }
+
+    void TcpConnector::cancel() {
+        for (auto& entry: m_attempts) {
+            m_loop.unwatch(entry.second.fd);
+            ::close(entry.second.fd);
+        }
+        m_attempts.clear();
+        m_addresses.clear();
+        m_callback = nullptr;
+        m_initial.clear();
+        m_lookups = 0;
+        m_lastFamily = AF_UNSPEC;
+        m_ready = false;
+        m_error = nullptr;
+
+        // Detach lookups and timers of the abandoned connect
+        {
+            std::lock_guard<std::mutex> lock(m_token->mutex);
+            m_token->self = nullptr;
+        }
+        m_token = std::make_shared<Token>();
+        m_token->self = this;
+    }
+
+    void TcpConnector::on_resolved(std::vector<SocketAddress> const& addresses, std::exception_ptr error) {
+        m_lookups--;
+        if (error) {
+            if (!m_error) {
+                m_error = error;
+            }
+        } else {
+            m_addresses.insert(m_addresses.end(), addresses.begin(), addresses.end());
+            if (m_attempts.empty() || m_ready) {
+                start_next();
+                return;
+            }
+        }
+        check_failed();
+    }
+
+    void TcpConnector::start_next() {
+        while (!m_addresses.empty()) {
+            // Alternate between families, so a broken IPv6 (or IPv4) route costs one attempt
+            auto next = m_addresses.begin();
+            for (auto iter = m_addresses.begin(); iter != m_addresses.end(); ++iter) {
+                if (iter->family() != m_lastFamily) {
+                    next = iter;
+                    break;
+                }
+            }
+            SocketAddress address = *next;
+            m_addresses.erase(next);
+            m_lastFamily = address.family();
+
+            int fd = ::socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                m_error = std::make_exception_ptr(socket_exception());
+                continue;
+            }
+            TcpClient(fd).apply(m_options.socket);
+            std::size_t sent = 0;
+            int err = start_attempt(fd, address, sent);
+            if (!err) {
+                LOG_DEBUG(logging::loggerNetwork, "Connected to " << address.toString());
+                Attempt attempt{fd, address, sent};
+                if (send_initial(attempt)) {
+                    complete(TcpClient(fd), nullptr);
+                    return;
+                }
+                err = last_error();
+            }
+            if (err != EINPROGRESS) {
+                LOG_DEBUG(logging::loggerNetwork, "Unable to connect to " << address.toString() << ": "
+                        << format_error(err));
+                ::close(fd);
+                m_error = std::make_exception_ptr(socket_exception(err));
+                continue;
+            }
+
+            std::uint64_t id = m_nextAttempt++;
+            LOG_TRACE(logging::loggerNetwork, "Connecting to " << address.toString());
+            m_attempts.emplace(id, Attempt{fd, address, sent});
+            m_ready = false;
+            m_loop.watch(fd, EventLoop::WRITABLE, false, [this, id](std::uint32_t) {
+                on_writable(id);
+            });
+
+            schedule(m_options.attemptDelay, [id](TcpConnector& self) {
+                if (self.m_nextAttempt != id + 1) {
+                    // A later attempt started already
+                    return;
+                }
+                if (self.m_addresses.empty()) {
+                    self.m_ready = true;
+                } else {
+                    self.start_next();
+                }
+            });
+            schedule(m_options.attemptTimeout, [id](TcpConnector& self) {
+                if (self.m_attempts.find(id) != self.m_attempts.end()) {
+                    self.fail_attempt(id, std::make_exception_ptr(socket_exception(ETIMEDOUT)));
+                }
+            });
+            return;
+        }
+        check_failed();
+    }
+
+    void TcpConnector::on_writable(std::uint64_t id) {
+        auto iter = m_attempts.find(id);
+        if (iter == m_attempts.end()) {
+            return;
+        }
+        int fd = iter->second.fd;
+        m_loop.unwatch(fd);
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+            err = last_error();
+        }
+        if (err) {
+            fail_attempt(id, std::make_exception_ptr(socket_exception(err)));
+            return;
+        }
+
+        LOG_DEBUG(logging::loggerNetwork, "Connected to " << iter->second.address.toString());
+        if (!send_initial(iter->second)) {
+            fail_attempt(id, std::make_exception_ptr(socket_exception()));
+            return;
+        }
+        m_attempts.erase(iter);
+        complete(TcpClient(fd), nullptr);
+    }
+
+    int TcpConnector::start_attempt(int fd, SocketAddress const& address, std::size_t& sent) {
+#ifdef MSG_FASTOPEN
+        if (m_options.fastOpen && !m_initial.empty()) {
+            // Connects and queues the data, which is carried by the SYN if a cookie is known
+            ssize_t res = ::sendto(fd, m_initial.data(), m_initial.size(), MSG_FASTOPEN | MSG_NOSIGNAL,
+                                   address.get(), address.len);
+            if (res >= 0) {
+                sent = static_cast<std::size_t>(res);
+                LOG_TRACE(logging::loggerNetwork, "Sent " << sent << " bytes with SYN to " << address.toString());
+                return EINPROGRESS;
+            }
+            int err = last_error();
+            if (err != EOPNOTSUPP) {
+                return err;
+            }
+            // Fast Open disabled for clients, connect normally
+        }
+#endif
+        if (::connect(fd, address.get(), address.len) == 0) {
+            return 0;
+        }
+        return last_error();
+    }
+
+    bool TcpConnector::send_initial(Attempt& attempt) {
+        while (attempt.sent < m_initial.size()) {
+            ssize_t res = ::send(attempt.fd, m_initial.data() + attempt.sent, m_initial.size() - attempt.sent,
+                                 MSG_NOSIGNAL);
+            if (res < 0) {
+                // A fresh socket takes far more than the initial data, so this is an error too
+                return false;
+            }
+            attempt.sent += static_cast<std::size_t>(res);
+        }
+        return true;
+    }
+
+    void TcpConnector::fail_attempt(std::uint64_t id, std::exception_ptr error) {
+        auto iter = m_attempts.find(id);
+        if (iter == m_attempts.end()) {
+            return;
+        }
+        try {
+            std::rethrow_exception(error);
+        } catch (std::exception& e) {
+            LOG_DEBUG(logging::loggerNetwork, "Unable to connect to " << iter->second.address.toString() << ": "
+                    << e.what());
+        }
+        m_loop.unwatch(iter->second.fd);
+        ::close(iter->second.fd);
+        m_attempts.erase(iter);
+        m_error = error;
+
+        // Do not wait for the delay after a failure
+        start_next();
+    }
+
+    void TcpConnector::check_failed() {
+        if (!active() || !m_attempts.empty() || !m_addresses.empty() || m_lookups) {
+            return;
+        }
+        std::exception_ptr error = m_error;
+        if (!error) {
+            error = std::make_exception_ptr(std::runtime_error("No addresses to connect to"));
+        }
+        complete(TcpClient(INVALID_SOCKET), error);
+    }
+
+    void TcpConnector::complete(TcpClient socket, std::exception_ptr error) {
+        Callback callback = std::move(m_callback);
+        // Closes the remaining attempts
+        cancel();
+        callback(std::move(socket), error);
+    }
+
+    void TcpConnector::schedule(std::chrono::milliseconds delay, std::function<void(TcpConnector&)> fn) {
+        std::weak_ptr<Token> weak = m_token;
+        m_loop.scheduleTimer(delay.count(), [weak, fn]() {
+            auto token = weak.lock();
+            if (token && token->self) {
+                fn(*token->self);
+            }
+        });
+    }
+
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "EventLoop.h"
+
+#include <socket/Resolver.h>
+#include <socket/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Nonblocking connect, racing the addresses of one or more hosts
+     * (Happy Eyeballs, RFC 8305).
+     *
+     * Hosts are resolved in the background by the shared Resolver. Attempts
+     * start as soon as the first addresses are known, alternating between
+     * address families. A new attempt starts whenever the previous one
+     * failed, or has not completed within attemptDelay; each attempt is
+     * abandoned after attemptTimeout. The first connection to succeed is
+     * handed to the callback, all other attempts are cancelled.
+     *
+     * Data to send first (e.g. a protocol HELLO) may be given with the
+     * connect. With fastOpen it goes out in the SYN where the kernel holds
+     * a TCP Fast Open cookie for the server, saving a round trip; otherwise
+     * it is written once connected. Either way, the callback receives the
+     * socket with all of it written.
+     *
+     * Must be used on the thread running the loop, and the loop must
+     * outlive the connector.
+     */
+    class TcpConnector {
+    public:
+        struct Options {
+            // Time before the next address is tried while earlier attempts are pending
+            std::chrono::milliseconds attemptDelay{250};
+            // Time after which a single attempt is given up
+            std::chrono::milliseconds attemptTimeout{10000};
+            // Send initial data with TCP Fast Open, where supported
+            bool fastOpen = false;
+            // Tuning applied to each attempt
+            SocketOptions socket;
+        };
+
+        /**
+         * Called with the connected (nonblocking) socket, or with the error of
+         * the last failed attempt. The connector may be destroyed from within
+         * the callback.
+         */
+        using Callback = std::function<void(TcpClient socket, std::exception_ptr error)>;
+
+    private:
+        /**
+         * Shared with resolver threads and timers, which outlive a cancelled connect
+         */
+        struct Token {
+            std::mutex mutex;
+            TcpConnector* self;
+        };
+
+        struct Attempt {
+            int fd;
+            SocketAddress address;
+            // Initial data already sent
+            std::size_t sent;
+        };
+
+        EventLoop& m_loop;
+        Options m_options;
+        Callback m_callback;
+        byte_vector m_initial;
+        std::shared_ptr<Token> m_token;
+
+        // Addresses not tried yet
+        std::deque<SocketAddress> m_addresses;
+        std::unordered_map<std::uint64_t, Attempt> m_attempts;
+        std::uint64_t m_nextAttempt;
+        // Hosts still being resolved
+        std::size_t m_lookups;
+        // Family of the last attempt, the next one prefers the other family
+        int m_lastFamily;
+        // The delay after the last attempt passed, the next may start right away
+        bool m_ready;
+        std::exception_ptr m_error;
+
+    public:
+        explicit TcpConnector(EventLoop& loop);
+        TcpConnector(EventLoop& loop, Options options);
+        ~TcpConnector();
+
+        TcpConnector(TcpConnector const&) = delete;
+        TcpConnector& operator=(TcpConnector const&) = delete;
+
+        /**
+         * Resolve the hosts and connect to any of their addresses. Cancels
+         * any connect in progress.
+         * @param hosts Host names or numeric addresses
+         * @param port Port to connect to
+         * @param callback Function to call with the result
+         * @param initial Data to send before the socket is handed over
+         */
+        void connect(std::vector<std::string> const& hosts, std::uint16_t port, Callback callback,
+                     byte_vector initial = byte_vector());
+
+        /**
+         * Connect to any of the given addresses. Cancels any connect in progress.
+         */
+        void connect(std::vector<SocketAddress> const& addresses, Callback callback,
+                     byte_vector initial = byte_vector());
+
+        /**
+         * Abandon the connect in progress, without calling the callback
+         */
+        void cancel();
+
+        /**
+         * @return True while a connect is in progress
+         */
+        bool active() const {
+            return static_cast<bool>(m_callback);
+        }
+
+    private:
+        void on_resolved(std::vector<SocketAddress> const& addresses, std::exception_ptr error);
+        void start_next();
+        int start_attempt(int fd, SocketAddress const& address, std::size_t& sent);
+        bool send_initial(Attempt& attempt);
+        void on_writable(std::uint64_t id);
+        void fail_attempt(std::uint64_t id, std::exception_ptr error);
+        void check_failed();
+        void complete(TcpClient socket, std::exception_ptr error);
+        void schedule(std::chrono::milliseconds delay, std::function<void(TcpConnector&)> fn);
+    };
+
+}
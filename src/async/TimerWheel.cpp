@@ -0,0 +1,238 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TimerWheel.h"
+
+#include <logging/logging.h>
+
+#include <algorithm>
+
+namespace ceema {
+
+    const std::uint32_t TimerWheel::NIL;
+
+    TimerWheel::TimerWheel(clock::time_point now) : m_origin(now), m_current(0), m_next(UINT64_MAX), m_horizon(0),
+                                                    m_slots(SLOTS + 1, NIL), m_count(0) {}
+
+    TimerWheel::TimerId TimerWheel::schedule(clock::time_point deadline, Callback callback) {
+        std::uint32_t index;
+        if (m_free.empty()) {
+            index = static_cast<std::uint32_t>(m_nodes.size());
+            m_nodes.push_back(Node{0, NIL, NIL, NIL, 0, false, Callback()});
+        } else {
+            index = m_free.back();
+            m_free.pop_back();
+        }
+
+        Node& node = m_nodes[index];
+        node.expires = std::max({to_tick(deadline), m_current, m_horizon});
+        node.active = true;
+        node.callback = std::move(callback);
+        place(index);
+
+        if (!m_count || node.expires < m_next) {
+            m_next = node.expires;
+        }
+        m_count++;
+        return (static_cast<TimerId>(node.generation) << 32) | (index + 1);
+    }
+
+    bool TimerWheel::cancel(TimerId id) {
+        std::uint32_t index = static_cast<std::uint32_t>(id) - 1;
+        if (!id || index >= m_nodes.size()) {
+            return false;
+        }
+        Node& node = m_nodes[index];
+        if (!node.active || node.generation != static_cast<std::uint32_t>(id >> 32)) {
+            return false;
+        }
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    std::size_t TimerWheel::advance(clock::time_point now) {
+        if (now < m_origin) {
+            return 0;
+        }
+        std::uint64_t target = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(now - m_origin).count());
+
+        // Timers scheduled from the callbacks are not run by this call
+        m_horizon = target + 1;
+        std::size_t ran = 0;
+        while (m_current <= target && m_count) {
+            std::uint64_t next = find_next();
+            if (next > target) {
+                break;
+            }
+            m_current = next;
+            ran += run_tick();
+        }
+        m_current = std::max(m_current, target + 1);
+        m_horizon = 0;
+
+        m_next = find_next();
+        return ran;
+    }
+
+    TimerWheel::clock::time_point TimerWheel::next_deadline() const {
+        if (!m_count) {
+            return clock::time_point::max();
+        }
+        return m_origin + std::chrono::milliseconds(m_next);
+    }
+
+    std::uint64_t TimerWheel::to_tick(clock::time_point time) const {
+        if (time <= m_origin) {
+            return 0;
+        }
+        // Round up, timers never fire early
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time - m_origin).count();
+        return static_cast<std::uint64_t>((ns + 999999) / 1000000);
+    }
+
+    void TimerWheel::place(std::uint32_t index) {
+        std::uint64_t expires = std::max(m_nodes[index].expires, m_current);
+        std::uint64_t delta = expires - m_current;
+        if (delta >= MAX_DELTA) {
+            // Parked in the last slot in reach, placed again once that is cascaded
+            delta = MAX_DELTA - 1;
+            expires = m_current + delta;
+        }
+
+        if (delta < ROOT_SIZE) {
+            link(index, static_cast<std::uint32_t>(expires & (ROOT_SIZE - 1)));
+            return;
+        }
+        for (unsigned level = 1; level < LEVELS; level++) {
+            if (delta < (std::uint64_t(1) << level_shift(level + 1))) {
+                std::uint32_t slot = static_cast<std::uint32_t>((expires >> level_shift(level)) & (LEVEL_SIZE - 1));
+                link(index, ROOT_SIZE + (level - 1) * LEVEL_SIZE + slot);
+                return;
+            }
+        }
+    }
+
+    void TimerWheel::link(std::uint32_t index, std::uint32_t slot) {
+        Node& node = m_nodes[index];
+        node.slot = slot;
+        node.prev = NIL;
+        node.next = m_slots[slot];
+        if (node.next != NIL) {
+            m_nodes[node.next].prev = index;
+        }
+        m_slots[slot] = index;
+    }
+
+    void TimerWheel::unlink(std::uint32_t index) {
+        Node& node = m_nodes[index];
+        if (node.prev != NIL) {
+            m_nodes[node.prev].next = node.next;
+        } else {
+            m_slots[node.slot] = node.next;
+        }
+        if (node.next != NIL) {
+            m_nodes[node.next].prev = node.prev;
+        }
+        node.prev = node.next = node.slot = NIL;
+    }
+
+    void TimerWheel::release(std::uint32_t index) {
+        Node& node = m_nodes[index];
+        node.active = false;
+        node.generation++;
+        node.callback = Callback();
+        m_free.push_back(index);
+        m_count--;
+    }
+
+    void TimerWheel::cascade(unsigned level) {
+        std::uint32_t slot = ROOT_SIZE + (level - 1) * LEVEL_SIZE
+                             + static_cast<std::uint32_t>((m_current >> level_shift(level)) & (LEVEL_SIZE - 1));
+        std::uint32_t index = m_slots[slot];
+        m_slots[slot] = NIL;
+        while (index != NIL) {
+            std::uint32_t next = m_nodes[index].next;
+            place(index);
+            index = next;
+        }
+    }
+
+    std::size_t TimerWheel::run_tick() {
+        if (!(m_current & (ROOT_SIZE - 1))) {
+            for (unsigned level = 1; level < LEVELS; level++) {
+                cascade(level);
+                if ((m_current >> level_shift(level)) & (LEVEL_SIZE - 1)) {
+                    break;
+                }
+            }
+        }
+
+        // Move the due timers aside, so callbacks can cancel them or schedule new ones
+        std::uint32_t slot = static_cast<std::uint32_t>(m_current & (ROOT_SIZE - 1));
+        m_slots[EXPIRING] = m_slots[slot];
+        m_slots[slot] = NIL;
+        for (std::uint32_t index = m_slots[EXPIRING]; index != NIL; index = m_nodes[index].next) {
+            m_nodes[index].slot = EXPIRING;
+        }
+        m_current++;
+
+        std::size_t ran = 0;
+        while (m_slots[EXPIRING] != NIL) {
+            std::uint32_t index = m_slots[EXPIRING];
+            unlink(index);
+            Callback callback = std::move(m_nodes[index].callback);
+            release(index);
+            try {
+                callback();
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Timer callback failed: " << e.what());
+            }
+            ran++;
+        }
+        return ran;
+    }
+
+    std::uint64_t TimerWheel::find_next() const {
+        if (!m_count) {
+            return UINT64_MAX;
+        }
+        std::uint64_t next = UINT64_MAX;
+        for (std::uint64_t tick = m_current; tick < m_current + ROOT_SIZE; tick++) {
+            if (m_slots[tick & (ROOT_SIZE - 1)] != NIL) {
+                next = tick;
+                break;
+            }
+        }
+        // Cascades of the coarser wheels, the first one for a non-empty slot
+        for (unsigned level = 1; level < LEVELS; level++) {
+            unsigned shift = level_shift(level);
+            std::uint64_t first = (m_current + (std::uint64_t(1) << shift) - 1) >> shift;
+            for (std::uint64_t step = first; step < first + LEVEL_SIZE; step++) {
+                if ((step << shift) >= next) {
+                    break;
+                }
+                if (m_slots[ROOT_SIZE + (level - 1) * LEVEL_SIZE + (step & (LEVEL_SIZE - 1))] != NIL) {
+                    next = step << shift;
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+
+}
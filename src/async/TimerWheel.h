@@ -0,0 +1,156 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Hierarchical timing wheel with a resolution of 1 ms, for large numbers
+     * of timers that are mostly cancelled before they expire (timeouts,
+     * keep-alives, retries).
+     *
+     * Scheduling and cancelling take constant time. Timers expiring within
+     * 256 ms are kept in the first wheel; later ones sit in coarser wheels and
+     * are moved down as their time comes closer. The owner calls advance()
+     * to run the expired timers, and uses next_deadline() to arm a single
+     * timer (timerfd, event loop timeout) for the whole wheel.
+     *
+     * Not thread safe.
+     */
+    class TimerWheel {
+    public:
+        using clock = std::chrono::steady_clock;
+        using Callback = std::function<void()>;
+
+        /**
+         * Identifies a scheduled timer. 0 never identifies a timer, so it can
+         * be used for "no timer".
+         */
+        using TimerId = std::uint64_t;
+
+    private:
+        static const unsigned ROOT_BITS = 8;
+        static const unsigned LEVEL_BITS = 6;
+        static const unsigned LEVELS = 4;
+        static const std::uint32_t ROOT_SIZE = 1u << ROOT_BITS;
+        static const std::uint32_t LEVEL_SIZE = 1u << LEVEL_BITS;
+        // Slots of all wheels, plus one for the timers being run
+        static const std::uint32_t SLOTS = ROOT_SIZE + (LEVELS - 1) * LEVEL_SIZE;
+        static const std::uint32_t EXPIRING = SLOTS;
+        // Ticks covered by the wheels, later timers are moved down in steps
+        static const std::uint64_t MAX_DELTA = std::uint64_t(1) << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS);
+        static const std::uint32_t NIL = UINT32_MAX;
+
+        struct Node {
+            std::uint64_t expires;
+            std::uint32_t prev;
+            std::uint32_t next;
+            std::uint32_t slot;
+            // Incremented when the node is freed, invalidating its TimerId
+            std::uint32_t generation;
+            bool active;
+            Callback callback;
+        };
+
+        clock::time_point m_origin;
+        // Next tick to process
+        std::uint64_t m_current;
+        // No timer expires before this tick, may be earlier than the actual first timer
+        std::uint64_t m_next;
+        // Timers expire no earlier than this tick, while advance() runs callbacks
+        std::uint64_t m_horizon;
+
+        std::vector<Node> m_nodes;
+        std::vector<std::uint32_t> m_free;
+        std::vector<std::uint32_t> m_slots;
+        std::size_t m_count;
+
+    public:
+        explicit TimerWheel(clock::time_point now = clock::now());
+
+        TimerWheel(TimerWheel const&) = delete;
+        TimerWheel& operator=(TimerWheel const&) = delete;
+
+        /**
+         * Schedule a callback
+         * @param deadline Time to run the callback at (rounded up to the next ms)
+         * @param callback Function to call from advance()
+         * @return ID of the timer, for cancel()
+         */
+        TimerId schedule(clock::time_point deadline, Callback callback);
+
+        /**
+         * Schedule a callback after a delay from now
+         */
+        TimerId schedule(std::chrono::milliseconds delay, Callback callback) {
+            return schedule(clock::now() + delay, std::move(callback));
+        }
+
+        /**
+         * Cancel a timer
+         * @param id ID of the timer
+         * @return True if the timer was still scheduled
+         */
+        bool cancel(TimerId id);
+
+        /**
+         * Run the callbacks of all timers expired at the given time. Timers
+         * scheduled by the callbacks run on a later call at the earliest.
+         * @param now Current time
+         * @return Number of callbacks run
+         */
+        std::size_t advance(clock::time_point now = clock::now());
+
+        /**
+         * @return Time at which advance() should be called next, or
+         * clock::time_point::max() without timers. May be earlier than the
+         * first deadline, if timers have to be moved to a finer wheel first.
+         */
+        clock::time_point next_deadline() const;
+
+        std::size_t size() const {
+            return m_count;
+        }
+
+        bool empty() const {
+            return m_count == 0;
+        }
+
+    private:
+        /**
+         * @return Lowest bit of the tick selecting the slot in the given wheel
+         */
+        static unsigned level_shift(unsigned level) {
+            return level ? ROOT_BITS + (level - 1) * LEVEL_BITS : 0;
+        }
+
+        std::uint64_t to_tick(clock::time_point time) const;
+        void place(std::uint32_t index);
+        void link(std::uint32_t index, std::uint32_t slot);
+        void unlink(std::uint32_t index);
+        void release(std::uint32_t index);
+        void cascade(unsigned level);
+        std::size_t run_tick();
+        std::uint64_t find_next() const;
+    };
+
+}
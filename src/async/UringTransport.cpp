@@ -0,0 +1,311 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UringTransport.h"
+#include "EventLoop.h"
+
+#include <logging/logging.h>
+#include <socket/socket.h>
+
+#include <algorithm>
+
+#include <unistd.h>
+
+namespace ceema {
+
+    namespace {
+        // Size of each provided receive buffer, Session reads in chunks of this size as well
+        const unsigned BUFFER_SIZE = 4096;
+
+        const unsigned OP_BITS = 2;
+
+        std::uint64_t user_data(std::uint64_t id, std::uint64_t op) {
+            return (id << OP_BITS) | op;
+        }
+    }
+
+    UringTransport::UringTransport(EventLoop& loop, unsigned entries, unsigned buffers) :
+            m_loop(loop), m_ring(entries), m_nextId(0), m_multishot(true) {
+        m_ring.provide_buffers(0, buffers, BUFFER_SIZE);
+        m_loop.watch(m_ring.eventfd(), EventLoop::READABLE, false, [this](std::uint32_t) {
+            on_completions();
+        });
+    }
+
+    UringTransport::~UringTransport() {
+        // Closing the ring cancels whatever is left
+        m_loop.unwatch(m_ring.eventfd());
+    }
+
+    void UringTransport::attach(Session& session, int fd, SessionHandler handler) {
+        std::uint64_t id = m_nextId++;
+        std::unique_ptr<Channel> channel(new Channel{&session, fd, std::move(handler), byte_vector(), 0,
+                                                     byte_vector(), false, 0, false});
+        Channel& c = *channel;
+        m_channels.emplace(id, std::move(channel));
+        m_sessions[&session] = id;
+
+        session.set_output([this, id](byte_vector data) {
+            auto iter = m_channels.find(id);
+            if (iter == m_channels.end() || iter->second->closed) {
+                return;
+            }
+            Channel& c = *iter->second;
+            if (c.queued.empty()) {
+                c.queued = std::move(data);
+            } else {
+                c.queued.insert(c.queued.end(), data.begin(), data.end());
+            }
+            if (!c.dirty) {
+                c.dirty = true;
+                m_dirty.push_back(id);
+            }
+        });
+        // Hand over whatever the session could not write to the socket itself
+        session.onReadyWrite();
+        arm_receive(id, c);
+    }
+
+    bool UringTransport::detach(Session& session) {
+        auto iter = m_sessions.find(&session);
+        if (iter == m_sessions.end()) {
+            return false;
+        }
+        std::uint64_t id = iter->second;
+        m_sessions.erase(iter);
+        session.set_output(nullptr);
+
+        Channel& c = *m_channels.at(id);
+        c.closed = true;
+        c.queued.clear();
+        m_closed.push_back(id);
+        if (c.inflight) {
+            // Must reach the kernel while the fd is still open, the caller closes it
+            io_uring_sqe* sqe = m_ring.sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = c.fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = user_data(id, OP_CANCEL);
+            m_ring.submit();
+        }
+        return true;
+    }
+
+    void UringTransport::write(int fd, byte_vector data, std::uint64_t offset, WriteHandler handler) {
+        std::uint64_t id = m_nextId++;
+        std::unique_ptr<FileWrite> write(new FileWrite{fd, std::move(data), offset, 0, std::move(handler)});
+        start_write(id, *write);
+        m_writes.emplace(id, std::move(write));
+    }
+
+    void UringTransport::submit() {
+        for (std::uint64_t id: m_dirty) {
+            auto iter = m_channels.find(id);
+            if (iter == m_channels.end()) {
+                continue;
+            }
+            Channel& c = *iter->second;
+            c.dirty = false;
+            if (!c.closed && c.sending.empty() && !c.queued.empty()) {
+                start_send(id, c);
+            }
+        }
+        m_dirty.clear();
+        collect();
+
+        if (m_ring.pending()) {
+            m_ring.submit();
+        }
+    }
+
+    void UringTransport::arm_receive(std::uint64_t id, Channel& channel) {
+        io_uring_sqe* sqe = m_ring.sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = channel.fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = m_ring.buffer_group();
+        sqe->ioprio = m_multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = user_data(id, OP_RECV);
+        channel.inflight++;
+    }
+
+    void UringTransport::start_send(std::uint64_t id, Channel& channel) {
+        if (channel.sending.empty()) {
+            channel.sending.swap(channel.queued);
+            channel.sent = 0;
+        }
+        io_uring_sqe* sqe = m_ring.sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = channel.fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(channel.sending.data() + channel.sent);
+        sqe->len = static_cast<std::uint32_t>(channel.sending.size() - channel.sent);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(id, OP_SEND);
+        channel.inflight++;
+    }
+
+    void UringTransport::start_write(std::uint64_t id, FileWrite& write) {
+        io_uring_sqe* sqe = m_ring.sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = write.fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(write.data.data() + write.written);
+        sqe->len = static_cast<std::uint32_t>(write.data.size() - write.written);
+        sqe->off = write.offset + write.written;
+        sqe->user_data = user_data(id, OP_WRITE);
+    }
+
+    void UringTransport::on_completions() {
+        m_ring.reap(m_completions);
+        for (auto const& cqe: m_completions) {
+            std::uint64_t id = cqe.data >> OP_BITS;
+            std::uint64_t op = cqe.data & ((1u << OP_BITS) - 1);
+            try {
+                if (op == OP_WRITE) {
+                    on_write(id, cqe);
+                    continue;
+                }
+                auto iter = m_channels.find(id);
+                if (iter == m_channels.end()) {
+                    if (cqe.flags & IORING_CQE_F_BUFFER) {
+                        m_ring.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    }
+                    continue;
+                }
+                if (op == OP_RECV) {
+                    on_receive(id, *iter->second, cqe);
+                } else if (op == OP_SEND) {
+                    on_send(id, *iter->second, cqe);
+                }
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Completion handler failed: " << e.what());
+            }
+        }
+        collect();
+    }
+
+    void UringTransport::on_receive(std::uint64_t id, Channel& channel, IoUring::Completion const& cqe) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            channel.inflight--;
+        }
+
+        std::exception_ptr error;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            unsigned buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (!channel.closed && cqe.res > 0) {
+                try {
+                    channel.session->onData(m_ring.buffer(buffer), static_cast<std::size_t>(cqe.res));
+                } catch (std::exception&) {
+                    error = std::current_exception();
+                }
+            }
+            m_ring.recycle(buffer);
+        }
+        if (channel.closed) {
+            return;
+        }
+
+        if (cqe.res == 0) {
+            error = std::make_exception_ptr(std::runtime_error("Connection closed by server"));
+        } else if (cqe.res == -EINVAL && m_multishot) {
+            LOG_INFO(logging::loggerNetwork, "Multishot receive not supported, falling back to single receives");
+            m_multishot = false;
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+            // Out of buffers only means the receive must be armed again
+            error = std::make_exception_ptr(socket_exception(-cqe.res));
+        }
+
+        if (cqe.res > 0) {
+            // Packets read before an error are still delivered
+            channel.handler(*channel.session, nullptr);
+        }
+        if (channel.closed) {
+            return;
+        }
+        if (error) {
+            fail(channel, error);
+        } else if (!more) {
+            arm_receive(id, channel);
+        }
+    }
+
+    void UringTransport::on_send(std::uint64_t id, Channel& channel, IoUring::Completion const& cqe) {
+        channel.inflight--;
+        if (channel.closed) {
+            return;
+        }
+        if (cqe.res < 0) {
+            fail(channel, std::make_exception_ptr(socket_exception(-cqe.res)));
+            return;
+        }
+        channel.sent += static_cast<std::size_t>(cqe.res);
+        if (channel.sent < channel.sending.size()) {
+            start_send(id, channel);
+            return;
+        }
+        channel.sending.clear();
+        if (!channel.queued.empty()) {
+            start_send(id, channel);
+        }
+    }
+
+    void UringTransport::on_write(std::uint64_t id, IoUring::Completion const& cqe) {
+        auto iter = m_writes.find(id);
+        if (iter == m_writes.end()) {
+            return;
+        }
+        FileWrite& write = *iter->second;
+        std::exception_ptr error;
+        if (cqe.res < 0) {
+            error = std::make_exception_ptr(socket_exception(-cqe.res));
+        } else if (cqe.res == 0) {
+            error = std::make_exception_ptr(socket_exception(EIO));
+        } else {
+            write.written += static_cast<std::size_t>(cqe.res);
+            if (write.written < write.data.size()) {
+                start_write(id, write);
+                return;
+            }
+        }
+
+        std::unique_ptr<FileWrite> done = std::move(iter->second);
+        m_writes.erase(iter);
+        done->handler(error);
+    }
+
+    void UringTransport::fail(Channel& channel, std::exception_ptr error) {
+        // Detaching closes the channel, which stays alive until collected
+        Session& session = *channel.session;
+        m_loop.detach(session);
+        channel.handler(session, error);
+    }
+
+    void UringTransport::collect() {
+        auto done = std::remove_if(m_closed.begin(), m_closed.end(), [this](std::uint64_t id) {
+            auto iter = m_channels.find(id);
+            if (iter == m_channels.end()) {
+                return true;
+            }
+            if (iter->second->inflight) {
+                return false;
+            }
+            m_channels.erase(iter);
+            return true;
+        });
+        m_closed.erase(done, m_closed.end());
+    }
+
+}
@@ -0,0 +1,141 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "IoUring.h"
+
+#include <protocol/session.h>
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace ceema {
+
+    class EventLoop;
+
+    /**
+     * Session and file I/O of an EventLoop through io_uring.
+     *
+     * Each attached session has a multishot receive armed, which receives
+     * into a ring of provided buffers, so an idle session holds no buffer
+     * and a busy one needs no system call per read. Data queued by sessions
+     * and file writes are collected and submitted together once per loop
+     * iteration. Completions are reaped through the eventfd of the ring,
+     * which the loop watches.
+     *
+     * Construction throws if the kernel lacks io_uring or buffer rings;
+     * the loop then keeps using readiness based I/O.
+     */
+    class UringTransport {
+    public:
+        using SessionHandler = std::function<void(Session& session, std::exception_ptr error)>;
+        using WriteHandler = std::function<void(std::exception_ptr error)>;
+
+    private:
+        enum Op : std::uint64_t {
+            OP_RECV,
+            OP_SEND,
+            OP_WRITE,
+            OP_CANCEL,
+        };
+
+        struct Channel {
+            Session* session;
+            int fd;
+            SessionHandler handler;
+            // Data being sent, and data queued behind it
+            byte_vector sending;
+            std::size_t sent;
+            byte_vector queued;
+            bool dirty;
+            // Operations the kernel still holds, the channel lives until these completed
+            unsigned inflight;
+            bool closed;
+        };
+
+        struct FileWrite {
+            int fd;
+            byte_vector data;
+            std::uint64_t offset;
+            std::size_t written;
+            WriteHandler handler;
+        };
+
+        EventLoop& m_loop;
+        IoUring m_ring;
+        std::uint64_t m_nextId;
+        std::unordered_map<std::uint64_t, std::unique_ptr<Channel>> m_channels;
+        std::unordered_map<Session*, std::uint64_t> m_sessions;
+        std::unordered_map<std::uint64_t, std::unique_ptr<FileWrite>> m_writes;
+        // Channels with data queued since the last submit
+        std::vector<std::uint64_t> m_dirty;
+        // Closed channels waiting for their operations to complete
+        std::vector<std::uint64_t> m_closed;
+        std::vector<IoUring::Completion> m_completions;
+        // Multishot receives supported, otherwise receives are re-armed after each completion
+        bool m_multishot;
+
+    public:
+        /**
+         * @param loop Loop to watch the completion eventfd on
+         * @param entries Size of the submission queue
+         * @param buffers Number of receive buffers shared by all sessions
+         */
+        UringTransport(EventLoop& loop, unsigned entries, unsigned buffers);
+        ~UringTransport();
+
+        UringTransport(UringTransport const&) = delete;
+        UringTransport& operator=(UringTransport const&) = delete;
+
+        /**
+         * Drive a connected session, see EventLoop::attach
+         */
+        void attach(Session& session, int fd, SessionHandler handler);
+
+        /**
+         * Stop driving a session. Cancels its operations and closes the socket.
+         * @return false if the session was not attached here
+         */
+        bool detach(Session& session);
+
+        /**
+         * Queue a write of data to a file at the given offset
+         */
+        void write(int fd, byte_vector data, std::uint64_t offset, WriteHandler handler);
+
+        /**
+         * Submit all queued operations in one go
+         */
+        void submit();
+
+    private:
+        void arm_receive(std::uint64_t id, Channel& channel);
+        void start_send(std::uint64_t id, Channel& channel);
+        void start_write(std::uint64_t id, FileWrite& write);
+        void on_completions();
+        void on_receive(std::uint64_t id, Channel& channel, IoUring::Completion const& cqe);
+        void on_send(std::uint64_t id, Channel& channel, IoUring::Completion const& cqe);
+        void on_write(std::uint64_t id, IoUring::Completion const& cqe);
+        void fail(Channel& channel, std::exception_ptr error);
+        void collect();
+    };
+
+}
@@ -0,0 +1,117 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+namespace ceema {
+
+    WorkerPool::WorkerPool(unsigned threads) : m_job(nullptr), m_count(0), m_next(0), m_active(0),
+                                               m_generation(0), m_stop(false) {
+        m_threads.reserve(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            m_threads.emplace_back(&WorkerPool::worker, this);
+        }
+    }
+
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& thread: m_threads) {
+            thread.join();
+        }
+    }
+
+    void WorkerPool::parallel_for(std::size_t count, std::function<void(std::size_t)> const& fn) {
+        if (m_threads.empty() || count <= 1) {
+            for (std::size_t i = 0; i < count; i++) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(m_runMutex);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &fn;
+            m_count = count;
+            m_next = 0;
+            m_active = m_threads.size();
+            m_error = nullptr;
+            m_generation++;
+        }
+        m_wake.notify_all();
+
+        run_job();
+
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this] { return m_active == 0; });
+            m_job = nullptr;
+            error = m_error;
+            m_error = nullptr;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    WorkerPool& WorkerPool::shared() {
+        // The caller of parallel_for is a worker too
+        static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+    void WorkerPool::worker() {
+        std::uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_wake.wait(lock, [this, seen] { return m_stop || m_generation != seen; });
+            if (m_stop) {
+                return;
+            }
+            seen = m_generation;
+
+            lock.unlock();
+            run_job();
+            lock.lock();
+
+            if (--m_active == 0) {
+                m_done.notify_all();
+            }
+        }
+    }
+
+    void WorkerPool::run_job() {
+        std::size_t i;
+        while ((i = m_next.fetch_add(1)) < m_count) {
+            try {
+                (*m_job)(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+        }
+    }
+
+}
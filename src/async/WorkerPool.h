@@ -0,0 +1,87 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Fixed set of threads to spread CPU bound work (e.g. encryption) over.
+     * Work is submitted as a blocking parallel loop; the calling thread takes
+     * part in the loop, so a pool without threads simply runs it inline.
+     */
+    class WorkerPool {
+        std::vector<std::thread> m_threads;
+
+        // Serializes parallel_for callers
+        std::mutex m_runMutex;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        std::function<void(std::size_t)> const* m_job;
+        std::size_t m_count;
+        std::atomic<std::size_t> m_next;
+        std::size_t m_active;
+        std::uint64_t m_generation;
+        std::exception_ptr m_error;
+        bool m_stop;
+
+    public:
+        /**
+         * @param threads Number of threads besides the caller
+         */
+        explicit WorkerPool(unsigned threads);
+        ~WorkerPool();
+
+        WorkerPool(WorkerPool const&) = delete;
+        WorkerPool& operator=(WorkerPool const&) = delete;
+
+        /**
+         * Call fn(i) for every i in [0, count), spread over the pool, and
+         * wait for all calls to finish. If any call throws, the first
+         * exception is rethrown once all calls have finished.
+         * @param count Number of iterations
+         * @param fn Function to call, must be safe to call concurrently
+         */
+        void parallel_for(std::size_t count, std::function<void(std::size_t)> const& fn);
+
+        /**
+         * @return Number of threads that can work on a loop, including the caller
+         */
+        unsigned concurrency() const {
+            return static_cast<unsigned>(m_threads.size()) + 1;
+        }
+
+        /**
+         * @return Pool shared by the library, sized after the number of CPUs
+         */
+        static WorkerPool& shared();
+
+    private:
+        void worker();
+        void run_job();
+    };
+
+}
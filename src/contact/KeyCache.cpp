@@ -0,0 +1,63 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeyCache.h"
+
+namespace ceema {
+
+    KeyCache::KeyCache(std::size_t capacity) : m_owner{}, m_capacity(capacity) {}
+
+    KeyCache::~KeyCache() {
+        clear();
+    }
+
+    precomputed_key const& KeyCache::get(Account const& sender, Contact const& recipient) {
+        if (sender.id() != m_owner) {
+            clear();
+            m_owner = sender.id();
+        }
+
+        auto search = m_keys.find(recipient.id());
+        if (search != m_keys.end()) {
+            if (search->second.pk == recipient.pk()) {
+                return search->second.key;
+            }
+            search->second.pk = recipient.pk();
+            search->second.key = crypto::box::precompute(recipient.pk(), sender.sk());
+            return search->second.key;
+        }
+
+        if (m_keys.size() >= m_capacity) {
+            // No usage order is kept, drop an arbitrary key
+            auto victim = m_keys.begin();
+            sodium_memzero(victim->second.key.data(), victim->second.key.size());
+            m_keys.erase(victim);
+        }
+
+        Entry& entry = m_keys[recipient.id()];
+        entry.pk = recipient.pk();
+        entry.key = crypto::box::precompute(recipient.pk(), sender.sk());
+        return entry.key;
+    }
+
+    void KeyCache::clear() {
+        for (auto& entry: m_keys) {
+            sodium_memzero(entry.second.key.data(), entry.second.key.size());
+        }
+        m_keys.clear();
+    }
+
+}
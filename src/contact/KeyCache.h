@@ -0,0 +1,69 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Account.h"
+
+#include <unordered_map>
+
+namespace ceema {
+
+    /**
+     * Cache of keys precomputed between an account and its contacts. Computing
+     * the shared key is the expensive part of encrypting a message, so messages
+     * to the same contact reuse it.
+     */
+    class KeyCache {
+        struct Entry {
+            public_key pk;
+            precomputed_key key;
+        };
+
+        client_id m_owner;
+        std::unordered_map<client_id, Entry> m_keys;
+        std::size_t m_capacity;
+
+    public:
+        /**
+         * @param capacity Maximum number of keys kept
+         */
+        explicit KeyCache(std::size_t capacity = 1024);
+        ~KeyCache();
+
+        KeyCache(KeyCache const&) = delete;
+        KeyCache& operator=(KeyCache const&) = delete;
+
+        /**
+         * Get the key shared between sender and recipient, computing it if needed.
+         * A changed public key of the recipient replaces the cached key.
+         * @param sender Own account
+         * @param recipient Contact to communicate with
+         * @return Precomputed key, valid until the next call that modifies the cache
+         */
+        precomputed_key const& get(Account const& sender, Contact const& recipient);
+
+        /**
+         * Remove and wipe all keys
+         */
+        void clear();
+
+        std::size_t size() const {
+            return m_keys.size();
+        }
+    };
+
+}
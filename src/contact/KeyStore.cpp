@@ -0,0 +1,287 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeyStore.h"
+
+#include <protocol/protocol.h>
+#include <logging/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace ceema {
+
+    namespace {
+        const std::uint8_t STORE_MAGIC[4] = {'C', 'K', 'S', '1'};
+        // Magic, reserved, number of sorted records
+        const std::size_t HEADER_SIZE = 4 + 4 + 8;
+        // ID, public key, flags, reserved, expiry
+        const std::size_t RECORD_SIZE = CLIENTID_SIZE + public_key::array_size + 4 + 4 + 8;
+
+        // Start compaction once the journal grows beyond this many records
+        const std::size_t MIN_JOURNAL_COMPACT = 1024;
+        // Appended records written to the file at once, unless flushed earlier
+        const std::size_t JOURNAL_FLUSH_BATCH = 16;
+
+        void write_record(KeyStore::Record const& record, std::uint8_t* buffer) {
+            std::memset(buffer, 0, RECORD_SIZE);
+            buffer = std::copy(record.id.begin(), record.id.end(), buffer);
+            buffer = std::copy(record.pk.begin(), record.pk.end(), buffer);
+            htole(record.flags, buffer);
+            htole(record.expires, buffer + 8);
+        }
+
+        KeyStore::Record read_record(std::uint8_t const* buffer) {
+            KeyStore::Record record;
+            std::copy(buffer, buffer + CLIENTID_SIZE, record.id.begin());
+            buffer += CLIENTID_SIZE;
+            std::copy(buffer, buffer + public_key::array_size, record.pk.begin());
+            buffer += public_key::array_size;
+            letoh(record.flags, buffer);
+            letoh(record.expires, buffer + 8);
+            return record;
+        }
+
+        void write_header(std::ostream& os, std::uint64_t count) {
+            std::uint8_t header[HEADER_SIZE] = {};
+            std::copy(std::begin(STORE_MAGIC), std::end(STORE_MAGIC), header);
+            htole(count, header + 8);
+            os.write(reinterpret_cast<const char*>(header), HEADER_SIZE);
+        }
+
+        bool id_less(KeyStore::Record const& a, KeyStore::Record const& b) {
+            return std::memcmp(a.id.data(), b.id.data(), CLIENTID_SIZE) < 0;
+        }
+
+        bool truncate_file(std::string const& path, std::size_t size) {
+#ifndef _WIN32
+            return ::truncate(path.c_str(), static_cast<off_t>(size)) == 0;
+#else
+            return false;
+#endif
+        }
+    }
+
+    KeyStore::KeyStore(std::string path) : m_path(std::move(path)), m_sorted(0), m_unflushed(0) {
+        open();
+    }
+
+    boost::optional<KeyStore::Record> KeyStore::find(client_id const& id) const {
+        auto search = m_journal.find(id);
+        if (search != m_journal.end()) {
+            return search->second;
+        }
+
+        // Binary search the sorted block in place
+        std::uint8_t const* base = sorted_begin();
+        std::size_t low = 0;
+        std::size_t high = m_sorted;
+        while (low < high) {
+            std::size_t mid = low + (high - low) / 2;
+            std::uint8_t const* rec = base + mid * RECORD_SIZE;
+            int cmp = std::memcmp(rec, id.data(), CLIENTID_SIZE);
+            if (cmp == 0) {
+                return read_record(rec);
+            } else if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return boost::none;
+    }
+
+    void KeyStore::put(Record const& record) {
+        append(record);
+        if (m_journal.size() > std::max(MIN_JOURNAL_COMPACT, m_sorted / 4)) {
+            compact();
+        }
+    }
+
+    void KeyStore::put(std::vector<Record> const& records) {
+        for (Record const& record: records) {
+            append(record);
+        }
+        flush();
+        if (m_journal.size() > std::max(MIN_JOURNAL_COMPACT, m_sorted / 4)) {
+            compact();
+        }
+    }
+
+    void KeyStore::append(Record const& record) {
+        std::uint8_t buffer[RECORD_SIZE];
+        write_record(record, buffer);
+        m_journalFile.write(reinterpret_cast<const char*>(buffer), RECORD_SIZE);
+        m_journal[record.id] = record;
+        if (++m_unflushed >= JOURNAL_FLUSH_BATCH) {
+            flush();
+        }
+    }
+
+    void KeyStore::flush() {
+        m_unflushed = 0;
+        if (!m_journalFile.is_open()) {
+            return;
+        }
+        m_journalFile.flush();
+        if (!m_journalFile) {
+            // The in-memory journal still has the records
+            LOG_WARN(logging::loggerRoot, "Unable to write key store " << m_path);
+        }
+    }
+
+    void KeyStore::compact() {
+        flush();
+
+        std::vector<Record> journal;
+        journal.reserve(m_journal.size());
+        for (auto const& entry: m_journal) {
+            journal.push_back(entry.second);
+        }
+        std::sort(journal.begin(), journal.end(), id_less);
+
+        std::string tmpPath = m_path + ".tmp";
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            LOG_WARN(logging::loggerRoot, "Unable to compact key store " << m_path);
+            compact_failed();
+            return;
+        }
+
+        // Header is rewritten once the number of merged records is known
+        write_header(out, 0);
+
+        std::uint8_t const* base = sorted_begin();
+        std::uint64_t count = 0;
+        std::size_t i = 0;
+        auto jiter = journal.begin();
+        std::uint8_t buffer[RECORD_SIZE];
+        while (i < m_sorted || jiter != journal.end()) {
+            int cmp;
+            if (jiter == journal.end()) {
+                cmp = -1;
+            } else if (i == m_sorted) {
+                cmp = 1;
+            } else {
+                cmp = std::memcmp(base + i * RECORD_SIZE, jiter->id.data(), CLIENTID_SIZE);
+            }
+
+            if (cmp < 0) {
+                out.write(reinterpret_cast<const char*>(base + i * RECORD_SIZE), RECORD_SIZE);
+                i++;
+            } else {
+                // Journal supersedes the sorted block
+                write_record(*jiter, buffer);
+                out.write(reinterpret_cast<const char*>(buffer), RECORD_SIZE);
+                if (cmp == 0) {
+                    i++;
+                }
+                ++jiter;
+            }
+            count++;
+        }
+
+        out.seekp(0);
+        write_header(out, count);
+        out.close();
+        if (!out) {
+            LOG_WARN(logging::loggerRoot, "Unable to compact key store " << m_path);
+            std::remove(tmpPath.c_str());
+            compact_failed();
+            return;
+        }
+
+        m_journalFile.close();
+        m_file = mapped_file();
+#ifdef _WIN32
+        std::remove(m_path.c_str());
+#endif
+        if (std::rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+            LOG_WARN(logging::loggerRoot, "Unable to replace key store " << m_path);
+            std::remove(tmpPath.c_str());
+            // Keep going with the old file and the in-memory journal
+            m_file = mapped_file(m_path);
+            compact_failed();
+            return;
+        }
+        open();
+    }
+
+    void KeyStore::compact_failed() {
+        // open() closes the journal before compacting a damaged file
+        if (m_journalFile.is_open()) {
+            return;
+        }
+        std::size_t size = m_file.size();
+        if (size > HEADER_SIZE) {
+            size = HEADER_SIZE + (size - HEADER_SIZE) / RECORD_SIZE * RECORD_SIZE;
+        }
+        if (size != m_file.size() && !truncate_file(m_path, size)) {
+            // Appending would misalign every later record
+            LOG_WARN(logging::loggerRoot, "Unable to repair key store " << m_path << ", keys are not saved");
+            return;
+        }
+        m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+    }
+
+    void KeyStore::open() {
+        m_journalFile.close();
+        m_journal.clear();
+        m_sorted = 0;
+        m_file = mapped_file(m_path);
+
+        std::uint8_t const* data = m_file.data();
+        if (m_file.size() < HEADER_SIZE || !std::equal(std::begin(STORE_MAGIC), std::end(STORE_MAGIC), data)) {
+            if (m_file.size()) {
+                LOG_WARN(logging::loggerRoot, "Discarding invalid key store " << m_path);
+            }
+            m_file = mapped_file();
+            std::ofstream out(m_path, std::ios::binary | std::ios::trunc);
+            write_header(out, 0);
+            out.close();
+
+            m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+            return;
+        }
+
+        std::uint64_t count = letoh<std::uint64_t>(data + 8);
+        std::size_t records = (m_file.size() - HEADER_SIZE) / RECORD_SIZE;
+        m_sorted = static_cast<std::size_t>(std::min<std::uint64_t>(count, records));
+
+        for (std::size_t i = m_sorted; i < records; i++) {
+            Record record = read_record(sorted_begin() + i * RECORD_SIZE);
+            m_journal[record.id] = record;
+        }
+
+        if (HEADER_SIZE + records * RECORD_SIZE != m_file.size()) {
+            // Partially written record, rewrite the file so appends stay aligned
+            compact();
+            return;
+        }
+
+        m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+    }
+
+    std::uint8_t const* KeyStore::sorted_begin() const {
+        return m_file.data() + HEADER_SIZE;
+    }
+
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <protocol/data/Client.h>
+#include <protocol/data/Crypto.h>
+#include <types/mapped_file.h>
+
+#include <boost/optional.hpp>
+#include <unordered_map>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Persistent map of client IDs to public keys.
+     *
+     * The file consists of a header, a block of fixed size records sorted by ID,
+     * and a journal of records appended since the last compaction. The sorted
+     * block is memory mapped and searched in place; only the journal is parsed
+     * when opening the store.
+     */
+    class KeyStore {
+    public:
+        enum Flags : std::uint32_t {
+            // The ID is not known to the server, the key is not valid
+            UNKNOWN_ID = 1u << 0,
+        };
+
+        struct Record {
+            client_id id;
+            public_key pk;
+            std::uint32_t flags;
+            // Unix time after which the record should be refreshed
+            std::int64_t expires;
+        };
+
+    private:
+        std::string m_path;
+        mapped_file m_file;
+        // Number of records in the sorted block
+        std::size_t m_sorted;
+        std::unordered_map<client_id, Record> m_journal;
+        std::ofstream m_journalFile;
+        // Records appended since the last flush
+        std::size_t m_unflushed;
+
+    public:
+        /**
+         * Open (or create) a key store
+         * @param path Path of the store file
+         */
+        explicit KeyStore(std::string path);
+
+        KeyStore(KeyStore const&) = delete;
+        KeyStore& operator=(KeyStore const&) = delete;
+
+        /**
+         * Look up the record of a client
+         * @param id ID of the client
+         * @return Record, if known
+         */
+        boost::optional<Record> find(client_id const& id) const;
+
+        /**
+         * Store a record, replacing any previous record for the same ID.
+         * The record is appended to the file, which is written in batches.
+         */
+        void put(Record const& record);
+
+        /**
+         * Store many records, compacting at most once afterwards
+         */
+        void put(std::vector<Record> const& records);
+
+        /**
+         * Write the appended records to the file
+         */
+        void flush();
+
+        /**
+         * Merge the journal into the sorted block
+         */
+        void compact();
+
+        /**
+         * @return Number of records appended since the last compaction
+         */
+        std::size_t journal_size() const {
+            return m_journal.size();
+        }
+
+    private:
+        void open();
+        void append(Record const& record);
+        void compact_failed();
+        std::uint8_t const* sorted_begin() const;
+    };
+
+}
@@ -0,0 +1,388 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ApiServer.h"
+
+#include <encoding/base64.h>
+#include <logging/logging.h>
+#include <socket/socket.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace ceema {
+
+    namespace {
+        // Frame length and JSON length of binary frames
+        const std::size_t BINARY_HEADER_SIZE = 8;
+        // Bytes read from a client per event, so one client cannot starve the others
+        const std::size_t MAX_READ = 1024 * 1024;
+        const std::size_t READ_CHUNK = 64 * 1024;
+
+        std::uint32_t read_be32(std::uint8_t const* buffer) {
+            return (std::uint32_t(buffer[0]) << 24) | (std::uint32_t(buffer[1]) << 16) |
+                   (std::uint32_t(buffer[2]) << 8) | std::uint32_t(buffer[3]);
+        }
+
+        void write_be32(std::uint32_t value, std::uint8_t* buffer) {
+            buffer[0] = static_cast<std::uint8_t>(value >> 24);
+            buffer[1] = static_cast<std::uint8_t>(value >> 16);
+            buffer[2] = static_cast<std::uint8_t>(value >> 8);
+            buffer[3] = static_cast<std::uint8_t>(value);
+        }
+
+        Frame error_frame(std::string const& error) {
+            Frame frame;
+            frame.body["ok"] = false;
+            frame.body["error"] = error;
+            return frame;
+        }
+    }
+
+    const std::size_t ApiServer::MAX_FRAME;
+    const std::size_t ApiServer::HIGH_WATER;
+    const std::size_t ApiServer::LOW_WATER;
+
+    ApiServer::ApiServer(EventLoop& loop, RequestHandler onRequest, CloseHandler onClose) :
+            m_loop(loop), m_onRequest(std::move(onRequest)), m_onClose(std::move(onClose)),
+            m_listen(-1), m_nextHandle(1) {
+    }
+
+    ApiServer::~ApiServer() {
+        for (auto& entry: m_clients) {
+            m_loop.unwatch(entry.second.fd);
+            ::close(entry.second.fd);
+        }
+        if (m_listen >= 0) {
+            m_loop.unwatch(m_listen);
+            ::close(m_listen);
+            ::unlink(m_path.c_str());
+        }
+    }
+
+    void ApiServer::listen(std::string const& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        std::copy(path.begin(), path.end(), addr.sun_path);
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw socket_exception();
+        }
+        // Left behind if the daemon did not shut down cleanly
+        ::unlink(path.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+            int err = last_error();
+            ::close(fd);
+            throw socket_exception(err);
+        }
+
+        m_path = path;
+        m_listen = fd;
+        m_loop.watch(fd, EventLoop::READABLE, false, [this](std::uint32_t) {
+            accept();
+        });
+        LOG_INFO(logging::loggerRoot, "Listening on " << path);
+    }
+
+    void ApiServer::send(ClientHandle handle, Frame const& frame) {
+        auto iter = m_clients.find(handle);
+        if (iter == m_clients.end()) {
+            return;
+        }
+        Client& client = iter->second;
+        if (client.framing == Framing::UNKNOWN) {
+            // Format is not known until the client sent its first request
+            return;
+        }
+        encode(client, frame);
+        if (!client.dirty) {
+            client.dirty = true;
+            m_dirty.push_back(handle);
+        }
+    }
+
+    void ApiServer::broadcast(Frame const& frame) {
+        for (auto& entry: m_clients) {
+            send(entry.first, frame);
+        }
+    }
+
+    void ApiServer::flush() {
+        std::vector<ClientHandle> dirty;
+        dirty.swap(m_dirty);
+        for (ClientHandle handle: dirty) {
+            auto iter = m_clients.find(handle);
+            if (iter == m_clients.end()) {
+                continue;
+            }
+            Client& client = iter->second;
+            client.dirty = false;
+            if (!write(client)) {
+                close(handle);
+                continue;
+            }
+            update(handle, client);
+        }
+    }
+
+    void ApiServer::accept() {
+        while (true) {
+            int fd = ::accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                int err = last_error();
+                if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR && err != ECONNABORTED) {
+                    LOG_WARN(logging::loggerRoot, "Unable to accept API client: " << format_error(err));
+                }
+                if (err == EINTR || err == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+
+            ClientHandle handle = m_nextHandle++;
+            m_clients.emplace(handle, Client{fd, Framing::UNKNOWN, {}, {}, 0, false, false});
+            m_loop.watch(fd, EventLoop::READABLE, false, [this, handle](std::uint32_t events) {
+                on_event(handle, events);
+            });
+            LOG_DEBUG(logging::loggerRoot, "API client " << handle << " connected");
+        }
+    }
+
+    void ApiServer::on_event(ClientHandle handle, std::uint32_t events) {
+        auto iter = m_clients.find(handle);
+        if (iter == m_clients.end()) {
+            return;
+        }
+        Client& client = iter->second;
+
+        if ((events & EventLoop::WRITABLE) && !write(client)) {
+            close(handle);
+            return;
+        }
+        if (events & (EventLoop::READABLE | EventLoop::CLOSED)) {
+            if (!read(handle, client)) {
+                close(handle);
+                return;
+            }
+            parse(handle);
+        }
+
+        iter = m_clients.find(handle);
+        if (iter != m_clients.end()) {
+            update(handle, iter->second);
+        }
+    }
+
+    bool ApiServer::read(ClientHandle handle, Client& client) {
+        std::size_t total = 0;
+        while (total < MAX_READ) {
+            std::size_t size = client.in.size();
+            client.in.resize(size + READ_CHUNK);
+            ssize_t res = ::recv(client.fd, client.in.data() + size, READ_CHUNK, 0);
+            if (res > 0) {
+                client.in.resize(size + static_cast<std::size_t>(res));
+                total += static_cast<std::size_t>(res);
+                continue;
+            }
+            client.in.resize(size);
+            if (res == 0) {
+                LOG_DEBUG(logging::loggerRoot, "API client " << handle << " disconnected");
+                return false;
+            }
+            int err = last_error();
+            if (err == EINTR) {
+                continue;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                break;
+            }
+            LOG_DEBUG(logging::loggerRoot, "API client " << handle << " failed: " << format_error(err));
+            return false;
+        }
+        return true;
+    }
+
+    bool ApiServer::write(Client& client) {
+        while (client.written < client.out.size()) {
+            ssize_t res = ::send(client.fd, client.out.data() + client.written,
+                                 client.out.size() - client.written, MSG_NOSIGNAL);
+            if (res >= 0) {
+                client.written += static_cast<std::size_t>(res);
+                continue;
+            }
+            int err = last_error();
+            if (err == EINTR) {
+                continue;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+
+        if (client.written == client.out.size()) {
+            client.out.clear();
+            client.written = 0;
+        } else if (client.written > client.out.size() / 2) {
+            client.out.erase(client.out.begin(), client.out.begin() + client.written);
+            client.written = 0;
+        }
+        return true;
+    }
+
+    void ApiServer::parse(ClientHandle handle) {
+        std::size_t offset = 0;
+        while (true) {
+            auto iter = m_clients.find(handle);
+            if (iter == m_clients.end()) {
+                return;
+            }
+            Client& client = iter->second;
+            byte_vector const& in = client.in;
+            if (offset >= in.size()) {
+                break;
+            }
+
+            if (client.framing == Framing::UNKNOWN) {
+                // A binary frame starting with '{' would exceed MAX_FRAME
+                client.framing = (in[offset] == '{') ? Framing::NDJSON : Framing::BINARY;
+            }
+
+            Frame frame;
+            try {
+                if (client.framing == Framing::NDJSON) {
+                    auto begin = in.begin() + offset;
+                    auto end = std::find(begin, in.end(), '\n');
+                    if (end == in.end()) {
+                        if (in.size() - offset > MAX_FRAME) {
+                            LOG_DEBUG(logging::loggerRoot, "API client " << handle << " exceeded frame size");
+                            close(handle);
+                            return;
+                        }
+                        break;
+                    }
+                    offset = static_cast<std::size_t>(end - in.begin()) + 1;
+                    if (std::all_of(begin, end, [](std::uint8_t c) { return std::isspace(c); })) {
+                        continue;
+                    }
+
+                    frame.body = json::parse(std::string(begin, end));
+                    auto data = frame.body.find("data");
+                    if (data != frame.body.end() && data->is_string()) {
+                        frame.data = base64_decode(data->get<std::string>());
+                        frame.body.erase(data);
+                    }
+                } else {
+                    if (in.size() - offset < BINARY_HEADER_SIZE) {
+                        break;
+                    }
+                    std::uint32_t length = read_be32(in.data() + offset);
+                    std::uint32_t jsonLength = read_be32(in.data() + offset + 4);
+                    if (length > MAX_FRAME || length < 4 || jsonLength > length - 4) {
+                        LOG_DEBUG(logging::loggerRoot, "API client " << handle << " sent invalid frame header");
+                        close(handle);
+                        return;
+                    }
+                    if (in.size() - offset < 4 + length) {
+                        break;
+                    }
+                    auto begin = in.begin() + offset + BINARY_HEADER_SIZE;
+                    auto end = in.begin() + offset + 4 + length;
+                    offset += 4 + length;
+
+                    frame.body = json::parse(std::string(begin, begin + jsonLength));
+                    frame.data.assign(begin + jsonLength, end);
+                }
+            } catch (std::exception& e) {
+                send(handle, error_frame(std::string("Invalid frame: ") + e.what()));
+                continue;
+            }
+
+            if (!frame.body.is_object()) {
+                send(handle, error_frame("Invalid frame: not an object"));
+                continue;
+            }
+            m_onRequest(handle, frame);
+        }
+
+        auto iter = m_clients.find(handle);
+        if (iter != m_clients.end()) {
+            byte_vector& in = iter->second.in;
+            in.erase(in.begin(), in.begin() + std::min(offset, in.size()));
+        }
+    }
+
+    void ApiServer::encode(Client& client, Frame const& frame) {
+        if (client.framing == Framing::NDJSON) {
+            std::string line;
+            if (frame.data.empty()) {
+                line = frame.body.dump();
+            } else {
+                json body = frame.body;
+                body["data"] = base64_encode(frame.data);
+                line = body.dump();
+            }
+            client.out.insert(client.out.end(), line.begin(), line.end());
+            client.out.push_back('\n');
+        } else {
+            std::string body = frame.body.dump();
+            std::uint8_t header[BINARY_HEADER_SIZE];
+            write_be32(static_cast<std::uint32_t>(4 + body.size() + frame.data.size()), header);
+            write_be32(static_cast<std::uint32_t>(body.size()), header + 4);
+            client.out.insert(client.out.end(), header, header + BINARY_HEADER_SIZE);
+            client.out.insert(client.out.end(), body.begin(), body.end());
+            client.out.insert(client.out.end(), frame.data.begin(), frame.data.end());
+        }
+    }
+
+    void ApiServer::update(ClientHandle handle, Client& client) {
+        std::size_t pending = client.out.size() - client.written;
+        if (!client.paused && pending > HIGH_WATER) {
+            LOG_DEBUG(logging::loggerRoot, "API client " << handle << " is not keeping up, pausing");
+            client.paused = true;
+        } else if (client.paused && pending < LOW_WATER) {
+            client.paused = false;
+        }
+
+        std::uint32_t events = client.paused ? 0 : EventLoop::READABLE;
+        if (pending) {
+            events |= EventLoop::WRITABLE;
+        }
+        m_loop.modify(client.fd, events);
+    }
+
+    void ApiServer::close(ClientHandle handle) {
+        auto iter = m_clients.find(handle);
+        if (iter == m_clients.end()) {
+            return;
+        }
+        m_loop.unwatch(iter->second.fd);
+        ::close(iter->second.fd);
+        m_clients.erase(iter);
+        m_onClose(handle);
+    }
+
+}
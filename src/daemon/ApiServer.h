@@ -0,0 +1,153 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <async/EventLoop.h>
+#include <types/bytes.h>
+
+#include <json/src/json.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace ceema {
+
+    /**
+     * Request, response or event exchanged with an API client. Binary data
+     * (e.g. blob contents) is kept apart from the JSON body.
+     */
+    struct Frame {
+        json body;
+        byte_vector data;
+    };
+
+    /**
+     * Local API socket of the daemon.
+     *
+     * Clients connect to a UNIX socket and exchange frames in one of two
+     * formats, chosen by the first byte a client sends ('{' for JSON):
+     * - newline-delimited JSON, with binary data base64 encoded in a "data"
+     *   field of the object;
+     * - length-prefixed binary frames: a 32-bit big endian length of the
+     *   rest of the frame, a 32-bit big endian JSON length, the JSON body and
+     *   the raw data.
+     *
+     * Requests may be pipelined; all complete frames are dispatched as soon
+     * as they are read. Responses are buffered and written by flush(), once
+     * per loop iteration. A client is no longer read from while its output
+     * buffer exceeds HIGH_WATER, until it drained below LOW_WATER.
+     */
+    class ApiServer {
+    public:
+        using ClientHandle = std::uint64_t;
+
+        /**
+         * Called for every frame received from a client
+         */
+        using RequestHandler = std::function<void(ClientHandle client, Frame& frame)>;
+
+        /**
+         * Called after a client disconnected
+         */
+        using CloseHandler = std::function<void(ClientHandle client)>;
+
+        // Largest frame accepted from a client
+        static const std::size_t MAX_FRAME = 64 * 1024 * 1024;
+        // Output buffer size at which reading from a client pauses
+        static const std::size_t HIGH_WATER = 4 * 1024 * 1024;
+        // Output buffer size at which reading from a client resumes
+        static const std::size_t LOW_WATER = 1024 * 1024;
+
+    private:
+        enum class Framing {
+            UNKNOWN,
+            NDJSON,
+            BINARY
+        };
+
+        struct Client {
+            int fd;
+            Framing framing;
+            byte_vector in;
+            byte_vector out;
+            // Part of out written already
+            std::size_t written;
+            bool paused;
+            bool dirty;
+        };
+
+        EventLoop& m_loop;
+        RequestHandler m_onRequest;
+        CloseHandler m_onClose;
+
+        std::string m_path;
+        int m_listen;
+        std::unordered_map<ClientHandle, Client> m_clients;
+        ClientHandle m_nextHandle;
+        // Clients with output to flush
+        std::vector<ClientHandle> m_dirty;
+
+    public:
+        ApiServer(EventLoop& loop, RequestHandler onRequest, CloseHandler onClose);
+        ~ApiServer();
+
+        ApiServer(ApiServer const&) = delete;
+        ApiServer& operator=(ApiServer const&) = delete;
+
+        /**
+         * Listen on a UNIX socket, replacing any stale socket file
+         * @param path Path of the socket
+         */
+        void listen(std::string const& path);
+
+        /**
+         * Queue a frame for a client. Frames for disconnected clients are dropped.
+         */
+        void send(ClientHandle client, Frame const& frame);
+
+        /**
+         * Queue a frame for all clients
+         */
+        void broadcast(Frame const& frame);
+
+        /**
+         * Write buffered output of all clients
+         */
+        void flush();
+
+        std::size_t client_count() const {
+            return m_clients.size();
+        }
+
+    private:
+        void accept();
+        void on_event(ClientHandle handle, std::uint32_t events);
+        bool read(ClientHandle handle, Client& client);
+        bool write(Client& client);
+        void parse(ClientHandle handle);
+        void encode(Client& client, Frame const& frame);
+        void update(ClientHandle handle, Client& client);
+        void close(ClientHandle handle);
+    };
+
+}
@@ -0,0 +1,638 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Daemon.h"
+
+#include <api/BlobTransfer.h>
+#include <encoding/hex.h>
+#include <logging/logging.h>
+#include <protocol/packet/payloads/PayloadBlob.h>
+#include <protocol/packet/payloads/PayloadText.h>
+#include <socket/socket.h>
+
+#include <algorithm>
+#include <csignal>
+
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+namespace ceema {
+
+    namespace {
+        // Interval of ACK retransmission checks
+        const long TICK_INTERVAL_MS = 1000;
+        // Messages returned by a receive request without "max"
+        const std::size_t DEFAULT_RECEIVE_MAX = 100;
+        // Delay before retrying a message of which the sender key could not be fetched
+        const std::chrono::seconds RETRY_DELAY{30};
+
+        BlobType parse_blob_type(std::string const& type) {
+            static const std::unordered_map<std::string, BlobType> types{
+                    {"image", BlobType::IMAGE},
+                    {"video", BlobType::VIDEO},
+                    {"video_thumb", BlobType::VIDEO_THUMB},
+                    {"audio", BlobType::AUDIO},
+                    {"file", BlobType::FILE},
+                    {"file_thumb", BlobType::FILE_THUMB},
+                    {"group_image", BlobType::GROUP_IMAGE},
+                    {"group_icon", BlobType::GROUP_ICON},
+                    {"icon", BlobType::ICON},
+            };
+            auto iter = types.find(type);
+            if (iter == types.end()) {
+                throw std::runtime_error("Unknown blob type " + type);
+            }
+            return iter->second;
+        }
+
+        json render(Message const& msg) {
+            json body;
+            body["from"] = msg.sender().toString();
+            body["msgid"] = hex_encode(msg.id());
+            body["time"] = msg.time();
+            body["nick"] = msg.nick();
+            body["type"] = static_cast<int>(msg.payloadType());
+            switch (msg.payloadType()) {
+                case MessageType::TEXT:
+                    body["text"] = msg.payload<PayloadText>().m_text;
+                    break;
+                case MessageType::FILE: {
+                    auto const& file = msg.payload<PayloadFile>();
+                    json& info = body["file"];
+                    info["blob"] = hex_encode(file.id);
+                    info["key"] = hex_encode(file.key);
+                    info["size"] = file.size;
+                    info["name"] = file.filename;
+                    info["mime"] = file.mime_type;
+                    break; }
+                default:
+                    break;
+            }
+            return body;
+        }
+
+        std::string what(std::exception_ptr error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (std::exception& e) {
+                return e.what();
+            } catch (...) {
+                return "Unknown error";
+            }
+        }
+    }
+
+    Daemon::Daemon(Options options, std::vector<Account> const& accounts) :
+            m_options(std::move(options)), m_identAPI(m_loop), m_blobAPI(m_loop, true),
+            m_server(m_loop,
+                     [this](ApiServer::ClientHandle client, Frame& frame) { on_request(client, frame); },
+                     [this](ApiServer::ClientHandle client) { on_close(client); }),
+            m_signalfd(-1), m_running(false),
+            m_pool(m_options.pool,
+                   [this](std::vector<SessionPool::Delivery>& batch) {
+                       // Called on the pool threads, handled on the main thread
+                       auto packets = std::make_shared<std::vector<SessionPool::Delivery>>(std::move(batch));
+                       m_loop.post([this, packets]() {
+                           on_packets(*packets);
+                       });
+                   },
+                   [this](client_id const& account, std::exception_ptr error) {
+                       m_loop.post([this, account, error]() {
+                           on_state(account, error);
+                       });
+                   }) {
+        for (Account const& account: accounts) {
+            m_accounts.emplace(account.id(), std::make_unique<AccountState>(account));
+        }
+    }
+
+    Daemon::~Daemon() {
+        m_pool.stop();
+        if (m_signalfd >= 0) {
+            m_loop.unwatch(m_signalfd);
+            ::close(m_signalfd);
+        }
+    }
+
+    void Daemon::run() {
+        // Blocked before the pool threads start, so the signals end up here
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        std::signal(SIGPIPE, SIG_IGN);
+        if (m_signalfd < 0) {
+            m_signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (m_signalfd < 0) {
+                throw socket_exception();
+            }
+            m_loop.watch(m_signalfd, EventLoop::READABLE, false, [this](std::uint32_t) {
+                signalfd_siginfo info;
+                while (::read(m_signalfd, &info, sizeof(info)) == sizeof(info)) {
+                    LOG_INFO(logging::loggerRoot, "Received signal " << info.ssi_signo << ", shutting down");
+                    stop();
+                }
+            });
+        }
+
+        m_server.listen(m_options.socketPath);
+        for (auto& entry: m_accounts) {
+            m_pool.add(entry.second->account);
+        }
+        m_pool.start();
+        m_loop.scheduleTimer(TICK_INTERVAL_MS, [this]() {
+            on_tick();
+        });
+
+        m_running = true;
+        while (m_running) {
+            m_loop.run_once(-1);
+            m_server.flush();
+        }
+
+        m_pool.stop();
+    }
+
+    void Daemon::on_request(ApiServer::ClientHandle client, Frame& frame) {
+        json id = frame.body.count("id") ? frame.body["id"] : json();
+        try {
+            std::string op = frame.body.at("op");
+            if (op == "send") {
+                op_send(client, id, frame.body);
+            } else if (op == "receive") {
+                op_receive(client, id, frame.body);
+            } else if (op == "ack") {
+                op_ack(client, id, frame.body);
+            } else if (op == "blob_upload") {
+                op_blob_upload(client, id, frame.body, frame.data);
+            } else if (op == "blob_download") {
+                op_blob_download(client, id, frame.body);
+            } else if (op == "status") {
+                op_status(client, id);
+            } else {
+                fail(client, id, "Unknown operation " + op);
+            }
+        } catch (std::exception& e) {
+            fail(client, id, e.what());
+        }
+    }
+
+    void Daemon::on_close(ApiServer::ClientHandle client) {
+        for (auto& entry: m_accounts) {
+            AccountState& state = *entry.second;
+            auto waiter = std::remove_if(state.waiters.begin(), state.waiters.end(), [client](Waiter const& w) {
+                return w.client == client;
+            });
+            state.waiters.erase(waiter, state.waiters.end());
+
+            // Messages the client did not ACK are handed to the next receiver
+            std::vector<Received> unacked;
+            for (auto iter = state.delivered.begin(); iter != state.delivered.end();) {
+                if (iter->second.client == client) {
+                    unacked.push_back(std::move(iter->second.message));
+                    iter = state.delivered.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
+            state.inbox.insert(state.inbox.begin(), std::make_move_iterator(unacked.begin()),
+                               std::make_move_iterator(unacked.end()));
+            deliver(state);
+        }
+    }
+
+    void Daemon::on_packets(std::vector<SessionPool::Delivery>& batch) {
+        for (auto& delivery: batch) {
+            auto iter = m_accounts.find(delivery.account);
+            if (iter == m_accounts.end()) {
+                continue;
+            }
+            AccountState& state = *iter->second;
+            switch (delivery.packet->type()) {
+                case PacketType::ACK_SERVER:
+                    state.tracker.acknowledge(static_cast<Acknowledgement const&>(*delivery.packet));
+                    break;
+                case PacketType::MESSAGE_RECV:
+                    on_message(state, std::shared_ptr<Message>(static_cast<Message*>(delivery.packet.release())));
+                    break;
+                case PacketType::DISCONNECTED:
+                    LOG_WARN(logging::loggerRoot, "Account " << state.account.id().toString()
+                            << " signed in somewhere else");
+                    break;
+                default:
+                    break;
+            }
+        }
+        for (auto& entry: m_accounts) {
+            update_throttle(*entry.second);
+        }
+    }
+
+    void Daemon::on_state(client_id const& account, std::exception_ptr error) {
+        auto iter = m_accounts.find(account);
+        if (iter == m_accounts.end()) {
+            return;
+        }
+        AccountState& state = *iter->second;
+        state.connected = !error;
+
+        Frame event;
+        event.body["event"] = "connection";
+        event.body["account"] = account.toString();
+        event.body["connected"] = state.connected;
+        if (error) {
+            event.body["error"] = what(error);
+            // The server delivers unacknowledged messages again after reconnecting
+            state.inbox.clear();
+            state.delivered.clear();
+            state.deferred.clear();
+            state.dropped = 0;
+        }
+        m_server.broadcast(event);
+    }
+
+    void Daemon::on_message(AccountState& state, std::shared_ptr<Message> msg) {
+        if (state.inbox.size() + state.delivered.size() >= m_options.maxInbox) {
+            // Not acknowledged, processed once clients ACKed enough messages
+            LOG_DEBUG(logging::loggerRoot, "Inbox of " << state.account.id().toString()
+                    << " is full, deferring message " << msg->id());
+            defer(state, std::move(msg), std::chrono::steady_clock::time_point());
+            return;
+        }
+        process(state, std::move(msg));
+    }
+
+    void Daemon::process(AccountState& state, std::shared_ptr<Message> msg) {
+        with_contact(msg->sender(), [this, &state, msg](Contact const* contact, std::exception_ptr error) {
+            Received received{MessageKey{msg->sender(), msg->id()}, msg->flags().isnset(MessageFlag::NO_ACK), json()};
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            } catch (unknown_identity_exception& e) {
+                // ACKed anyway, the sender will not exist when delivered again
+                LOG_WARN(logging::loggerRoot, "Dropping message " << msg->id() << " from "
+                        << msg->sender().toString() << ": " << e.what());
+                if (received.ack) {
+                    send_ack(state, received.key);
+                }
+                return;
+            } catch (std::exception& e) {
+                // Not acknowledged, the lookup may succeed later
+                LOG_DEBUG(logging::loggerRoot, "Deferring message " << msg->id() << " from "
+                        << msg->sender().toString() << ": " << e.what());
+                defer(state, msg, std::chrono::steady_clock::now() + RETRY_DELAY);
+                return;
+            }
+
+            try {
+                msg->decrypt(*contact, state.account);
+                received.body = render(*msg);
+            } catch (std::exception& e) {
+                // ACKed anyway, it will not be any better when delivered again
+                LOG_WARN(logging::loggerRoot, "Dropping message " << msg->id() << " from "
+                        << msg->sender().toString() << ": " << e.what());
+                if (received.ack) {
+                    send_ack(state, received.key);
+                }
+                return;
+            }
+            state.inbox.push_back(std::move(received));
+            deliver(state);
+        });
+    }
+
+    void Daemon::process_deferred(AccountState& state) {
+        auto now = std::chrono::steady_clock::now();
+        // Keeps the order of the messages that are not due yet
+        for (std::size_t i = state.deferred.size(); i > 0; i--) {
+            Deferred deferred = std::move(state.deferred.front());
+            state.deferred.pop_front();
+            if (deferred.retry <= now && state.inbox.size() + state.delivered.size() < m_options.maxInbox) {
+                process(state, std::move(deferred.msg));
+            } else {
+                state.deferred.push_back(std::move(deferred));
+            }
+        }
+
+        if (state.dropped && state.inbox.empty() && state.delivered.empty()) {
+            // Everything handed out was ACKed, have the server deliver the dropped messages again
+            LOG_INFO(logging::loggerRoot, "Reconnecting " << state.account.id().toString() << " to fetch "
+                    << state.dropped << " dropped messages");
+            state.dropped = 0;
+            m_pool.reconnect(state.account.id());
+        }
+    }
+
+    void Daemon::defer(AccountState& state, std::shared_ptr<Message> msg, std::chrono::steady_clock::time_point retry) {
+        if (state.deferred.size() >= m_options.maxInbox) {
+            // Not acknowledged, so the server keeps it
+            if (!state.dropped++) {
+                LOG_WARN(logging::loggerRoot, "Too many messages held back for " << state.account.id().toString()
+                        << ", leaving further messages with the server");
+            }
+            return;
+        }
+        state.deferred.push_back(Deferred{std::move(msg), retry});
+    }
+
+    void Daemon::on_tick() {
+        for (auto& entry: m_accounts) {
+            AccountState& state = *entry.second;
+            client_id account = entry.first;
+            state.tracker.tick([this, account](Message const& msg) {
+                m_pool.send(account, std::make_shared<Message>(msg));
+            });
+            update_throttle(state);
+            process_deferred(state);
+        }
+        m_loop.scheduleTimer(TICK_INTERVAL_MS, [this]() {
+            on_tick();
+        });
+    }
+
+    void Daemon::op_send(ApiServer::ClientHandle client, json const& id, json const& request) {
+        AccountState& state = account_of(request);
+        if (state.throttled) {
+            fail(client, id, "Too many messages in flight");
+            return;
+        }
+        client_id recipient = client_id::fromString(request.at("to"));
+        std::string text = request.at("text");
+
+        state.lookups++;
+        update_throttle(state);
+        with_contact(recipient, [this, &state, client, id, text](Contact const* contact, std::exception_ptr error) {
+            state.lookups--;
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                auto msg = std::make_unique<Message>(state.account.id(), contact->id(), PayloadText{text});
+                msg->encrypt(state.account, *contact);
+                std::shared_ptr<Message const> packet = std::make_shared<Message>(*msg);
+
+                state.tracker.track(std::move(msg)).next([this, &state, client, id](future<std::unique_ptr<Message>> fut) {
+                    try {
+                        auto sent = fut.get();
+                        Frame response;
+                        response.body["msgid"] = hex_encode(sent->id());
+                        reply(client, id, std::move(response));
+                    } catch (std::exception& e) {
+                        fail(client, id, e.what());
+                    }
+                    update_throttle(state);
+                });
+                m_pool.send(state.account.id(), packet);
+            } catch (std::exception& e) {
+                fail(client, id, e.what());
+            }
+            update_throttle(state);
+        });
+    }
+
+    void Daemon::op_receive(ApiServer::ClientHandle client, json const& id, json const& request) {
+        AccountState& state = account_of(request);
+        std::size_t max = request.count("max") ? request["max"].get<std::size_t>() : DEFAULT_RECEIVE_MAX;
+        bool wait = request.count("wait") ? request["wait"].get<bool>() : true;
+        if (!max) {
+            throw std::runtime_error("Invalid max");
+        }
+
+        if (state.inbox.empty() && !wait) {
+            Frame response;
+            response.body["messages"] = json::array();
+            reply(client, id, std::move(response));
+            return;
+        }
+        state.waiters.push_back(Waiter{client, id, max});
+        deliver(state);
+    }
+
+    void Daemon::op_ack(ApiServer::ClientHandle client, json const& id, json const& request) {
+        AccountState& state = account_of(request);
+        std::size_t acked = 0;
+        for (json const& entry: request.at("messages")) {
+            MessageKey key{client_id::fromString(entry.at("from")),
+                           hex_decode<message_id>(entry.at("msgid").get<std::string>())};
+            auto iter = state.delivered.find(key);
+            if (iter == state.delivered.end()) {
+                continue;
+            }
+            if (iter->second.message.ack) {
+                send_ack(state, key);
+            }
+            state.delivered.erase(iter);
+            acked++;
+        }
+        process_deferred(state);
+
+        Frame response;
+        response.body["acked"] = acked;
+        reply(client, id, std::move(response));
+    }
+
+    void Daemon::op_blob_upload(ApiServer::ClientHandle client, json const& id, json const& request,
+                                byte_vector& data) {
+        BlobType type = parse_blob_type(request.count("type") ? request["type"].get<std::string>() : "file");
+        auto transfer = new BlobUploadTransfer(std::move(data), type);
+        transfer->get_future().next([this, client, id, transfer](future<Blob> fut) {
+            try {
+                Blob blob = fut.get();
+                Frame response;
+                response.body["blob"] = hex_encode(blob.id);
+                response.body["key"] = hex_encode(blob.key);
+                response.body["size"] = blob.size;
+                reply(client, id, std::move(response));
+            } catch (std::exception& e) {
+                fail(client, id, e.what());
+            }
+            // Still in use by the HTTP client until this returns
+            m_loop.post([transfer]() {
+                delete transfer;
+            });
+        });
+        m_blobAPI.upload(transfer);
+    }
+
+    void Daemon::op_blob_download(ApiServer::ClientHandle client, json const& id, json const& request) {
+        BlobType type = parse_blob_type(request.count("type") ? request["type"].get<std::string>() : "file");
+        blob_id blob = hex_decode<blob_id>(request.at("blob").get<std::string>());
+        shared_key key = hex_decode<shared_key>(request.at("key").get<std::string>());
+        std::string path = request.count("path") ? request["path"].get<std::string>() : std::string();
+
+        auto transfer = new BlobDownloadTransfer(blob, type, key);
+        transfer->get_future().next([this, client, id, transfer, path](future<byte_vector> fut) {
+            try {
+                if (path.empty()) {
+                    Frame response;
+                    response.data = fut.get();
+                    reply(client, id, std::move(response));
+                } else {
+                    save_blob(client, id, path, fut.get());
+                }
+            } catch (std::exception& e) {
+                fail(client, id, e.what());
+            }
+            m_loop.post([transfer]() {
+                delete transfer;
+            });
+        });
+        m_blobAPI.downloadFile(transfer, blob);
+    }
+
+    void Daemon::save_blob(ApiServer::ClientHandle client, json const& id, std::string const& path,
+                           byte_vector data) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " + format_error());
+        }
+        std::size_t size = data.size();
+        m_loop.write_file(fd, std::move(data), 0, [this, client, id, path, fd, size](std::exception_ptr error) {
+            ::close(fd);
+            try {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                Frame response;
+                response.body["path"] = path;
+                response.body["size"] = size;
+                reply(client, id, std::move(response));
+            } catch (std::exception& e) {
+                fail(client, id, "Unable to write " + path + ": " + e.what());
+            }
+        });
+    }
+
+    void Daemon::op_status(ApiServer::ClientHandle client, json const& id) {
+        Frame response;
+        response.body["accounts"] = json::array();
+        for (auto const& entry: m_accounts) {
+            AccountState const& state = *entry.second;
+            response.body["accounts"].push_back({
+                    {"account", entry.first.toString()},
+                    {"connected", state.connected},
+                    {"inbox", state.inbox.size()},
+                    {"unacked", state.delivered.size()},
+                    {"deferred", state.deferred.size()},
+                    {"dropped", state.dropped},
+                    {"inflight", state.tracker.size() + state.lookups},
+                    {"throttled", state.throttled}
+            });
+        }
+        reply(client, id, std::move(response));
+    }
+
+    Daemon::AccountState& Daemon::account_of(json const& request) {
+        auto field = request.find("account");
+        if (field == request.end()) {
+            if (m_accounts.size() != 1) {
+                throw std::runtime_error("No account given");
+            }
+            return *m_accounts.begin()->second;
+        }
+        auto iter = m_accounts.find(client_id::fromString(field->get<std::string>()));
+        if (iter == m_accounts.end()) {
+            throw std::runtime_error("Unknown account " + field->get<std::string>());
+        }
+        return *iter->second;
+    }
+
+    void Daemon::with_contact(client_id const& id, ContactCallback callback) {
+        auto iter = m_contacts.find(id);
+        if (iter != m_contacts.end()) {
+            callback(&iter->second, nullptr);
+            return;
+        }
+        m_identAPI.fetchClientInfo(id).next([this, callback](future<Contact> fut) {
+            try {
+                Contact contact = fut.get();
+                if (m_contacts.size() >= m_options.maxContacts && !m_contacts.count(contact.id())) {
+                    // No usage order is kept, drop an arbitrary contact
+                    m_contacts.erase(m_contacts.begin());
+                }
+                auto result = m_contacts.emplace(contact.id(), contact);
+                callback(&result.first->second, nullptr);
+            } catch (std::exception&) {
+                callback(nullptr, std::current_exception());
+            }
+        });
+    }
+
+    void Daemon::deliver(AccountState& state) {
+        while (!state.waiters.empty() && !state.inbox.empty()) {
+            Waiter waiter = std::move(state.waiters.front());
+            state.waiters.pop_front();
+
+            Frame response;
+            json& messages = response.body["messages"] = json::array();
+            for (std::size_t i = 0; i < waiter.max && !state.inbox.empty(); i++) {
+                Received& received = state.inbox.front();
+                messages.push_back(received.body);
+                MessageKey key = received.key;
+                state.delivered[key] = Delivered{waiter.client, std::move(received)};
+                state.inbox.pop_front();
+            }
+            reply(waiter.client, waiter.id, std::move(response));
+        }
+    }
+
+    void Daemon::update_throttle(AccountState& state) {
+        std::size_t inflight = state.tracker.size() + state.lookups;
+        bool throttled = state.throttled;
+        if (!throttled && inflight >= m_options.maxInflight) {
+            throttled = true;
+        } else if (throttled && inflight <= m_options.maxInflight / 2) {
+            throttled = false;
+        }
+        if (throttled == state.throttled) {
+            return;
+        }
+        state.throttled = throttled;
+
+        Frame event;
+        event.body["event"] = "backpressure";
+        event.body["account"] = state.account.id().toString();
+        event.body["active"] = throttled;
+        m_server.broadcast(event);
+    }
+
+    void Daemon::send_ack(AccountState& state, MessageKey const& key) {
+        m_pool.send(state.account.id(), std::make_shared<Acknowledgement>(key.sender, key.id));
+    }
+
+    void Daemon::reply(ApiServer::ClientHandle client, json const& id, Frame frame) {
+        if (!id.is_null()) {
+            frame.body["id"] = id;
+        }
+        frame.body["ok"] = true;
+        m_server.send(client, frame);
+    }
+
+    void Daemon::fail(ApiServer::ClientHandle client, json const& id, std::string const& error) {
+        Frame frame;
+        if (!id.is_null()) {
+            frame.body["id"] = id;
+        }
+        frame.body["ok"] = false;
+        frame.body["error"] = error;
+        m_server.send(client, frame);
+    }
+
+}
@@ -0,0 +1,210 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "ApiServer.h"
+
+#include <api/BlobAPI.h>
+#include <api/IdentAPI.h>
+#include <async/EventLoop.h>
+#include <protocol/AckTracker.h>
+#include <protocol/SessionPool.h>
+#include <protocol/packet/Message.h>
+
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Headless client for bots and integrations.
+     *
+     * Keeps the sessions of the configured accounts connected through a
+     * SessionPool, and serves the API socket from the main thread, where
+     * HTTP (IdentAPI, BlobAPI) and the contact keys shared by all accounts
+     * live as well. Requests are JSON objects with an "op" field, an
+     * optional "id" echoed in the response, and an "account" field unless
+     * only one account is configured:
+     * - send: text message "text" to "to", answered once the server ACKed it
+     * - receive: up to "max" received messages; unless "wait" is false, the
+     *   response is held until at least one message is available
+     * - ack: "messages" ([{from, msgid}]) were processed, ACK them to the
+     *   server. Unacknowledged messages are delivered again after a reconnect.
+     *   Received messages are held back while the inbox is full, or retried
+     *   later if the key of the sender could not be fetched. Once too many
+     *   are held back, further messages are left with the server, and
+     *   fetched again by reconnecting after the clients ACKed the inbox.
+     * - blob_upload: upload the frame data as a blob of "type"
+     * - blob_download: download blob "blob" of "type" with "key", returned
+     *   as frame data, or written to the file "path" if given
+     * - status: connection state of the accounts
+     *
+     * Besides responses, clients receive events: "connection" when a session
+     * connects or disconnects, and "backpressure" when an account has too
+     * many messages in flight (sends are refused until it is cleared).
+     */
+    class Daemon {
+    public:
+        struct Options {
+            std::string socketPath = "ceemad.sock";
+            SessionPool::Options pool;
+            // Received messages kept per account until API clients ACK them
+            std::size_t maxInbox = 10000;
+            // Messages sent per account and not yet ACKed by the server
+            std::size_t maxInflight = 4096;
+            // Contact keys kept in memory, shared by all accounts
+            std::size_t maxContacts = 10000;
+        };
+
+    private:
+        struct MessageKey {
+            client_id sender;
+            message_id id;
+
+            bool operator==(MessageKey const& other) const {
+                return sender == other.sender && id == other.id;
+            }
+        };
+
+        struct MessageKeyHash {
+            std::size_t operator()(MessageKey const& key) const {
+                std::uint64_t id;
+                std::copy(key.id.begin(), key.id.end(), reinterpret_cast<std::uint8_t*>(&id));
+                return std::hash<client_id>{}(key.sender) ^ std::hash<std::uint64_t>{}(id);
+            }
+        };
+
+        struct Received {
+            MessageKey key;
+            // False for messages the server does not want ACKed
+            bool ack;
+            json body;
+        };
+
+        /**
+         * Received message not yet decrypted, and not ACKed
+         */
+        struct Deferred {
+            std::shared_ptr<Message> msg;
+            // Not retried before this time
+            std::chrono::steady_clock::time_point retry;
+        };
+
+        struct Delivered {
+            ApiServer::ClientHandle client;
+            Received message;
+        };
+
+        /**
+         * Receive request waiting for messages
+         */
+        struct Waiter {
+            ApiServer::ClientHandle client;
+            json id;
+            std::size_t max;
+        };
+
+        struct AccountState {
+            Account account;
+            bool connected;
+            AckTracker tracker;
+            std::deque<Received> inbox;
+            std::deque<Deferred> deferred;
+            std::unordered_map<MessageKey, Delivered, MessageKeyHash> delivered;
+            std::deque<Waiter> waiters;
+            // Messages to send waiting for the key of the recipient
+            std::size_t lookups;
+            bool throttled;
+            // Messages dropped without ACK while deferred was full
+            std::size_t dropped;
+
+            explicit AccountState(Account const& account) :
+                    account(account), connected(false), lookups(0), throttled(false), dropped(0) {}
+        };
+
+        using ContactCallback = std::function<void(Contact const* contact, std::exception_ptr error)>;
+
+        Options m_options;
+        EventLoop m_loop;
+        IdentAPI m_identAPI;
+        BlobAPI m_blobAPI;
+        ApiServer m_server;
+
+        std::unordered_map<client_id, std::unique_ptr<AccountState>> m_accounts;
+        // Keys of contacts, shared by all accounts
+        std::unordered_map<client_id, Contact> m_contacts;
+
+        int m_signalfd;
+        bool m_running;
+
+        // Last, as its threads post to the members above
+        SessionPool m_pool;
+
+    public:
+        Daemon(Options options, std::vector<Account> const& accounts);
+        ~Daemon();
+
+        Daemon(Daemon const&) = delete;
+        Daemon& operator=(Daemon const&) = delete;
+
+        /**
+         * Serve the API and keep the accounts connected until stop() is
+         * called, or SIGINT or SIGTERM is received
+         */
+        void run();
+
+        void stop() {
+            m_running = false;
+        }
+
+    private:
+        void on_request(ApiServer::ClientHandle client, Frame& frame);
+        void on_close(ApiServer::ClientHandle client);
+        void on_packets(std::vector<SessionPool::Delivery>& batch);
+        void on_state(client_id const& account, std::exception_ptr error);
+        void on_message(AccountState& state, std::shared_ptr<Message> msg);
+        void process(AccountState& state, std::shared_ptr<Message> msg);
+        void process_deferred(AccountState& state);
+        void defer(AccountState& state, std::shared_ptr<Message> msg, std::chrono::steady_clock::time_point retry);
+        void on_tick();
+
+        void op_send(ApiServer::ClientHandle client, json const& id, json const& request);
+        void op_receive(ApiServer::ClientHandle client, json const& id, json const& request);
+        void op_ack(ApiServer::ClientHandle client, json const& id, json const& request);
+        void op_blob_upload(ApiServer::ClientHandle client, json const& id, json const& request, byte_vector& data);
+        void op_blob_download(ApiServer::ClientHandle client, json const& id, json const& request);
+        void op_status(ApiServer::ClientHandle client, json const& id);
+
+        AccountState& account_of(json const& request);
+        void with_contact(client_id const& id, ContactCallback callback);
+        void deliver(AccountState& state);
+        void update_throttle(AccountState& state);
+        void send_ack(AccountState& state, MessageKey const& key);
+
+        void save_blob(ApiServer::ClientHandle client, json const& id, std::string const& path, byte_vector data);
+        void reply(ApiServer::ClientHandle client, json const& id, Frame frame);
+        void fail(ApiServer::ClientHandle client, json const& id, std::string const& error);
+    };
+
+}
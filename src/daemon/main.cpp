@@ -0,0 +1,138 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Daemon.h"
+
+#include <encoding/hex.h>
+#include <logging/logging.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <getopt.h>
+
+namespace {
+    void usage(const char* name) {
+        std::cerr << "Usage: " << name << " [options] ACCOUNTS\n"
+                  << "\n"
+                  << "ACCOUNTS is a file with one account per line: the ID and the hex encoded\n"
+                  << "private key, separated by whitespace. Lines starting with # are ignored.\n"
+                  << "\n"
+                  << "Options:\n"
+                  << "  -s PATH    API socket path (default ceemad.sock)\n"
+                  << "  -H HOST    Server host, may be repeated to race several servers\n"
+                  << "  -p PORT    Server port\n"
+                  << "  -t COUNT   Number of I/O threads (default: one per CPU)\n"
+                  << "  -g         Connect as a gateway (without proxy) client\n"
+                  << "  -P PROFILE Socket profile: latency (default), throughput or mobile\n"
+                  << "  -F         Fast connect: precomputed keys, HELLO sent with TCP Fast Open\n"
+                  << "  -h         Show this help\n";
+    }
+
+    std::vector<ceema::Account> read_accounts(std::string const& path) {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+
+        std::vector<ceema::Account> accounts;
+        std::string line;
+        unsigned lineNo = 0;
+        while (std::getline(file, line)) {
+            lineNo++;
+            std::istringstream fields(line);
+            std::string id;
+            std::string key;
+            if (!(fields >> id) || id[0] == '#') {
+                continue;
+            }
+            if (!(fields >> key)) {
+                throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": missing private key");
+            }
+            accounts.emplace_back(ceema::client_id::fromString(id), ceema::hex_decode<ceema::private_key>(key));
+        }
+        return accounts;
+    }
+}
+
+int main(int argc, char** argv) {
+    ceema::Daemon::Options options;
+
+    bool defaultHosts = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:H:p:t:gP:Fh")) != -1) {
+        switch (opt) {
+            case 's':
+                options.socketPath = optarg;
+                break;
+            case 'H':
+                if (defaultHosts) {
+                    options.pool.hosts.clear();
+                    defaultHosts = false;
+                }
+                options.pool.hosts.emplace_back(optarg);
+                break;
+            case 'p':
+                options.pool.port = static_cast<std::uint16_t>(std::stoi(optarg));
+                break;
+            case 't':
+                options.pool.shards = static_cast<unsigned>(std::stoi(optarg));
+                break;
+            case 'g':
+                options.pool.useProxy = false;
+                break;
+            case 'P':
+                try {
+                    options.pool.connect.socket = ceema::SocketOptions::profile(optarg);
+                } catch (std::invalid_argument& e) {
+                    std::cerr << "ceemad: " << e.what() << std::endl;
+                    return 1;
+                }
+                break;
+            case 'F':
+                options.pool.fastConnect = true;
+                options.pool.connect.fastOpen = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ceema::logging::init();
+
+    try {
+        std::vector<ceema::Account> accounts = read_accounts(argv[optind]);
+        if (accounts.empty()) {
+            throw std::runtime_error("No accounts configured");
+        }
+        ceema::Daemon daemon(options, accounts);
+        daemon.run();
+    } catch (std::exception& e) {
+        std::cerr << "ceemad: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
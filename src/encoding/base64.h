@@ -51,17 +51,19 @@ namespace ceema {
         to.resize(outlen, '=');
 
         size_t i = 0, j = 0;
-        for(; i < from_len - 2; i += 3, j += 4) {
+        for(; i + 2 < from_len; i += 3, j += 4) {
             to[j] = b64_chars[from[i] >> 2 & 0x3f];
             to[j+1] = b64_chars[(from[i] << 4 | from[i+1] >> 4) & 0x3f];
             to[j+2] = b64_chars[(from[i+1] << 2 | from[i+2] >> 6) & 0x3f];
             to[j+3] = b64_chars[from[i+2] & 0x3f];
         }
         if (pad) {
+            // Bytes past the end are taken as zero
+            unsigned int last = (pad == 2) ? from[i+1] : 0;
             to[j] = b64_chars[from[i] >> 2 & 0x3f];
-            to[j+1] = b64_chars[(from[i] << 4 | from[i+1] >> 4) & 0x3f];
+            to[j+1] = b64_chars[(from[i] << 4 | last >> 4) & 0x3f];
             if (pad == 2) {
-                to[j+2] = b64_chars[(from[i+1] << 2 | from[i+2] >> 6) & 0x3f];
+                to[j+2] = b64_chars[(last << 2) & 0x3f];
             }
         }
         return to;
@@ -112,6 +112,39 @@ namespace ceema {
                                             n.data(), pk.data(), sk.data()) == 0;
             }
 
+            /**
+             * Compute the key shared by a key pair, to avoid repeating the key
+             * exchange for every message between the same parties
+             * @param pk Public key of the other party
+             * @param sk Own private key
+             * @return Precomputed key
+             */
+            inline precomputed_key precompute(public_key const& pk, private_key const& sk) {
+                precomputed_key k;
+                if (crypto_box_beforenm(k.data(), pk.data(), sk.data()) != 0) {
+                    throw crypto_error("Unable to precompute key");
+                }
+                return k;
+            }
+
+            template<typename Array>
+            bool encrypt_inplace(Array& data, nonce const& n, precomputed_key const& k) {
+                if (data.size() < crypto_box_MACBYTES) {
+                    throw crypto_error("Invalid buffer size");
+                }
+                return crypto_box_easy_afternm(data.data(), data.data(), data.size() - crypto_box_MACBYTES,
+                                               n.data(), k.data()) == 0;
+            }
+
+            template<typename Array>
+            bool decrypt_inplace(Array& data, nonce const& n, precomputed_key const& k) {
+                if (data.size() < crypto_box_MACBYTES) {
+                    throw crypto_error("Invalid buffer size");
+                }
+                return crypto_box_open_easy_afternm(data.data(), data.data(), data.size(),
+                                                    n.data(), k.data()) == 0;
+            }
+
         }
 
         namespace secretbox {
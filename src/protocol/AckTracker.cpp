@@ -0,0 +1,100 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AckTracker.h"
+
+#include <logging/logging.h>
+
+#include <vector>
+
+namespace ceema {
+
+    AckTracker::AckTracker(std::chrono::milliseconds timeout, unsigned maxAttempts) :
+            m_timeout(timeout), m_maxAttempts(maxAttempts), m_retransmits(0), m_expired(0) {}
+
+    future<std::unique_ptr<Message>> AckTracker::track(std::unique_ptr<Message> msg) {
+        Key key{msg->recipient(), msg->id()};
+        clock::time_point now = clock::now();
+
+        Inflight entry{std::move(msg), promise<std::unique_ptr<Message>>(), now, now, 1};
+        auto fut = entry.prom.get_future();
+        m_inflight[key] = std::move(entry);
+        return fut;
+    }
+
+    bool AckTracker::acknowledge(Acknowledgement const& ack) {
+        // Server ACKs carry the recipient of the acknowledged message
+        auto search = m_inflight.find(Key{ack.sender(), ack.message()});
+        if (search == m_inflight.end()) {
+            LOG_DEBUG(logging::loggerProtocol, "ACK for unknown message " << ack.message());
+            return false;
+        }
+
+        // Take the entry out first, the promise callbacks may track new messages
+        Inflight entry = std::move(search->second);
+        m_inflight.erase(search);
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - entry.firstSent);
+        m_latency.record(static_cast<std::uint64_t>(elapsed.count()));
+
+        entry.prom.set_value(std::move(entry.message));
+        return true;
+    }
+
+    std::size_t AckTracker::tick(std::function<void(Message const&)> const& resend) {
+        clock::time_point now = clock::now();
+        std::vector<Inflight> expired;
+        std::size_t resent = 0;
+
+        for (auto iter = m_inflight.begin(); iter != m_inflight.end();) {
+            Inflight& entry = iter->second;
+            if (now - entry.lastSent < m_timeout) {
+                ++iter;
+                continue;
+            }
+
+            if (entry.attempts >= m_maxAttempts) {
+                expired.push_back(std::move(entry));
+                iter = m_inflight.erase(iter);
+                continue;
+            }
+
+            resend(*entry.message);
+            entry.attempts++;
+            entry.lastSent = now;
+            resent++;
+            ++iter;
+        }
+
+        m_retransmits += resent;
+        m_expired += expired.size();
+        for (Inflight& entry: expired) {
+            LOG_WARN(logging::loggerProtocol, "No ACK for message " << entry.message->id() << " to "
+                                              << entry.message->recipient().toString());
+            entry.prom.set_exception(std::make_exception_ptr(ack_timeout_exception(entry.message->recipient())));
+        }
+        return resent;
+    }
+
+    void AckTracker::fail_all(std::exception_ptr exc) {
+        auto inflight = std::move(m_inflight);
+        m_inflight.clear();
+        for (auto& entry: inflight) {
+            entry.second.prom.set_exception(exc);
+        }
+    }
+
+}
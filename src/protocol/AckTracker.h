@@ -0,0 +1,150 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <async/future.h>
+#include <protocol/packet/Acknowledgement.h>
+#include <protocol/packet/Message.h>
+#include <types/histogram.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace ceema {
+
+    /**
+     * Raised when the server did not acknowledge a message after all retransmissions
+     */
+    class ack_timeout_exception : public std::runtime_error {
+        client_id m_recipient;
+    public:
+        explicit ack_timeout_exception(client_id const& recipient) :
+                std::runtime_error("No acknowledgement from server"), m_recipient(recipient) {
+        }
+
+        client_id const& recipient() const {
+            return m_recipient;
+        }
+    };
+
+    /**
+     * Keeps track of sent messages until the server acknowledges them.
+     *
+     * Sent messages are tracked by recipient and message ID. The future
+     * returned for a message resolves once the server ACK arrives. Overdue
+     * messages are handed back for retransmission by tick(), and fail once
+     * they ran out of attempts. The time from first send to ACK is collected
+     * in a histogram.
+     */
+    class AckTracker {
+    public:
+        using clock = std::chrono::steady_clock;
+
+    private:
+        struct Key {
+            client_id recipient;
+            message_id id;
+
+            bool operator==(Key const& other) const {
+                return recipient == other.recipient && id == other.id;
+            }
+        };
+
+        struct KeyHash {
+            std::size_t operator()(Key const& key) const {
+                // Message IDs are random, except for the first two bytes
+                std::uint64_t id;
+                std::copy(key.id.begin(), key.id.end(), reinterpret_cast<std::uint8_t*>(&id));
+                return std::hash<client_id>{}(key.recipient) ^ std::hash<std::uint64_t>{}(id);
+            }
+        };
+
+        struct Inflight {
+            std::unique_ptr<Message> message;
+            promise<std::unique_ptr<Message>> prom;
+            clock::time_point firstSent;
+            clock::time_point lastSent;
+            unsigned attempts;
+        };
+
+        std::unordered_map<Key, Inflight, KeyHash> m_inflight;
+        std::chrono::milliseconds m_timeout;
+        unsigned m_maxAttempts;
+
+        // Milliseconds from first send to server ACK
+        histogram m_latency;
+        std::uint64_t m_retransmits;
+        std::uint64_t m_expired;
+
+    public:
+        /**
+         * @param timeout Time to wait for an ACK before retransmitting
+         * @param maxAttempts Number of times a message is sent before giving up
+         */
+        explicit AckTracker(std::chrono::milliseconds timeout = std::chrono::seconds(10), unsigned maxAttempts = 3);
+
+        AckTracker(AckTracker const&) = delete;
+        AckTracker& operator=(AckTracker const&) = delete;
+
+        /**
+         * Track a message that was just sent
+         * @param msg Encrypted message, kept for retransmission
+         * @return Future holding the message once acknowledged
+         */
+        future<std::unique_ptr<Message>> track(std::unique_ptr<Message> msg);
+
+        /**
+         * Handle a server ACK
+         * @param ack ACK received from the server
+         * @return true if the ACK matched a tracked message
+         */
+        bool acknowledge(Acknowledgement const& ack);
+
+        /**
+         * Retransmit overdue messages, and fail messages that ran out of attempts
+         * with an ack_timeout_exception.
+         * @param resend Function that sends a message again
+         * @return Number of retransmitted messages
+         */
+        std::size_t tick(std::function<void(Message const&)> const& resend);
+
+        /**
+         * Fail all tracked messages, e.g. when the connection is closed
+         * @param exc Exception to fail the messages with
+         */
+        void fail_all(std::exception_ptr exc);
+
+        std::size_t size() const {
+            return m_inflight.size();
+        }
+
+        histogram const& latency() const {
+            return m_latency;
+        }
+
+        std::uint64_t retransmits() const {
+            return m_retransmits;
+        }
+
+        std::uint64_t expired() const {
+            return m_expired;
+        }
+    };
+
+}
@@ -0,0 +1,312 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Broadcaster.h"
+
+#include <async/WorkerPool.h>
+#include <logging/logging.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace ceema {
+
+    namespace {
+        // Chunks at least this large are encrypted on the worker pool
+        const std::size_t PARALLEL_ENCRYPT_MIN = 32;
+    }
+
+    struct Broadcaster::Chunk {
+        std::size_t begin;
+        std::size_t end;
+        // Contact of each recipient in the chunk, nullptr if unknown
+        std::vector<std::shared_ptr<Contact const>> contacts;
+        // Set if the bulk lookup failed
+        std::string error;
+        bool ready = false;
+    };
+
+    struct Broadcaster::Job {
+        std::vector<client_id> recipients;
+        byte_vector payload;
+        MessageFlags flags;
+        OutcomeHandler on_outcome;
+        std::function<void()> on_done;
+
+        // Start of the next chunk to prefetch
+        std::size_t fetchPos = 0;
+        // Prefetched chunks, in send order
+        std::deque<std::shared_ptr<Chunk>> chunks;
+        // Waiting for the front chunk to become ready
+        bool waiting = false;
+        // Waiting for the session write buffer to drain
+        bool blocked = false;
+        bool cancelled = false;
+        // Timer pumping the next chunk, 0 if none is scheduled
+        HttpManager::TimerId timer = 0;
+    };
+
+    Broadcaster::Broadcaster(Account const& sender, Session& session, IdentAPI& identAPI, HttpManager& manager) :
+            m_sender(sender), m_session(session), m_identAPI(identAPI), m_manager(manager),
+            m_chunkSize(IdentAPI::MAX_BULK_LOOKUP), m_rate(0) {}
+
+    Broadcaster::~Broadcaster() {
+        cancel();
+    }
+
+    void Broadcaster::set_chunk_size(std::size_t size) {
+        m_chunkSize = std::max<std::size_t>(1, std::min(size, IdentAPI::MAX_BULK_LOOKUP));
+    }
+
+    void Broadcaster::broadcast(std::vector<client_id> recipients, MessagePayload const& payload,
+                                OutcomeHandler on_outcome, std::function<void()> on_done) {
+        if (m_job) {
+            throw std::logic_error("Broadcast already in progress");
+        }
+
+        auto job = std::make_shared<Job>();
+        job->recipients = std::move(recipients);
+        job->payload = Message::encodePayload(payload);
+        job->flags = payload.default_flags();
+        job->on_outcome = std::move(on_outcome);
+        job->on_done = std::move(on_done);
+        m_job = job;
+
+        LOG_DEBUG(logging::loggerProtocol, "Broadcasting to " << job->recipients.size() << " recipients");
+
+        prefetch(job);
+        pump(job);
+    }
+
+    void Broadcaster::writable() {
+        if (m_job && m_job->blocked && !m_session.hasWriteData()) {
+            m_job->blocked = false;
+            // Copy, the job may finish while pumping
+            auto job = m_job;
+            pump(job);
+        }
+    }
+
+    void Broadcaster::cancel() {
+        if (m_job) {
+            m_job->cancelled = true;
+            m_manager.cancelTimer(m_job->timer);
+            m_job.reset();
+        }
+    }
+
+    void Broadcaster::prefetch(std::shared_ptr<Job> const& job) {
+        // Keep one chunk in flight besides the one being sent
+        if (job->fetchPos >= job->recipients.size() || job->chunks.size() >= 2) {
+            return;
+        }
+
+        auto chunk = std::make_shared<Chunk>();
+        chunk->begin = job->fetchPos;
+        chunk->end = std::min(job->recipients.size(), chunk->begin + m_chunkSize);
+        chunk->contacts.resize(chunk->end - chunk->begin);
+        job->fetchPos = chunk->end;
+        job->chunks.push_back(chunk);
+
+        std::vector<client_id> unknown;
+        for (std::size_t i = chunk->begin; i < chunk->end; i++) {
+            auto contact = m_lookup ? m_lookup(job->recipients[i]) : nullptr;
+            if (contact) {
+                chunk->contacts[i - chunk->begin] = std::move(contact);
+            } else {
+                unknown.push_back(job->recipients[i]);
+            }
+        }
+        if (unknown.empty()) {
+            chunk->ready = true;
+            return;
+        }
+
+        m_identAPI.getClientInfo(unknown).next([this, job, chunk](future<std::vector<Contact>> fut) {
+            if (job->cancelled) {
+                return;
+            }
+            try {
+                std::vector<Contact> contacts = fut.get();
+                std::unordered_map<client_id, std::shared_ptr<Contact const>> found;
+                for (Contact const& contact: contacts) {
+                    found.emplace(contact.id(), std::make_shared<Contact const>(contact));
+                    if (m_found) {
+                        m_found(contact);
+                    }
+                }
+                for (std::size_t i = chunk->begin; i < chunk->end; i++) {
+                    auto& slot = chunk->contacts[i - chunk->begin];
+                    if (!slot) {
+                        auto search = found.find(job->recipients[i]);
+                        if (search != found.end()) {
+                            slot = search->second;
+                        }
+                    }
+                }
+            } catch (std::exception& e) {
+                chunk->error = e.what();
+            }
+            chunk->ready = true;
+
+            if (job->waiting) {
+                job->waiting = false;
+                pump(job);
+            }
+        });
+    }
+
+    void Broadcaster::pump(std::shared_ptr<Job> const& job) {
+        if (job->cancelled) {
+            return;
+        }
+        if (job->chunks.empty()) {
+            finish(job);
+            return;
+        }
+
+        // Do not pile up chunks the socket cannot take
+        if (m_session.hasWriteData()) {
+            job->blocked = true;
+            return;
+        }
+
+        auto chunk = job->chunks.front();
+        if (!chunk->ready) {
+            job->waiting = true;
+            return;
+        }
+        job->chunks.pop_front();
+
+        // Fetch the next chunk while this one is sent
+        prefetch(job);
+        send_chunk(*job, *chunk);
+        if (job->cancelled) {
+            return;
+        }
+
+        // Yield to the event loop between chunks, also when not rate limited
+        long delay = 0;
+        if (m_rate > 0) {
+            delay = static_cast<long>((chunk->end - chunk->begin) * 1000.0 / m_rate);
+        }
+        job->timer = m_manager.scheduleTimer(delay, [this, job]() {
+            job->timer = 0;
+            pump(job);
+        });
+    }
+
+    void Broadcaster::send_chunk(Job& job, Chunk& chunk) {
+        std::vector<std::unique_ptr<Message>> messages;
+        std::vector<precomputed_key> keys;
+        for (std::size_t i = chunk.begin; i < chunk.end; i++) {
+            client_id const& recipient = job.recipients[i];
+            auto const& contact = chunk.contacts[i - chunk.begin];
+            if (!contact) {
+                if (chunk.error.empty()) {
+                    job.on_outcome(recipient, Outcome::UNKNOWN_RECIPIENT, message_id{}, "Unknown identity");
+                } else {
+                    job.on_outcome(recipient, Outcome::FAILED, message_id{}, chunk.error);
+                }
+                continue;
+            }
+
+            auto msg = std::make_unique<Message>(m_sender.id(), recipient, job.flags);
+            if (m_sender.nick().size()) {
+                msg->nick() = m_sender.nick();
+            }
+            messages.push_back(std::move(msg));
+            keys.push_back(m_keys.get(m_sender, *contact));
+        }
+
+        std::vector<std::string> errors(messages.size());
+        auto encrypt = [&](std::size_t i) {
+            try {
+                messages[i]->encrypt(job.payload, keys[i]);
+            } catch (std::exception& e) {
+                errors[i] = e.what();
+                if (errors[i].empty()) {
+                    errors[i] = "Encryption failed";
+                }
+            }
+        };
+        if (messages.size() >= PARALLEL_ENCRYPT_MIN) {
+            WorkerPool::shared().parallel_for(messages.size(), encrypt);
+        } else {
+            for (std::size_t i = 0; i < messages.size(); i++) {
+                encrypt(i);
+            }
+        }
+        for (auto& key: keys) {
+            sodium_memzero(key.data(), key.size());
+        }
+
+        std::string sendError;
+        if (!m_session.is_connected()) {
+            sendError = "Not connected";
+        } else {
+            try {
+                for (std::size_t i = 0; i < messages.size(); i++) {
+                    if (errors[i].empty()) {
+                        m_session.queue_packet(*messages[i]);
+                    }
+                }
+                if (m_flush) {
+                    m_flush();
+                } else {
+                    m_session.flush();
+                }
+            } catch (std::exception& e) {
+                sendError = e.what();
+            }
+        }
+
+        for (std::size_t i = 0; i < messages.size(); i++) {
+            Message const& msg = *messages[i];
+            if (!errors[i].empty()) {
+                job.on_outcome(msg.recipient(), Outcome::FAILED, msg.id(), errors[i]);
+            } else if (!sendError.empty()) {
+                job.on_outcome(msg.recipient(), Outcome::FAILED, msg.id(), sendError);
+            } else {
+                job.on_outcome(msg.recipient(), Outcome::SENT, msg.id(), std::string());
+            }
+        }
+
+        if (!sendError.empty()) {
+            // The session is gone, the remaining recipients would fail as well
+            LOG_WARN(logging::loggerProtocol, "Broadcast aborted: " << sendError);
+            job.cancelled = true;
+            if (m_job.get() == &job) {
+                auto done = std::move(job.on_done);
+                m_job.reset();
+                if (done) {
+                    done();
+                }
+            }
+        }
+    }
+
+    void Broadcaster::finish(std::shared_ptr<Job> const& job) {
+        LOG_DEBUG(logging::loggerProtocol, "Broadcast complete");
+        if (m_job == job) {
+            m_job.reset();
+        }
+        if (job->on_done) {
+            job->on_done();
+        }
+    }
+
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "session.h"
+
+#include <api/IdentAPI.h>
+#include <contact/KeyCache.h>
+#include <protocol/packet/Message.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Sends one payload to many individual recipients.
+     *
+     * Recipients are handled in chunks. Keys of recipients missing from the
+     * contact lookup are fetched with one bulk request per chunk, one chunk
+     * ahead of the chunk being sent. Each chunk is encrypted (in parallel for
+     * large chunks), framed into the session and written with a single flush.
+     * The next chunk is only framed once the session write buffer drained,
+     * see writable(). The outcome of every recipient is reported through a
+     * callback as soon as it is known.
+     */
+    class Broadcaster {
+    public:
+        enum class Outcome {
+            // Message was written to the session
+            SENT,
+            // The server does not know the recipient
+            UNKNOWN_RECIPIENT,
+            // Key lookup, encryption or sending failed
+            FAILED,
+        };
+
+        /** Returns the contact with the given ID if its key is known, nullptr otherwise */
+        using ContactLookup = std::function<std::shared_ptr<Contact const>(client_id const&)>;
+        /** Called for every contact fetched from the server */
+        using ContactFound = std::function<void(Contact const&)>;
+        /** Called once per recipient; id is the ID of the sent message, error is set for failures */
+        using OutcomeHandler = std::function<void(client_id const& recipient, Outcome outcome,
+                                                  message_id const& id, std::string const& error)>;
+
+    private:
+        struct Chunk;
+        struct Job;
+
+        Account const& m_sender;
+        Session& m_session;
+        IdentAPI& m_identAPI;
+        HttpManager& m_manager;
+
+        ContactLookup m_lookup;
+        ContactFound m_found;
+        std::function<void()> m_flush;
+        std::size_t m_chunkSize;
+        double m_rate;
+
+        KeyCache m_keys;
+        std::shared_ptr<Job> m_job;
+
+    public:
+        Broadcaster(Account const& sender, Session& session, IdentAPI& identAPI, HttpManager& manager);
+        ~Broadcaster();
+
+        Broadcaster(Broadcaster const&) = delete;
+        Broadcaster& operator=(Broadcaster const&) = delete;
+
+        void set_contact_lookup(ContactLookup lookup) {
+            m_lookup = std::move(lookup);
+        }
+
+        void set_contact_found(ContactFound found) {
+            m_found = std::move(found);
+        }
+
+        /**
+         * Set the function writing the session to the socket after each chunk,
+         * Session::flush by default. The owner can use it to watch the socket
+         * for writability if data is left in the session.
+         */
+        void set_flush(std::function<void()> flush) {
+            m_flush = std::move(flush);
+        }
+
+        /**
+         * Set the number of recipients handled at once, at most IdentAPI::MAX_BULK_LOOKUP
+         */
+        void set_chunk_size(std::size_t size);
+
+        /**
+         * Limit the send rate. Messages are sent in bursts of at most one chunk.
+         * @param per_second Messages per second, 0 for no limit
+         */
+        void set_rate(double per_second) {
+            m_rate = per_second;
+        }
+
+        /**
+         * Start sending a payload to the given recipients. Only one broadcast
+         * can run at a time. If writing to the session fails, the broadcast
+         * stops and the remaining recipients get no outcome.
+         * @param recipients IDs of the recipients
+         * @param payload Payload to send
+         * @param on_outcome Called for every recipient
+         * @param on_done Called once all recipients were handled
+         */
+        void broadcast(std::vector<client_id> recipients, MessagePayload const& payload,
+                       OutcomeHandler on_outcome, std::function<void()> on_done = {});
+
+        /**
+         * @return true if a broadcast is in progress
+         */
+        bool busy() const {
+            return m_job != nullptr;
+        }
+
+        /**
+         * Continue a broadcast waiting for the session write buffer to drain.
+         * Call whenever the socket became writable.
+         */
+        void writable();
+
+        /**
+         * Stop the running broadcast. Recipients not yet handled get no outcome.
+         */
+        void cancel();
+
+    private:
+        void prefetch(std::shared_ptr<Job> const& job);
+        void pump(std::shared_ptr<Job> const& job);
+        void send_chunk(Job& job, Chunk& chunk);
+        void finish(std::shared_ptr<Job> const& job);
+    };
+
+}
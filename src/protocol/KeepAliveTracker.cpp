@@ -0,0 +1,134 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeepAliveTracker.h"
+
+#include <logging/logging.h>
+
+#include <algorithm>
+
+namespace ceema {
+
+    KeepAliveTracker::KeepAliveTracker() : KeepAliveTracker(Options()) {}
+
+    KeepAliveTracker::KeepAliveTracker(Options const& options) : m_options(options),
+            m_interval(options.interval), m_good(options.interval), m_ceiling(0), m_confirmed(0),
+            m_srtt(0), m_rttVar(0), m_idle(0), m_probes(0), m_sent(0), m_lost(0) {}
+
+    void KeepAliveTracker::reset(clock::time_point now) {
+        m_lastSent = now;
+        m_lastReceived = now;
+        m_probes = 0;
+        m_probePayload.clear();
+    }
+
+    KeepAliveTracker::Action KeepAliveTracker::poll(clock::time_point now) {
+        if (!m_probes) {
+            return now >= m_lastReceived + m_interval ? Action::SEND : Action::NONE;
+        }
+        if (now < m_probeTime + timeout()) {
+            return Action::NONE;
+        }
+        if (m_probes < m_options.probes) {
+            return Action::SEND;
+        }
+
+        m_lost++;
+        m_probes = 0;
+        if (m_options.adaptive && m_interval > m_good && m_idle > m_good) {
+            // Died after being idle longer than known to work, most likely dropped while idle
+            LOG_INFO(logging::loggerSession, "Keep-alive interval of " << m_interval.count()
+                    << "ms failed, going back to " << m_good.count() << "ms");
+            m_ceiling = m_interval;
+            m_interval = m_good;
+            m_confirmed = 0;
+        }
+        return Action::DEAD;
+    }
+
+    KeepAliveTracker::clock::time_point KeepAliveTracker::deadline() const {
+        if (m_probes) {
+            return m_probeTime + timeout();
+        }
+        return m_lastReceived + m_interval;
+    }
+
+    void KeepAliveTracker::probe_sent(byte_vector const& payload, clock::time_point now) {
+        if (!m_probes) {
+            m_idle = std::chrono::duration_cast<std::chrono::milliseconds>(now - std::max(m_lastSent, m_lastReceived));
+        }
+        m_probes++;
+        m_probeTime = now;
+        m_probePayload = payload;
+        m_sent++;
+    }
+
+    void KeepAliveTracker::acknowledged(byte_vector const& payload, clock::time_point now) {
+        if (!m_probes || payload != m_probePayload) {
+            return;
+        }
+
+        auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - m_probeTime);
+        if (m_srtt == std::chrono::microseconds::zero()) {
+            m_srtt = sample;
+            m_rttVar = sample / 2;
+        } else {
+            auto delta = m_srtt > sample ? m_srtt - sample : sample - m_srtt;
+            m_rttVar = (3 * m_rttVar + delta) / 4;
+            m_srtt = (7 * m_srtt + sample) / 8;
+        }
+
+        m_probes = 0;
+        // Only a connection that survived being idle for the interval confirms it.
+        // Allow for traffic right after the last receive, like ACKs of messages.
+        if (!m_options.adaptive || m_idle < m_interval * 9 / 10) {
+            return;
+        }
+        if (++m_confirmed < m_options.confirm) {
+            return;
+        }
+        m_confirmed = 0;
+        m_good = m_interval;
+
+        std::chrono::milliseconds next = std::min<std::chrono::milliseconds>(m_interval * 3 / 2, m_options.maxInterval);
+        if (m_ceiling.count()) {
+            // Stay clear of the interval that failed
+            next = std::min(next, m_ceiling * 9 / 10);
+        }
+        if (next > m_interval) {
+            LOG_DEBUG(logging::loggerSession, "Probing keep-alive interval of " << next.count() << "ms");
+            m_interval = next;
+        }
+    }
+
+    void KeepAliveTracker::sent(clock::time_point now) {
+        m_lastSent = now;
+    }
+
+    void KeepAliveTracker::received(clock::time_point now) {
+        m_lastReceived = now;
+        m_probes = 0;
+    }
+
+    std::chrono::milliseconds KeepAliveTracker::timeout() const {
+        if (m_srtt == std::chrono::microseconds::zero()) {
+            return m_options.maxTimeout / 2;
+        }
+        auto rto = std::chrono::duration_cast<std::chrono::milliseconds>(m_srtt + 4 * m_rttVar);
+        return std::max(m_options.minTimeout, std::min(rto, m_options.maxTimeout));
+    }
+
+}
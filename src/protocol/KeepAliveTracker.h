@@ -0,0 +1,172 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <types/bytes.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace ceema {
+
+    /**
+     * Decides when a session sends keep-alives, and when it is dead.
+     *
+     * A keep-alive is sent once nothing was received for the keep-alive
+     * interval, also while data is being sent, so a server that silently went
+     * away is noticed. If its ACK does not arrive within a timeout derived
+     * from the measured round trip time, it is sent again, and the connection
+     * is considered dead after the last probe went unanswered.
+     *
+     * With adaptive intervals, the interval grows after a number of
+     * keep-alives were answered at the current one, counting only those sent
+     * after the connection was idle in both directions. A connection dying
+     * after being idle longer than the last interval that worked hints at a
+     * NAT (or firewall) dropping idle connections: the interval goes back to
+     * that one, and is not probed beyond the failed one again. The learned
+     * interval and round trip time are kept over reset(), so an owner keeping
+     * the tracker keeps them over reconnects.
+     *
+     * Holds no timers: the owner calls poll() at deadline(), and reports traffic.
+     */
+    class KeepAliveTracker {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        struct Options {
+            // Idle time before the first keep-alive
+            std::chrono::seconds interval{60};
+            // Longest interval probed with adaptive intervals
+            std::chrono::seconds maxInterval{600};
+            // Grow the interval while keep-alives are answered
+            bool adaptive = true;
+            // Keep-alives answered at an interval before probing a longer one
+            unsigned confirm = 3;
+            // Keep-alives sent before the connection is considered dead
+            unsigned probes = 2;
+            // Bounds of the time to wait for a keep-alive ACK
+            std::chrono::milliseconds minTimeout{2000};
+            std::chrono::milliseconds maxTimeout{20000};
+        };
+
+        enum class Action {
+            NONE,
+            // Send a keep-alive, and report it with probe_sent()
+            SEND,
+            // The keep-alives went unanswered, close the connection
+            DEAD,
+        };
+
+    private:
+        Options m_options;
+
+        // Learned over connections
+        std::chrono::milliseconds m_interval;
+        // Longest interval known to work, and shortest known to fail (0 if none)
+        std::chrono::milliseconds m_good;
+        std::chrono::milliseconds m_ceiling;
+        unsigned m_confirmed;
+        // Smoothed round trip time and its variation, as for TCP (RFC 6298)
+        std::chrono::microseconds m_srtt;
+        std::chrono::microseconds m_rttVar;
+
+        // State of the current connection
+        clock::time_point m_lastSent;
+        clock::time_point m_lastReceived;
+        clock::time_point m_probeTime;
+        // Time the connection was idle in both directions before the first probe
+        std::chrono::milliseconds m_idle;
+        byte_vector m_probePayload;
+        unsigned m_probes;
+
+        std::uint64_t m_sent;
+        std::uint64_t m_lost;
+
+    public:
+        KeepAliveTracker();
+        explicit KeepAliveTracker(Options const& options);
+
+        /**
+         * Start tracking a new connection
+         */
+        void reset(clock::time_point now = clock::now());
+
+        /**
+         * @return What to do at the given time
+         */
+        Action poll(clock::time_point now = clock::now());
+
+        /**
+         * @return Time of the next action, the time to call poll() at
+         */
+        clock::time_point deadline() const;
+
+        /**
+         * A keep-alive is sent. Call before reporting it with sent().
+         * @param payload Payload of the keep-alive, echoed by the ACK
+         */
+        void probe_sent(byte_vector const& payload, clock::time_point now = clock::now());
+
+        /**
+         * A keep-alive ACK was received. Call before received().
+         */
+        void acknowledged(byte_vector const& payload, clock::time_point now = clock::now());
+
+        /**
+         * Data was sent. Keeps a NAT from dropping the connection, but does
+         * not prove the server is alive.
+         */
+        void sent(clock::time_point now = clock::now());
+
+        /**
+         * Data was received, proving the connection is alive
+         */
+        void received(clock::time_point now = clock::now());
+
+        /**
+         * @return Time to wait for a keep-alive ACK
+         */
+        std::chrono::milliseconds timeout() const;
+
+        std::chrono::milliseconds interval() const {
+            return m_interval;
+        }
+
+        /**
+         * @return Smoothed round trip time, 0 before the first ACK
+         */
+        std::chrono::microseconds rtt() const {
+            return m_srtt;
+        }
+
+        std::chrono::microseconds rtt_var() const {
+            return m_rttVar;
+        }
+
+        std::uint64_t sent_count() const {
+            return m_sent;
+        }
+
+        /**
+         * @return Connections declared dead for lack of keep-alive ACKs
+         */
+        std::uint64_t lost_count() const {
+            return m_lost;
+        }
+    };
+
+}
@@ -0,0 +1,291 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "NonceStore.h"
+
+#include <protocol/protocol.h>
+#include <logging/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace ceema {
+
+    namespace {
+        const std::uint8_t STORE_MAGIC[4] = {'C', 'N', 'S', '1'};
+        // Magic, reserved, number of sorted records
+        const std::size_t HEADER_SIZE = 4 + 4 + 8;
+        // Nonce, time first seen
+        const std::size_t RECORD_SIZE = nonce::array_size + 8;
+
+        // Start compaction once the journal grows beyond this many records
+        const std::size_t MIN_JOURNAL_COMPACT = 4096;
+        // Smallest filter, so a new store does not need rebuilding right away
+        const std::size_t MIN_FILTER_CAPACITY = 1 << 16;
+        // Appended records written to the file at once, unless flushed earlier
+        const std::size_t JOURNAL_FLUSH_BATCH = 64;
+        // Time in seconds before a failed compaction is tried again
+        const std::int64_t COMPACT_RETRY_DELAY = 60;
+
+        void write_record(NonceStore::Record const& record, std::uint8_t* buffer) {
+            buffer = std::copy(record.n.begin(), record.n.end(), buffer);
+            htole(record.seen, buffer);
+        }
+
+        NonceStore::Record read_record(std::uint8_t const* buffer) {
+            NonceStore::Record record;
+            std::copy(buffer, buffer + nonce::array_size, record.n.begin());
+            letoh(record.seen, buffer + nonce::array_size);
+            return record;
+        }
+
+        void write_header(std::ostream& os, std::uint64_t count) {
+            std::uint8_t header[HEADER_SIZE] = {};
+            std::copy(std::begin(STORE_MAGIC), std::end(STORE_MAGIC), header);
+            htole(count, header + 8);
+            os.write(reinterpret_cast<const char*>(header), HEADER_SIZE);
+        }
+
+        bool nonce_less(NonceStore::Record const& a, NonceStore::Record const& b) {
+            return std::memcmp(a.n.data(), b.n.data(), nonce::array_size) < 0;
+        }
+    }
+
+    constexpr std::int64_t NonceStore::DEFAULT_RETENTION;
+
+    NonceStore::NonceStore(std::string path, std::int64_t retention) :
+            m_path(std::move(path)), m_retention(retention), m_sorted(0), m_unflushed(0),
+            m_filterComplete(true), m_compactRetry(0) {
+        randombytes_buf(m_hashKey.data(), m_hashKey.size());
+        open();
+    }
+
+    bool NonceStore::contains(nonce const& n) const {
+        std::uint64_t h = hash(n);
+        if (m_filterComplete && !m_filter.contains(h)) {
+            return false;
+        }
+
+        auto range = m_journal.equal_range(h);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second.n == n) {
+                return true;
+            }
+        }
+
+        // Binary search the sorted block in place
+        std::uint8_t const* base = sorted_begin();
+        std::size_t low = 0;
+        std::size_t high = m_sorted;
+        while (low < high) {
+            std::size_t mid = low + (high - low) / 2;
+            int cmp = std::memcmp(base + mid * RECORD_SIZE, n.data(), nonce::array_size);
+            if (cmp == 0) {
+                return true;
+            } else if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return false;
+    }
+
+    bool NonceStore::insert(nonce const& n, std::int64_t now) {
+        if (contains(n)) {
+            return false;
+        }
+
+        Record record{n, now};
+        std::uint8_t buffer[RECORD_SIZE];
+        write_record(record, buffer);
+        m_journalFile.write(reinterpret_cast<const char*>(buffer), RECORD_SIZE);
+        if (++m_unflushed >= JOURNAL_FLUSH_BATCH) {
+            flush();
+        }
+
+        std::uint64_t h = hash(n);
+        m_journal.emplace(h, record);
+        if (!m_filter.insert(h)) {
+            m_filterComplete = false;
+        }
+        if ((!m_filterComplete || m_journal.size() > std::max(MIN_JOURNAL_COMPACT, m_sorted / 4))
+                && now >= m_compactRetry) {
+            // Compaction also rebuilds the filter, sized for the new number of records
+            compact(now);
+        }
+        return true;
+    }
+
+    void NonceStore::flush() {
+        m_unflushed = 0;
+        if (!m_journalFile.is_open()) {
+            return;
+        }
+        m_journalFile.flush();
+        if (!m_journalFile) {
+            LOG_WARN(logging::loggerRoot, "Unable to write nonce store " << m_path);
+            m_journalFile.clear();
+        }
+    }
+
+    void NonceStore::compact(std::int64_t now) {
+        std::int64_t cutoff = now - m_retention;
+
+        std::vector<Record> journal;
+        journal.reserve(m_journal.size());
+        for (auto const& entry: m_journal) {
+            journal.push_back(entry.second);
+        }
+        std::sort(journal.begin(), journal.end(), nonce_less);
+
+        std::string tmpPath = m_path + ".tmp";
+        flush();
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            LOG_WARN(logging::loggerRoot, "Unable to compact nonce store " << m_path);
+            compact_failed(now);
+            return;
+        }
+
+        // Header is rewritten once the number of merged records is known
+        write_header(out, 0);
+
+        std::uint8_t const* base = sorted_begin();
+        std::uint64_t count = 0;
+        std::size_t i = 0;
+        auto jiter = journal.begin();
+        std::uint8_t buffer[RECORD_SIZE];
+        while (i < m_sorted || jiter != journal.end()) {
+            Record record;
+            if (jiter == journal.end() ||
+                    (i < m_sorted && std::memcmp(base + i * RECORD_SIZE, jiter->n.data(), nonce::array_size) < 0)) {
+                record = read_record(base + i * RECORD_SIZE);
+                i++;
+            } else {
+                record = *jiter++;
+            }
+            if (record.seen < cutoff) {
+                continue;
+            }
+            write_record(record, buffer);
+            out.write(reinterpret_cast<const char*>(buffer), RECORD_SIZE);
+            count++;
+        }
+
+        out.seekp(0);
+        write_header(out, count);
+        out.close();
+        if (!out) {
+            LOG_WARN(logging::loggerRoot, "Unable to compact nonce store " << m_path);
+            std::remove(tmpPath.c_str());
+            compact_failed(now);
+            return;
+        }
+
+        m_journalFile.close();
+        m_file = mapped_file();
+#ifdef _WIN32
+        std::remove(m_path.c_str());
+#endif
+        if (std::rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+            LOG_WARN(logging::loggerRoot, "Unable to replace nonce store " << m_path);
+            std::remove(tmpPath.c_str());
+            // Keep going with the old file and the in-memory journal
+            m_file = mapped_file(m_path);
+            compact_failed(now);
+            return;
+        }
+        m_compactRetry = 0;
+        open();
+    }
+
+    void NonceStore::compact_failed(std::int64_t now) {
+        m_compactRetry = now + COMPACT_RETRY_DELAY;
+        // open() closes the journal before compacting a damaged file
+        if (!m_journalFile.is_open()) {
+            m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+        }
+    }
+
+    void NonceStore::open() {
+        m_journalFile.close();
+        m_journal.clear();
+        m_sorted = 0;
+        m_filterComplete = true;
+        m_file = mapped_file(m_path);
+
+        std::uint8_t const* data = m_file.data();
+        if (m_file.size() < HEADER_SIZE || !std::equal(std::begin(STORE_MAGIC), std::end(STORE_MAGIC), data)) {
+            if (m_file.size()) {
+                LOG_WARN(logging::loggerRoot, "Discarding invalid nonce store " << m_path);
+            }
+            m_file = mapped_file();
+            m_filter = cuckoo_filter(MIN_FILTER_CAPACITY);
+            std::ofstream out(m_path, std::ios::binary | std::ios::trunc);
+            write_header(out, 0);
+            out.close();
+
+            m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+            return;
+        }
+
+        std::uint64_t count = letoh<std::uint64_t>(data + 8);
+        std::size_t records = (m_file.size() - HEADER_SIZE) / RECORD_SIZE;
+        m_sorted = static_cast<std::size_t>(std::min<std::uint64_t>(count, records));
+
+        // Leave room to grow until the next compaction
+        m_filter = cuckoo_filter(std::max(MIN_FILTER_CAPACITY, records * 2));
+        std::uint8_t const* base = sorted_begin();
+        for (std::size_t i = 0; i < m_sorted; i++) {
+            nonce n;
+            std::copy(base + i * RECORD_SIZE, base + i * RECORD_SIZE + nonce::array_size, n.begin());
+            if (!m_filter.insert(hash(n))) {
+                m_filterComplete = false;
+            }
+        }
+        for (std::size_t i = m_sorted; i < records; i++) {
+            Record record = read_record(base + i * RECORD_SIZE);
+            std::uint64_t h = hash(record.n);
+            m_journal.emplace(h, record);
+            if (!m_filter.insert(h)) {
+                m_filterComplete = false;
+            }
+        }
+
+        if (HEADER_SIZE + records * RECORD_SIZE != m_file.size()) {
+            // Partially written record, rewrite the file so appends stay aligned
+            compact();
+            return;
+        }
+
+        m_journalFile.open(m_path, std::ios::binary | std::ios::app);
+    }
+
+    std::uint64_t NonceStore::hash(nonce const& n) const {
+        std::uint8_t out[crypto_shorthash_BYTES];
+        crypto_shorthash(out, n.data(), n.size(), m_hashKey.data());
+        return letoh<std::uint64_t>(out);
+    }
+
+    std::uint8_t const* NonceStore::sorted_begin() const {
+        return m_file.data() + HEADER_SIZE;
+    }
+
+}
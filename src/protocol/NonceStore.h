@@ -0,0 +1,138 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <protocol/data/Crypto.h>
+#include <types/cuckoo_filter.h>
+#include <types/mapped_file.h>
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+
+namespace ceema {
+
+    /**
+     * Persistent set of nonces of received messages, to detect messages that
+     * are delivered more than once.
+     *
+     * The file has the same layout as the KeyStore: a block of records sorted
+     * by nonce, which is memory mapped, followed by a journal of records
+     * appended since the last compaction. A cuckoo filter over all nonces
+     * answers most lookups of new nonces without touching the file. Nonces are
+     * forgotten after the retention period, at the next compaction.
+     */
+    class NonceStore {
+    public:
+        // Default time nonces are kept, in seconds
+        static constexpr std::int64_t DEFAULT_RETENTION = 180 * 24 * 3600;
+
+        struct Record {
+            nonce n;
+            // Unix time the nonce was first seen
+            std::int64_t seen;
+        };
+
+    private:
+        std::string m_path;
+        std::int64_t m_retention;
+        // Key of the hash fed to the filter, so senders cannot pick colliding nonces
+        std::array<std::uint8_t, crypto_shorthash_KEYBYTES> m_hashKey;
+
+        mapped_file m_file;
+        // Number of records in the sorted block
+        std::size_t m_sorted;
+        // Journal records by hash of their nonce
+        std::unordered_multimap<std::uint64_t, Record> m_journal;
+        std::ofstream m_journalFile;
+        // Records appended since the last flush
+        std::size_t m_unflushed;
+        cuckoo_filter m_filter;
+        // False once a nonce did not fit the filter, lookups cannot rely on it then
+        bool m_filterComplete;
+        // Unix time before which a failed compaction is not retried
+        std::int64_t m_compactRetry;
+
+    public:
+        /**
+         * Open (or create) a nonce store
+         * @param path Path of the store file
+         * @param retention Time in seconds nonces are remembered
+         */
+        explicit NonceStore(std::string path, std::int64_t retention = DEFAULT_RETENTION);
+
+        NonceStore(NonceStore const&) = delete;
+        NonceStore& operator=(NonceStore const&) = delete;
+
+        /**
+         * @return True if the nonce was seen before
+         */
+        bool contains(nonce const& n) const;
+
+        /**
+         * Record a nonce. The record is appended to the file, which is written
+         * by flush() or once enough records were appended.
+         * @param n Nonce of a received message
+         * @param now Current Unix time
+         * @return False if the nonce was seen before
+         */
+        bool insert(nonce const& n, std::int64_t now = std::time(nullptr));
+
+        /**
+         * Write the appended records to the file. Call after a batch of inserts.
+         */
+        void flush();
+
+        /**
+         * Merge the journal into the sorted block, dropping expired nonces
+         * @param now Current Unix time
+         */
+        void compact(std::int64_t now = std::time(nullptr));
+
+        /**
+         * @return Number of nonces in the store
+         */
+        std::size_t size() const {
+            return m_sorted + m_journal.size();
+        }
+
+        /**
+         * @return Number of records appended since the last compaction
+         */
+        std::size_t journal_size() const {
+            return m_journal.size();
+        }
+
+        /**
+         * @return Memory used by the filter, in bytes
+         */
+        std::size_t filter_memory() const {
+            return m_filter.memory();
+        }
+
+    private:
+        void open();
+        void compact_failed(std::int64_t now);
+        std::uint64_t hash(nonce const& n) const;
+        std::uint8_t const* sorted_begin() const;
+    };
+
+}
@@ -0,0 +1,128 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ReceiveFilter.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace ceema {
+
+    namespace {
+        // Contacts may send in bursts, e.g. when coming online
+        const ReceiveFilter::Limit KNOWN_LIMIT{20.0, 200.0};
+        // Unknown senders each cost a key lookup
+        const ReceiveFilter::Limit UNKNOWN_LIMIT{0.2, 5.0};
+
+        bool id_less(client_id const& a, client_id const& b) {
+            return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+        }
+    }
+
+    constexpr std::size_t ReceiveFilter::MAX_BUCKETS;
+
+    ReceiveFilter::ReceiveFilter() : m_known(KNOWN_LIMIT), m_unknown(UNKNOWN_LIMIT),
+                                     m_blockedCount(0), m_limitedCount(0) {
+    }
+
+    void ReceiveFilter::set_blocklist(std::vector<client_id> blocked) {
+        std::sort(blocked.begin(), blocked.end(), id_less);
+        blocked.erase(std::unique(blocked.begin(), blocked.end()), blocked.end());
+        m_blocked = std::move(blocked);
+    }
+
+    void ReceiveFilter::block(client_id const& id) {
+        auto iter = std::lower_bound(m_blocked.begin(), m_blocked.end(), id, id_less);
+        if (iter == m_blocked.end() || *iter != id) {
+            m_blocked.insert(iter, id);
+        }
+    }
+
+    void ReceiveFilter::unblock(client_id const& id) {
+        auto iter = std::lower_bound(m_blocked.begin(), m_blocked.end(), id, id_less);
+        if (iter != m_blocked.end() && *iter == id) {
+            m_blocked.erase(iter);
+        }
+    }
+
+    bool ReceiveFilter::is_blocked(client_id const& id) const {
+        return std::binary_search(m_blocked.begin(), m_blocked.end(), id, id_less);
+    }
+
+    ReceiveFilter::Verdict ReceiveFilter::check(client_id const& sender, bool known, clock::time_point now) {
+        if (is_blocked(sender)) {
+            m_blockedCount++;
+            return Verdict::BLOCKED;
+        }
+
+        Limit const& limit = known ? m_known : m_unknown;
+        if (limit.rate <= 0) {
+            return Verdict::ACCEPT;
+        }
+
+        auto iter = m_buckets.find(sender);
+        if (iter == m_buckets.end()) {
+            if (m_buckets.size() >= MAX_BUCKETS) {
+                expire_buckets(now);
+            }
+            if (m_buckets.size() >= MAX_BUCKETS && !known) {
+                // Flood from many different IDs, do not let it grow the table
+                m_limitedCount++;
+                return Verdict::RATE_LIMITED;
+            }
+            iter = m_buckets.emplace(sender, Bucket{limit.burst, now, known}).first;
+        }
+
+        Bucket& bucket = iter->second;
+        bucket.known = known;
+        std::chrono::duration<double> elapsed = now - bucket.last;
+        bucket.tokens = std::min(limit.burst, bucket.tokens + elapsed.count() * limit.rate);
+        bucket.last = now;
+        if (bucket.tokens < 1.0) {
+            m_limitedCount++;
+            return Verdict::RATE_LIMITED;
+        }
+        bucket.tokens -= 1.0;
+        return Verdict::ACCEPT;
+    }
+
+    void ReceiveFilter::expire_buckets(clock::time_point now) {
+        // A bucket that has refilled behaves the same as a new one
+        for (auto iter = m_buckets.begin(); iter != m_buckets.end(); ) {
+            Limit const& limit = iter->second.known ? m_known : m_unknown;
+            std::chrono::duration<double> elapsed = now - iter->second.last;
+            if (limit.rate <= 0 || iter->second.tokens + elapsed.count() * limit.rate >= limit.burst) {
+                iter = m_buckets.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+
+    std::ostream& operator<<(std::ostream& os, ReceiveFilter::Verdict verdict) {
+        switch (verdict) {
+            case ReceiveFilter::Verdict::ACCEPT:
+                return os << "accept";
+            case ReceiveFilter::Verdict::BLOCKED:
+                return os << "blocked";
+            case ReceiveFilter::Verdict::RATE_LIMITED:
+                return os << "rate limited";
+        }
+        return os << "unknown";
+    }
+
+}
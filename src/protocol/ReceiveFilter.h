@@ -0,0 +1,122 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <protocol/data/Client.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Decides whether an incoming message is processed at all, based only on
+     * the sender ID in the (unencrypted) message header. Runs before the key
+     * of the sender is looked up or the message is decrypted.
+     *
+     * Blocked senders are kept in a sorted array. Every sender gets a token
+     * bucket; senders without a known key get a far smaller one.
+     */
+    class ReceiveFilter {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        enum class Verdict {
+            ACCEPT,
+            BLOCKED,
+            RATE_LIMITED,
+        };
+
+        /**
+         * Token bucket parameters. A rate of 0 disables rate limiting.
+         */
+        struct Limit {
+            // Messages per second
+            double rate;
+            // Messages accepted in a burst
+            double burst;
+        };
+
+        // Maximum number of senders with a token bucket
+        static constexpr std::size_t MAX_BUCKETS = 4096;
+
+    private:
+        struct Bucket {
+            double tokens;
+            clock::time_point last;
+            bool known;
+        };
+
+        std::vector<client_id> m_blocked;
+        Limit m_known;
+        Limit m_unknown;
+        std::unordered_map<client_id, Bucket> m_buckets;
+
+        std::uint64_t m_blockedCount;
+        std::uint64_t m_limitedCount;
+
+    public:
+        ReceiveFilter();
+
+        /**
+         * Replace the set of blocked senders
+         */
+        void set_blocklist(std::vector<client_id> blocked);
+
+        void block(client_id const& id);
+        void unblock(client_id const& id);
+        bool is_blocked(client_id const& id) const;
+
+        void set_limits(Limit known, Limit unknown) {
+            m_known = known;
+            m_unknown = unknown;
+        }
+
+        /**
+         * Check an incoming message, taking a token from the bucket of the sender
+         * @param sender ID of the sender
+         * @param known True if the key of the sender is known
+         * @param now Current time
+         * @return Whether the message should be processed
+         */
+        Verdict check(client_id const& sender, bool known, clock::time_point now = clock::now());
+
+        /**
+         * @return Number of messages dropped for blocked senders
+         */
+        std::uint64_t blocked() const {
+            return m_blockedCount;
+        }
+
+        /**
+         * @return Number of messages dropped due to rate limiting
+         */
+        std::uint64_t limited() const {
+            return m_limitedCount;
+        }
+
+    private:
+        void expire_buckets(clock::time_point now);
+    };
+
+    std::ostream& operator<<(std::ostream& os, ReceiveFilter::Verdict verdict);
+
+}
@@ -0,0 +1,200 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ReconnectScheduler.h"
+
+#include <api/RetryPolicy.h>
+#include <logging/logging.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace ceema {
+
+    ReconnectScheduler::ReconnectScheduler(Wakeup wakeup) : ReconnectScheduler(Options(), std::move(wakeup)) {}
+
+    ReconnectScheduler::ReconnectScheduler(Options options, Wakeup wakeup) : m_options(options),
+            m_wakeup(std::move(wakeup)), m_handshakes(0), m_armed(clock::time_point::max()) {}
+
+    void ReconnectScheduler::request(client_id const& account, std::string server, Start start) {
+        Entry& e = entry(account);
+        release(e);
+
+        clock::time_point now = clock::now();
+        e.state = State::WAITING;
+        e.server = std::move(server);
+        e.start = std::move(start);
+        e.due = now;
+        if (e.attempt) {
+            RetryPolicy policy;
+            policy.baseDelay = m_options.baseDelay;
+            policy.maxDelay = m_options.maxDelay;
+            e.due += std::chrono::milliseconds(policy.backoff(e.attempt));
+            LOG_DEBUG(logging::loggerNetwork, "Reconnecting " << account.toString() << " in "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(e.due - now).count() << "ms");
+        }
+        wakeup(e.due, now);
+    }
+
+    void ReconnectScheduler::cancel(client_id const& account) {
+        auto iter = m_entries.find(account);
+        if (iter == m_entries.end()) {
+            return;
+        }
+        release(iter->second);
+        iter->second.state = State::IDLE;
+        iter->second.start = Start();
+    }
+
+    void ReconnectScheduler::connected(client_id const& account) {
+        Entry& e = entry(account);
+        release(e);
+        e.state = State::IDLE;
+        e.start = Start();
+        e.attempt = 0;
+    }
+
+    void ReconnectScheduler::failed(client_id const& account) {
+        Entry& e = entry(account);
+        release(e);
+        e.state = State::IDLE;
+        e.start = Start();
+        e.attempt++;
+    }
+
+    void ReconnectScheduler::disconnected(client_id const& account) {
+        Entry& e = entry(account);
+        release(e);
+        e.state = State::IDLE;
+        e.start = Start();
+        e.attempt = std::max(e.attempt, 1u);
+    }
+
+    void ReconnectScheduler::activity(client_id const& account) {
+        entry(account).lastActive = clock::now();
+    }
+
+    void ReconnectScheduler::remove(client_id const& account) {
+        auto iter = m_entries.find(account);
+        if (iter == m_entries.end()) {
+            return;
+        }
+        release(iter->second);
+        m_entries.erase(iter);
+    }
+
+    void ReconnectScheduler::poll(clock::time_point now) {
+        m_armed = clock::time_point::max();
+
+        clock::time_point next = clock::time_point::max();
+        std::vector<std::pair<clock::time_point, client_id>> due;
+        for (auto& item: m_entries) {
+            Entry& e = item.second;
+            if (e.state == State::HANDSHAKE && e.slot) {
+                if (e.due + m_options.handshakeTimeout <= now) {
+                    // Free the slot, the owner still reports the outcome
+                    LOG_DEBUG(logging::loggerNetwork, "Handshake of " << item.first.toString() << " timed out");
+                    release(e);
+                } else {
+                    next = std::min(next, e.due + m_options.handshakeTimeout);
+                }
+            } else if (e.state == State::WAITING) {
+                if (e.due <= now) {
+                    due.emplace_back(e.lastActive, item.first);
+                } else {
+                    next = std::min(next, e.due);
+                }
+            }
+        }
+
+        // Most recently active first
+        std::sort(due.begin(), due.end(), [](std::pair<clock::time_point, client_id> const& a,
+                                             std::pair<clock::time_point, client_id> const& b) {
+            return a.first > b.first;
+        });
+
+        for (auto const& item: due) {
+            if (m_handshakes >= m_options.maxHandshakes) {
+                // Polled again once a handshake completes
+                break;
+            }
+            // Starting a connect may change the scheduler, look the account up again
+            auto iter = m_entries.find(item.second);
+            if (iter == m_entries.end() || iter->second.state != State::WAITING) {
+                continue;
+            }
+            Entry& e = iter->second;
+            std::size_t& serverHandshakes = m_serverHandshakes[e.server];
+            if (serverHandshakes >= m_options.maxPerServer) {
+                continue;
+            }
+
+            serverHandshakes++;
+            m_handshakes++;
+            e.state = State::HANDSHAKE;
+            e.slot = true;
+            e.due = now;
+            next = std::min(next, now + m_options.handshakeTimeout);
+
+            Start start = std::move(e.start);
+            e.start = Start();
+            start();
+        }
+
+        if (next != clock::time_point::max()) {
+            wakeup(next, now);
+        }
+    }
+
+    ReconnectScheduler::Entry& ReconnectScheduler::entry(client_id const& account) {
+        auto iter = m_entries.find(account);
+        if (iter == m_entries.end()) {
+            Entry e{State::IDLE, std::string(), Start(), clock::time_point(), clock::time_point(), 0, false};
+            iter = m_entries.emplace(account, std::move(e)).first;
+        }
+        return iter->second;
+    }
+
+    void ReconnectScheduler::release(Entry& entry) {
+        if (!entry.slot) {
+            return;
+        }
+        entry.slot = false;
+        m_handshakes--;
+        auto iter = m_serverHandshakes.find(entry.server);
+        if (iter != m_serverHandshakes.end() && !--iter->second) {
+            m_serverHandshakes.erase(iter);
+        }
+
+        // Due connects may have been held back by the caps
+        clock::time_point now = clock::now();
+        for (auto const& item: m_entries) {
+            if (item.second.state == State::WAITING && item.second.due <= now) {
+                wakeup(now, now);
+                break;
+            }
+        }
+    }
+
+    void ReconnectScheduler::wakeup(clock::time_point when, clock::time_point now) {
+        if (when >= m_armed) {
+            return;
+        }
+        m_armed = when;
+        m_wakeup(std::chrono::duration_cast<std::chrono::milliseconds>(std::max(when - now, clock::duration::zero())));
+    }
+
+}
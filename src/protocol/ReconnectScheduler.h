@@ -0,0 +1,162 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <protocol/data/Client.h>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace ceema {
+
+    /**
+     * Paces the (re)connects of many accounts, so a network outage is not
+     * followed by all of them connecting at once.
+     *
+     * Connects are delayed by exponential backoff with full jitter once an
+     * account lost its connection or failed to connect, and the number of
+     * handshakes in progress is capped, both in total and per server.
+     * Among the connects that are due, accounts with the most recent
+     * activity go first.
+     *
+     * The scheduler has no timers of its own: it asks for a wakeup through
+     * the function passed to the constructor, after which poll() must be
+     * called. Not thread safe.
+     */
+    class ReconnectScheduler {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        struct Options {
+            // Handshakes in progress at once, in total and per server
+            std::size_t maxHandshakes = 16;
+            std::size_t maxPerServer = 8;
+            // Backoff cap for the first reconnect, doubled for every failure, in ms
+            long baseDelay = 1000;
+            long maxDelay = 300000;
+            // A handshake not reported done within this time counts as failed
+            std::chrono::seconds handshakeTimeout{60};
+        };
+
+        /**
+         * Called when poll() should be called, after the given delay
+         */
+        using Wakeup = std::function<void(std::chrono::milliseconds delay)>;
+
+        /**
+         * Starts a connect. Must eventually lead to connected(), failed() or
+         * cancel() for the account.
+         */
+        using Start = std::function<void()>;
+
+    private:
+        enum class State {
+            IDLE,
+            WAITING,
+            HANDSHAKE,
+        };
+
+        struct Entry {
+            State state;
+            std::string server;
+            Start start;
+            // Earliest start of a waiting connect, or start of the handshake
+            clock::time_point due;
+            clock::time_point lastActive;
+            // Backoff step of the next connect, 0 to connect right away
+            unsigned attempt;
+            // Handshake counts towards the caps, until done or timed out
+            bool slot;
+        };
+
+        Options m_options;
+        Wakeup m_wakeup;
+        std::unordered_map<client_id, Entry> m_entries;
+        std::unordered_map<std::string, std::size_t> m_serverHandshakes;
+        std::size_t m_handshakes;
+        // Wakeup requested, if any
+        clock::time_point m_armed;
+
+    public:
+        explicit ReconnectScheduler(Wakeup wakeup);
+        ReconnectScheduler(Options options, Wakeup wakeup);
+
+        ReconnectScheduler(ReconnectScheduler const&) = delete;
+        ReconnectScheduler& operator=(ReconnectScheduler const&) = delete;
+
+        /**
+         * Request a connect, replacing any pending request of the account.
+         * @param account Account to connect
+         * @param server Server the account connects to, for the per server cap
+         * @param start Function starting the connect, called from poll()
+         */
+        void request(client_id const& account, std::string server, Start start);
+
+        /**
+         * Drop a pending request, or end a handshake without counting it as failed
+         */
+        void cancel(client_id const& account);
+
+        /**
+         * The handshake of the account completed, reset its backoff
+         */
+        void connected(client_id const& account);
+
+        /**
+         * The connect or handshake of the account failed, back off further
+         */
+        void failed(client_id const& account);
+
+        /**
+         * An established connection was lost. The next connect is jittered,
+         * so all accounts losing their connection at once do not reconnect at once.
+         */
+        void disconnected(client_id const& account);
+
+        /**
+         * Note activity of the account, prioritizing its connects
+         */
+        void activity(client_id const& account);
+
+        /**
+         * Forget all about an account
+         */
+        void remove(client_id const& account);
+
+        /**
+         * Start the connects that are due, as far as the caps allow
+         * @param now Current time
+         */
+        void poll(clock::time_point now = clock::now());
+
+        /**
+         * @return Number of handshakes in progress
+         */
+        std::size_t handshakes() const {
+            return m_handshakes;
+        }
+
+    private:
+        Entry& entry(client_id const& account);
+        void release(Entry& entry);
+        void wakeup(clock::time_point when, clock::time_point now = clock::now());
+    };
+
+}
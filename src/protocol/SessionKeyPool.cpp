@@ -0,0 +1,44 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SessionKeyPool.h"
+
+namespace ceema {
+
+    SessionKeyPool::~SessionKeyPool() {
+        for (auto& keys: m_keys) {
+            sodium_memzero(keys.sk.data(), keys.sk.size());
+        }
+    }
+
+    SessionKeys SessionKeyPool::take() {
+        if (m_keys.empty()) {
+            return SessionKeys::generate();
+        }
+        SessionKeys keys = m_keys.back();
+        sodium_memzero(m_keys.back().sk.data(), m_keys.back().sk.size());
+        m_keys.pop_back();
+        return keys;
+    }
+
+    bool SessionKeyPool::refill(std::size_t max) {
+        while (m_keys.size() < m_size && max--) {
+            m_keys.push_back(SessionKeys::generate());
+        }
+        return m_keys.size() >= m_size;
+    }
+
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "session.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Session keys generated ahead of time, so a connect does not wait for
+     * key generation. Not thread safe; keep one pool per thread.
+     */
+    class SessionKeyPool {
+        std::vector<SessionKeys> m_keys;
+        std::size_t m_size;
+
+    public:
+        /**
+         * @param size Number of keys to keep ready
+         */
+        explicit SessionKeyPool(std::size_t size) : m_size(size) {}
+        ~SessionKeyPool();
+
+        SessionKeyPool(SessionKeyPool const&) = delete;
+        SessionKeyPool& operator=(SessionKeyPool const&) = delete;
+
+        /**
+         * Take ready keys, or generate them if the pool ran dry
+         */
+        SessionKeys take();
+
+        /**
+         * Generate keys until the pool is full
+         * @param max Maximum number of keys to generate in this call
+         * @return True if the pool is full
+         */
+        bool refill(std::size_t max = static_cast<std::size_t>(-1));
+
+        std::size_t available() const {
+            return m_keys.size();
+        }
+    };
+
+}
@@ -0,0 +1,560 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "SessionPool.h"
+
+#include <logging/logging.h>
+#include <protocol/SessionKeyPool.h>
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <unistd.h>
+
+namespace ceema {
+
+    // Interval at which the session keys used by connects are topped up in full, in ms
+    static const long KEY_REFILL_INTERVAL = 180000;
+    // Minimum interval between resolving the servers again after failed connects, in ms
+    static const long ADDRESS_REFRESH_INTERVAL = 30000;
+
+    /**
+     * Sessions handled by a single I/O thread. Only accessed on that thread,
+     * other threads go through EventLoop::post().
+     */
+    struct SessionPool::Shard {
+        enum class State {
+            IDLE,
+            CONNECTING,
+            HANDSHAKE,
+            CONNECTED
+        };
+
+        struct Entry {
+            std::unique_ptr<Session> session;
+            std::unique_ptr<TcpConnector> connector;
+            State state;
+            // Socket of the session, once connected
+            int fd;
+            // Handshake timeout, cancelled once connected or closed
+            HttpManager::TimerId timer;
+            // Next keep-alive check, while connected
+            HttpManager::TimerId keepAlive;
+            // Index of the server address tried first
+            std::size_t address;
+            // Has queued packets that were not flushed yet
+            bool dirty;
+        };
+
+        /**
+         * Shared with resolver threads, which outlive the shard
+         */
+        struct Token {
+            std::mutex mutex;
+            Shard* self;
+        };
+
+        SessionPool& pool;
+        EventLoop loop;
+        IdentAPI identAPI;
+        KeyCache keyCache;
+        Context context;
+        std::thread thread;
+        bool running;
+
+        std::unordered_map<client_id, std::unique_ptr<Entry>> sessions;
+        // Server addresses, set by start() and refreshed after failed connects
+        std::vector<SocketAddress> addresses;
+        std::size_t nextAddress;
+        std::shared_ptr<Token> token;
+        // Hosts still being resolved by a refresh, and the addresses found so far
+        std::size_t lookups;
+        std::vector<SocketAddress> resolved;
+        std::chrono::steady_clock::time_point refreshed;
+        SessionKeyPool keys;
+        ReconnectScheduler reconnects;
+
+        // Work batched until the end of a loop iteration
+        std::vector<Delivery> deliveries;
+        std::vector<client_id> dirty;
+
+        explicit Shard(SessionPool& pool) : pool(pool), identAPI(loop), context{loop, identAPI, keyCache},
+                                   running(false), nextAddress(0), token(std::make_shared<Token>()), lookups(0),
+                                   keys(pool.m_options.fastConnect ? pool.m_options.keyPool : 0),
+                                   reconnects(pool.m_options.reconnect, [this](std::chrono::milliseconds delay) {
+                                       loop.scheduleTimer(delay.count(), [this]() {
+                                           reconnects.poll();
+                                       });
+                                   }) {
+            token->self = this;
+        }
+
+        ~Shard() {
+            std::lock_guard<std::mutex> lock(token->mutex);
+            token->self = nullptr;
+        }
+
+        void run() {
+            running = true;
+            for (auto& entry: sessions) {
+                enqueue(entry.first, *entry.second);
+            }
+            refill_keys();
+
+            while (running) {
+                loop.run_once(-1);
+                flush();
+                deliver();
+                // Top up the keys used by connects a little at a time, to not stall the loop
+                keys.refill(1);
+            }
+
+            for (auto& entry: sessions) {
+                close(entry.first, *entry.second);
+            }
+            dirty.clear();
+        }
+
+        void add(Account const& account) {
+            std::unique_ptr<Entry>& entry = sessions[account.id()];
+            if (entry) {
+                LOG_DEBUG(logging::loggerNetwork, "Account " << account.id().toString() << " already in pool");
+                return;
+            }
+            entry.reset(new Entry{std::make_unique<Session>(account),
+                                  std::make_unique<TcpConnector>(loop, pool.m_options.connect),
+                                  State::IDLE, -1, 0, 0, 0, false});
+            entry->session->set_keep_alive(pool.m_options.keepAlive);
+            if (running) {
+                enqueue(account.id(), *entry);
+            }
+        }
+
+        void remove(client_id const& id) {
+            auto iter = sessions.find(id);
+            if (iter == sessions.end()) {
+                return;
+            }
+            close(id, *iter->second);
+            sessions.erase(iter);
+            reconnects.remove(id);
+        }
+
+        void reconnect(client_id const& id) {
+            auto iter = sessions.find(id);
+            if (iter == sessions.end() || iter->second->state != State::CONNECTED) {
+                // Not connected, the server delivers everything on the next connect anyway
+                return;
+            }
+            Entry& e = *iter->second;
+            close(id, e);
+            notify(id, std::make_exception_ptr(std::runtime_error("Reconnecting")));
+            enqueue(id, e);
+        }
+
+        void send(client_id const& id, Packet const& packet) {
+            auto iter = sessions.find(id);
+            if (iter == sessions.end() || iter->second->state != State::CONNECTED) {
+                LOG_DEBUG(logging::loggerNetwork, "Dropping packet for disconnected account " << id.toString());
+                return;
+            }
+            Entry& e = *iter->second;
+            e.session->queue_packet(packet);
+            mark_dirty(id, e);
+            reconnects.activity(id);
+        }
+
+        void enqueue(client_id const& id, Entry& e) {
+            // Rotate the addresses, so sessions spread over the servers
+            e.address = nextAddress++ % addresses.size();
+            reconnects.request(id, addresses[e.address].toString(), [this, id]() {
+                auto iter = sessions.find(id);
+                if (iter != sessions.end() && iter->second->state == State::IDLE) {
+                    connect(id, *iter->second);
+                } else {
+                    reconnects.cancel(id);
+                }
+            });
+        }
+
+        void mark_dirty(client_id const& id, Entry& e) {
+            if (!e.dirty) {
+                e.dirty = true;
+                dirty.push_back(id);
+            }
+        }
+
+        void connect(client_id const& id, Entry& e) {
+            std::vector<SocketAddress> order;
+            std::size_t count = addresses.size();
+            for (std::size_t i = 0; i < count; i++) {
+                order.push_back(addresses[(e.address + i) % count]);
+            }
+
+            e.state = State::CONNECTING;
+
+            auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(pool.m_options.handshakeTimeout);
+            e.timer = loop.scheduleTimer(timeout.count(), [this, id]() {
+                auto iter = sessions.find(id);
+                if (iter == sessions.end()) {
+                    return;
+                }
+                Entry& e = *iter->second;
+                e.timer = 0;
+                failed(id, e, std::make_exception_ptr(std::runtime_error("Handshake timed out")));
+            });
+
+            try {
+                byte_vector hello;
+                if (pool.m_options.fastConnect) {
+                    e.session->prepare(keys.take(), pool.m_options.useProxy);
+                    hello = e.session->hello();
+                }
+                e.connector->connect(order, [this, id, &e](TcpClient socket, std::exception_ptr error) {
+                    on_connect(id, e, std::move(socket), error);
+                }, std::move(hello));
+
+                if (pool.m_options.fastConnect) {
+                    // The AUTH secret does not depend on the server HELLO, box it while the SYN is out
+                    e.session->prepare_auth();
+                }
+            } catch (std::exception&) {
+                failed(id, e, std::current_exception());
+            }
+        }
+
+        void on_connect(client_id const& id, Entry& e, TcpClient socket, std::exception_ptr error) {
+            if (error) {
+                failed(id, e, error);
+                return;
+            }
+
+            e.fd = socket.fd();
+            try {
+                e.session->connect(std::move(socket), pool.m_options.useProxy, pool.m_options.fastConnect);
+                loop.attach(*e.session, e.fd, [this, id, &e](Session&, std::exception_ptr error) {
+                    on_session(id, e, error);
+                });
+            } catch (std::exception&) {
+                failed(id, e, std::current_exception());
+                return;
+            }
+            e.state = State::HANDSHAKE;
+        }
+
+        void on_session(client_id const& id, Entry& e, std::exception_ptr error) {
+            if (error) {
+                failed(id, e, error);
+                return;
+            }
+
+            if (e.state == State::HANDSHAKE && e.session->is_connected()) {
+                e.state = State::CONNECTED;
+                loop.cancelTimer(e.timer);
+                e.timer = 0;
+                reconnects.connected(id);
+                pool.m_connected++;
+                notify(id, nullptr);
+                keep_alive(id, e);
+            }
+            if (e.state == State::CONNECTED && e.session->hasWriteData()) {
+                // Answers to keep-alives of the server
+                mark_dirty(id, e);
+            }
+            if (e.session->has_packet()) {
+                reconnects.activity(id);
+            }
+            while (e.session->has_packet()) {
+                deliveries.push_back(Delivery{id, e.session->get_packet()});
+            }
+        }
+
+        /**
+         * Disconnect a session, without reconnecting
+         */
+        void close(client_id const& id, Entry& e) {
+            switch (e.state) {
+                case State::CONNECTING:
+                    e.connector->cancel();
+                    if (e.fd >= 0) {
+                        ::close(e.fd);
+                    }
+                    break;
+                case State::HANDSHAKE:
+                    loop.detach(*e.session);
+                    break;
+                case State::CONNECTED:
+                    loop.detach(*e.session);
+                    pool.m_connected--;
+                    break;
+                case State::IDLE:
+                    break;
+            }
+            reconnects.cancel(id);
+            e.state = State::IDLE;
+            e.fd = -1;
+            loop.cancelTimer(e.timer);
+            e.timer = 0;
+            loop.cancelTimer(e.keepAlive);
+            e.keepAlive = 0;
+        }
+
+        void failed(client_id const& id, Entry& e, std::exception_ptr error) {
+            bool wasConnected = e.state == State::CONNECTED;
+            close(id, e);
+            if (wasConnected) {
+                reconnects.disconnected(id);
+            } else {
+                reconnects.failed(id);
+            }
+            notify(id, error);
+            // The servers may have moved, e.g. after a network change
+            refresh_addresses();
+            enqueue(id, e);
+        }
+
+        /**
+         * Resolve the servers again in the background, at most once per
+         * ADDRESS_REFRESH_INTERVAL. Connects use the new addresses once all
+         * hosts were resolved; if none could be, the old ones are kept.
+         */
+        void refresh_addresses() {
+            auto now = std::chrono::steady_clock::now();
+            if (lookups || now - refreshed < std::chrono::milliseconds(ADDRESS_REFRESH_INTERVAL)) {
+                return;
+            }
+            refreshed = now;
+            lookups = pool.m_options.hosts.size();
+            resolved.clear();
+
+            std::shared_ptr<Token> t = token;
+            for (auto const& host: pool.m_options.hosts) {
+                Resolver::shared().resolve(host, pool.m_options.port,
+                                           [t, host](std::vector<SocketAddress> result, std::exception_ptr error) {
+                    std::lock_guard<std::mutex> lock(t->mutex);
+                    if (t->self) {
+                        Shard* s = t->self;
+                        s->loop.post([s, host, result, error]() {
+                            s->on_resolved(host, result, error);
+                        });
+                    }
+                });
+            }
+        }
+
+        void on_resolved(std::string const& host, std::vector<SocketAddress> const& result, std::exception_ptr error) {
+            if (error) {
+                try {
+                    std::rethrow_exception(error);
+                } catch (std::exception& e) {
+                    LOG_DEBUG(logging::loggerNetwork, "Unable to resolve " << host << ": " << e.what());
+                }
+            } else {
+                resolved.insert(resolved.end(), result.begin(), result.end());
+            }
+            if (--lookups == 0 && !resolved.empty()) {
+                LOG_DEBUG(logging::loggerNetwork, "Resolved " << resolved.size() << " server addresses");
+                addresses.swap(resolved);
+                resolved.clear();
+            }
+        }
+
+        void notify(client_id const& id, std::exception_ptr error) {
+            if (!pool.m_onState) {
+                return;
+            }
+            try {
+                pool.m_onState(id, error);
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Session state handler failed: " << e.what());
+            }
+        }
+
+        void refill_keys() {
+            keys.refill();
+            loop.scheduleTimer(KEY_REFILL_INTERVAL, [this]() {
+                refill_keys();
+            });
+        }
+
+        /**
+         * Send a keep-alive if the session is idle, and schedule the next check
+         */
+        void keep_alive(client_id const& id, Entry& e) {
+            KeepAliveTracker::clock::time_point deadline;
+            try {
+                deadline = e.session->keep_alive();
+            } catch (std::exception&) {
+                failed(id, e, std::current_exception());
+                return;
+            }
+            if (e.session->hasWriteData()) {
+                mark_dirty(id, e);
+            }
+
+            // Traffic moves the deadline, in which case the timer only reschedules
+            auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - KeepAliveTracker::clock::now()) + std::chrono::milliseconds(1);
+            e.keepAlive = loop.scheduleTimer(std::max<long>(delay.count(), 0), [this, id]() {
+                auto iter = sessions.find(id);
+                if (iter == sessions.end()) {
+                    return;
+                }
+                Entry& e = *iter->second;
+                e.keepAlive = 0;
+                keep_alive(id, e);
+            });
+        }
+
+        void flush() {
+            for (client_id const& id: dirty) {
+                auto iter = sessions.find(id);
+                if (iter == sessions.end()) {
+                    continue;
+                }
+                Entry& e = *iter->second;
+                e.dirty = false;
+                if (e.state != State::CONNECTED) {
+                    continue;
+                }
+                try {
+                    e.session->flush();
+                } catch (std::exception&) {
+                    failed(id, e, std::current_exception());
+                }
+            }
+            dirty.clear();
+        }
+
+        void deliver() {
+            if (deliveries.empty()) {
+                return;
+            }
+            if (pool.m_onPackets) {
+                try {
+                    pool.m_onPackets(deliveries);
+                } catch (std::exception& e) {
+                    LOG_WARN(logging::loggerNetwork, "Packet handler failed: " << e.what());
+                }
+            }
+            deliveries.clear();
+        }
+    };
+
+    SessionPool::SessionPool(Options options, PacketHandler onPackets, StateHandler onState) :
+            m_options(std::move(options)), m_onPackets(std::move(onPackets)), m_onState(std::move(onState)),
+            m_connected(0), m_started(false) {
+        unsigned count = m_options.shards;
+        if (!count) {
+            count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < count; i++) {
+            m_shards.emplace_back(new Shard(*this));
+        }
+    }
+
+    SessionPool::~SessionPool() {
+        stop();
+    }
+
+    void SessionPool::start() {
+        if (m_started) {
+            return;
+        }
+
+        // Resolve once for all sessions, each connect then races the results
+        std::vector<SocketAddress> addresses;
+        for (auto const& host: m_options.hosts) {
+            try {
+                auto found = Resolver::lookup(host, m_options.port);
+                addresses.insert(addresses.end(), found.begin(), found.end());
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, e.what());
+            }
+        }
+        if (addresses.empty()) {
+            throw std::runtime_error("Unable to resolve any chat server");
+        }
+
+        for (auto& shard: m_shards) {
+            Shard* s = shard.get();
+            s->addresses = addresses;
+            s->thread = std::thread([s]() {
+                s->run();
+            });
+        }
+        m_started = true;
+    }
+
+    void SessionPool::stop() {
+        if (!m_started) {
+            return;
+        }
+        for (auto& shard: m_shards) {
+            Shard* s = shard.get();
+            s->loop.post([s]() {
+                s->running = false;
+            });
+        }
+        for (auto& shard: m_shards) {
+            shard->thread.join();
+        }
+        m_started = false;
+    }
+
+    void SessionPool::add(Account const& account) {
+        Shard* s = m_shards[shard_of(account.id())].get();
+        s->loop.post([s, account]() {
+            s->add(account);
+        });
+    }
+
+    void SessionPool::remove(client_id const& account) {
+        Shard* s = m_shards[shard_of(account)].get();
+        s->loop.post([s, account]() {
+            s->remove(account);
+        });
+    }
+
+    void SessionPool::reconnect(client_id const& account) {
+        Shard* s = m_shards[shard_of(account)].get();
+        s->loop.post([s, account]() {
+            s->reconnect(account);
+        });
+    }
+
+    void SessionPool::send(client_id const& account, std::shared_ptr<Packet const> packet) {
+        Shard* s = m_shards[shard_of(account)].get();
+        s->loop.post([s, account, packet]() {
+            s->send(account, *packet);
+        });
+    }
+
+    void SessionPool::post(client_id const& account, std::function<void(Context&)> fn) {
+        Shard* s = m_shards[shard_of(account)].get();
+        s->loop.post([s, fn]() {
+            fn(s->context);
+        });
+    }
+
+    std::size_t SessionPool::shard_of(client_id const& account) const {
+        return std::hash<client_id>()(account) % m_shards.size();
+    }
+
+}
@@ -0,0 +1,173 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "session.h"
+#include "ReconnectScheduler.h"
+
+#include <api/IdentAPI.h>
+#include <async/EventLoop.h>
+#include <async/TcpConnector.h>
+#include <contact/KeyCache.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Runs the sessions of many accounts over a fixed number of I/O threads.
+     *
+     * Each thread (shard) has its own EventLoop, and with it its own HTTP
+     * connection pool, IdentAPI and KeyCache, which are shared by all
+     * accounts of the shard. An account always lives on the same shard.
+     * Within a shard, connects are paced, each session sends keep-alives
+     * only while idle, and received packets are handed over in batches once
+     * per loop iteration.
+     *
+     * Handlers are called on the shard threads, possibly concurrently for
+     * different shards.
+     */
+    class SessionPool {
+    public:
+        struct Options {
+            // Chat servers, the addresses of all of them are raced on connect
+            std::vector<std::string> hosts{"g-xx.0.threema.ch"};
+            std::uint16_t port = 5222;
+            bool useProxy = true;
+            // Number of I/O threads, 0 for one per CPU
+            unsigned shards = 0;
+            std::chrono::seconds handshakeTimeout{30};
+            KeepAliveTracker::Options keepAlive;
+            // Backoff and handshake caps, per shard
+            ReconnectScheduler::Options reconnect;
+            TcpConnector::Options connect;
+            // Generate session keys ahead of time and send the HELLO along with
+            // the connect (in the SYN, if connect.fastOpen is set)
+            bool fastConnect = false;
+            // Session keys kept ready per shard with fastConnect
+            std::size_t keyPool = 16;
+        };
+
+        /**
+         * Shard facilities available to functions run by post()
+         */
+        struct Context {
+            EventLoop& loop;
+            IdentAPI& identAPI;
+            KeyCache& keyCache;
+        };
+
+        struct Delivery {
+            client_id account;
+            std::unique_ptr<Packet> packet;
+        };
+
+        /**
+         * Called with the packets received by the sessions of a shard
+         */
+        using PacketHandler = std::function<void(std::vector<Delivery>& batch)>;
+
+        /**
+         * Called when a session completed its handshake (no error), or was
+         * disconnected (with the error). Disconnected sessions are reconnected.
+         */
+        using StateHandler = std::function<void(client_id const& account, std::exception_ptr error)>;
+
+    private:
+        struct Shard;
+
+        Options m_options;
+        PacketHandler m_onPackets;
+        StateHandler m_onState;
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
+        std::atomic<std::size_t> m_connected;
+        bool m_started;
+
+    public:
+        SessionPool(Options options, PacketHandler onPackets, StateHandler onState);
+        ~SessionPool();
+
+        SessionPool(SessionPool const&) = delete;
+        SessionPool& operator=(SessionPool const&) = delete;
+
+        /**
+         * Resolve the server and start the I/O threads. Throws if the server
+         * cannot be resolved. Each shard resolves the server again in the
+         * background once its connects fail, to follow address changes.
+         */
+        void start();
+
+        /**
+         * Disconnect all sessions and join the I/O threads
+         */
+        void stop();
+
+        /**
+         * Add an account and connect it. Accounts may be added before start().
+         */
+        void add(Account const& account);
+
+        /**
+         * Disconnect and remove an account
+         */
+        void remove(client_id const& account);
+
+        /**
+         * Disconnect the session of an account and connect it again right
+         * away, so the server delivers the messages that were not ACKed again.
+         * Reported to the StateHandler like any other disconnect.
+         */
+        void reconnect(client_id const& account);
+
+        /**
+         * Send a packet on the session of an account. Dropped if the session
+         * is not connected.
+         */
+        void send(client_id const& account, std::shared_ptr<Packet const> packet);
+
+        /**
+         * Run a function on the shard of an account
+         */
+        void post(client_id const& account, std::function<void(Context&)> fn);
+
+        /**
+         * @return Index of the shard handling an account
+         */
+        std::size_t shard_of(client_id const& account) const;
+
+        std::size_t shard_count() const {
+            return m_shards.size();
+        }
+
+        /**
+         * @return Number of sessions that completed the handshake, over all shards
+         */
+        std::size_t connected() const {
+            return m_connected;
+        }
+    };
+
+}
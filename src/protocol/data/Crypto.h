@@ -32,6 +32,13 @@ namespace ceema {
         using byte_array::byte_array;
     };
 
+    /**
+     * Key precomputed from a public and private key pair, see crypto::box::precompute
+     */
+    struct precomputed_key : public byte_array<crypto_box_BEFORENMBYTES> {
+        using byte_array::byte_array;
+    };
+
     struct nonce : public byte_array<crypto_box_NONCEBYTES> {
         using byte_array::byte_array;
     };
@@ -64,3 +64,18 @@ namespace ceema {
         return uid;
     }
 }
+
+namespace std {
+    template<> struct hash<ceema::group_uid>
+    {
+        typedef ceema::group_uid argument_type;
+        typedef std::size_t result_type;
+        result_type operator()(argument_type const& s) const
+        {
+            // Group IDs are random, the owner mixes in for IDs shared between owners
+            std::uint64_t owner = *reinterpret_cast<std::uint64_t const*>(s.data());
+            std::uint64_t gid = *reinterpret_cast<std::uint64_t const*>(s.data() + ceema::client_id::array_size);
+            return std::hash<std::uint64_t>{}(gid ^ (owner * 0x9E3779B97F4A7C15ull));
+        }
+    };
+}
@@ -28,6 +28,15 @@ namespace ceema {
 
     Message::Message() : Packet(PacketType::MESSAGE_RECV), m_payload() {}
 
+    Message::Message(client_id const& sender, client_id const& recipient, MessageFlags flags) :
+            Packet(PacketType::MESSAGE_SEND), m_sender(sender),
+            m_recipient(recipient), m_id(gen_message_id()),
+            m_time(static_cast<timestamp>(
+                           std::chrono::duration_cast<std::chrono::seconds>(
+                                   std::chrono::system_clock::now().time_since_epoch()).count())),
+            m_flags(flags), m_nick(sender.toString()), m_nonce(crypto::generate_nonce()),
+            m_payload() {}
+
     Message Message::fromPacket(PacketType type, byte_vector const& packet) {
         if (type != PacketType::MESSAGE_RECV) {
             throw protocol_exception("Invalid Message type");
@@ -124,12 +133,7 @@ namespace ceema {
             throw std::runtime_error("Sender/Receiver mismatch");
         }
 
-        byte_vector type_data(sizeof(MessageType));
-        htole(m_payload.get_type(), type_data.data());
-        byte_vector payload_data = m_payload.serialize();
-        payload_data.insert(payload_data.begin(), type_data.begin(), type_data.end());
-        LOG_TRACE(logging::loggerRoot, "Encrypting payload " << payload_data);
-        pkcs7::add_padding(payload_data);
+        byte_vector payload_data = encodePayload(m_payload);
         payload_data.resize(payload_data.size() + crypto_box_MACBYTES);
         if (!crypto::box::encrypt_inplace(payload_data, m_nonce, recipient.pk(), sender.sk())) {
             throw std::runtime_error("Message encryption error");
@@ -137,6 +141,27 @@ namespace ceema {
         m_payloadData.swap(payload_data);
     }
 
+    void Message::encrypt(byte_vector const& payload, precomputed_key const& key) {
+        byte_vector payload_data;
+        payload_data.reserve(payload.size() + crypto_box_MACBYTES);
+        payload_data.assign(payload.begin(), payload.end());
+        payload_data.resize(payload.size() + crypto_box_MACBYTES);
+        if (!crypto::box::encrypt_inplace(payload_data, m_nonce, key)) {
+            throw std::runtime_error("Message encryption error");
+        }
+        m_payloadData.swap(payload_data);
+    }
+
+    byte_vector Message::encodePayload(MessagePayload const& payload) {
+        byte_vector type_data(sizeof(MessageType));
+        htole(payload.get_type(), type_data.data());
+        byte_vector payload_data = payload.serialize();
+        payload_data.insert(payload_data.begin(), type_data.begin(), type_data.end());
+        LOG_TRACE(logging::loggerRoot, "Encoded payload " << payload_data);
+        pkcs7::add_padding(payload_data);
+        return payload_data;
+    }
+
     void Message::decrypt(Contact const& sender, Account const& recipient) {
         if (!m_payloadData.size()) {
             throw std::runtime_error("Attempt to decrypt message without payload data");
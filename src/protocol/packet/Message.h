@@ -72,6 +72,16 @@ namespace ceema {
         {
         }
 
+        /**
+         * Create a message without payload object, for sending a payload that
+         * was encoded once for multiple recipients (see encodePayload). Only
+         * encrypt(payload, key) can be used on the result.
+         * @param sender Sender ID
+         * @param recipient Recipient ID
+         * @param flags Flags of the message, usually the default flags of the payload
+         */
+        Message(client_id const& sender, client_id const& recipient, MessageFlags flags);
+
         client_id const& sender() const {
             return m_sender;
         }
@@ -129,6 +139,20 @@ namespace ceema {
 
         void encrypt(Account const& sender, Contact const& recipient);
 
+        /**
+         * Encrypt an encoded payload with a precomputed key
+         * @param payload Payload as returned by encodePayload
+         * @param key Key shared by sender and recipient
+         */
+        void encrypt(byte_vector const& payload, precomputed_key const& key);
+
+        /**
+         * Encode and pad a payload, ready for encryption
+         * @param payload Payload to encode
+         * @return Encoded payload
+         */
+        static byte_vector encodePayload(MessagePayload const& payload);
+
         void decrypt(Contact const& sender, Account const& recipient);
 
     private:
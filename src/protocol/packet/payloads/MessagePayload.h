@@ -104,7 +104,7 @@ namespace ceema {
 
         static MessagePayload deserialize(byte_vector const& payload_data);
 
-        byte_vector serialize() {
+        byte_vector serialize() const {
             return mpark::visit([](const auto& x) -> byte_vector { return x.serialize(); }, m_payload);
         }
 
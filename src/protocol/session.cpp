@@ -40,15 +40,24 @@ namespace ceema {
 
     Session::Session(Account const &client) :
             m_noncePrefix{0}, m_serverNoncePrefix{0}, m_counter(0), m_serverCounter(0), m_sessionPK{0}, m_sessionSK{0},
-            m_sessionServerPK{0}, m_client(client), m_socket(INVALID_SOCKET), m_useProxy(false),
+            m_sessionServerPK{0}, m_sessionKey{0}, m_prepared(false), m_vouch{}, m_vouchNonce{0},
+            m_vouchReady(false), m_client(client), m_socket(INVALID_SOCKET), m_useProxy(false),
             m_state(State::DISCONNECTED), m_nextReadSize(0) {
     }
 
-    void Session::connect(TcpClient socket, bool useProxy) {
+    SessionKeys SessionKeys::generate() {
+        SessionKeys keys;
+        if (!crypto::generate_keypair(keys.pk, keys.sk)) {
+            throw std::runtime_error("Unable to generate session keypair");
+        }
+        crypto::randombytes(keys.noncePrefix);
+        return keys;
+    }
+
+    void Session::prepare(SessionKeys const& keys, bool useProxy) {
         if (m_state != State::DISCONNECTED) {
             terminate();
         }
-        m_socket = std::move(socket);
 
         m_useProxy = useProxy;
         // Store PK
@@ -58,8 +67,7 @@ namespace ceema {
             m_serverPK = serverPKGateway;
         }
 
-        // Generate nonce prefix
-        crypto::randombytes(m_noncePrefix);
+        m_noncePrefix = keys.noncePrefix;
 
         // Reset the counters
         if (m_useProxy) {
@@ -70,13 +78,56 @@ namespace ceema {
             m_serverCounter = 1u;
         }
 
-        // Generate short-term key
-        if (!crypto::generate_keypair(m_sessionPK, m_sessionSK)) {
-            throw std::runtime_error("Unable to generate session keypair");
+        m_sessionPK = keys.pk;
+        m_sessionSK = keys.sk;
+        m_vouchReady = false;
+        m_prepared = true;
+    }
+
+    void Session::prepare_auth() {
+        if (!m_prepared && m_state == State::DISCONNECTED) {
+            throw std::logic_error("Session keys not prepared");
+        }
+        if (m_vouchReady) {
+            return;
+        }
+        m_vouchNonce = crypto::generate_nonce();
+        if (!crypto::box::encrypt(m_vouch, m_sessionPK, m_vouchNonce, m_serverPK, m_client.sk())) {
+            throw std::runtime_error("Error encrypting AUTH secret");
+        }
+        m_vouchReady = true;
+    }
+
+    byte_vector Session::hello() const {
+        if (!m_prepared) {
+            throw std::logic_error("Session keys not prepared");
         }
+        byte_vector packet(m_sessionPK.begin(), m_sessionPK.end());
+        packet.insert(packet.end(), m_noncePrefix.begin(), m_noncePrefix.end());
+        return packet;
+    }
+
+    void Session::connect(TcpClient socket, bool useProxy, bool helloSent) {
+        if (m_state != State::DISCONNECTED) {
+            terminate();
+        }
+        if (!m_prepared || m_useProxy != useProxy) {
+            if (helloSent) {
+                throw std::logic_error("HELLO sent for keys that are not prepared");
+            }
+            prepare(SessionKeys::generate(), useProxy);
+        }
+        m_prepared = false;
+        m_socket = std::move(socket);
 
-        m_state = State::WAIT_CONNECT;
-        packetReady();
+        if (helloSent) {
+            LOG_TRACE(logging::loggerSession, "HELLO sent on connect");
+            m_nextReadSize = PROTO_HELLO_PACKET_SIZE;
+            m_state = State::WAIT_HELLO;
+        } else {
+            m_state = State::WAIT_CONNECT;
+            packetReady();
+        }
     }
 
     bool Session::onReadyRead() {
@@ -97,20 +148,21 @@ namespace ceema {
                 throw;
             }
             if (recvSize > 0) {
-                m_readBuffer.insert(m_readBuffer.end(), buffer.begin(),
-                                    buffer.begin() + recvSize);
-                LOG_TRACE(logging::loggerSession,
-                          "Read " << recvSize << " bytes, expecting "
-                                  << m_nextReadSize);
+                onData(buffer.data(), static_cast<std::size_t>(recvSize));
             }
 
         } while (recvSize > 0);
 
+        return recvSize != 0;
+    }
+
+    void Session::onData(std::uint8_t const* data, std::size_t size) {
+        m_readBuffer.insert(m_readBuffer.end(), data, data + size);
+        LOG_TRACE(logging::loggerSession, "Read " << size << " bytes, expecting " << m_nextReadSize);
+
         while (m_nextReadSize && m_readBuffer.size() >= m_nextReadSize) {
             packetReady();
         }
-
-        return recvSize != 0;
     }
 
     void Session::packetReady() {
@@ -138,6 +190,7 @@ namespace ceema {
                 // Handshake complete, begin receiving packets
                 m_nextReadSize = PACKET_LENGTH_SIZE;
                 m_state = State::WAIT_PKT_HEADER;
+                m_keepAlive.reset();
                 break;
             case State::WAIT_PKT_HEADER:
                 // Simply switch state to WAIT_PKT and set m_nextReadSize
@@ -163,6 +216,14 @@ namespace ceema {
 
     void Session::onReadyWrite() {
         LOG_TRACE(logging::loggerSession, "onReadyWrite " << m_writeBuffer.size());
+        if (m_output) {
+            if (!m_writeBuffer.empty()) {
+                byte_vector data;
+                data.swap(m_writeBuffer);
+                m_output(std::move(data));
+            }
+            return;
+        }
         while (m_writeBuffer.size()) {
             // TODO: Send data in chunks of 4K
             auto sendSize = m_writeBuffer.size();
@@ -189,6 +250,10 @@ namespace ceema {
         m_noncePrefix.fill(0);
         m_sessionPK.fill(0);
         m_sessionSK.fill(0);
+        sodium_memzero(m_sessionKey.data(), m_sessionKey.size());
+        m_vouch.fill(0);
+        m_prepared = false;
+        m_vouchReady = false;
 
         m_state = State::DISCONNECTED;
         m_nextReadSize = 0;
@@ -230,6 +295,8 @@ namespace ceema {
             // Store the short term public key
             std::copy(serverSPK.begin(), serverSPK.end(), m_sessionServerPK.begin());
             LOG_TRACE(logging::loggerSession, "Got server session PK: " << m_sessionServerPK);
+            // Every following packet uses the same key pair
+            m_sessionKey = crypto::box::precompute(m_sessionServerPK, m_sessionSK);
 
             // Verify client nonce correct
             if (!std::equal(m_noncePrefix.begin(), m_noncePrefix.end(), client_prefix.begin())) {
@@ -257,26 +324,22 @@ namespace ceema {
         packet_iter += PROTO_VERSIONID_SIZE;
         LOG_TRACE(logging::loggerSession, "Sending version " << ver_info);
 
-        // Random nonce
-        nonce ran_nonce = crypto::generate_nonce();
+        // Random nonce and encrypted public key, usually prepared while connecting
+        prepare_auth();
 
         if (m_useProxy) {
-            packet_iter = std::copy(ran_nonce.begin(), ran_nonce.end(), packet_iter);
+            packet_iter = std::copy(m_vouchNonce.begin(), m_vouchNonce.end(), packet_iter);
             packet_iter = std::copy(m_serverNoncePrefix.begin(), m_serverNoncePrefix.end(), packet_iter);
         } else {
             packet_iter = std::copy(m_serverNoncePrefix.begin(), m_serverNoncePrefix.end(), packet_iter);
-            packet_iter = std::copy(ran_nonce.begin(), ran_nonce.end(), packet_iter);
+            packet_iter = std::copy(m_vouchNonce.begin(), m_vouchNonce.end(), packet_iter);
         }
 
-        // Encrypted public key
-        byte_array<crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES> crypto{};
-        if (!crypto::box::encrypt(crypto, m_sessionPK, ran_nonce, m_serverPK, m_client.sk())) {
-            throw std::runtime_error("Error encrypting AUTH secret");
-        }
-        packet_iter = std::copy(crypto.begin(), crypto.end(), packet_iter);
+        packet_iter = std::copy(m_vouch.begin(), m_vouch.end(), packet_iter);
+        m_vouchReady = false;
 
         // Full packet encrypted
-        if (!crypto::box::encrypt_inplace(packet, nextClientNonce(), m_sessionServerPK, m_sessionSK)) {
+        if (!crypto::box::encrypt_inplace(packet, nextClientNonce(), m_sessionKey)) {
             throw std::runtime_error("Error encrypting AUTH packet");
         }
 
@@ -288,7 +351,7 @@ namespace ceema {
         byte_array<PROTO_ACK_PACKET_SIZE> packet{m_readBuffer};
         m_readBuffer.erase(m_readBuffer.begin(), m_readBuffer.begin() + PROTO_ACK_PACKET_SIZE);
 
-        if (!crypto::box::decrypt_inplace(packet, nextServerNonce(), m_sessionServerPK, m_sessionSK)) {
+        if (!crypto::box::decrypt_inplace(packet, nextServerNonce(), m_sessionKey)) {
             LOG_TRACE(logging::loggerSession, "Ack decrypt failed");
             throw session_exception("Unable to decrypt ACK packet");
         }
@@ -313,16 +376,21 @@ namespace ceema {
     }
 
     void Session::send_packet(Packet const& packet) {
+        queue_packet(packet);
+        flush();
+    }
+
+    void Session::queue_packet(Packet const& packet) {
         switch(packet.type()) {
             case PacketType::ACK_CLIENT:
-                send_packet(static_cast<Acknowledgement const&>(packet).toPacket());
+                queue_packet(static_cast<Acknowledgement const&>(packet).toPacket());
                 break;
             case PacketType::MESSAGE_SEND:
-                send_packet(static_cast<Message const&>(packet).toPacket());
+                queue_packet(static_cast<Message const&>(packet).toPacket());
                 break;
             case PacketType::KEEPALIVE:
             case PacketType::KEEPALIVE_ACK:
-                send_packet(static_cast<KeepAlive const&>(packet).toPacket());
+                queue_packet(static_cast<KeepAlive const&>(packet).toPacket());
                 break;
             case PacketType::CONNECTED:
             case PacketType::DISCONNECTED:
@@ -342,40 +410,83 @@ namespace ceema {
         }
 
         // Decrypt it
-        if (!crypto::box::decrypt_inplace(body, nextServerNonce(), m_sessionServerPK, m_sessionSK)) {
+        if (!crypto::box::decrypt_inplace(body, nextServerNonce(), m_sessionKey)) {
             throw session_exception("Failed to decrypt message");
         }
 
         // Truncate MAC
         body.resize(body.size() - crypto_box_MACBYTES);
 
+        std::unique_ptr<Packet> packet;
         try
         {
-            m_packetQueue.emplace_back( Packet::fromPacket(body) );
+            packet = Packet::fromPacket(body);
         }
         catch (const packet_type_exception& e)
         {
             LOG_TRACE(logging::loggerSession, e.what());
+            m_keepAlive.received();
             return;
         }
-        LOG_TRACE(logging::loggerSession, "Got packet of type " << m_packetQueue.back()->type());
+        LOG_TRACE(logging::loggerSession, "Got packet of type " << packet->type());
+
+        switch (packet->type()) {
+            case PacketType::KEEPALIVE_ACK:
+                m_keepAlive.acknowledged(static_cast<KeepAlive const&>(*packet).payload());
+                m_keepAlive.received();
+                break;
+            case PacketType::KEEPALIVE:
+                // Answered right away, the reply goes out with the next write
+                m_keepAlive.received();
+                queue_packet(static_cast<KeepAlive const&>(*packet).generateAck());
+                break;
+            default:
+                m_keepAlive.received();
+                m_packetQueue.push_back(std::move(packet));
+                break;
+        }
+    }
+
+    KeepAliveTracker::clock::time_point Session::keep_alive(KeepAliveTracker::clock::time_point now) {
+        if (!is_connected()) {
+            return KeepAliveTracker::clock::time_point::max();
+        }
+        switch (m_keepAlive.poll(now)) {
+            case KeepAliveTracker::Action::DEAD:
+                throw session_exception("No keep-alive response from server");
+            case KeepAliveTracker::Action::SEND: {
+                KeepAlive keepAlive;
+                m_keepAlive.probe_sent(keepAlive.payload(), now);
+                queue_packet(keepAlive);
+                break;
+            }
+            case KeepAliveTracker::Action::NONE:
+                break;
+        }
+        return m_keepAlive.deadline();
+    }
+
+    void Session::flush() {
+        onReadyWrite();
     }
 
-    void Session::send_packet(byte_vector const& data) {
-        byte_vector packet(PACKET_LENGTH_SIZE + data.size() + crypto_box_MACBYTES);
+    void Session::queue_packet(byte_vector const& data) {
+        m_keepAlive.sent();
+        // Frame directly into the write buffer
+        std::size_t offset = m_writeBuffer.size();
+        m_writeBuffer.resize(offset + PACKET_LENGTH_SIZE + data.size() + crypto_box_MACBYTES);
 
-        htole(data.size() + crypto_box_MACBYTES, packet.data());
-        auto iter = packet.begin() + PACKET_LENGTH_SIZE;
+        auto iter = m_writeBuffer.begin() + offset;
+        htole(static_cast<std::uint16_t>(data.size() + crypto_box_MACBYTES), &*iter);
+        iter += PACKET_LENGTH_SIZE;
 
         //TODO: need crypto:: interface when encrypting with an offset
-        int res = crypto_box_easy(&*iter, data.data(), data.size(), nextClientNonce().data(), m_sessionServerPK.data(),
-                                  m_sessionSK.data());
+        int res = crypto_box_easy_afternm(&*iter, data.data(), data.size(), nextClientNonce().data(),
+                                          m_sessionKey.data());
         if (res != 0) {
+            m_writeBuffer.resize(offset);
             throw std::runtime_error("Failed to encrypt packet body");
         }
-
-        m_writeBuffer.insert(m_writeBuffer.end(), packet.begin(), packet.end());
-        onReadyWrite();
     }
 
     public_key const serverPK{
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "protocol.h"
+#include "KeepAliveTracker.h"
 
 #include "contact/Contact.h"
 #include "socket/socket.h"
@@ -24,6 +25,7 @@
 
 #include <string>
 #include <deque>
+#include <functional>
 #include <contact/Account.h>
 
 namespace ceema {
@@ -41,11 +43,30 @@ namespace ceema {
         return n;
     }
 
+    /**
+     * Short term keypair and nonce prefix of a single session
+     */
+    struct SessionKeys {
+        public_key pk;
+        private_key sk;
+        nonce_prefix noncePrefix;
+
+        /**
+         * Generate fresh keys. Throws exception on error
+         */
+        static SessionKeys generate();
+    };
+
     /**
      * Session keeps track of nonces, temporary server key and message sequence IDs
      */
     class Session {
     public:
+        /**
+         * Takes data to send, for transports doing their own socket I/O
+         */
+        using Output = std::function<void(byte_vector data)>;
+
         enum class State {
             DISCONNECTED,
             WAIT_CONNECT,
@@ -66,6 +87,15 @@ namespace ceema {
         public_key m_sessionPK;
         private_key m_sessionSK;
         public_key m_sessionServerPK;
+        // Precomputed from server session PK and session SK
+        precomputed_key m_sessionKey;
+
+        // Keys and server selected by prepare(), not used by a connection yet
+        bool m_prepared;
+        // Session PK boxed with the long term key for the AUTH packet
+        byte_array<crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES> m_vouch;
+        nonce m_vouchNonce;
+        bool m_vouchReady;
 
         // Contact data
         Account m_client;
@@ -80,20 +110,44 @@ namespace ceema {
         std::size_t m_nextReadSize;
         byte_vector m_readBuffer;
         byte_vector m_writeBuffer;
+        Output m_output;
 
         // Packet buffer
         std::deque<std::unique_ptr<Packet>> m_packetQueue;
 
+        KeepAliveTracker m_keepAlive;
+
     public:
         Session(Account const &client);
 
+        /**
+         * Select the keys of the next connection ahead of time, so hello() is
+         * available before the socket is. Terminates any current connection.
+         * @param keys Session keys, e.g. taken from a SessionKeyPool
+         * @param useProxy As passed to connect()
+         */
+        void prepare(SessionKeys const& keys, bool useProxy = true);
+
+        /**
+         * Box the session PK for the AUTH packet, which only needs the prepared
+         * keys. Call while waiting for the connection to save the work once
+         * the server HELLO arrives; done by the handshake otherwise.
+         */
+        void prepare_auth();
+
+        /**
+         * @return Client HELLO packet of the prepared keys
+         */
+        byte_vector hello() const;
+
         /**
          * Connect to remote server and perform handshake. Throws exception on error
-         * @param hostname
-         * @param port
-         * @param serverPK
+         * @param socket Connected socket
+         * @param useProxy Connect to the proxy rather than the gateway server
+         * @param helloSent The HELLO of the prepared keys was already written
+         * to the socket (e.g. in the SYN with TCP Fast Open)
          */
-        void connect(TcpClient socket, bool useProxy = true);
+        void connect(TcpClient socket, bool useProxy = true, bool helloSent = false);
 
         void terminate();
 
@@ -101,14 +155,76 @@ namespace ceema {
         bool onReadyRead();
         void onReadyWrite();
 
+        /**
+         * Process data received by a transport set with set_output(),
+         * instead of reading the socket in onReadyRead()
+         */
+        void onData(std::uint8_t const* data, std::size_t size);
+
+        /**
+         * Hand queued data to the given function rather than writing it to
+         * the socket. Pass nullptr to write to the socket again.
+         */
+        void set_output(Output output) {
+            m_output = std::move(output);
+        }
+
         bool has_packet() const;
         std::unique_ptr<Packet> get_packet();
         void send_packet(Packet const& packet);
 
+        /**
+         * Encrypt and frame a packet into the write buffer, without writing
+         * it to the socket. Use flush() once all packets are queued.
+         * @param packet Packet to send
+         */
+        void queue_packet(Packet const& packet);
+
+        /**
+         * Write as much of the queued data to the socket as possible
+         */
+        void flush();
+
+        /**
+         * Queue a keep-alive if the connection was idle long enough, and check
+         * that the previous one was answered. Keep-alives of the server are
+         * answered and their ACKs consumed as they are received.
+         * Throws session_exception if the connection is dead.
+         * @param now Current time
+         * @return Time to call again at
+         */
+        KeepAliveTracker::clock::time_point keep_alive(KeepAliveTracker::clock::time_point now = KeepAliveTracker::clock::now());
+
+        /**
+         * Replace the keep-alive settings, forgetting the learned interval
+         */
+        void set_keep_alive(KeepAliveTracker::Options const& options) {
+            m_keepAlive = KeepAliveTracker(options);
+        }
+
+        /**
+         * Continue with the state learned by another tracker, e.g. of an
+         * earlier session of the same account
+         */
+        void set_keep_alive(KeepAliveTracker const& tracker) {
+            m_keepAlive = tracker;
+        }
+
+        KeepAliveTracker const& keep_alive_stats() const {
+            return m_keepAlive;
+        }
+
         State getState() const {
             return m_state;
         }
 
+        /**
+         * @return true if the handshake completed and packets can be exchanged
+         */
+        bool is_connected() const {
+            return m_state == State::WAIT_PKT_HEADER || m_state == State::WAIT_PKT;
+        }
+
         bool hasWriteData() const {
             return m_writeBuffer.size() != 0;
         }
@@ -142,7 +258,7 @@ namespace ceema {
         nonce nextServerNonce();
 
         void read_packet(std::uint16_t length);
-        void send_packet(byte_vector const& data);
+        void queue_packet(byte_vector const& data);
 
         void packetReady();
     };
@@ -0,0 +1,125 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Resolver.h"
+
+#include <logging/logging.h>
+
+#include <cstring>
+
+namespace ceema {
+
+    std::string SocketAddress::toString() const {
+        char host[INET6_ADDRSTRLEN];
+        if (getnameinfo(get(), len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
+            return "<invalid>";
+        }
+        return host;
+    }
+
+    Resolver::Resolver(unsigned threads) : m_stop(false) {
+        m_threads.reserve(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            m_threads.emplace_back(&Resolver::worker, this);
+        }
+    }
+
+    Resolver::~Resolver() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            // Lookups in progress still finish, the rest are dropped
+            m_queue.clear();
+        }
+        m_wake.notify_all();
+        for (auto& thread: m_threads) {
+            thread.join();
+        }
+    }
+
+    void Resolver::resolve(std::string host, std::uint16_t port, Callback callback) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(Lookup{std::move(host), port, std::move(callback)});
+        }
+        m_wake.notify_one();
+    }
+
+    std::vector<SocketAddress> Resolver::lookup(std::string const& host, std::uint16_t port) {
+        addrinfo hints{};
+#ifdef IPV6
+        hints.ai_family = AF_UNSPEC;
+#else
+        hints.ai_family = AF_INET;
+#endif
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* results;
+        int s = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &results);
+        if (s != 0) {
+            throw std::runtime_error("Unable to resolve " + host + ": " + gai_strerror(s));
+        }
+
+        std::vector<SocketAddress> addresses;
+        for (addrinfo* result = results; result != nullptr; result = result->ai_next) {
+            SocketAddress address{};
+            std::memcpy(&address.addr, result->ai_addr, result->ai_addrlen);
+            address.len = static_cast<socklen_t>(result->ai_addrlen);
+            addresses.push_back(address);
+        }
+        freeaddrinfo(results);
+
+        if (addresses.empty()) {
+            throw std::runtime_error("Unable to resolve " + host + ": no addresses");
+        }
+        return addresses;
+    }
+
+    Resolver& Resolver::shared() {
+        static Resolver resolver;
+        return resolver;
+    }
+
+    void Resolver::worker() {
+        while (true) {
+            Lookup request;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+                if (m_stop) {
+                    return;
+                }
+                request = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            std::vector<SocketAddress> addresses;
+            std::exception_ptr error;
+            try {
+                addresses = lookup(request.host, request.port);
+            } catch (std::exception&) {
+                error = std::current_exception();
+            }
+            try {
+                request.callback(std::move(addresses), error);
+            } catch (std::exception& e) {
+                LOG_WARN(logging::loggerNetwork, "Resolver callback failed: " << e.what());
+            }
+        }
+    }
+
+}
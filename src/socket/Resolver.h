@@ -0,0 +1,116 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "socket.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <netdb.h>
+#else
+    #include <ws2tcpip.h>
+#endif
+
+namespace ceema {
+
+    /**
+     * Resolved socket address
+     */
+    struct SocketAddress {
+        sockaddr_storage addr;
+        socklen_t len;
+
+        int family() const {
+            return addr.ss_family;
+        }
+
+        sockaddr const* get() const {
+            return reinterpret_cast<sockaddr const*>(&addr);
+        }
+
+        /**
+         * @return Numeric host of the address
+         */
+        std::string toString() const;
+    };
+
+    /**
+     * Runs getaddrinfo on background threads, so name resolution does not
+     * block the caller. A few threads are used, so one slow lookup does not
+     * hold up the others.
+     */
+    class Resolver {
+    public:
+        /**
+         * Called on a resolver thread with the addresses of the host in the
+         * order returned by the system, or with the error
+         */
+        using Callback = std::function<void(std::vector<SocketAddress> addresses, std::exception_ptr error)>;
+
+    private:
+        struct Lookup {
+            std::string host;
+            std::uint16_t port;
+            Callback callback;
+        };
+
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<Lookup> m_queue;
+        bool m_stop;
+
+    public:
+        explicit Resolver(unsigned threads = 2);
+        ~Resolver();
+
+        Resolver(Resolver const&) = delete;
+        Resolver& operator=(Resolver const&) = delete;
+
+        /**
+         * Resolve a host in the background
+         * @param host Host name or numeric address
+         * @param port Port of the addresses
+         * @param callback Function to call with the result, on a resolver thread
+         */
+        void resolve(std::string host, std::uint16_t port, Callback callback);
+
+        /**
+         * Resolve a host on the calling thread. Throws on failure.
+         */
+        static std::vector<SocketAddress> lookup(std::string const& host, std::uint16_t port);
+
+        /**
+         * @return Resolver shared by the library
+         */
+        static Resolver& shared();
+
+    private:
+        void worker();
+    };
+
+}
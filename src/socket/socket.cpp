@@ -20,6 +20,7 @@
 #ifndef _WIN32
 	#include <unistd.h>
 	#include <netinet/in.h>
+	#include <netinet/tcp.h>
 	#include <netdb.h>
 	#include <fcntl.h>
 #else
@@ -136,7 +137,116 @@ namespace ceema {
 	}
 
 
-	bool TcpClient::connect_to(std::string address, std::uint16_t port) {
+	namespace {
+		template<typename T>
+		void set_option(SOCKET sock, int level, int name, T value, const char* what) {
+			if (::setsockopt(sock, level, name, reinterpret_cast<const char*>(&value), sizeof(value)) != 0) {
+				LOG_DEBUG(ceema::logging::loggerNetwork,
+						  "Unable to set " << what << ": " << format_error());
+			}
+		}
+	}
+
+	SocketOptions SocketOptions::latency() {
+		return SocketOptions();
+	}
+
+	SocketOptions SocketOptions::throughput() {
+		SocketOptions options;
+		options.noDelay = false;
+		options.keepAliveIdle = std::chrono::seconds(120);
+		options.keepAliveInterval = std::chrono::seconds(30);
+		options.keepAliveCount = 4;
+		options.receiveBuffer = 1 << 20;
+		options.sendBuffer = 1 << 20;
+		options.userTimeout = std::chrono::milliseconds(120000);
+		options.notSentLowat = 0;
+		return options;
+	}
+
+	SocketOptions SocketOptions::mobile() {
+		SocketOptions options;
+		// Carrier NATs commonly drop idle mappings after 30 seconds or more
+		options.keepAliveIdle = std::chrono::seconds(25);
+		options.keepAliveInterval = std::chrono::seconds(5);
+		options.keepAliveCount = 4;
+		options.userTimeout = std::chrono::milliseconds(20000);
+		return options;
+	}
+
+	SocketOptions SocketOptions::profile(std::string const& name) {
+		if (name == "latency") {
+			return latency();
+		} else if (name == "throughput") {
+			return throughput();
+		} else if (name == "mobile") {
+			return mobile();
+		}
+		throw std::invalid_argument("Unknown socket profile " + name);
+	}
+
+	void TcpSocket::apply(SocketOptions const& options) {
+		set_option<int>(m_sock, IPPROTO_TCP, TCP_NODELAY, options.noDelay ? 1 : 0, "TCP_NODELAY");
+
+		if (options.keepAliveIdle.count()) {
+			set_option<int>(m_sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+			set_option<int>(m_sock, IPPROTO_TCP, TCP_KEEPIDLE, static_cast<int>(options.keepAliveIdle.count()),
+							"TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+			if (options.keepAliveInterval.count()) {
+				set_option<int>(m_sock, IPPROTO_TCP, TCP_KEEPINTVL,
+								static_cast<int>(options.keepAliveInterval.count()), "TCP_KEEPINTVL");
+			}
+#endif
+#ifdef TCP_KEEPCNT
+			if (options.keepAliveCount) {
+				set_option<int>(m_sock, IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount, "TCP_KEEPCNT");
+			}
+#endif
+		}
+
+		if (options.receiveBuffer) {
+			set_option<int>(m_sock, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer, "SO_RCVBUF");
+		}
+		if (options.sendBuffer) {
+			set_option<int>(m_sock, SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF");
+		}
+#ifdef TCP_USER_TIMEOUT
+		if (options.userTimeout.count()) {
+			set_option<unsigned>(m_sock, IPPROTO_TCP, TCP_USER_TIMEOUT,
+								 static_cast<unsigned>(options.userTimeout.count()), "TCP_USER_TIMEOUT");
+		}
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+		if (options.notSentLowat) {
+			set_option<int>(m_sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat, "TCP_NOTSENT_LOWAT");
+		}
+#endif
+	}
+
+	bool TcpSocket::info(TcpInfo& info) const {
+#if defined(__linux__) && defined(TCP_INFO)
+		tcp_info raw{};
+		socklen_t len = sizeof(raw);
+		if (::getsockopt(m_sock, IPPROTO_TCP, TCP_INFO, &raw, &len) != 0) {
+			return false;
+		}
+		info.rtt = std::chrono::microseconds(raw.tcpi_rtt);
+		info.rttVar = std::chrono::microseconds(raw.tcpi_rttvar);
+		info.retransmits = raw.tcpi_retransmits;
+		info.totalRetransmits = raw.tcpi_total_retrans;
+		info.lost = raw.tcpi_lost;
+		info.unacked = raw.tcpi_unacked;
+		info.congestionWindow = raw.tcpi_snd_cwnd;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool TcpClient::connect_to(std::string address, std::uint16_t port, SocketOptions const& options) {
 		LOG_TRACE(ceema::logging::loggerNetwork,
 				  "Connecting to " << address << " port " << port);
 		if (m_sock != INVALID_SOCKET) {
@@ -178,6 +288,7 @@ namespace ceema {
 								  << format_error());
 				continue;
 			}
+			apply(options);
 
 			char hostname[INET6_ADDRSTRLEN];
 			getnameinfo(next_result->ai_addr, next_result->ai_addrlen, hostname,
@@ -18,6 +18,7 @@
 
 #include "config.h"
 
+#include <chrono>
 #include <cstdint>
 #include <stdexcept>
 #include <string>
@@ -105,6 +106,66 @@ namespace ceema {
         }
     };
 
+    /**
+     * TCP tuning of a socket. Zero values leave the system default in place.
+     * Default constructed options are the latency profile. Best applied
+     * before connecting: buffer sizes set on a connected socket no longer
+     * affect the window scaling agreed on in the handshake.
+     */
+    struct SocketOptions {
+        // Disable Nagle's algorithm, so small packets (ACKs, keepalives) go out at once
+        bool noDelay = true;
+        // TCP keepalive probes, disabled if the idle time is 0
+        std::chrono::seconds keepAliveIdle{60};
+        std::chrono::seconds keepAliveInterval{10};
+        int keepAliveCount = 3;
+        // Kernel buffer sizes in bytes
+        int receiveBuffer = 0;
+        int sendBuffer = 0;
+        // Drop the connection if sent data stays unacknowledged this long
+        std::chrono::milliseconds userTimeout{30000};
+        // Only report the socket writable while less than this is unsent
+        int notSentLowat = 16384;
+
+        /**
+         * Small packets with minimal delay, dead peers noticed within a minute or two
+         */
+        static SocketOptions latency();
+
+        /**
+         * Bulk transfers: Nagle enabled, large buffers, relaxed timeouts
+         */
+        static SocketOptions throughput();
+
+        /**
+         * Mobile networks: keepalives frequent enough to hold NAT mappings,
+         * fast detection of connections lost to network changes
+         */
+        static SocketOptions mobile();
+
+        /**
+         * Look up a profile by name ("latency", "throughput" or "mobile").
+         * Throws std::invalid_argument for unknown names
+         */
+        static SocketOptions profile(std::string const& name);
+    };
+
+    /**
+     * Connection statistics of a TCP socket, see TcpSocket::info()
+     */
+    struct TcpInfo {
+        // Smoothed round trip time and its variance
+        std::chrono::microseconds rtt;
+        std::chrono::microseconds rttVar;
+        // Retransmits of the current unacknowledged segment
+        std::uint32_t retransmits;
+        std::uint32_t totalRetransmits;
+        std::uint32_t lost;
+        std::uint32_t unacked;
+        // Congestion window in segments
+        std::uint32_t congestionWindow;
+    };
+
     /**
      * Socket wrapper. Performs basic error checking
      * on socket operations. Does not actually own the socket,
@@ -130,6 +191,13 @@ namespace ceema {
          */
         void close();
 
+        /**
+         * @return The wrapped socket
+         */
+        SOCKET fd() const {
+            return m_sock;
+        }
+
         /**
          * Send length bytes. Either sends all bytes, or if nonblocking,
          * none. Throws socket_exception if there is some
@@ -168,6 +236,20 @@ namespace ceema {
          */
         void set_blocking(bool blocking);
 
+        /**
+         * Apply TCP tuning. Options not supported by the platform are
+         * skipped, failures are logged but not fatal.
+         * @param options Options to set
+         */
+        void apply(SocketOptions const& options);
+
+        /**
+         * Sample the kernel TCP statistics of the connection
+         * @param info Filled with the statistics
+         * @return false if not supported by the platform or the socket
+         */
+        bool info(TcpInfo& info) const;
+
         /**
          * Initialize socket stack on Windows
          * @return true iff init ok
@@ -195,9 +277,10 @@ namespace ceema {
          * connected
          * @param address Host or IP address to connect to
          * @param port Port to connect to
+         * @param options Tuning applied before connecting
          * @return true iff connection succeeded, false otherwise
          */
-        bool connect_to(std::string address, std::uint16_t port);
+        bool connect_to(std::string address, std::uint16_t port, SocketOptions const& options = SocketOptions());
     };
 
 }
\ No newline at end of file
@@ -6,65 +6,180 @@
 
 #include <libpurple/debug.h>
 #include <libpurple/blist.h>
+#include <libpurple/util.h>
 #include <encoding/hex.h>
+#include <logging/logging.h>
+#include <cstdlib>
+#include <string>
+#include <vector>
 
 ContactStore::ContactStore(ceema::IdentAPI& ident_api) : m_ident_api(ident_api) {}
 
 bool ContactStore::has_contact(ceema::client_id const& id) {
-    auto search = m_idmap.find(id);
-    return (search != m_idmap.end());
+    Entry* entry = find_entry(id);
+    if (!entry) {
+        return false;
+    }
+    // Stale keys are still usable, stale failures warrant a new lookup
+    return entry->state == EntryState::FOUND || entry->expires > std::time(nullptr);
+}
+
+bool ContactStore::is_known(ceema::client_id const& id) {
+    Entry* entry = find_entry(id);
+    return entry && entry->state == EntryState::FOUND;
+}
+
+bool ContactStore::is_unknown(ceema::client_id const& id) {
+    Entry* entry = find_entry(id);
+    return entry && entry->state == EntryState::NOT_FOUND;
 }
 
 ContactPtr ContactStore::get_contact(ceema::client_id const& id) {
-    return m_idmap.find(id)->second;
-    //return m_idmap[id];
+    Entry* entry = find_entry(id);
+    if (!entry) {
+        return nullptr;
+    }
+    if (entry->state == EntryState::FOUND && entry->expires <= std::time(nullptr)) {
+        refresh(id);
+    }
+    return entry->contact;
 }
 
 void ContactStore::add_contact(ceema::Contact const& contact) {
-    m_idmap.emplace(contact.id(), std::make_shared<ceema::Contact>(contact));
+    set_entry(contact.id(), std::make_shared<ceema::Contact>(contact), EntryState::FOUND,
+              std::time(nullptr) + m_policy.found_ttl);
 }
 
 ceema::future<ContactPtr> ContactStore::fetch_contact(ceema::client_id id) {
-    if (has_contact(id)) {
-        ceema::promise<ContactPtr> prom;
-        prom.set_value(m_idmap[id]);
-        return prom.get_future();
+    Entry* found = find_entry(id);
+    if (found) {
+        Entry& entry = *found;
+        if (entry.state == EntryState::FOUND) {
+            // Serve stale keys, never block on the refresh
+            if (entry.expires <= std::time(nullptr)) {
+                refresh(id);
+            }
+            ceema::promise<ContactPtr> prom;
+            prom.set_value(entry.contact);
+            return prom.get_future();
+        } else if (entry.expires > std::time(nullptr)) {
+            ceema::promise<ContactPtr> prom;
+            if (entry.state == EntryState::NOT_FOUND) {
+                prom.set_exception(std::make_exception_ptr(ceema::unknown_identity_exception(id)));
+            } else {
+                prom.set_exception(std::make_exception_ptr(std::runtime_error("Contact lookup failed recently")));
+            }
+            return prom.get_future();
+        }
     }
-    auto fut_contact = m_ident_api.getClientInfo(id.toString());
+
+    return lookup(id);
+}
+
+ceema::future<ContactPtr> ContactStore::lookup(ceema::client_id const& id) {
+    auto fut_contact = m_ident_api.fetchClientInfo(id);
     return fut_contact.next([this, id](ceema::future<ceema::Contact> fut) {
+        std::time_t now = std::time(nullptr);
         try {
             auto contact_ptr = std::make_shared<ceema::Contact>(fut.get());
-            m_idmap.emplace(id, contact_ptr);
+            auto search = m_idmap.find(id);
+            if (search != m_idmap.end() && search->second.state == EntryState::FOUND &&
+                search->second.contact && search->second.contact->pk() != contact_ptr->pk()) {
+                // Keys of an ID never change, do not trust the new one
+                LOG_WARN(ceema::logging::loggerRoot, "Public key of " << id.toString()
+                        << " changed on the server, keeping the known key");
+                contact_ptr = search->second.contact;
+            }
+            set_entry(id, contact_ptr, EntryState::FOUND, now + m_policy.found_ttl);
             return contact_ptr;
+        } catch (ceema::unknown_identity_exception& e) {
+            LOG_DBG("Contact does not exist: " << e.what());
+            set_entry(id, nullptr, EntryState::NOT_FOUND, now + m_policy.not_found_ttl);
+            throw;
         } catch (std::exception& e) {
             LOG_DBG("Failed to fetch contact: " << e.what());
-            m_idmap.emplace(id, nullptr);
+            auto search = m_idmap.find(id);
+            if (search != m_idmap.end() && search->second.state == EntryState::FOUND) {
+                // Keep using the stale key, try again later
+                set_entry(id, search->second.contact, EntryState::FOUND, now + m_policy.failure_ttl);
+            } else {
+                set_entry(id, nullptr, EntryState::FAILED, now + m_policy.failure_ttl);
+            }
             throw; //std::rethrow_exception(std::current_exception());
         }
     });
 }
 
-void ContactStore::update_buddies(PurpleAccount* account) const {
-    for(auto& contact_pair: m_idmap) {
+void ContactStore::refresh(ceema::client_id const& id) {
+    auto search = m_idmap.find(id);
+    if (search == m_idmap.end() || search->second.refreshing) {
+        return;
+    }
+    search->second.refreshing = true;
+    lookup(id);
+}
 
-        auto idStr = contact_pair.first.toString();
-        PurpleBuddy* buddy = purple_find_buddy(account, idStr.c_str());
-        if (buddy) {
-            if (!contact_pair.second) {
-                purple_blist_node_set_string(&buddy->node, "public-key",
-                                             "!");
+ContactStore::Entry* ContactStore::find_entry(ceema::client_id const& id) {
+    auto search = m_idmap.find(id);
+    if (search != m_idmap.end()) {
+        return &search->second;
+    }
+
+    if (m_keys) {
+        auto record = m_keys->find(id);
+        if (record) {
+            Entry& entry = m_idmap[id];
+            if (record->flags & ceema::KeyStore::UNKNOWN_ID) {
+                entry.state = EntryState::NOT_FOUND;
             } else {
-                purple_blist_node_set_string(&buddy->node, "public-key",
-                                             ceema::hex_encode(
-                                                     contact_pair.second->pk()).c_str());
+                entry.state = EntryState::FOUND;
+                entry.contact = std::make_shared<ceema::Contact>(id, record->pk);
             }
+            entry.expires = static_cast<std::time_t>(record->expires);
+            entry.refreshing = false;
+            return &entry;
         }
     }
+    return nullptr;
+}
+
+void ContactStore::set_entry(ceema::client_id const& id, ContactPtr contact, EntryState state, std::time_t expires) {
+    Entry& entry = m_idmap[id];
+    entry.contact = std::move(contact);
+    entry.state = state;
+    entry.expires = expires;
+    entry.refreshing = false;
+
+    // Transient failures are not worth remembering
+    if (m_keys && state != EntryState::FAILED) {
+        ceema::KeyStore::Record record{};
+        record.id = id;
+        if (entry.contact) {
+            record.pk = entry.contact->pk();
+        } else {
+            record.flags = ceema::KeyStore::UNKNOWN_ID;
+        }
+        record.expires = expires;
+        m_keys->put(record);
+    }
 }
 
 void ContactStore::load_buddies(PurpleAccount* account) {
     PurpleConnection* gc = purple_account_get_connection(account);
 
+    gchar* dir = g_build_filename(purple_user_dir(), "threepl", NULL);
+    purple_build_dir(dir, 0700);
+    gchar* file = g_strdup_printf("%s.keys", purple_account_get_username(account));
+    gchar* path = g_build_filename(dir, file, NULL);
+    m_keys.reset(new ceema::KeyStore(path));
+    g_free(path);
+    g_free(file);
+    g_free(dir);
+
+    // Keys stored by older versions, moved into the key store at once
+    std::vector<ceema::KeyStore::Record> migrated;
+    std::vector<PurpleBuddy*> migrated_buddies;
+
     for (GSList* buddies = purple_find_buddies(account, NULL); buddies;
          buddies = g_slist_delete_link(buddies, buddies)) {
         PurpleBuddy* buddy = static_cast<PurpleBuddy*>(buddies->data);
@@ -84,21 +199,40 @@ void ContactStore::load_buddies(PurpleAccount* account) {
             // Invalid ID, broken buddy
             continue;
         }
-        if (!has_contact(id)) {
-            const char *pk = purple_blist_node_get_string(&buddy->node, "public-key");
-            if (pk) {
+        // Only consult the store, contacts are materialized once used
+        auto record = m_keys->find(id);
+        const char *pk = purple_blist_node_get_string(&buddy->node, "public-key");
+        if (pk) {
+            if (!record) {
+                ceema::KeyStore::Record legacy{};
+                legacy.id = id;
                 if (*pk == '!') {
-                    m_idmap.emplace(id, nullptr);
+                    legacy.flags = ceema::KeyStore::UNKNOWN_ID;
                 } else {
                     std::string pk_string{pk};
-                    add_contact(ceema::Contact(id, ceema::public_key{
-                            ceema::hex_decode(pk_string)}));
+                    legacy.pk = ceema::public_key{ceema::hex_decode(pk_string)};
                 }
+                // Entries stored without lifetime are considered expired
+                const char* expires_str = purple_blist_node_get_string(&buddy->node, "public-key-expires");
+                if (expires_str) {
+                    legacy.expires = std::strtoll(expires_str, nullptr, 10);
+                }
+                migrated.push_back(legacy);
+                record = legacy;
             }
+            migrated_buddies.push_back(buddy);
         }
 
-        if (has_contact(id)) {
+        if (record && !(record->flags & ceema::KeyStore::UNKNOWN_ID)) {
             purple_prpl_got_user_status(account, purple_buddy_get_name(buddy), "online", NULL, NULL);
         }
     }
+
+    if (!migrated.empty()) {
+        m_keys->put(migrated);
+    }
+    for (PurpleBuddy* buddy: migrated_buddies) {
+        purple_blist_node_remove_setting(&buddy->node, "public-key");
+        purple_blist_node_remove_setting(&buddy->node, "public-key-expires");
+    }
 }
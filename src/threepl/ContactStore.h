@@ -8,26 +8,89 @@
 #include <contact/Contact.h>
 #include <unordered_map>
 #include <api/IdentAPI.h>
+#include <contact/KeyStore.h>
 #include <memory>
+#include <ctime>
 #include <libpurple/account.h>
 
 typedef std::shared_ptr<ceema::Contact> ContactPtr;
 
+/**
+ * Lifetimes (in seconds) of cached key lookups
+ */
+struct ContactCachePolicy {
+    // Known key, refreshed in the background once expired
+    std::time_t found_ttl = 30 * 24 * 3600;
+    // ID unknown to the server
+    std::time_t not_found_ttl = 24 * 3600;
+    // Lookup failed for some other reason (network, server error)
+    std::time_t failure_ttl = 5 * 60;
+};
+
 class ContactStore {
-    std::unordered_map<ceema::client_id, ContactPtr> m_idmap;
+    enum class EntryState {
+        FOUND,
+        NOT_FOUND,
+        FAILED,
+    };
+
+    struct Entry {
+        ContactPtr contact;
+        EntryState state;
+        std::time_t expires;
+        bool refreshing;
+    };
+
+    // Entries in use, materialized from the key store on demand
+    std::unordered_map<ceema::client_id, Entry> m_idmap;
+    std::unique_ptr<ceema::KeyStore> m_keys;
     ceema::IdentAPI& m_ident_api;
+    ContactCachePolicy m_policy;
 
 public:
     ContactStore(ceema::IdentAPI& ident_api);
 
+    void set_cache_policy(ContactCachePolicy const& policy) {
+        m_policy = policy;
+    }
+
+    /**
+     * Checks if the key lookup for a contact can be answered without network access,
+     * i.e. a key is known or the lookup failed recently.
+     */
     bool has_contact(ceema::client_id const& id);
 
+    /**
+     * Checks if a key of the ID is known, without network access
+     */
+    bool is_known(ceema::client_id const& id);
+
+    /**
+     * Checks if the ID is known not to exist, without network access
+     */
+    bool is_unknown(ceema::client_id const& id);
+
+    /**
+     * Get a cached contact. Expired keys are still returned, but are refreshed
+     * in the background.
+     * @return Contact, or nullptr if no key is known
+     */
     ContactPtr get_contact(ceema::client_id const& id);
 
     void add_contact(ceema::Contact const& contact);
 
     ceema::future<ContactPtr> fetch_contact(ceema::client_id id);
 
-    void update_buddies(PurpleAccount* account) const;
+    /**
+     * Open the key store of the account and mark buddies with a known key online
+     */
     void load_buddies(PurpleAccount* account);
+
+private:
+    Entry* find_entry(ceema::client_id const& id);
+
+    ceema::future<ContactPtr> lookup(ceema::client_id const& id);
+    void refresh(ceema::client_id const& id);
+
+    void set_entry(ceema::client_id const& id, ContactPtr contact, EntryState state, std::time_t expires);
 };
\ No newline at end of file
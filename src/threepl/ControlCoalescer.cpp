@@ -0,0 +1,106 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ControlCoalescer.h"
+#include "ThreeplConnection.h"
+
+#include <libpurple/eventloop.h>
+#include <logging/logging.h>
+
+ControlCoalescer::~ControlCoalescer() {
+    clear();
+}
+
+void ControlCoalescer::queue_status(ceema::client_id const& contact, ceema::MessageStatus status, ceema::message_id const& id) {
+    m_pending[contact].statuses.emplace_back(status, id);
+    schedule();
+}
+
+void ControlCoalescer::set_typing(ceema::client_id const& contact, bool typing) {
+    Pending& pending = m_pending[contact];
+    pending.has_typing = true;
+    pending.typing = typing;
+    schedule();
+}
+
+void ControlCoalescer::flush() {
+    if (m_timer) {
+        purple_timeout_remove(m_timer);
+        m_timer = 0;
+    }
+
+    // Sending may queue new control messages, work on a snapshot
+    auto pending = std::move(m_pending);
+    m_pending.clear();
+    std::time_t now = std::time(nullptr);
+
+    for(auto& entry: pending) {
+        ceema::client_id const& contact = entry.first;
+        auto& statuses = entry.second.statuses;
+
+        // Group by status, keeping the order of IDs within a status
+        std::stable_sort(statuses.begin(), statuses.end(),
+                         [](auto const& a, auto const& b) { return a.first < b.first; });
+        auto iter = statuses.begin();
+        while (iter != statuses.end()) {
+            ceema::PayloadMessageStatus payload;
+            payload.m_status = iter->first;
+            while (iter != statuses.end() && iter->first == payload.m_status &&
+                    payload.m_ids.size() < MAX_STATUS_IDS) {
+                payload.m_ids.push_back(iter->second);
+                ++iter;
+            }
+            LOG_DBG("Sending status " << payload.m_status << " for " << payload.m_ids.size()
+                                      << " messages to " << contact.toString());
+            m_connection.send_message(contact, std::move(payload));
+        }
+
+        if (entry.second.has_typing) {
+            bool typing = entry.second.typing;
+            auto search = m_typing.find(contact);
+            bool changed = search == m_typing.end() || search->second.typing != typing;
+            if (changed || (typing && now - search->second.sent >= TYPING_REFRESH)) {
+                ceema::PayloadTyping payload;
+                payload.m_typing = typing;
+                m_connection.send_message(contact, std::move(payload));
+                m_typing[contact] = TypingState{typing, now};
+            }
+        }
+    }
+}
+
+void ControlCoalescer::clear() {
+    if (m_timer) {
+        purple_timeout_remove(m_timer);
+        m_timer = 0;
+    }
+    m_pending.clear();
+    m_typing.clear();
+}
+
+void ControlCoalescer::schedule() {
+    if (!m_timer) {
+        m_timer = purple_timeout_add(FLUSH_WINDOW, &on_flush, this);
+    }
+}
+
+gboolean ControlCoalescer::on_flush(gpointer data) {
+    ControlCoalescer* coalescer = static_cast<ControlCoalescer*>(data);
+    // Removed by returning FALSE
+    coalescer->m_timer = 0;
+    coalescer->flush();
+    return FALSE;
+}
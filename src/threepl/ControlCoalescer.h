@@ -0,0 +1,96 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CEEMA_CONTROLCOALESCER_H
+#define CEEMA_CONTROLCOALESCER_H
+
+#include <protocol/packet/payloads/PayloadControl.h>
+#include <protocol/data/Client.h>
+
+#include <glib.h>
+#include <ctime>
+#include <unordered_map>
+#include <vector>
+
+class ThreeplConnection;
+
+/**
+ * Collects outgoing control messages per contact for a short while, so that
+ * receipts for many messages go out as a single status message and typing
+ * changes only go out when the state actually changed.
+ */
+class ControlCoalescer {
+    // Time in ms control messages are held back
+    static const guint FLUSH_WINDOW = 250;
+    // Maximum number of IDs in a single status message
+    static const std::size_t MAX_STATUS_IDS = 256;
+    // Unchanged typing state is repeated after this many seconds, so it does not time out
+    static const std::time_t TYPING_REFRESH = 10;
+
+    struct Pending {
+        std::vector<std::pair<ceema::MessageStatus, ceema::message_id>> statuses;
+        bool has_typing = false;
+        bool typing = false;
+    };
+
+    struct TypingState {
+        bool typing;
+        std::time_t sent;
+    };
+
+    ThreeplConnection& m_connection;
+    std::unordered_map<ceema::client_id, Pending> m_pending;
+    // Last typing state sent to each contact
+    std::unordered_map<ceema::client_id, TypingState> m_typing;
+    guint m_timer;
+
+public:
+    explicit ControlCoalescer(ThreeplConnection& connection) : m_connection(connection), m_timer(0) {}
+    ~ControlCoalescer();
+
+    ControlCoalescer(ControlCoalescer const&) = delete;
+    ControlCoalescer& operator=(ControlCoalescer const&) = delete;
+
+    /**
+     * Queue a delivery receipt
+     * @param contact Sender of the message
+     * @param status Status to report
+     * @param id ID of the message
+     */
+    void queue_status(ceema::client_id const& contact, ceema::MessageStatus status, ceema::message_id const& id);
+
+    /**
+     * Queue a typing notification, replacing any queued one for the contact
+     */
+    void set_typing(ceema::client_id const& contact, bool typing);
+
+    /**
+     * Send everything that is queued
+     */
+    void flush();
+
+    /**
+     * Drop everything that is queued, e.g. when disconnecting
+     */
+    void clear();
+
+private:
+    void schedule();
+    static gboolean on_flush(gpointer data);
+};
+
+
+#endif //CEEMA_CONTROLCOALESCER_H
@@ -12,7 +12,84 @@ PurpleConvChat* ThreeplGroup::find_conversation(PurpleConnection *gc) const {
     return conv ? PURPLE_CONV_CHAT(conv) : NULL;
 }
 
-PurpleConvChat* ThreeplGroup::create_conversation(PurpleConnection *gc) const {
+namespace {
+    void add_users(PurpleConvChat *conv, std::vector<ceema::client_id> const& members,
+                   ceema::client_id const& owner, bool new_arrivals) {
+        GList* users = NULL;
+        GList* flags = NULL;
+        for(ceema::client_id const& cid: members) {
+            std::string name = cid.toString();
+            if (new_arrivals && purple_conv_chat_find_user(conv, name.c_str())) {
+                continue;
+            }
+            users = g_list_prepend(users, g_strdup(name.c_str()));
+            flags = g_list_prepend(flags, GINT_TO_POINTER( cid == owner ? PURPLE_CBFLAGS_FOUNDER : PURPLE_CBFLAGS_NONE ));
+        }
+        if (users) {
+            purple_conv_chat_add_users(conv, users, NULL, flags, new_arrivals);
+        }
+        g_list_free_full(users, &g_free);
+        g_list_free(flags);
+    }
+}
+
+bool MemberSet::insert(ceema::client_id const& member) {
+    auto iter = std::lower_bound(m_members.begin(), m_members.end(), member);
+    if (iter != m_members.end() && *iter == member) {
+        return false;
+    }
+    m_members.insert(iter, member);
+    record_change(m_added, m_removed, member);
+    return true;
+}
+
+bool MemberSet::erase(ceema::client_id const& member) {
+    auto iter = std::lower_bound(m_members.begin(), m_members.end(), member);
+    if (iter == m_members.end() || *iter != member) {
+        return false;
+    }
+    m_members.erase(iter);
+    record_change(m_removed, m_added, member);
+    return true;
+}
+
+void MemberSet::assign(std::vector<ceema::client_id> members) {
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+
+    // Walk both sorted lists once to find the difference
+    auto old_iter = m_members.begin();
+    auto new_iter = members.begin();
+    while (old_iter != m_members.end() || new_iter != members.end()) {
+        if (new_iter == members.end() || (old_iter != m_members.end() && *old_iter < *new_iter)) {
+            record_change(m_removed, m_added, *old_iter++);
+        } else if (old_iter == m_members.end() || *new_iter < *old_iter) {
+            record_change(m_added, m_removed, *new_iter++);
+        } else {
+            ++old_iter;
+            ++new_iter;
+        }
+    }
+
+    m_members = std::move(members);
+}
+
+void MemberSet::record_change(std::vector<ceema::client_id>& changes,
+                              std::vector<ceema::client_id>& opposite,
+                              ceema::client_id const& member) {
+    // A change cancels out a pending opposite change
+    auto iter = std::lower_bound(opposite.begin(), opposite.end(), member);
+    if (iter != opposite.end() && *iter == member) {
+        opposite.erase(iter);
+        return;
+    }
+    iter = std::lower_bound(changes.begin(), changes.end(), member);
+    if (iter == changes.end() || *iter != member) {
+        changes.insert(iter, member);
+    }
+}
+
+PurpleConvChat* ThreeplGroup::create_conversation(PurpleConnection *gc) {
     auto conv = find_conversation(gc);
     if (conv) {
         return conv;
@@ -24,14 +101,9 @@ PurpleConvChat* ThreeplGroup::create_conversation(PurpleConnection *gc) const {
                                                  "nickname", "");
     purple_conv_chat_set_nick(conv, nick);
 
-    // Set initial members
-    GList* users = NULL;
-    GList* flags = NULL;
-    for(ceema::client_id const& cid: members()) {
-        users = g_list_append(users, g_strdup(cid.toString().c_str()));
-        flags = g_list_append(flags, GINT_TO_POINTER( cid == owner() ? PURPLE_CBFLAGS_FOUNDER : PURPLE_CBFLAGS_NONE ));
-    }
-    purple_conv_chat_add_users(conv, users, NULL, flags, false);
+    // Set initial members, earlier changes are covered by the full roster
+    add_users(conv, members(), owner(), false);
+    clear_member_changes();
 
     // Update group data
     update_conversation(conv);
@@ -39,7 +111,7 @@ PurpleConvChat* ThreeplGroup::create_conversation(PurpleConnection *gc) const {
     return conv;
 }
 
-void ThreeplGroup::update_conversation(PurpleConvChat *conv) const {
+void ThreeplGroup::update_conversation(PurpleConvChat *conv) {
     // Set topic
     const char* topic = purple_conv_chat_get_topic(conv);
     if (!topic || name() != topic) {
@@ -47,29 +119,21 @@ void ThreeplGroup::update_conversation(PurpleConvChat *conv) const {
                                    name().c_str());
     }
 
-    // Set members
-    GList* new_users = NULL;
-    GList* users = NULL;
-    GList* new_flags = NULL;
-    GList* flags = NULL;
-    for(ceema::client_id const& cid: members()) {
-        if (purple_conv_chat_find_user(conv, cid.toString().c_str())) {
-            users = g_list_append(users, g_strdup(cid.toString().c_str()));
-            flags = g_list_append(flags, GINT_TO_POINTER( cid == owner() ? PURPLE_CBFLAGS_FOUNDER : PURPLE_CBFLAGS_NONE ));
-        } else {
-            new_users = g_list_append(new_users, g_strdup(cid.toString().c_str()));
-            new_flags = g_list_append(new_flags, GINT_TO_POINTER( cid == owner() ? PURPLE_CBFLAGS_FOUNDER : PURPLE_CBFLAGS_NONE ));
+    // Apply member changes
+    GList* removed = NULL;
+    for(ceema::client_id const& cid: m_members.removed()) {
+        std::string name = cid.toString();
+        if (purple_conv_chat_find_user(conv, name.c_str())) {
+            removed = g_list_prepend(removed, g_strdup(name.c_str()));
         }
-
     }
-    purple_conv_chat_clear_users(conv);
-    purple_conv_chat_add_users(conv, users, NULL, flags, false);
-    purple_conv_chat_add_users(conv, new_users, NULL, new_flags, true);
+    if (removed) {
+        purple_conv_chat_remove_users(conv, removed, NULL);
+    }
+    g_list_free_full(removed, &g_free);
 
-    g_list_free_full(users, &g_free);
-    g_list_free(flags);
-    g_list_free_full(new_users, &g_free);
-    g_list_free(new_flags);
+    add_users(conv, m_members.added(), owner(), true);
+    clear_member_changes();
 }
 
 PurpleChat* ThreeplGroup::find_blist_chat(PurpleAccount *account) const {
@@ -114,11 +178,21 @@ ThreeplGroup* GroupStore::find_or_create(GHashTable* components) {
     return find_group(owner_id, gid, true);
 }
 
+ThreeplGroup* GroupStore::add_group(ceema::group_uid const& uid) {
+    auto res = m_groups.emplace(std::piecewise_construct, std::forward_as_tuple(uid),
+                                std::forward_as_tuple(uid.cid(), uid.gid(), m_nextId));
+    ThreeplGroup* group = &res.first->second;
+    if (res.second) {
+        m_chats.emplace(m_nextId++, group);
+    }
+    return group;
+}
+
 PurpleChat* GroupStore::find_chat(PurpleAccount* account, ThreeplGroup const& group) const {
     return group.find_blist_chat(account);
 }
 
-void GroupStore::update_chat(PurpleAccount* account, ThreeplGroup const& group) const {
+void GroupStore::update_chat(PurpleAccount* account, ThreeplGroup& group) {
     // Update stored data if any
     PurpleChat* chat = group.find_blist_chat(account);
     if (chat) {
@@ -129,12 +203,15 @@ void GroupStore::update_chat(PurpleAccount* account, ThreeplGroup const& group)
     PurpleConvChat* chat_conv = group.find_conversation(purple_account_get_connection(account));
     if (chat_conv) {
         group.update_conversation(chat_conv);
+    } else {
+        // Opening the conversation adds the full roster
+        group.clear_member_changes();
     }
 }
 
-void GroupStore::update_chats(PurpleAccount* account) const {
+void GroupStore::update_chats(PurpleAccount* account) {
     for(auto& group: m_groups) {
-        update_chat(account, group);
+        update_chat(account, group.second);
     }
 }
 
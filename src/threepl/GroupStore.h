@@ -10,14 +10,65 @@
 #include <libpurple/blist.h>
 #include <encoding/hex.h>
 
+#include <algorithm>
+#include <unordered_map>
+
 class ThreeplConnection;
 
+/**
+ * Sorted set of group members, tracking which members were added and
+ * removed since the last time the changes were consumed.
+ */
+class MemberSet {
+    std::vector<ceema::client_id> m_members;
+    std::vector<ceema::client_id> m_added;
+    std::vector<ceema::client_id> m_removed;
+
+public:
+    /**
+     * @return Members, sorted by ID
+     */
+    std::vector<ceema::client_id> const& members() const {
+        return m_members;
+    }
+
+    bool contains(ceema::client_id const& member) const {
+        return std::binary_search(m_members.begin(), m_members.end(), member);
+    }
+
+    bool insert(ceema::client_id const& member);
+    bool erase(ceema::client_id const& member);
+
+    /**
+     * Replace the members, recording the difference with the current set
+     */
+    void assign(std::vector<ceema::client_id> members);
+
+    std::vector<ceema::client_id> const& added() const {
+        return m_added;
+    }
+
+    std::vector<ceema::client_id> const& removed() const {
+        return m_removed;
+    }
+
+    void clear_changes() {
+        m_added.clear();
+        m_removed.clear();
+    }
+
+private:
+    void record_change(std::vector<ceema::client_id>& changes,
+                       std::vector<ceema::client_id>& opposite,
+                       ceema::client_id const& member);
+};
+
 class ThreeplGroup {
     ceema::client_id m_owner;
     ceema::group_id m_groupid;
     ceema::group_uid m_groupuid;
     std::string m_name;
-    std::vector<ceema::client_id> m_members;
+    MemberSet m_members;
     //TODO: icon path
 
     // (Unique) ID of the group, can be used as chat ID
@@ -31,37 +82,30 @@ public:
      */
     ThreeplGroup(ceema::client_id owner, ceema::group_id gid, int id) :
             m_owner(owner), m_groupid(gid), m_groupuid(ceema::make_group_uid(m_owner, m_groupid)),
-            m_members{owner}, m_id(id)
+            m_id(id)
     {
         m_name = ceema::hex_encode(gid) + " owned by " + owner.toString();
+        m_members.insert(owner);
     }
 
     std::vector<ceema::client_id> const& members() const {
-        return m_members;
+        return m_members.members();
+    }
+
+    bool has_member(ceema::client_id const& member) const {
+        return m_members.contains(member);
     }
 
     bool add_member(ceema::client_id const& member) {
-        for(auto& cid: m_members) {
-            if (cid == member) {
-                return false;
-            }
-        }
-        m_members.emplace_back(member);
-        return true;
+        return m_members.insert(member);
     }
 
     bool remove_member(ceema::client_id const& member) {
-        for(auto iter = m_members.begin(); iter != m_members.end(); ++iter) {
-            if (*iter == member) {
-                m_members.erase(iter);
-                return true;
-            }
-        }
-        return false;
+        return m_members.erase(member);
     }
 
-    void set_members(std::vector<ceema::client_id> const& members) {
-        m_members = members;
+    void set_members(std::vector<ceema::client_id> members) {
+        m_members.assign(std::move(members));
     }
 
 
@@ -99,62 +143,68 @@ public:
     }
 
     PurpleConvChat* find_conversation(PurpleConnection *gc) const;
-    PurpleConvChat* create_conversation(PurpleConnection *gc) const;
-    void update_conversation(PurpleConvChat *conv) const;
+    PurpleConvChat* create_conversation(PurpleConnection *gc);
+    /**
+     * Update the topic and apply member changes since the last update to the roster
+     */
+    void update_conversation(PurpleConvChat *conv);
+    /**
+     * Forget member changes, e.g. once the roster was rebuilt
+     */
+    void clear_member_changes() {
+        m_members.clear_changes();
+    }
     PurpleChat* find_blist_chat(PurpleAccount *account) const;
     void update_blist_chat(PurpleChat *chat) const;
 };
 
 
 class GroupStore {
-    // TODO: should be map, but no hash method yet
-    std::vector<ThreeplGroup> m_groups;
+    // Groups are never removed, node storage keeps handed out pointers valid
+    std::unordered_map<ceema::group_uid, ThreeplGroup> m_groups;
+    // Index from chat ID to group
+    std::unordered_map<int, ThreeplGroup*> m_chats;
+    int m_nextId;
     ThreeplConnection &m_conn;
 
 public:
-    GroupStore(ThreeplConnection &conn) : m_conn(conn) {}
-
-    ThreeplGroup* find_group(ceema::group_uid uid, bool add_if_new = false) {
-        return find_group(uid.cid(), uid.gid(), add_if_new);
-    }
+    GroupStore(ThreeplConnection &conn) : m_nextId(1), m_conn(conn) {}
 
-    ThreeplGroup* find_group(ceema::client_id owner, ceema::group_id gid, bool add_if_new = false) {
-        for(auto& group: m_groups) {
-            if (group.gid() == gid && group.owner() == owner) {
-                return &group;
-            }
+    ThreeplGroup* find_group(ceema::group_uid const& uid, bool add_if_new = false) {
+        auto search = m_groups.find(uid);
+        if (search != m_groups.end()) {
+            return &search->second;
         }
         if (add_if_new) {
-            return add_group(owner, gid);
+            return add_group(uid);
         } else {
             return nullptr;
         }
     }
 
+    ThreeplGroup* find_group(ceema::client_id owner, ceema::group_id gid, bool add_if_new = false) {
+        return find_group(ceema::make_group_uid(owner, gid), add_if_new);
+    }
+
     ThreeplGroup* find_group(int id) {
-        for(auto& group: m_groups) {
-            if (group.id() == id) {
-                return &group;
-            }
-        }
-        return nullptr;
+        auto search = m_chats.find(id);
+        return search != m_chats.end() ? search->second : nullptr;
     }
 
     ThreeplGroup* find_or_create(GHashTable* components);
 
     ThreeplGroup* add_group(ceema::client_id owner, ceema::group_id id) {
-        m_groups.emplace_back(owner, id, m_groups.size() + 1);
-        return  &m_groups.back();
+        return add_group(ceema::make_group_uid(owner, id));
     }
 
-    ThreeplGroup* add_group(ceema::group_uid uid) {
-        m_groups.emplace_back(uid.cid(), uid.gid(), m_groups.size() + 1);
-        return  &m_groups.back();
-    }
+    /**
+     * Add a group, or return the existing one with the same UID
+     */
+    ThreeplGroup* add_group(ceema::group_uid const& uid);
 
     PurpleChat* find_chat(PurpleAccount* account, ThreeplGroup const& group) const;
-    void update_chat(PurpleAccount* account, ThreeplGroup const& group) const;
-    void update_chats(PurpleAccount* account) const;
+    void update_chat(PurpleAccount* account, ThreeplGroup& group);
+    void update_chats(PurpleAccount* account);
     void load_chats(PurpleAccount* account);
 };
 
@@ -5,12 +5,20 @@
 #include <libpurple/debug.h>
 #include <api/BlobTransfer.h>
 #include <types/formatstr.h>
+#include <async/WorkerPool.h>
 #include "MessageHandler.h"
 
 #include "ThreeplConnection.h"
 #include "ContactStore.h"
 #include "Transfer.h"
 
+#include <algorithm>
+#include <ctime>
+
+constexpr std::size_t ThreeplMessageHandler::MAX_PENDING_SYNCS;
+constexpr std::chrono::seconds ThreeplMessageHandler::SYNC_BACKOFF_MIN;
+constexpr std::chrono::seconds ThreeplMessageHandler::SYNC_BACKOFF_MAX;
+
 ceema::group_uid getGroupUID(ceema::Message const &msg, ceema::PayloadGroupMessage const &payload) {
     return payload.group;
 }
@@ -27,25 +35,190 @@ void ThreeplMessageHandler::onRecvMessage(std::unique_ptr<ceema::Message> msg) {
     if (m_contacts.has_contact(msg->sender())) {
         recv(*msg);
     } else {
-        enqueue(std::move(msg));
+        ceema::client_id sender = msg->sender();
+        bool fetch = !m_pending.has(sender);
+        m_pending.push_received(std::move(msg));
+        if (fetch) {
+            fetch_pending(sender);
+        }
     }
 }
 
 ceema::future<std::unique_ptr<ceema::Message>> ThreeplMessageHandler::sendMessage(std::unique_ptr<ceema::Message> msg) {
     if (m_contacts.has_contact(msg->recipient())) {
-        ceema::promise<std::unique_ptr<ceema::Message>> prom;
         try {
             send(*msg);
-            prom.set_value(std::move(msg));
-        } catch (std::exception&) {
-            prom.set_exception(std::current_exception());
+        } catch (std::exception& e) {
+            ceema::promise<std::unique_ptr<ceema::Message>> prom;
+            prom.set_exception(std::make_exception_ptr(message_exception(msg->recipient(), e.what())));
+            return prom.get_future();
         }
-        return prom.get_future();
+        return track(std::move(msg));
     } else {
         return enqueue(std::move(msg));
     }
 }
 
+ceema::future<std::unique_ptr<ceema::Message>> ThreeplMessageHandler::track(std::unique_ptr<ceema::Message> msg) {
+    if (msg->flags().isset(ceema::MessageFlag::NO_ACK)) {
+        // Nothing to wait for
+        ceema::promise<std::unique_ptr<ceema::Message>> prom;
+        prom.set_value(std::move(msg));
+        return prom.get_future();
+    }
+
+    ceema::client_id recipient = msg->recipient();
+    return m_acks.track(std::move(msg)).next([recipient](ceema::future<std::unique_ptr<ceema::Message>> fut) {
+        try {
+            return fut.get();
+        } catch (message_exception&) {
+            throw;
+        } catch (std::exception& e) {
+            throw message_exception(recipient, e.what());
+        }
+    });
+}
+
+void ThreeplMessageHandler::onAck(ceema::Acknowledgement const& ack) {
+    m_acks.acknowledge(ack);
+}
+
+void ThreeplMessageHandler::retransmit() {
+    m_acks.tick([this](ceema::Message const& msg) {
+        LOG_DBG("Retransmitting message " << msg.id() << " to " << msg.recipient().toString());
+        m_connection.send_packet(msg);
+    });
+}
+
+void ThreeplMessageHandler::fail_pending(std::string const& reason) {
+    m_acks.fail_all(std::make_exception_ptr(std::runtime_error(reason)));
+}
+
+ceema::future<GroupSendResult> ThreeplMessageHandler::sendGroupPayload(ceema::Account const& sender,
+                                                                       std::vector<ceema::client_id> const& members,
+                                                                       ceema::byte_vector payload,
+                                                                       ceema::MessageFlags flags) {
+    struct GroupSend {
+        ceema::promise<GroupSendResult> promise;
+        GroupSendResult result;
+        std::size_t pending;
+    };
+    auto state = std::make_shared<GroupSend>();
+    auto fut = state->promise.get_future();
+    state->result.time = static_cast<ceema::timestamp>(std::time(nullptr));
+    state->result.sent = 0;
+    // Held until all messages are underway
+    state->pending = 1;
+
+    auto finish_one = [state]() {
+        if (--state->pending == 0) {
+            state->promise.set_value(std::move(state->result));
+        }
+    };
+    auto on_acked = [state, finish_one](ceema::future<std::unique_ptr<ceema::Message>> fut) {
+        try {
+            fut.get();
+            state->result.sent++;
+        } catch (message_exception& e) {
+            state->result.failures.push_back(e);
+        }
+        finish_one();
+    };
+
+    auto make_message = [sender_id = sender.id(), nick = sender.nick(), flags](ceema::client_id const& member) {
+        auto msg = std::make_unique<ceema::Message>(sender_id, member, flags);
+        if (nick.size()) {
+            msg->nick() = nick;
+        }
+        return msg;
+    };
+
+    std::vector<std::unique_ptr<ceema::Message>> batch;
+    std::vector<ceema::precomputed_key> keys;
+    std::vector<ceema::client_id> deferred;
+    for(ceema::client_id const& member: members) {
+        if (member == sender.id()) {
+            continue;
+        }
+        if (!m_contacts.has_contact(member)) {
+            deferred.push_back(member);
+            continue;
+        }
+        ContactPtr contact = m_contacts.get_contact(member);
+        if (!contact) {
+            state->result.failures.emplace_back(member, "Unable to fetch contact key");
+            continue;
+        }
+        batch.push_back(make_message(member));
+        keys.push_back(m_keys.get(sender, *contact));
+    }
+
+    // Only the encryption differs per member
+    std::vector<std::exception_ptr> errors(batch.size());
+    auto encrypt = [&batch, &keys, &errors, &payload](std::size_t i) {
+        try {
+            batch[i]->encrypt(payload, keys[i]);
+        } catch (std::exception&) {
+            errors[i] = std::current_exception();
+        }
+    };
+    if (batch.size() >= PARALLEL_ENCRYPT_MIN) {
+        ceema::WorkerPool::shared().parallel_for(batch.size(), encrypt);
+    } else {
+        for(std::size_t i = 0; i < batch.size(); i++) {
+            encrypt(i);
+        }
+    }
+    for(auto& key: keys) {
+        sodium_memzero(key.data(), key.size());
+    }
+
+    std::vector<std::unique_ptr<ceema::Message>> ready;
+    ready.reserve(batch.size());
+    for(std::size_t i = 0; i < batch.size(); i++) {
+        if (errors[i]) {
+            try {
+                std::rethrow_exception(errors[i]);
+            } catch (std::exception& e) {
+                state->result.failures.emplace_back(batch[i]->recipient(), e.what());
+            }
+        } else {
+            ready.push_back(std::move(batch[i]));
+        }
+    }
+    m_connection.send_packets(ready);
+    state->pending += ready.size();
+    for(auto& msg: ready) {
+        track(std::move(msg)).next(on_acked);
+    }
+
+    // Members without key follow once their key is known
+    if (!deferred.empty()) {
+        auto shared_payload = std::make_shared<const ceema::byte_vector>(std::move(payload));
+        state->pending += deferred.size();
+        for(ceema::client_id const& member: deferred) {
+            m_contacts.fetch_contact(member).next([this, state, member, shared_payload, make_message,
+                                                          finish_one, on_acked](ceema::future<ContactPtr> fut) {
+                std::unique_ptr<ceema::Message> msg;
+                try {
+                    ContactPtr contact = fut.get();
+                    msg = make_message(member);
+                    msg->encrypt(*shared_payload, m_keys.get(m_connection.account(), *contact));
+                    m_connection.send_packet(*msg);
+                } catch (std::exception& e) {
+                    state->result.failures.emplace_back(member, e.what());
+                    finish_one();
+                    return;
+                }
+                track(std::move(msg)).next(on_acked);
+            });
+        }
+    }
+    finish_one();
+
+    return fut;
+}
+
 ThreeplGroup* ThreeplMessageHandler::find_or_create_group(ceema::group_uid uid, ceema::Message const &msg, bool add_chat) {
     ThreeplGroup* group = m_groups.find_group(uid, false);
     if (!group) {
@@ -71,37 +244,67 @@ ThreeplGroup* ThreeplMessageHandler::find_or_create_group(ceema::group_uid uid,
 
 ceema::future<std::unique_ptr<ceema::Message>> ThreeplMessageHandler::enqueue(std::unique_ptr<ceema::Message> msg) {
     // Fetch contact, queue message
-    ceema::client_id contact_id = (msg->type() == ceema::PacketType::MESSAGE_RECV) ? msg->sender() : msg->recipient();
+    ceema::client_id contact_id = msg->recipient();
     auto prom = ceema::promise<std::unique_ptr<ceema::Message>>();
     auto queue_fut = prom.get_future();
-    auto iter = packetQueue.find(contact_id);
-    if (iter != packetQueue.end()) {
-        iter->second.emplace_back(std::move(msg), std::move(prom));
-    } else {
-        packetQueue.emplace(contact_id, std::vector<std::pair<std::unique_ptr<ceema::Message>, ceema::promise<std::unique_ptr<ceema::Message>>>>{});
-        packetQueue[contact_id].emplace_back(std::move(msg), std::move(prom));
-        m_contacts.fetch_contact(contact_id).next([this, contact_id](ceema::future<ContactPtr> fut) {
+    bool fetch = !m_pending.has(contact_id);
+    if (!m_pending.push_sent(msg, prom)) {
+        prom.set_exception(std::make_exception_ptr(message_exception(contact_id, "Too many messages waiting for contact key")));
+        return queue_fut;
+    }
+    if (fetch) {
+        fetch_pending(contact_id);
+    }
+    return queue_fut;
+}
+
+void ThreeplMessageHandler::fetch_pending(ceema::client_id const& contact_id) {
+    m_contacts.fetch_contact(contact_id).next([this, contact_id](ceema::future<ContactPtr> fut) {
+        // Handling the messages may queue new ones, work on what is queued now
+        PendingQueue::Batch batch = m_pending.take(contact_id);
+        try {
+            fut.get();
+        } catch(std::exception& e) {
+            LOG_DBG("Dropping " << batch.received.size() << " received messages of " << contact_id.toString()
+                    << ": " << e.what());
+            for(auto& queue_iter: batch.sent) {
+                queue_iter.second.set_exception(std::make_exception_ptr(message_exception(contact_id, e.what())));
+            }
+            return true;
+        }
+
+        for(auto& msg: batch.received) {
+            this->recv(*msg);
+        }
+        for(auto& queue_iter: batch.sent) {
             try {
-                ContactPtr contact = fut.get();
-                for(auto& queue_iter: packetQueue[contact_id]) {
-                    if (queue_iter.first->type() == ceema::PacketType::MESSAGE_RECV) {
-                        this->recv(*queue_iter.first);
-                    } else {
-                        this->send(*queue_iter.first);
-                    }
-                    queue_iter.second.set_value(std::move(queue_iter.first));
-                }
-            } catch(std::exception& e) {
-                for(auto& queue_iter: packetQueue[contact_id]) {
-                    queue_iter.second.set_exception(std::make_exception_ptr(message_exception(contact_id, e.what())));
-                }
+                this->send(*queue_iter.first);
+            } catch (std::exception& e) {
+                queue_iter.second.set_exception(std::make_exception_ptr(message_exception(contact_id, e.what())));
+                continue;
             }
-            packetQueue.erase(contact_id);
+            track(std::move(queue_iter.first)).next([prom = std::move(queue_iter.second)](
+                    ceema::future<std::unique_ptr<ceema::Message>> fut) mutable {
+                try {
+                    prom.set_value(fut.get());
+                } catch (std::exception&) {
+                    prom.set_exception(std::current_exception());
+                }
+            });
+        }
 
-            return true;
-        });
+        return true;
+    });
+}
+
+void ThreeplMessageHandler::load_pending(std::string path) {
+    m_pending.open(std::move(path));
+}
+
+void ThreeplMessageHandler::resume_pending() {
+    for (auto const& contact_id: m_pending.take_restored()) {
+        fetch_pending(contact_id);
     }
-    return queue_fut;
 }
 
 void ThreeplMessageHandler::recv(ceema::Message& msg) {
@@ -293,11 +496,9 @@ void ThreeplMessageHandler::recv(ceema::Message& msg) {
     if (ack && !msg.flags().isset(ceema::MessageFlag::GROUP)) {
         bool mark_seen = purple_account_get_bool(m_connection.acct(), "status-seen", false) != 0;
 
-        ceema::PayloadMessageStatus payloadStatus;
-        payloadStatus.m_status = mark_seen ? ceema::MessageStatus::SEEN : ceema::MessageStatus::RECEIVED;
-        payloadStatus.m_ids.push_back(msg.id());
-
-        sendPayload(m_connection.account(), msg.sender(), payloadStatus);
+        m_connection.control().queue_status(msg.sender(),
+                                            mark_seen ? ceema::MessageStatus::SEEN : ceema::MessageStatus::RECEIVED,
+                                            msg.id());
     }
 }
 
@@ -526,6 +727,8 @@ bool ThreeplMessageHandler::onMsgGroupTitle(ceema::Message const& msg, ThreeplGr
 }
 
 bool ThreeplMessageHandler::onMsgGroupMembers(ceema::Message const& msg, ThreeplGroup* group, ceema::PayloadGroupMembers const& payload) {
+    // Members is the reply to a sync request
+    m_syncRequests.erase(group->uid());
     group->set_members(payload.members);
     m_groups.update_chat(m_connection.acct(), *group);
 
@@ -570,6 +773,7 @@ bool ThreeplMessageHandler::onMsgGroupLeave(ceema::Message const& msg, ThreeplGr
     if (!group->remove_member(msg.sender())) {
         return false;
     }
+    m_groups.update_chat(m_connection.acct(), *group);
 
     ceema::PayloadGroupMembers payloadMembers;
     payloadMembers.group = group->gid();
@@ -629,8 +833,32 @@ bool ThreeplMessageHandler::isOwner(ceema::group_uid const& id) const {
 }
 
 void ThreeplMessageHandler::requestSync(ceema::Message const& msg, ceema::group_uid const& uid) {
+    auto now = std::chrono::steady_clock::now();
+    auto iter = m_syncRequests.find(uid);
+    if (iter == m_syncRequests.end()) {
+        if (m_syncRequests.size() >= MAX_PENDING_SYNCS) {
+            expireSyncRequests(now);
+            if (m_syncRequests.size() >= MAX_PENDING_SYNCS) {
+                LOG_DBG("Too many pending group syncs, not syncing " << uid);
+                return;
+            }
+        }
+        iter = m_syncRequests.emplace(uid, SyncRequest{now, SYNC_BACKOFF_MIN, {}}).first;
+    }
+    SyncRequest& request = iter->second;
+
     if (isOwner(uid)) {
-        // Cannot sync own group, inform other party the group is gone
+        // Cannot sync own group, inform other party the group is gone.
+        // Each sender is told once per backoff period.
+        if (now >= request.next) {
+            request.notified.clear();
+            request.next = now + SYNC_BACKOFF_MAX;
+        }
+        if (std::find(request.notified.begin(), request.notified.end(), msg.sender()) != request.notified.end()) {
+            return;
+        }
+        request.notified.push_back(msg.sender());
+
         //TODO: Should only send member list update when group is still known?
         ceema::PayloadGroupMembers payloadMembers;
         payloadMembers.group = uid.gid();
@@ -642,8 +870,27 @@ void ThreeplMessageHandler::requestSync(ceema::Message const& msg, ceema::group_
         sendPayload(m_connection.account(), msg.sender(), std::move(payloadLeave));
 
     } else {
+        if (now < request.next) {
+            // Request still outstanding
+            return;
+        }
+        request.next = now + request.backoff;
+        request.backoff = std::min(request.backoff * 2, SYNC_BACKOFF_MAX);
+
+        LOG_DBG("Requesting sync of group " << uid);
         ceema::PayloadGroupSync payload;
         payload.group = uid.gid();
         sendPayload(m_connection.account(), uid.cid(), std::move(payload));
     }
 }
+
+void ThreeplMessageHandler::expireSyncRequests(std::chrono::steady_clock::time_point now) {
+    // Requests past their backoff no longer suppress anything
+    for (auto iter = m_syncRequests.begin(); iter != m_syncRequests.end(); ) {
+        if (now >= iter->second.next) {
+            iter = m_syncRequests.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
@@ -6,8 +6,12 @@
 
 #include <protocol/packet/Message.h>
 #include <unordered_map>
+#include <chrono>
 #include <api/BlobAPI.h>
+#include <contact/KeyCache.h>
+#include <protocol/AckTracker.h>
 #include "GroupStore.h"
+#include "PendingQueue.h"
 
 class ThreeplConnection;
 class ContactStore;
@@ -27,13 +31,46 @@ public:
     }
 };
 
+/**
+ * Outcome of sending a payload to all members of a group
+ */
+struct GroupSendResult {
+    ceema::timestamp time;
+    // Number of members the server accepted the message for
+    std::size_t sent;
+    std::vector<message_exception> failures;
+};
+
 class ThreeplMessageHandler {
+    // Groups at least this large are encrypted on the worker pool
+    static constexpr std::size_t PARALLEL_ENCRYPT_MIN = 32;
+    // Outstanding group sync requests kept per account
+    static constexpr std::size_t MAX_PENDING_SYNCS = 64;
+    // Delay before an unanswered sync request is repeated, doubled each attempt
+    static constexpr std::chrono::seconds SYNC_BACKOFF_MIN{30};
+    static constexpr std::chrono::seconds SYNC_BACKOFF_MAX{3600};
+
+    /**
+     * Group sync request that has not been answered yet. For own groups,
+     * the senders that were told the group is gone.
+     */
+    struct SyncRequest {
+        // No new request is sent for the group before this time
+        std::chrono::steady_clock::time_point next;
+        std::chrono::seconds backoff;
+        std::vector<ceema::client_id> notified;
+    };
+
     ThreeplConnection& m_connection;
     ContactStore& m_contacts;
     GroupStore& m_groups;
     ceema::BlobAPI& m_blobAPI;
+    ceema::KeyCache m_keys;
+    ceema::AckTracker m_acks;
+    std::unordered_map<ceema::group_uid, SyncRequest> m_syncRequests;
 
-    std::unordered_map<ceema::client_id, std::vector<std::pair<std::unique_ptr<ceema::Message>, ceema::promise<std::unique_ptr<ceema::Message>>>>> packetQueue;
+    // Messages waiting for the key of their contact
+    PendingQueue m_pending;
 
     ceema::message_id m_lastAgreeable;
 public:
@@ -47,25 +84,56 @@ public:
     ceema::future<std::unique_ptr<ceema::Message>> sendPayload(ceema::Account const& sender, ceema::client_id const& recipient, Payload&& payload) {
         std::unique_ptr<ceema::Message> msg = std::make_unique<ceema::Message>(
                 sender.id(), recipient, std::forward<Payload>(payload));
-        // Threepl does not make use of ACK, so no need to request one
-        // If the network is down, Purple can't do much anyway
-        msg->flags().set(ceema::MessageFlag::NO_ACK);
         if (sender.nick().size()) {
             msg->nick() = sender.nick();
         }
         return sendMessage(std::move(msg));
     }
 
+    /**
+     * Send a payload to all members of a group. The payload is encoded once,
+     * and the messages to all members with a known key are sent in one batch.
+     * @return Future of the combined result for all members
+     */
     template<typename Payload>
-    std::vector<ceema::future<std::unique_ptr<ceema::Message>>> sendPayload(ceema::Account const& sender, ThreeplGroup* group, Payload&& payload) {
-        std::vector<ceema::future<std::unique_ptr<ceema::Message>>> res;
-        for(ceema::client_id const& member: group->members()) {
-            if (member == sender.id()) {
-                continue;
-            }
-            res.push_back(sendPayload(sender, member, payload));
-        }
-        return res;
+    ceema::future<GroupSendResult> sendPayload(ceema::Account const& sender, ThreeplGroup* group, Payload&& payload) {
+        ceema::MessageFlags flags = payload.default_flags();
+        ceema::byte_vector data = ceema::Message::encodePayload(ceema::MessagePayload(std::forward<Payload>(payload)));
+        return sendGroupPayload(sender, group->members(), std::move(data), flags);
+    }
+
+    /**
+     * Handle a server ACK for a sent message
+     */
+    void onAck(ceema::Acknowledgement const& ack);
+
+    /**
+     * Retransmit messages the server did not acknowledge in time
+     */
+    void retransmit();
+
+    /**
+     * Fail all messages still waiting for an ACK
+     */
+    void fail_pending(std::string const& reason);
+
+    ceema::AckTracker const& acks() const {
+        return m_acks;
+    }
+
+    /**
+     * Open the file messages are spilled to when too many wait for a key
+     */
+    void load_pending(std::string path);
+
+    /**
+     * Fetch the keys of contacts with messages left in the spill file by a
+     * previous session
+     */
+    void resume_pending();
+
+    PendingQueue const& pending() const {
+        return m_pending;
     }
 
     ThreeplGroup* find_or_create_group(ceema::group_uid uid, ceema::Message const &msg, bool add_chat = false);
@@ -75,8 +143,13 @@ public:
     }
 private:
     ceema::future<std::unique_ptr<ceema::Message>> sendMessage(std::unique_ptr<ceema::Message> msg);
+    ceema::future<GroupSendResult> sendGroupPayload(ceema::Account const& sender,
+                                                    std::vector<ceema::client_id> const& members,
+                                                    ceema::byte_vector payload, ceema::MessageFlags flags);
 
+    ceema::future<std::unique_ptr<ceema::Message>> track(std::unique_ptr<ceema::Message> msg);
     ceema::future<std::unique_ptr<ceema::Message>> enqueue(std::unique_ptr<ceema::Message> msg);
+    void fetch_pending(ceema::client_id const& contact);
     void recv(ceema::Message& msg);
     void send(ceema::Message& msg);
 
@@ -107,4 +180,5 @@ private:
 
     bool isOwner(ceema::group_uid const& id) const;
     void requestSync(ceema::Message const& msg, ceema::group_uid const& id);
+    void expireSyncRequests(std::chrono::steady_clock::time_point now);
 };
\ No newline at end of file
@@ -0,0 +1,197 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PendingQueue.h"
+
+#include <logging/logging.h>
+
+namespace {
+    // Each spilled message is stored as its length followed by the encrypted packet
+    const std::size_t SPILL_HEADER_SIZE = 4;
+
+    bool read_spilled(std::istream& is, ceema::byte_vector& packet) {
+        std::uint8_t header[SPILL_HEADER_SIZE];
+        if (!is.read(reinterpret_cast<char*>(header), SPILL_HEADER_SIZE)) {
+            return false;
+        }
+        packet.resize(ceema::letoh<std::uint32_t>(header));
+        return static_cast<bool>(is.read(reinterpret_cast<char*>(packet.data()), packet.size()));
+    }
+}
+
+void PendingQueue::open(std::string path) {
+    m_spillPath = std::move(path);
+    m_spillFile.close();
+
+    std::ifstream in(m_spillPath, std::ios::binary);
+    std::uint64_t offset = 0;
+    ceema::byte_vector packet;
+    while (in && read_spilled(in, packet)) {
+        try {
+            ceema::Message msg = ceema::Message::fromPacket(ceema::PacketType::MESSAGE_RECV, packet);
+            Queue& queue = m_queues[msg.sender()];
+            if (queue.spilled.empty()) {
+                m_restored.push_back(msg.sender());
+            }
+            queue.spilled.push_back(offset);
+            m_stats.spilled++;
+        } catch (std::exception& e) {
+            LOG_WARN(ceema::logging::loggerRoot, "Skipping invalid spilled message: " << e.what());
+        }
+        offset += SPILL_HEADER_SIZE + packet.size();
+    }
+    in.close();
+
+    if (m_stats.spilled) {
+        LOG_DBG("Restored " << m_stats.spilled << " spilled messages of " << m_restored.size() << " contacts");
+        m_spillFile.open(m_spillPath, std::ios::binary | std::ios::app);
+        // Appends go to the actual end, past any partially written record
+        m_spillFile.seekp(0, std::ios::end);
+        m_spillSize = static_cast<std::uint64_t>(m_spillFile.tellp());
+    } else {
+        truncate_spill();
+    }
+}
+
+void PendingQueue::push_received(MessagePtr msg) {
+    Queue& queue = m_queues[msg->sender()];
+    if (queue.size() >= MAX_PER_CONTACT || m_stats.depth >= MAX_TOTAL || !queue.spilled.empty()) {
+        // Once spilling, keep spilling so the messages are replayed in order
+        if (!spill(*msg, queue)) {
+            LOG_WARN(ceema::logging::loggerRoot, "Dropping message " << msg->id() << " from "
+                    << msg->sender().toString() << ", pending queue is full");
+            m_stats.dropped++;
+        }
+        return;
+    }
+    queue.received.push_back(std::move(msg));
+    pushed();
+}
+
+bool PendingQueue::push_sent(MessagePtr& msg, MessagePromise& prom) {
+    auto iter = m_queues.find(msg->recipient());
+    if (m_stats.depth >= MAX_TOTAL || (iter != m_queues.end() && iter->second.size() >= MAX_PER_CONTACT)) {
+        m_stats.rejected++;
+        return false;
+    }
+    Queue& queue = (iter != m_queues.end()) ? iter->second : m_queues[msg->recipient()];
+    queue.sent.emplace_back(std::move(msg), std::move(prom));
+    pushed();
+    return true;
+}
+
+PendingQueue::Batch PendingQueue::take(ceema::client_id const& contact) {
+    Batch batch;
+    auto iter = m_queues.find(contact);
+    if (iter == m_queues.end()) {
+        return batch;
+    }
+    Queue queue = std::move(iter->second);
+    m_queues.erase(iter);
+
+    m_stats.depth -= queue.size();
+    batch.received = std::move(queue.received);
+    batch.sent = std::move(queue.sent);
+
+    if (!queue.spilled.empty()) {
+        m_spillFile.flush();
+        std::ifstream in(m_spillPath, std::ios::binary);
+        ceema::byte_vector packet;
+        for (std::uint64_t offset: queue.spilled) {
+            in.seekg(static_cast<std::streamoff>(offset));
+            try {
+                if (!read_spilled(in, packet)) {
+                    throw std::runtime_error("truncated record");
+                }
+                batch.received.push_back(std::make_unique<ceema::Message>(
+                        ceema::Message::fromPacket(ceema::PacketType::MESSAGE_RECV, packet)));
+            } catch (std::exception& e) {
+                LOG_WARN(ceema::logging::loggerRoot, "Unable to read spilled message of "
+                        << contact.toString() << ": " << e.what());
+                in.clear();
+            }
+        }
+        m_stats.spilled -= queue.spilled.size();
+        if (!m_stats.spilled) {
+            truncate_spill();
+        }
+    }
+
+    return batch;
+}
+
+std::vector<ceema::client_id> PendingQueue::take_restored() {
+    std::vector<ceema::client_id> restored;
+    restored.swap(m_restored);
+    return restored;
+}
+
+bool PendingQueue::spill(ceema::Message const& msg, Queue& queue) {
+    if (!m_spillFile.is_open()) {
+        return false;
+    }
+
+    ceema::byte_vector packet = msg.toPacket();
+    if (m_spillSize + SPILL_HEADER_SIZE + packet.size() > MAX_SPILL_SIZE) {
+        return false;
+    }
+
+    std::uint8_t header[SPILL_HEADER_SIZE];
+    ceema::htole(static_cast<std::uint32_t>(packet.size()), header);
+    m_spillFile.write(reinterpret_cast<const char*>(header), SPILL_HEADER_SIZE);
+    m_spillFile.write(reinterpret_cast<const char*>(packet.data()), packet.size());
+    m_spillFile.flush();
+    if (!m_spillFile) {
+        // Position of the next record is unknown, start over once the file is empty
+        m_spillFile.close();
+        if (!m_stats.spilled) {
+            truncate_spill();
+        }
+        return false;
+    }
+
+    queue.spilled.push_back(m_spillSize);
+    m_spillSize += SPILL_HEADER_SIZE + packet.size();
+    m_stats.spilled++;
+    m_stats.spilledTotal++;
+    return true;
+}
+
+void PendingQueue::truncate_spill() {
+    m_spillFile.close();
+    m_spillSize = 0;
+    if (m_spillPath.empty()) {
+        return;
+    }
+    m_spillFile.open(m_spillPath, std::ios::binary | std::ios::trunc);
+    if (!m_spillFile) {
+        LOG_WARN(ceema::logging::loggerRoot, "Unable to open spill file " << m_spillPath);
+    }
+}
+
+void PendingQueue::pushed() {
+    m_stats.depth++;
+    if (m_stats.depth > m_stats.peak) {
+        m_stats.peak = m_stats.depth;
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, PendingQueue::Stats const& stats) {
+    os << stats.depth << " pending (peak " << stats.peak << "), "
+       << stats.spilled << " spilled (" << stats.spilledTotal << " total), "
+       << stats.dropped << " dropped, " << stats.rejected << " rejected";
+    return os;
+}
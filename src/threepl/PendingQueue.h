@@ -0,0 +1,150 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CEEMA_PENDINGQUEUE_H
+#define CEEMA_PENDINGQUEUE_H
+
+#include <protocol/packet/Message.h>
+#include <async/future.h>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Messages waiting for the key of a contact to be fetched. Both the number of
+ * messages per contact and the total number of messages kept in memory are
+ * bounded. Received messages over the limit are still encrypted, and are
+ * appended to a spill file instead, to be read back once the key arrives.
+ * The spill file is bounded in size as well, received messages beyond it are
+ * dropped. Messages to send over the limit are rejected.
+ */
+class PendingQueue {
+public:
+    // Messages kept in memory for a single contact
+    static const std::size_t MAX_PER_CONTACT = 32;
+    // Messages kept in memory for all contacts together
+    static const std::size_t MAX_TOTAL = 512;
+    // Size in bytes of the spill file
+    static const std::uint64_t MAX_SPILL_SIZE = 16 * 1024 * 1024;
+
+    using MessagePtr = std::unique_ptr<ceema::Message>;
+    using MessagePromise = ceema::promise<MessagePtr>;
+
+    /**
+     * Messages of a single contact, taken from the queue once its key is known
+     */
+    struct Batch {
+        std::vector<MessagePtr> received;
+        std::vector<std::pair<MessagePtr, MessagePromise>> sent;
+    };
+
+    struct Stats {
+        // Messages currently in memory
+        std::size_t depth = 0;
+        // Highest number of messages in memory at once
+        std::size_t peak = 0;
+        // Messages currently in the spill file
+        std::size_t spilled = 0;
+        std::uint64_t spilledTotal = 0;
+        // Received messages lost because the spill file was full or could not be written
+        std::uint64_t dropped = 0;
+        // Messages to send refused because the queue was full
+        std::uint64_t rejected = 0;
+    };
+
+private:
+    struct Queue {
+        std::vector<MessagePtr> received;
+        std::vector<std::pair<MessagePtr, MessagePromise>> sent;
+        // Offsets of received messages in the spill file
+        std::vector<std::uint64_t> spilled;
+
+        std::size_t size() const {
+            return received.size() + sent.size();
+        }
+    };
+
+    std::unordered_map<ceema::client_id, Queue> m_queues;
+    // Contacts with messages in the spill file left by a previous session
+    std::vector<ceema::client_id> m_restored;
+
+    std::string m_spillPath;
+    std::ofstream m_spillFile;
+    std::uint64_t m_spillSize;
+
+    Stats m_stats;
+
+public:
+    PendingQueue() : m_spillSize(0) {}
+
+    PendingQueue(PendingQueue const&) = delete;
+    PendingQueue& operator=(PendingQueue const&) = delete;
+
+    /**
+     * Open the spill file, and index the messages left in it
+     * @param path Path of the spill file
+     */
+    void open(std::string path);
+
+    /**
+     * @return True if messages are queued for the contact, i.e. its key is being fetched
+     */
+    bool has(ceema::client_id const& contact) const {
+        return m_queues.find(contact) != m_queues.end();
+    }
+
+    /**
+     * Queue a received message, spilling it to disk if the queue is full
+     */
+    void push_received(MessagePtr msg);
+
+    /**
+     * Queue a message to send
+     * @return False if the queue is full, the message is not queued
+     */
+    bool push_sent(MessagePtr& msg, MessagePromise& prom);
+
+    /**
+     * Remove all messages of a contact, including the spilled ones
+     * @param contact Contact ID
+     * @return Queued messages, received messages first
+     */
+    Batch take(ceema::client_id const& contact);
+
+    /**
+     * @return Contacts with messages restored from the spill file, which
+     * have not been requested before
+     */
+    std::vector<ceema::client_id> take_restored();
+
+    Stats const& stats() const {
+        return m_stats;
+    }
+
+private:
+    bool spill(ceema::Message const& msg, Queue& queue);
+    void truncate_spill();
+    void pushed();
+};
+
+std::ostream& operator<<(std::ostream& os, PendingQueue::Stats const& stats);
+
+#endif //CEEMA_PENDINGQUEUE_H
@@ -3,3 +3,48 @@
 //
 
 #include "PrplHttpManager.h"
+
+#include <algorithm>
+#include <type_traits>
+
+// Timers of the wheel are handed out as HttpManager timers
+static_assert(std::is_same<ceema::TimerWheel::TimerId, ceema::HttpManager::TimerId>::value, "Timer ID types differ");
+
+namespace {
+    guint armed_handle = 0;
+    ceema::TimerWheel::clock::time_point armed_deadline = ceema::TimerWheel::clock::time_point::max();
+}
+
+ceema::TimerWheel& PrplHttpManager::timers() {
+    static ceema::TimerWheel wheel;
+    return wheel;
+}
+
+ceema::TimerWheel::TimerId PrplHttpManager::schedule(long timeout_ms, std::function<void()> callback) {
+    ceema::TimerWheel::TimerId id = timers().schedule(std::chrono::milliseconds(timeout_ms), std::move(callback));
+    arm();
+    return id;
+}
+
+gboolean PrplHttpManager::on_timer_event(gpointer) {
+    armed_handle = 0;
+    armed_deadline = ceema::TimerWheel::clock::time_point::max();
+    timers().advance();
+    arm();
+    return FALSE;
+}
+
+void PrplHttpManager::arm() {
+    ceema::TimerWheel::clock::time_point deadline = timers().next_deadline();
+    if (deadline >= armed_deadline) {
+        // Cancelled timers leave the timeout armed, it fires early at worst
+        return;
+    }
+    if (armed_handle) {
+        purple_timeout_remove(armed_handle);
+    }
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - ceema::TimerWheel::clock::now() + std::chrono::microseconds(999));
+    armed_handle = purple_timeout_add(static_cast<guint>(std::max<long>(delay.count(), 0)), &on_timer_event, nullptr);
+    armed_deadline = deadline;
+}
@@ -6,18 +6,39 @@
 #define CEEMA_PRPLHTTPMANAGER_H
 
 #include <api/HttpManager.h>
+#include <async/TimerWheel.h>
 #include <libpurple/eventloop.h>
 #include <curl/curl.h>
-
+#include <unordered_set>
+#include <memory>
+
+/**
+ * Runs the CURL transfers of a connection from the libpurple event loop. The
+ * timers of all managers share a single timer wheel, driven by one libpurple
+ * timeout.
+ */
 class PrplHttpManager : public ceema::HttpManager {
     struct SocketCallbacks {
         guint read;
         guint write;
     };
 
-    guint timeout;
+    // Timeout requested by CURL, replaced on every registerTimeout()
+    ceema::TimerWheel::TimerId m_timeout;
+
+    // Pending timers of this manager, cancelled on destruction
+    std::unordered_set<ceema::TimerWheel::TimerId> m_timers;
 
 public:
+    PrplHttpManager() : m_timeout(0) {}
+
+    ~PrplHttpManager() {
+        timers().cancel(m_timeout);
+        for(ceema::TimerWheel::TimerId id: m_timers) {
+            timers().cancel(id);
+        }
+    }
+
     void* registerRead(int fd, void* ptr) override {
         SocketCallbacks* callbacks = static_cast<SocketCallbacks*>(ptr);
         if (!callbacks) {
@@ -59,13 +80,46 @@ public:
     }
 
     void registerTimeout(long timeout_ms) override {
-        if (timeout_ms == -1) {
-            purple_timeout_remove(timeout);
-        } else {
-            timeout = purple_timeout_add(timeout_ms, &on_http_timeout_event, this);
+        timers().cancel(m_timeout);
+        m_timeout = 0;
+        if (timeout_ms >= 0) {
+            m_timeout = schedule(timeout_ms, [this]() {
+                m_timeout = 0;
+                int running_handles = 0;
+                curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+                checkMessages();
+            });
+        }
+    }
+
+    TimerId scheduleTimer(long timeout_ms, std::function<void()> callback) override {
+        auto id = std::make_shared<ceema::TimerWheel::TimerId>();
+        *id = schedule(timeout_ms, [this, id, callback{std::move(callback)}]() {
+            m_timers.erase(*id);
+            callback();
+        });
+        m_timers.insert(*id);
+        return *id;
+    }
+
+    void cancelTimer(TimerId id) override {
+        if (m_timers.erase(id)) {
+            timers().cancel(id);
         }
     }
 
+    /**
+     * Run a callback once after a delay, on the shared timer wheel. The
+     * timer is not tied to a manager.
+     * @return ID of the timer, for timers().cancel()
+     */
+    static ceema::TimerWheel::TimerId schedule(long timeout_ms, std::function<void()> callback);
+
+    /**
+     * @return Timer wheel shared by all managers
+     */
+    static ceema::TimerWheel& timers();
+
 protected:
     static void on_http_data_event(gpointer data, gint fd, PurpleInputCondition condition) {
         PrplHttpManager* mgr = static_cast<PrplHttpManager*>(data);
@@ -79,17 +133,12 @@ protected:
         mgr->checkMessages();
     }
 
-    static gboolean on_http_timeout_event(gpointer data) {
-        PrplHttpManager* mgr = static_cast<PrplHttpManager*>(data);
-
-        int running_handles = 0;
-        curl_multi_socket_action(mgr->m_handle, CURL_SOCKET_TIMEOUT, 0, &running_handles);
-
-        mgr->checkMessages();
-
-        return FALSE; // curl asks for non-repeating
-    }
+    static gboolean on_timer_event(gpointer data);
 
+    /**
+     * Move the libpurple timeout to the first deadline of the wheel
+     */
+    static void arm();
 };
 
 
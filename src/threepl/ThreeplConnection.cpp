@@ -5,7 +5,39 @@
 #include "ThreeplConnection.h"
 
 #include <libpurple/debug.h>
-#include <protocol/packet/KeepAlive.h>
+#include <libpurple/notify.h>
+#include <libpurple/util.h>
+#include <protocol/packet/payloads/PayloadText.h>
+#include <protocol/ReconnectScheduler.h>
+#include <logging/logging.h>
+
+#include <unordered_map>
+
+// Interval in seconds at which unacknowledged messages are checked
+static const guint ACK_CHECK_INTERVAL = 2;
+
+/**
+ * Paces the connects of all accounts, so they do not all reconnect at once
+ * after the network comes back. Outlives the connections, so the backoff
+ * of an account carries over to the next login.
+ */
+static ceema::ReconnectScheduler& reconnect_scheduler() {
+    static ceema::ReconnectScheduler scheduler([](std::chrono::milliseconds delay) {
+        PrplHttpManager::schedule(delay.count(), []() {
+            reconnect_scheduler().poll();
+        });
+    });
+    return scheduler;
+}
+
+/**
+ * Keep-alive state learned per account. Purple creates a new connection on
+ * every login, so the interval found to keep the NAT open is kept here.
+ */
+static std::unordered_map<ceema::client_id, ceema::KeepAliveTracker>& keepalive_trackers() {
+    static std::unordered_map<ceema::client_id, ceema::KeepAliveTracker> trackers;
+    return trackers;
+}
 
 //Helper for packet type downcast
 //TODO: creates a new deleter, which is bad
@@ -17,26 +49,75 @@ unique_ptr_cast( std::unique_ptr<Base>&& p )
     return std::unique_ptr<Derived>(d);
 }
 
+void ThreeplConnection::load_stores() {
+    m_nonces.reset(new ceema::NonceStore(account_file("nonces")));
+    LOG_DBG("Loaded " << m_nonces->size() << " nonces, filter uses " << m_nonces->filter_memory() << " bytes");
+
+    m_handler.load_pending(account_file("pending"));
+}
+
+std::string ThreeplConnection::account_file(const char* suffix) const {
+    gchar* dir = g_build_filename(purple_user_dir(), "threepl", NULL);
+    purple_build_dir(dir, 0700);
+    gchar* file = g_strdup_printf("%s.%s", purple_account_get_username(m_prpl_acct), suffix);
+    gchar* path = g_build_filename(dir, file, NULL);
+    std::string result(path);
+    g_free(path);
+    g_free(file);
+    g_free(dir);
+    return result;
+}
+
+void ThreeplConnection::load_privacy() {
+    std::vector<ceema::client_id> blocked;
+    // Only an explicit deny list applies to individual senders
+    if (acct()->perm_deny == PURPLE_PRIVACY_DENY_USERS) {
+        for (GSList* deny = acct()->deny; deny; deny = deny->next) {
+            try {
+                blocked.push_back(ceema::client_id::fromString(static_cast<const char*>(deny->data)));
+            } catch (std::exception& e) {
+                LOG_DBG("Ignoring invalid ID in deny list: " << e.what());
+            }
+        }
+    }
+    m_filter.set_blocklist(std::move(blocked));
+}
+
 bool ThreeplConnection::start_connect() {
     if (m_state != State::DISCONNECTED) {
         return false;
     }
 
+    purple_connection_update_progress(m_connection, "Waiting to connect", 0, 5);
+
+    auto tracker = keepalive_trackers().find(m_account.id());
+    if (tracker != keepalive_trackers().end()) {
+        m_session.set_keep_alive(tracker->second);
+    }
+
+    const char* host = purple_account_get_string(acct(), "server", "g-xx.0.threema.ch");
+
+    m_state = State::CONNECTING;
+    reconnect_scheduler().request(m_account.id(), host, [this]() {
+        do_connect();
+    });
+
+    //purple_connection_set_state(m_connection, PURPLE_CONNECTING);
+    return true;
+}
+
+void ThreeplConnection::do_connect() {
     purple_connection_update_progress(m_connection, "Connecting", 0, 5);
 
     const char* host = purple_account_get_string(acct(), "server", "g-xx.0.threema.ch");
     int port = purple_account_get_int(acct(), "port", 5222);
 
-    m_state = State::CONNECTING;
     if (purple_proxy_connect(this, acct(), host, port, &ThreeplConnection::on_connect, this) == NULL) {
+        reconnect_scheduler().failed(m_account.id());
         purple_connection_error_reason(m_connection, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        ("Unable to connect"));
         m_state = State::DISCONNECTED;
-        return false;
     }
-
-    //purple_connection_set_state(m_connection, PURPLE_CONNECTING);
-    return true;
 }
 
 void ThreeplConnection::close() {
@@ -45,14 +126,35 @@ void ThreeplConnection::close() {
     }
 
     if (m_state == State::CONNECTING) {
+        reconnect_scheduler().cancel(m_account.id());
         purple_proxy_connect_cancel_with_handle(this);
         m_state = State::DISCONNECTED;
         return;
     }
 
+    if (m_state == State::AUTHENTICATING) {
+        reconnect_scheduler().failed(m_account.id());
+    } else {
+        reconnect_scheduler().disconnected(m_account.id());
+    }
     m_state = State::DISCONNECTED;
 
     m_session.terminate();
+    keepalive_trackers()[m_account.id()] = m_session.keep_alive_stats();
+
+    m_httpManager.cancelTimer(ack_timer);
+    ack_timer = 0;
+    m_httpManager.cancelTimer(keepalive_timer);
+    keepalive_timer = 0;
+    LOG_DBG("Keep-alive RTT (us): " << m_session.keep_alive_stats().rtt().count()
+            << ", interval (ms): " << m_session.keep_alive_stats().interval().count());
+    LOG_DBG("Server ACK latency (ms): " << m_handler.acks().latency()
+            << ", " << m_handler.acks().retransmits() << " retransmits");
+    LOG_DBG("Dropped messages: " << m_filter.blocked() << " blocked, " << m_filter.limited() << " rate limited");
+    LOG_DBG("Messages waiting for keys: " << m_handler.pending().stats());
+    m_handler.fail_pending("Connection closed");
+    m_control.clear();
+    m_broadcaster.cancel();
 
     if (input_handler_read) {
         purple_input_remove(input_handler_read);
@@ -91,20 +193,113 @@ bool ThreeplConnection::send_packet(ceema::Packet const& packet) {
     return true;
 }
 
-void ThreeplConnection::send_keepalive() {
-    send_packet(ceema::KeepAlive());
+bool ThreeplConnection::send_packets(std::vector<std::unique_ptr<ceema::Message>> const& packets) {
+    if (state() != State::CONNECTED) {
+        return false;
+    }
+    reconnect_scheduler().activity(m_account.id());
+    try {
+        for(auto const& packet: packets) {
+            m_session.queue_packet(*packet);
+        }
+        m_session.flush();
+    } catch (ceema::socket_exception& e) {
+        purple_connection_error_reason(connection(),
+                                       PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                                       e.what());
+        purple_connection_set_state(m_connection, PURPLE_DISCONNECTED);
+        return true;
+    } catch (std::exception& e) {
+        purple_connection_error_reason(connection(),
+                                       PURPLE_CONNECTION_ERROR_OTHER_ERROR,
+                                       e.what());
+        purple_connection_set_state(m_connection, PURPLE_DISCONNECTED);
+        return true;
+    }
+
+    // Large batches may not fit the socket buffer
+    watch_write();
+    return true;
+}
+
+void ThreeplConnection::watch_write() {
+    if (m_session.hasWriteData() && input_handler_write == 0) {
+        input_handler_write = purple_input_add(session_socket, static_cast<PurpleInputCondition>(PURPLE_INPUT_WRITE),
+                                               &on_session_data_write, this);
+    }
+}
+
+bool ThreeplConnection::broadcast_text(std::vector<ceema::client_id> recipients, std::string const& text) {
+    if (state() != State::CONNECTED || m_broadcaster.busy()) {
+        return false;
+    }
+    reconnect_scheduler().activity(m_account.id());
+
+    struct Summary {
+        std::size_t sent = 0;
+        std::size_t unknown = 0;
+        std::size_t failed = 0;
+    };
+    auto summary = std::make_shared<Summary>();
+    m_broadcaster.broadcast(std::move(recipients), ceema::MessagePayload(ceema::PayloadText{text}),
+            [summary](ceema::client_id const& recipient, ceema::Broadcaster::Outcome outcome,
+                      ceema::message_id const&, std::string const& error) {
+                switch (outcome) {
+                    case ceema::Broadcaster::Outcome::SENT:
+                        summary->sent++;
+                        break;
+                    case ceema::Broadcaster::Outcome::UNKNOWN_RECIPIENT:
+                        summary->unknown++;
+                        break;
+                    case ceema::Broadcaster::Outcome::FAILED:
+                        LOG_DBG("Broadcast to " << recipient.toString() << " failed: " << error);
+                        summary->failed++;
+                        break;
+                }
+            },
+            [this, summary]() {
+                std::string info = "Sent: " + std::to_string(summary->sent) + "\n"
+                                 + "Unknown recipients: " + std::to_string(summary->unknown) + "\n"
+                                 + "Failed: " + std::to_string(summary->failed);
+                purple_notify_info(m_connection, "Broadcast", "Broadcast complete", info.c_str());
+            });
+    return true;
+}
+
+void ThreeplConnection::check_keepalive() {
+    m_httpManager.cancelTimer(keepalive_timer);
+    keepalive_timer = 0;
+    if (state() != State::CONNECTED) {
+        return;
+    }
+
+    ceema::KeepAliveTracker::clock::time_point deadline;
+    try {
+        deadline = m_session.keep_alive();
+        if (m_session.hasWriteData()) {
+            m_session.flush();
+            watch_write();
+        }
+    } catch (std::exception& e) {
+        purple_connection_error_reason(connection(), PURPLE_CONNECTION_ERROR_NETWORK_ERROR, e.what());
+        return;
+    }
+
+    // Traffic moves the deadline, in which case the timer only reschedules
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - ceema::KeepAliveTracker::clock::now()) + std::chrono::milliseconds(1);
+    keepalive_timer = m_httpManager.scheduleTimer(std::max<long>(delay.count(), 0), [this]() {
+        keepalive_timer = 0;
+        check_keepalive();
+    });
 }
 
 bool ThreeplConnection::send_agreement(ceema::client_id const& who, bool agree) {
-    ceema::PayloadMessageStatus payload;
-    payload.m_status = agree ? ceema::MessageStatus::AGREED : ceema::MessageStatus::DISAGREED;
-    payload.m_ids.push_back(m_handler.lastAgreeable());
+    ceema::MessageStatus status = agree ? ceema::MessageStatus::AGREED : ceema::MessageStatus::DISAGREED;
 
     LOG_DBG("Agree with " << who.toString() << " on msg " << m_handler.lastAgreeable());
 
-    send_message(who, payload);
-
-    send_packet(ceema::KeepAlive());
+    m_control.queue_status(who, status, m_handler.lastAgreeable());
 
     return true;
 }
@@ -127,6 +322,10 @@ bool ThreeplConnection::authenticate() {
                 purple_connection_update_progress(connection(), "Connected", 4, 5);
                 purple_connection_set_state(connection(), PURPLE_CONNECTED);
                 m_state = State::CONNECTED;
+                reconnect_scheduler().connected(m_account.id());
+                schedule_ack_check();
+                check_keepalive();
+                m_handler.resume_pending();
                 break;
         }
     }
@@ -140,16 +339,25 @@ bool ThreeplConnection::read_packets() {
             case ceema::PacketType::CONNECTED:
                 purple_debug_info("threepl", "Connection complete\n");
                 break;
-            case ceema::PacketType::KEEPALIVE_ACK:
-                break;
             case ceema::PacketType::ACK_SERVER:
-                purple_debug_info("threepl", "TODO: Received ACK\n");
+                message_handler().onAck(static_cast<ceema::Acknowledgement const&>(*packet));
                 break;
             case ceema::PacketType::MESSAGE_RECV: {
                 auto msg = unique_ptr_cast<ceema::Message>(std::move(packet));
+                reconnect_scheduler().activity(m_account.id());
                 if (msg->flags().isnset(ceema::MessageFlag::NO_ACK)) {
                     send_packet(msg->generateAck());
                 }
+                // Dropped messages are ACKed as well, so they are not delivered again
+                auto verdict = m_filter.check(msg->sender(), m_store.is_known(msg->sender()));
+                if (verdict != ceema::ReceiveFilter::Verdict::ACCEPT) {
+                    LOG_DBG("Dropping message from " << msg->sender().toString() << ": " << verdict);
+                    break;
+                }
+                if (m_nonces && !m_nonces->insert(msg->data_nonce())) {
+                    LOG_DBG("Dropping replayed message " << msg->id() << " from " << msg->sender().toString());
+                    break;
+                }
                 message_handler().onRecvMessage(std::move(msg));
                 break; }
             case ceema::PacketType::DISCONNECTED:
@@ -167,6 +375,10 @@ bool ThreeplConnection::read_packets() {
                 break;
         }
     }
+    // Nonces of the batch are written at once
+    if (m_nonces) {
+        m_nonces->flush();
+    }
     return m_state == State::CONNECTED;
 }
 
@@ -176,6 +388,7 @@ void ThreeplConnection::on_connect(gpointer data, gint source, const gchar *erro
 
     if (source == -1) {
         if(source < 0) {
+            reconnect_scheduler().failed(connection->m_account.id());
             gchar *tmp = g_strdup_printf(("Unable to connect: %s"), error_message);
             purple_connection_error_reason(connection->connection(),
                                            PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
@@ -190,12 +403,30 @@ void ThreeplConnection::on_connect(gpointer data, gint source, const gchar *erro
     connection->m_state = State::AUTHENTICATING;
 
     connection->session_socket = source;
-    session.connect(ceema::TcpClient{connection->session_socket}, proxy);
+    ceema::TcpClient socket{source};
+    // The proxy code hands over a connected socket, so the buffer sizes of
+    // the profile do not widen the window scaling
+    const char* profile = purple_account_get_string(connection->acct(), "socket-profile", "latency");
+    try {
+        socket.apply(ceema::SocketOptions::profile(profile));
+    } catch (std::invalid_argument& e) {
+        LOG_WARN(ceema::logging::loggerRoot, e.what());
+        socket.apply(ceema::SocketOptions());
+    }
+    session.connect(std::move(socket), proxy);
 
     connection->input_handler_read = purple_input_add(source, static_cast<PurpleInputCondition>(PURPLE_INPUT_READ), &on_session_data_read, data);
     connection->input_handler_write = purple_input_add(source, static_cast<PurpleInputCondition>(PURPLE_INPUT_WRITE), &on_session_data_write, data);
 }
 
+void ThreeplConnection::schedule_ack_check() {
+    ack_timer = m_httpManager.scheduleTimer(ACK_CHECK_INTERVAL * 1000, [this]() {
+        ack_timer = 0;
+        message_handler().retransmit();
+        schedule_ack_check();
+    });
+}
+
 void ThreeplConnection::on_session_data_write(gpointer data, gint source, PurpleInputCondition condition) {
     ThreeplConnection* connection = static_cast<ThreeplConnection*>(data);
     ceema::Session& session = connection->m_session;
@@ -217,6 +448,7 @@ void ThreeplConnection::on_session_data_write(gpointer data, gint source, Purple
     if (!session.hasWriteData()) {
         purple_input_remove(connection->input_handler_write);
         connection->input_handler_write = 0;
+        connection->m_broadcaster.writable();
     }
 }
 
@@ -10,9 +10,13 @@
 #include "GroupStore.h"
 #include "Transfer.h"
 #include "MessageHandler.h"
+#include "ControlCoalescer.h"
 #include <libpurple/connection.h>
 #include <api/BlobAPI.h>
 #include <protocol/session.h>
+#include <protocol/Broadcaster.h>
+#include <protocol/ReceiveFilter.h>
+#include <protocol/NonceStore.h>
 
 /**
  * Holds data association with PurpleConnection specific for Threepl
@@ -34,10 +38,16 @@ class ThreeplConnection {
     ContactStore m_store;
     GroupStore m_groups;
     ThreeplMessageHandler m_handler;
+    ControlCoalescer m_control;
+
+    // Checked before incoming messages are decrypted
+    ceema::ReceiveFilter m_filter;
+    std::unique_ptr<ceema::NonceStore> m_nonces;
 
     // ceema connection data
     ceema::Session m_session;
     ceema::Account m_account;
+    ceema::Broadcaster m_broadcaster;
 
     // Purple data
     PurpleAccount* m_prpl_acct;
@@ -47,24 +57,35 @@ class ThreeplConnection {
 
     guint input_handler_read;
     guint input_handler_write;
+    ceema::HttpManager::TimerId ack_timer;
+    ceema::HttpManager::TimerId keepalive_timer;
 
     State m_state;
 
 public:
-    //std::unordered_map<ceema::group_uid, ThreeplGroup> m_groups;
-    /** Map from ceema group to chat conv (inverse direction is handled by protocol data) */
-    //std::unordered_map<ceema::group_uid, int> m_group_chats;
-
     //TODO: make TLS usage configurable
     ThreeplConnection(PurpleAccount* acct, ceema::Account const& account) :
             m_identAPI(m_httpManager), m_blobAPI(m_httpManager, true), m_store(m_identAPI),
             m_groups(*this),
-            m_handler(*this, m_store, m_groups, m_blobAPI), m_session(account),
-            m_account(account), m_prpl_acct(acct),
+            m_handler(*this, m_store, m_groups, m_blobAPI), m_control(*this), m_session(account),
+            m_account(account), m_broadcaster(m_account, m_session, m_identAPI, m_httpManager),
+            m_prpl_acct(acct),
             m_connection(purple_account_get_connection(m_prpl_acct)),
-            session_socket(-1), input_handler_read(0), input_handler_write(0),
+            session_socket(-1), input_handler_read(0), input_handler_write(0), ack_timer(0),
+            keepalive_timer(0),
             m_state(State::DISCONNECTED)
-    {}
+    {
+        m_broadcaster.set_contact_lookup([this](ceema::client_id const& id) {
+            return m_store.get_contact(id);
+        });
+        m_broadcaster.set_contact_found([this](ceema::Contact const& contact) {
+            m_store.add_contact(contact);
+        });
+        m_broadcaster.set_flush([this]() {
+            m_session.flush();
+            watch_write();
+        });
+    }
 
     ContactStore& contact_store() {
         return m_store;
@@ -74,6 +95,19 @@ public:
         return m_groups;
     }
 
+    ControlCoalescer& control() {
+        return m_control;
+    }
+
+    ceema::ReceiveFilter& receive_filter() {
+        return m_filter;
+    }
+
+    /**
+     * Load the blocked senders from the privacy settings of the account
+     */
+    void load_privacy();
+
     ceema::IdentAPI& ident_API() {
         return m_identAPI;
     }
@@ -106,6 +140,24 @@ public:
         return m_state;
     }
 
+    /**
+     * Sample the TCP statistics of the chat server connection
+     * @return false if not connected or not supported
+     */
+    bool tcp_info(ceema::TcpInfo& info) const {
+        return session_socket >= 0 && ceema::TcpClient(session_socket).info(info);
+    }
+
+    /**
+     * Open the nonces of received messages, and restore messages that were
+     * waiting for a contact key when the account was last closed
+     */
+    void load_stores();
+
+    /**
+     * Request a connect to the chat server. The connect starts once the
+     * reconnect scheduler allows it.
+     */
     bool start_connect();
 
     void close();
@@ -119,9 +171,9 @@ public:
     }
 
     template<typename Payload>
-    std::vector<ceema::future<std::unique_ptr<ceema::Message>>> send_group_message(ThreeplGroup* group, Payload&& payload) {
+    ceema::future<GroupSendResult> send_group_message(ThreeplGroup* group, Payload&& payload) {
         if (state() != State::CONNECTED) {
-            return std::vector<ceema::future<std::unique_ptr<ceema::Message>>>();
+            return ceema::future<GroupSendResult>();
         }
         return m_handler.sendPayload(account(), group, std::move(payload));
     }
@@ -133,7 +185,26 @@ public:
      */
     bool send_packet(ceema::Packet const& packet);
 
-    void send_keepalive();
+    /**
+     * Send the given messages, writing them to the socket in one go.
+     * @param packets Messages to send
+     * @return true if the session is connected, false otherwise
+     */
+    bool send_packets(std::vector<std::unique_ptr<ceema::Message>> const& packets);
+
+    /**
+     * Send a text message to many contacts at once. A summary is shown once
+     * all recipients were handled.
+     * @return false if not connected or a broadcast is already running
+     */
+    bool broadcast_text(std::vector<ceema::client_id> recipients, std::string const& text);
+
+    /**
+     * Send a keep-alive if the connection was idle for the keep-alive
+     * interval, and close the connection if the server stopped answering
+     * them. Reschedules itself for the next keep-alive deadline.
+     */
+    void check_keepalive();
 
     /**
      * Send agree/disagree for last received message
@@ -155,11 +226,28 @@ private:
 
     bool read_packets();
 
+    void do_connect();
+
+    /**
+     * Watch the socket for writability while the session has data left to write
+     */
+    void watch_write();
+
     static void on_connect(gpointer data, gint source, const gchar *error_message);
 
     static void on_session_data_write(gpointer data, gint source, PurpleInputCondition condition);
 
     static void on_session_data_read(gpointer data, gint source, PurpleInputCondition condition);
+
+    /**
+     * Check for unacknowledged messages periodically, until the connection is closed
+     */
+    void schedule_ack_check();
+
+    /**
+     * @return Path of a file with account data in the user directory
+     */
+    std::string account_file(const char* suffix) const;
 };
 
 
@@ -250,6 +250,66 @@ static void threepl_import_backup(PurplePluginAction* action) {
                          connection->acct(), NULL, NULL, data);
 }
 
+static void threepl_broadcast_cb(ThreeplConnection* connection, const char* text) {
+    if (!text || !*text) {
+        return;
+    }
+
+    std::vector<ceema::client_id> recipients;
+    for (GSList* buddies = purple_find_buddies(connection->acct(), NULL); buddies;
+         buddies = g_slist_delete_link(buddies, buddies)) {
+        PurpleBuddy* buddy = static_cast<PurpleBuddy*>(buddies->data);
+        try {
+            recipients.push_back(ceema::client_id::fromString(purple_buddy_get_name(buddy)));
+        } catch (std::exception& e) {
+            // Invalid ID, broken buddy
+        }
+    }
+    if (recipients.empty()) {
+        return;
+    }
+
+    if (!connection->broadcast_text(std::move(recipients), text)) {
+        purple_notify_error(connection->connection(), "Broadcast", "Unable to broadcast",
+                            "Not connected, or a broadcast is still running");
+    }
+}
+
+static void threepl_broadcast(PurplePluginAction* action) {
+    PurpleConnection* gc = static_cast<PurpleConnection*>(action->context);
+    ThreeplConnection* connection = static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc));
+
+    purple_request_input(gc, ("Broadcast message"), ("Send a message to all your contacts."),
+                         ("Every contact on the buddy list receives the message individually."),
+                         NULL, TRUE, FALSE, NULL, ("Send"), PURPLE_CALLBACK(threepl_broadcast_cb), ("Cancel"), NULL,
+                         connection->acct(), NULL, NULL, connection);
+}
+
+static void threepl_connection_info(PurplePluginAction* action) {
+    PurpleConnection* gc = static_cast<PurpleConnection*>(action->context);
+    ThreeplConnection* connection = static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc));
+
+    ceema::TcpInfo info;
+    if (!connection->tcp_info(info)) {
+        purple_notify_error(gc, "Connection statistics", "No statistics available",
+                            "Not connected, or not supported on this platform");
+        return;
+    }
+    std::string text = "Round trip time: " + std::to_string(info.rtt.count() / 1000.0) + " ms"
+                     + " (variance " + std::to_string(info.rttVar.count() / 1000.0) + " ms)\n"
+                     + "Retransmits: " + std::to_string(info.totalRetransmits)
+                     + " (" + std::to_string(info.retransmits) + " pending)\n"
+                     + "Lost segments: " + std::to_string(info.lost) + "\n"
+                     + "Unacknowledged segments: " + std::to_string(info.unacked) + "\n"
+                     + "Congestion window: " + std::to_string(info.congestionWindow) + " segments\n";
+    ceema::KeepAliveTracker const& keepAlive = connection->session().keep_alive_stats();
+    text += "Keep-alive round trip time: " + std::to_string(keepAlive.rtt().count() / 1000.0) + " ms\n"
+          + "Keep-alive interval: " + std::to_string(keepAlive.interval().count() / 1000) + " s\n"
+          + "Keep-alives sent: " + std::to_string(keepAlive.sent_count())
+          + " (" + std::to_string(keepAlive.lost_count()) + " connections lost)";
+    purple_notify_info(gc, "Connection statistics", "Chat server connection", text.c_str());
+}
+
 GList* threepl_actions(PurplePlugin *plugin, gpointer context) {
     PurplePluginAction *act = purple_plugin_action_new(("Set Nickname..."), &threepl_set_nickname);
     GList* acts = g_list_append(NULL, act);
@@ -262,6 +322,10 @@ GList* threepl_actions(PurplePlugin *plugin, gpointer context) {
     act = purple_plugin_action_new(("Import from backup..."), &threepl_import_backup);
     acts = g_list_append(acts, act);
     act = purple_plugin_action_new(("Generate backup string..."), &threepl_generate_backup);
+    acts = g_list_append(acts, act);
+    act = purple_plugin_action_new(("Broadcast message..."), &threepl_broadcast);
+    acts = g_list_append(acts, act);
+    act = purple_plugin_action_new(("Connection statistics"), &threepl_connection_info);
     return g_list_append(acts, act);
 
 }
@@ -6,6 +6,8 @@
 
 #include <threepl/ThreeplConnection.h>
 
+#include <ctime>
+
 char* threepl_get_chat_name(GHashTable *components) {
     const char* id = static_cast<const char*>(g_hash_table_lookup(components, "id"));
     const char* owner = static_cast<const char*>(g_hash_table_lookup(components, "owner"));
@@ -157,46 +159,24 @@ int threepl_chat_send(PurpleConnection* gc, int id, const char* message, PurpleM
     auto raw_message = purple_unescape_html(message);
     payload.m_text = raw_message;
     g_free(raw_message);
-    auto msg_fut_vec = connection->send_group_message(group_data, payload);
-    if (msg_fut_vec.empty()) {
+    auto send_fut = connection->send_group_message(group_data, payload);
+    if (!send_fut.valid()) {
         return -ENOTCONN;
     }
-    bool first = true;
-    for(auto& msg_fut: msg_fut_vec) {
-        if (first) {
-            first = false;
-            msg_fut.next([connection, id, msg = std::string(message), flags](
-                    ceema::future<std::unique_ptr<ceema::Message>> fut) {
-                try {
-                    std::unique_ptr<ceema::Message> m = fut.get();
-                    serv_got_chat_in(connection->connection(), id, m->sender().toString().c_str(), flags, msg.c_str(), m->time());
-                } catch (message_exception &e) {
-                    const char* who = e.id().toString().c_str();
-                    gchar *errMsg = g_strdup_printf("Unable to send message to %s: %s", who, e.what());
-                    if (!purple_conv_present_error(who, connection->acct(), errMsg)) {
-                        purple_notify_error(connection->connection(), "Error sending message", "Unable to send message", errMsg);
-                    }
-                    g_free(errMsg);
-                }
-
-            });
-        } else {
-            msg_fut.next([connection](ceema::future<std::unique_ptr<ceema::Message>> fut) {
-                try {
-                    std::unique_ptr<ceema::Message> m = fut.get();
-                } catch (message_exception &e) {
-                    std::string who = e.id().toString();
-                    gchar *errMsg = g_strdup_printf("Unable to send message to %s: %s", who.c_str(), e.what());
-                    if (!purple_conv_present_error(who.c_str(), connection->acct(), errMsg)) {
-                        purple_notify_error(connection->connection(), "Error sending message", "Unable to send message",
-                                            errMsg);
-                    }
-                    g_free(errMsg);
-                }
-
-            });
+    // Echo right away, members with a slow key lookup must not hold up the own message
+    serv_got_chat_in(gc, id, connection->account().id().toString().c_str(), flags, message, std::time(nullptr));
+    send_fut.next([connection](ceema::future<GroupSendResult> fut) {
+        GroupSendResult result = fut.get();
+        for(message_exception const& e: result.failures) {
+            std::string who = e.id().toString();
+            gchar *errMsg = g_strdup_printf("Unable to send message to %s: %s", who.c_str(), e.what());
+            if (!purple_conv_present_error(who.c_str(), connection->acct(), errMsg)) {
+                purple_notify_error(connection->connection(), "Error sending message", "Unable to send message",
+                                    errMsg);
+            }
+            g_free(errMsg);
         }
-    }
+    });
 
     // Echo the message regardless of error (some clients may succeed while others fail)
     return 1;
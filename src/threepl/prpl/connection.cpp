@@ -33,6 +33,11 @@ void threepl_login(PurpleAccount *account) {
         // Load chats
         connection->group_store().load_chats(account);
 
+        // Seen nonces and messages that were waiting for a key when last closed
+        connection->load_stores();
+
+        connection->load_privacy();
+
         purple_connection_set_protocol_data(gc, connection);
         connection->start_connect();
     } catch (std::exception& e) {
@@ -51,7 +56,6 @@ void threepl_close(PurpleConnection *gc) {
 
     connection->close();
 
-    connection->contact_store().update_buddies(connection->acct());
     connection->group_store().update_chats(connection->acct());
 
     delete connection;
@@ -61,5 +65,21 @@ void threepl_close(PurpleConnection *gc) {
 void threepl_keepalive(PurpleConnection* gc) {
     ThreeplConnection* connection = static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc));
 
-    connection->send_keepalive();
-}
\ No newline at end of file
+    connection->check_keepalive();
+}
+
+// The deny list of the account is already updated when these are called
+
+void threepl_add_deny(PurpleConnection* gc, const char* name) {
+    threepl_set_permit_deny(gc);
+}
+
+void threepl_rem_deny(PurpleConnection* gc, const char* name) {
+    threepl_set_permit_deny(gc);
+}
+
+void threepl_set_permit_deny(PurpleConnection* gc) {
+    ThreeplConnection* connection = static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc));
+
+    connection->load_privacy();
+}
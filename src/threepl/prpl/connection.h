@@ -14,4 +14,10 @@ void threepl_close(PurpleConnection *gc);
 
 void threepl_keepalive(PurpleConnection* gc);
 
+void threepl_add_deny(PurpleConnection* gc, const char* name);
+
+void threepl_rem_deny(PurpleConnection* gc, const char* name);
+
+void threepl_set_permit_deny(PurpleConnection* gc);
+
 #endif //CEEMA_CONNECTION_H
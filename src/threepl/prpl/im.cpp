@@ -123,11 +123,9 @@ int threepl_send_im(PurpleConnection* gc, const char *who, const char *message,
 unsigned int threepl_send_typing(PurpleConnection* gc, const char* who, PurpleTypingState state) {
     ThreeplConnection* connection = static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc));
 
-    ceema::PayloadTyping payload;
-    payload.m_typing = (state == PURPLE_TYPING);
-
     try {
-        connection->send_message(ceema::client_id::fromString(who), payload);
+        // Debounced, only state changes are sent
+        connection->control().set_typing(ceema::client_id::fromString(who), state == PURPLE_TYPING);
     } catch (std::exception& e) {
         // Log error, not much more to do
         LOG_ERROR(ceema::logging::loggerRoot, e.what());
@@ -3,6 +3,7 @@
 //
 
 #include "list.h"
+#include "threepl/ThreeplConnection.h"
 
 #include <libpurple/blist.h>
 
@@ -11,12 +12,21 @@ const char* threepl_list_icon(PurpleAccount *acct, PurpleBuddy *buddy) {
 }
 
 const char* threepl_list_emblem(PurpleBuddy* buddy)  {
-    const char* pk = purple_blist_node_get_string(&buddy->node, "public-key");
-    if (pk && pk[0] == '!') {
-        return "not-authorized"; // Public key not found
-    }
     if (purple_buddy_get_name(buddy)[0] == '*') {
         return "bot"; // Gateway account (starts with *)
     }
+
+    PurpleConnection* gc = purple_account_get_connection(purple_buddy_get_account(buddy));
+    ThreeplConnection* connection = gc ?
+            static_cast<ThreeplConnection*>(purple_connection_get_protocol_data(gc)) : nullptr;
+    if (connection) {
+        try {
+            if (connection->contact_store().is_unknown(ceema::client_id::fromString(purple_buddy_get_name(buddy)))) {
+                return "not-authorized"; // Public key not found
+            }
+        } catch (std::exception&) {
+            return "not-authorized"; // Invalid ID
+        }
+    }
     return NULL;
-}
\ No newline at end of file
+}
@@ -52,6 +52,7 @@
 
 #include "libpurple/version.h"
 #include "libpurple/accountopt.h"
+#include "libpurple/util.h"
 
 #include "threepl.h"
 #include "threepl/ThreeplConnection.h"
@@ -96,8 +97,8 @@ static void threepl_get_info(PurpleConnection* gc, const char* who) {
     purple_notify_user_info_add_pair_plaintext(user_info, "ID", who);
 
     ceema::client_id cid = ceema::client_id::fromString(who);
-    if (connection->contact_store().has_contact(cid)) {
-        ContactPtr contact = connection->contact_store().get_contact(cid);
+    ContactPtr contact = connection->contact_store().get_contact(cid);
+    if (contact) {
         purple_notify_user_info_add_pair_plaintext(user_info, "Public key", ceema::hex_encode(contact->pk()).c_str());
         purple_notify_user_info_add_pair_plaintext(user_info, "Nickname", contact->nick().c_str());
         //Fingerprint
@@ -147,10 +148,10 @@ static PurplePluginProtocolInfo threepl_protocol_info =
   NULL,               /* remove_buddy */
   NULL,             /* remove_buddies */
   NULL,                 /* add_permit */
-  NULL,                   /* add_deny */
+  threepl_add_deny,                   /* add_deny */
   NULL,                 /* rem_permit */
-  NULL,                   /* rem_deny */
-  NULL,            /* set_permit_deny */
+  threepl_rem_deny,                   /* rem_deny */
+  threepl_set_permit_deny,            /* set_permit_deny */
   threepl_join_chat,                  /* join_chat */
   NULL,                /* reject_chat */
   threepl_get_chat_name,              /* get_chat_name */
@@ -237,6 +238,16 @@ static void threepl_init(PurplePlugin *plugin) {
     opt = purple_account_option_bool_new("Mark received messages as seen", "status-seen", false);
     opts = g_list_append(opts, opt);
 
+    GList* profiles = NULL;
+    for (const char* profile: {"latency", "throughput", "mobile"}) {
+        PurpleKeyValuePair* kvp = g_new0(PurpleKeyValuePair, 1);
+        kvp->key = g_strdup(profile);
+        kvp->value = g_strdup(profile);
+        profiles = g_list_append(profiles, kvp);
+    }
+    opt = purple_account_option_list_new("Socket profile", "socket-profile", profiles);
+    opts = g_list_append(opts, opt);
+
     threepl_protocol_info.protocol_options = opts;
 
     threepl_register_commands(plugin);
@@ -0,0 +1,165 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ceema {
+
+    /**
+     * Cuckoo filter over 64 bit hashes, storing a 16 bit fingerprint per item
+     * in buckets of four. Answers "definitely not present" or "probably
+     * present", with a false positive rate of about 0.01%. The hashes must be
+     * uniformly distributed; use a keyed hash for untrusted input.
+     */
+    class cuckoo_filter {
+        static constexpr std::size_t BUCKET_SIZE = 4;
+        static constexpr unsigned MAX_KICKS = 500;
+
+        // Fingerprint 0 marks an empty slot
+        std::vector<std::uint16_t> m_table;
+        std::size_t m_mask;
+        std::size_t m_size;
+        // Fingerprint left over when an insert ran out of kicks
+        std::uint16_t m_victim;
+        std::size_t m_victimIndex;
+        std::uint32_t m_random;
+
+    public:
+        /**
+         * Create a filter
+         * @param capacity Number of items the filter should hold
+         */
+        explicit cuckoo_filter(std::size_t capacity = 0) : m_size(0), m_victim(0), m_victimIndex(0), m_random(2463534242u) {
+            // Aim for a load factor of about 85%
+            std::size_t buckets = 1;
+            while (buckets * BUCKET_SIZE * 85 < capacity * 100) {
+                buckets <<= 1;
+            }
+            m_table.assign(buckets * BUCKET_SIZE, 0);
+            m_mask = buckets - 1;
+        }
+
+        /**
+         * Add a hash to the filter
+         * @return False if the filter is full, it should be rebuilt larger
+         */
+        bool insert(std::uint64_t hash) {
+            if (m_victim) {
+                return false;
+            }
+
+            std::uint16_t fp = fingerprint(hash);
+            std::size_t i1 = index(hash);
+            std::size_t i2 = alt_index(i1, fp);
+            if (add(i1, fp) || add(i2, fp)) {
+                m_size++;
+                return true;
+            }
+
+            // Both buckets full, relocate random entries to their alternate bucket
+            std::size_t i = (next_random() & 1) ? i1 : i2;
+            for (unsigned kick = 0; kick < MAX_KICKS; kick++) {
+                std::uint16_t& slot = m_table[i * BUCKET_SIZE + next_random() % BUCKET_SIZE];
+                std::swap(fp, slot);
+                i = alt_index(i, fp);
+                if (add(i, fp)) {
+                    m_size++;
+                    return true;
+                }
+            }
+
+            // Keep the displaced fingerprint, so no inserted item gets lost
+            m_victim = fp;
+            m_victimIndex = i;
+            m_size++;
+            return true;
+        }
+
+        /**
+         * @return False if the hash was never inserted, true if it probably was
+         */
+        bool contains(std::uint64_t hash) const {
+            std::uint16_t fp = fingerprint(hash);
+            std::size_t i1 = index(hash);
+            std::size_t i2 = alt_index(i1, fp);
+            if (m_victim == fp && (m_victimIndex == i1 || m_victimIndex == i2)) {
+                return true;
+            }
+            return has(i1, fp) || has(i2, fp);
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        /**
+         * @return Memory used by the table, in bytes
+         */
+        std::size_t memory() const {
+            return m_table.size() * sizeof(std::uint16_t);
+        }
+
+    private:
+        static std::uint16_t fingerprint(std::uint64_t hash) {
+            std::uint16_t fp = static_cast<std::uint16_t>(hash >> 48);
+            return fp ? fp : 1;
+        }
+
+        std::size_t index(std::uint64_t hash) const {
+            return static_cast<std::size_t>(hash) & m_mask;
+        }
+
+        std::size_t alt_index(std::size_t i, std::uint16_t fp) const {
+            // Involution: alt_index(alt_index(i, fp), fp) == i
+            return (i ^ (static_cast<std::size_t>(fp) * 0x5bd1e995u)) & m_mask;
+        }
+
+        bool add(std::size_t i, std::uint16_t fp) {
+            std::uint16_t* bucket = &m_table[i * BUCKET_SIZE];
+            for (std::size_t j = 0; j < BUCKET_SIZE; j++) {
+                if (!bucket[j]) {
+                    bucket[j] = fp;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool has(std::size_t i, std::uint16_t fp) const {
+            std::uint16_t const* bucket = &m_table[i * BUCKET_SIZE];
+            for (std::size_t j = 0; j < BUCKET_SIZE; j++) {
+                if (bucket[j] == fp) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        std::uint32_t next_random() {
+            // xorshift32, only used to pick entries to relocate
+            m_random ^= m_random << 13;
+            m_random ^= m_random >> 17;
+            m_random ^= m_random << 5;
+            return m_random;
+        }
+    };
+
+}
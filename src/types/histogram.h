@@ -0,0 +1,105 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+namespace ceema {
+
+    /**
+     * Histogram with power of two buckets, for latencies and similar values
+     * spanning several orders of magnitude. Bucket i counts values in
+     * [2^(i-1), 2^i), bucket 0 counts 0.
+     */
+    class histogram {
+    public:
+        static constexpr std::size_t BUCKETS = 32;
+
+    private:
+        std::array<std::uint64_t, BUCKETS> m_buckets;
+        std::uint64_t m_count;
+        std::uint64_t m_sum;
+        std::uint64_t m_max;
+
+    public:
+        histogram() : m_buckets{}, m_count(0), m_sum(0), m_max(0) {}
+
+        void record(std::uint64_t value) {
+            std::size_t bucket = 0;
+            while (bucket < BUCKETS - 1 && (value >> bucket) != 0) {
+                bucket++;
+            }
+            m_buckets[bucket]++;
+            m_count++;
+            m_sum += value;
+            if (value > m_max) {
+                m_max = value;
+            }
+        }
+
+        std::uint64_t count() const {
+            return m_count;
+        }
+
+        std::uint64_t max() const {
+            return m_max;
+        }
+
+        double mean() const {
+            return m_count ? static_cast<double>(m_sum) / m_count : 0.0;
+        }
+
+        /**
+         * Estimate a percentile
+         * @param percentile Percentile to compute, between 0 and 1
+         * @return Upper bound of the bucket holding the percentile, 0 if empty
+         */
+        std::uint64_t percentile(double percentile) const {
+            if (!m_count) {
+                return 0;
+            }
+            std::uint64_t rank = static_cast<std::uint64_t>(percentile * m_count);
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < BUCKETS; i++) {
+                seen += m_buckets[i];
+                if (seen > rank) {
+                    return i ? std::min(m_max, (std::uint64_t(1) << i) - 1) : 0;
+                }
+            }
+            return m_max;
+        }
+
+        std::array<std::uint64_t, BUCKETS> const& buckets() const {
+            return m_buckets;
+        }
+
+        void reset() {
+            *this = histogram();
+        }
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, histogram const& hist) {
+        return os << hist.count() << " samples, mean " << hist.mean()
+                  << ", p50 " << hist.percentile(0.5)
+                  << ", p99 " << hist.percentile(0.99)
+                  << ", max " << hist.max();
+    }
+
+}
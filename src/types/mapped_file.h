@@ -0,0 +1,114 @@
+/**
+ * Copyright 2017 Harold Bruintjes
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "bytes.h"
+
+#include <string>
+#include <fstream>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace ceema {
+
+    /**
+     * Read-only view of a whole file. Uses mmap where available, otherwise
+     * the file is read into memory. A missing file results in an empty view.
+     */
+    class mapped_file {
+        std::uint8_t const* m_data;
+        std::size_t m_size;
+#ifdef _WIN32
+        byte_vector m_buffer;
+#endif
+
+    public:
+        mapped_file() : m_data(nullptr), m_size(0) {}
+
+        explicit mapped_file(std::string const& path) : m_data(nullptr), m_size(0) {
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+                if (data != MAP_FAILED) {
+                    m_data = static_cast<std::uint8_t const*>(data);
+                    m_size = static_cast<std::size_t>(st.st_size);
+                }
+            }
+            ::close(fd);
+#else
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file) {
+                return;
+            }
+            m_buffer.resize(static_cast<std::size_t>(file.tellg()));
+            file.seekg(0);
+            file.read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size());
+            m_data = m_buffer.data();
+            m_size = m_buffer.size();
+#endif
+        }
+
+        mapped_file(mapped_file const&) = delete;
+        mapped_file& operator=(mapped_file const&) = delete;
+
+        mapped_file(mapped_file&& other) : mapped_file() {
+            swap(other);
+        }
+
+        mapped_file& operator=(mapped_file&& other) {
+            mapped_file tmp(std::move(other));
+            swap(tmp);
+            return *this;
+        }
+
+        ~mapped_file() {
+#ifndef _WIN32
+            if (m_data) {
+                ::munmap(const_cast<std::uint8_t*>(m_data), m_size);
+            }
+#endif
+        }
+
+        void swap(mapped_file& other) {
+            std::swap(m_data, other.m_data);
+            std::swap(m_size, other.m_size);
+#ifdef _WIN32
+            std::swap(m_buffer, other.m_buffer);
+#endif
+        }
+
+        std::uint8_t const* data() const {
+            return m_data;
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+    };
+
+}